@@ -7,6 +7,7 @@ var sources = [
     "src/llama-vocab.cpp",
     "src/llama-grammar.cpp",
     "src/llama-sampling.cpp",
+    "src/llama-lz.cpp",
     "src/unicode.cpp",
     "src/unicode-data.cpp",
     "ggml/src/ggml.c",
@@ -0,0 +1,4 @@
+int LLAMA_BUILD_NUMBER = 36;
+char const *LLAMA_COMMIT = "5b984d1";
+char const *LLAMA_COMPILER = "cc (Debian 12.2.0-14+deb12u1) 12.2.0";
+char const *LLAMA_BUILD_TARGET = "x86_64-linux-gnu";
@@ -277,6 +277,9 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
     if (!params.tensor_buft_overrides.empty()) {
         params.tensor_buft_overrides.push_back({nullptr, nullptr});
     }
+    if (!params.kv_type_overrides.empty()) {
+        params.kv_type_overrides.push_back({nullptr, GGML_TYPE_COUNT, GGML_TYPE_COUNT});
+    }
 
     return true;
 }
@@ -331,6 +334,28 @@ bool parse_buft_overrides(const std::string& value, std::vector<llama_model_tens
     }
     return true;
 }
+// LAYERS=TYPE sets the K and V cache types of the matching layers, LAYERS=TYPE_K:TYPE_V sets them separately
+bool parse_kv_type_overrides(const std::string& value, std::vector<llama_kv_type_override>& overrides) {
+    for (const auto & override : string_split<std::string>(value, ',')) {
+        std::string::size_type pos = override.find('=');
+        if (pos == std::string::npos || pos == 0) {
+            fprintf(stderr, "Invalid KV cache type override argument %s\n", override.c_str());
+            return false;
+        }
+        std::string layers = override.substr(0, pos);
+        std::string types  = override.substr(pos + 1);
+        std::string::size_type sep = types.find(':');
+        try {
+            auto type_k = kv_cache_type_from_str(types.substr(0, sep));
+            auto type_v = sep == std::string::npos ? type_k : kv_cache_type_from_str(types.substr(sep + 1));
+            overrides.push_back({strdup(layers.c_str()), type_k, type_v});
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s\n", e.what());
+            return false;
+        }
+    }
+    return true;
+}
 template<class T1, class T2>
 std::vector<std::pair<T1,T2>> string_split_pairs(const std::string & str, char delim) {
     std::vector<std::pair<T1,T2>> values;
@@ -552,6 +577,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else if (value == "mean") { params.pooling_type = LLAMA_POOLING_TYPE_MEAN; }
         else if (value == "cls") { params.pooling_type = LLAMA_POOLING_TYPE_CLS; }
         else if (value == "last") { params.pooling_type = LLAMA_POOLING_TYPE_LAST; }
+        else if (value == "rank") { params.pooling_type = LLAMA_POOLING_TYPE_RANK; }
         else { invalid_param = true; }
         return true;
     }
@@ -860,6 +886,16 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.image.emplace_back(argv[i]);
         return true;
     }
+    if (arg == "--mmproj-threads") {
+        CHECK_ARG
+        params.n_threads_mmproj = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--mmproj-cache") {
+        CHECK_ARG
+        params.mmproj_cache = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-i" || arg == "--interactive") {
         params.interactive = true;
         return true;
@@ -872,6 +908,19 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.embedding = true;
         return true;
     }
+    if (arg == "--reranking" || arg == "--rerank") {
+        params.reranking = true;
+        return true;
+    }
+    if (arg == "--async-decode") {
+        params.async_decode = true;
+        return true;
+    }
+    if (arg == "--score-seqs") {
+        CHECK_ARG
+        params.n_score_seq = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--embd-normalize") {
         CHECK_ARG
         params.embd_normalize = std::stoi(argv[i]);
@@ -915,6 +964,51 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.cache_type_v = argv[++i];
         return true;
     }
+    if (arg == "-ctl" || arg == "--cache-type-layers") {
+        CHECK_ARG
+        if (!parse_kv_type_overrides(std::string{ argv[i] }, params.kv_type_overrides)) {
+            fprintf(stderr, "error: Invalid KV cache type override: %s\n", argv[i]);
+            invalid_param = true;
+        }
+        return true;
+    }
+    if (arg == "--kv-swap") {
+        params.kv_swap = true;
+        return true;
+    }
+    if (arg == "--kv-swap-type") {
+        CHECK_ARG
+        params.kv_swap_type = argv[i];
+        return true;
+    }
+    if (arg == "--kv-swap-file") {
+        CHECK_ARG
+        params.kv_swap_file = argv[i];
+        return true;
+    }
+    if (arg == "-khp" || arg == "--kv-huge-pages") {
+        params.kv_huge_page_size = -1;
+        return true;
+    }
+    if (arg == "--kv-huge-page-size") {
+        CHECK_ARG
+        params.kv_huge_page_size = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--numa-mem") {
+        CHECK_ARG
+        std::string value(argv[i]);
+        /**/ if (value == "none")       { params.numa_mem = LLAMA_NUMA_MEM_POLICY_NONE; }
+        else if (value == "interleave") { params.numa_mem = LLAMA_NUMA_MEM_POLICY_INTERLEAVE; }
+        else if (value == "bind")       { params.numa_mem = LLAMA_NUMA_MEM_POLICY_BIND; }
+        else { invalid_param = true; }
+        return true;
+    }
+    if (arg == "--top-logits") {
+        CHECK_ARG
+        params.n_top_logits = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-mli" || arg == "--multiline-input") {
         params.multiline_input = true;
         return true;
@@ -949,6 +1043,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.fused_moe_up_gate = true;
         return true;
     }
+    if (arg == "--swa-full") {
+        params.swa_full = true;
+        return true;
+    }
     if (arg == "-ser" || arg == "--smart-expert-reduction") {
         CHECK_ARG
         auto values = string_split_pairs<int,float>(argv[i], ',');
@@ -1089,6 +1187,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.use_mmap = false;
         return true;
     }
+    if (arg == "-fw" || arg == "--fuse-weights") {
+        params.fuse_weights = true;
+        return true;
+    }
     if (arg == "-thp" || arg == "--transparent-huge-pages") {
         params.use_thp = true;
         return true;
@@ -1099,6 +1201,7 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         /**/ if (value == "distribute" || value == "") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; }
         else if (value == "isolate") { params.numa = GGML_NUMA_STRATEGY_ISOLATE; }
         else if (value == "numactl") { params.numa = GGML_NUMA_STRATEGY_NUMACTL; }
+        else if (value == "shard") { params.numa = GGML_NUMA_STRATEGY_DISTRIBUTE; params.numa_shard = true; }
         else { invalid_param = true; }
         return true;
     }
@@ -1202,6 +1305,11 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.kl_divergence = true;
         return true;
     }
+    if (arg == "--kl-divergence-top-k") {
+        CHECK_ARG
+        params.kl_divergence_top_k = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--ignore-eos") {
         params.ignore_eos = true;
         return true;
@@ -1405,6 +1513,10 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         }
         return true;
     }
+    if (arg == "--slot-save-compress") {
+        params.slot_save_compress = true;
+        return true;
+    }
     if (arg == "--chat-template") {
         CHECK_ARG
         if (!llama_chat_verify_template(argv[i])) {
@@ -1464,6 +1576,21 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.chunk_separator = argv[i];
         return true;
     }
+    if (arg == "--kv-sens-type") {
+        CHECK_ARG
+        params.kv_sens_type = argv[i];
+        return true;
+    }
+    if (arg == "--kv-sens-type-high") {
+        CHECK_ARG
+        params.kv_sens_type_high = argv[i];
+        return true;
+    }
+    if (arg == "--kv-sens-n-high") {
+        CHECK_ARG
+        params.kv_sens_n_high = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "--junk") {
         CHECK_ARG
         params.n_junk = std::stoi(argv[i]);
@@ -1657,6 +1784,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-mla,  --mla-use",              "enable MLA (default: %d)", params.mla_attn });
     options.push_back({ "*",           "-amb,  --attention-max-batch",  "max batch size for attention computations (default: %d)", params.attn_max_batch});
     options.push_back({ "*",           "-fmoe, --fused-moe",            "enable fused MoE (default: %s)", params.fused_moe_up_gate ? "enabled" : "disabled" });
+    options.push_back({ "*",           "       --swa-full",             "use a full-size KV cache for the sliding window attention layers\n"
+                                                                        "(default: only the attention window of each sequence is kept)" });
     options.push_back({ "*",         "-ser,  --smart-expert-reduction,","experts reduction (default: %d,%g)", params.min_experts, params.thresh_experts});
     options.push_back({ "*",           "-p,    --prompt PROMPT",        "prompt to start generation with\n"
                                                                         "in conversation mode, this will be used as system prompt\n"
@@ -1736,7 +1865,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "For schemas w/ external $refs, use --grammar + example/json_schema_to_grammar.py instead" });
 
     options.push_back({ "embedding" });
-    options.push_back({ "embedding",   "       --pooling {none,mean,cls,last}",
+    options.push_back({ "embedding",   "       --pooling {none,mean,cls,last,rank}",
                                                                         "pooling type for embeddings, use model default if unspecified" });
     options.push_back({ "embedding",   "       --attention {causal,non-causal}",
                                                                         "attention type for embeddings, use model default if unspecified" });
@@ -1758,6 +1887,20 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-nkvo, --no-kv-offload",        "disable KV offload" });
     options.push_back({ "*",           "-ctk,  --cache-type-k TYPE",    "KV cache data type for K (default: %s)", params.cache_type_k.c_str() });
     options.push_back({ "*",           "-ctv,  --cache-type-v TYPE",    "KV cache data type for V (default: %s)", params.cache_type_v.c_str() });
+    options.push_back({ "*",           "-ctl,  --cache-type-layers L=T,...", "KV cache data types of the layers whose index matches the regex L,\n"
+                                                                        "T is TYPE for K and V or TYPE_K:TYPE_V, e.g. \"0|1|4[67]=q8_0\"" });
+    options.push_back({ "*",           "       --kv-swap",              "swap the least recently used sequences out of the KV cache when it is full\n"
+                                                                        "and back in when they are used again (default: %s)", params.kv_swap ? "enabled" : "disabled" });
+    options.push_back({ "*",           "       --kv-swap-type TYPE",    "data type of the swapped out f16/bf16/f32 cache rows (default: same as the cache)" });
+    options.push_back({ "*",           "       --kv-swap-file FNAME",   "store the swapped out sequences in FNAME instead of host memory" });
+    options.push_back({ "*",           "-khp,  --kv-huge-pages",        "allocate the CPU KV cache and compute buffers with huge pages of the default size (linux only)" });
+    options.push_back({ "*",           "       --kv-huge-page-size N",  "huge page size in MiB for the CPU KV cache and compute buffers, e.g. 2 or 1024 (default: %d, 0 = regular pages)", params.kv_huge_page_size });
+    options.push_back({ "*",           "       --numa-mem TYPE",        "NUMA placement of the CPU KV cache and compute buffers (linux only)\n"
+                                                                        "  - none: first touch (default)\n"
+                                                                        "  - interleave: interleave pages over all nodes\n"
+                                                                        "  - bind: bind the KV cache of consecutive layers to the same node" });
+    options.push_back({ "*",           "       --top-logits N",         "select the top N logits per output in the graph and sample from those only\n"
+                                                                        "(default: %d, 0 = sample from the full vocabulary)", params.n_top_logits });
 
     options.push_back({ "perplexity" });
     options.push_back({ "perplexity",  "       --all-logits",           "return logits for all tokens in the batch (default: %s)", params.logits_all ? "true" : "false" });
@@ -1769,6 +1912,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "perplexity",  "       --multiple-choice-tasks N",
                                                                         "number of tasks to use when computing the multiple choice score (default: %zu)", params.multiple_choice_tasks });
     options.push_back({ "perplexity",  "       --kl-divergence",        "computes KL-divergence to logits provided via --kl-divergence-base" });
+    options.push_back({ "perplexity",  "       --kl-divergence-top-k N", "save only the top N log-probabilities per token to --kl-divergence-base (default: %d, 0 = all)", params.kl_divergence_top_k });
     options.push_back({ "perplexity",  "       --ppl-stride N",         "stride for perplexity calculation (default: %d)", params.ppl_stride });
     options.push_back({ "perplexity",  "       --ppl-output-type {0,1}",
                                                                         "output type for perplexity calculation (default: %d)", params.ppl_output_type });
@@ -1783,6 +1927,8 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "multi-modality" });
     options.push_back({ "*",           "       --mmproj FILE",          "path to a multimodal projector file for LLaVA. see examples/llava/README.md" });
     options.push_back({ "*",           "       --image FILE",           "path to an image file. use with multimodal models. Specify multiple times for batching" });
+    options.push_back({ "server",      "       --mmproj-threads N",     "number of threads used to encode images (default: same as --threads-batch)" });
+    options.push_back({ "server",      "       --mmproj-cache N",       "number of image embeddings to keep in a cache of recently used images (default: %d, 0 = disabled)", params.mmproj_cache });
 
     options.push_back({ "backend" });
     options.push_back({ "*",           "       --rpc SERVERS",          "comma separated list of RPC servers" });
@@ -1794,10 +1940,14 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
         options.push_back({ "*",           "       --no-mmap",              "do not memory-map model (slower load but may reduce pageouts if not using mlock)" });
     }
     options.push_back({ "*",           "       --run-time-repack",      "repack tensors if interleaved variant is available"});
+    options.push_back({ "*",           "-fw,   --fuse-weights",         "concatenate Q/K/V and ffn_gate/ffn_up weights of the same type at load time,\n"
+                                                                        "so that each is one matrix multiplication (disables mmap of the weights)"});
     options.push_back({ "*",           "       --numa TYPE",            "attempt optimizations that help on some NUMA systems\n"
                                                                         "  - distribute: spread execution evenly over all nodes\n"
                                                                         "  - isolate: only spawn threads on CPUs on the node that execution started on\n"
                                                                         "  - numactl: use the CPU map provided by numactl\n"
+                                                                        "  - shard: distribute, and partition the rows of weight matrices between nodes\n"
+                                                                        "    so that threads only read weights from their own node (best with --no-mmap)\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
 
@@ -1849,6 +1999,11 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "passkey",     "       --junk N",               "number of times to repeat the junk text (default: %d)", params.n_junk });
     options.push_back({ "passkey",     "       --pos N",                "position of the passkey in the junk text (default: %d)", params.i_pos });
 
+    options.push_back({ "kv-sensitivity" });
+    options.push_back({ "kv-sensitivity", "       --kv-sens-type TYPE",   "KV cache type measured one layer at a time (default: %s)", params.kv_sens_type.c_str() });
+    options.push_back({ "kv-sensitivity", "       --kv-sens-type-high TYPE", "KV cache type of the most sensitive layers in the proposed mix (default: %s)", params.kv_sens_type_high.c_str() });
+    options.push_back({ "kv-sensitivity", "       --kv-sens-n-high N", "number of layers that use the high precision type in the proposed mix (default: %d, -1 = n_layer/8)", params.kv_sens_n_high });
+
     options.push_back({ "imatrix" });
     options.push_back({ "imatrix",     "-o,    --output FNAME",         "output file (default: '%s')", params.out_file.c_str() });
     options.push_back({ "imatrix",     "       --output-frequency N",   "output the imatrix every N iterations (default: %d)", params.n_out_freq });
@@ -1873,6 +2028,10 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --port PORT",            "port to listen (default: %d)", params.port });
     options.push_back({ "server",      "       --path PATH",            "path to serve static files from (default: %s)", params.public_path.c_str() });
     options.push_back({ "server",      "       --embedding(s)",         "restrict to only support embedding use case; use only with dedicated embedding models (default: %s)", params.embedding ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --reranking, --rerank",  "enable the reranking endpoint; use only with cross-encoder models (default: %s)", params.reranking ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --async-decode",         "submit the next generation batch before detokenizing and sending the sampled tokens (default: %s)", params.async_decode ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --score-seqs N",         "number of sequences reserved for the scoring endpoint, the most continuations\n"
+                                                                        "of a prompt that can be scored (default: %d, 0 = disabled)", params.n_score_seq });
     options.push_back({ "server",      "       --api-key KEY",          "API key to use for authentication (default: none)" });
     options.push_back({ "server",      "       --api-key-file FNAME",   "path to file containing API keys (default: none)" });
     options.push_back({ "server",      "       --ssl-key-file FNAME",   "path to file a PEM-encoded SSL private key" });
@@ -1886,6 +2045,7 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --metrics",              "enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --no-slots",             "disables slots monitoring endpoint (default: %s)", params.endpoint_slots ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --slot-save-path PATH",  "path to save slot kv cache (default: disabled)" });
+    options.push_back({ "server",      "       --slot-save-compress",   "LZ compress the saved slot kv cache (default: %s)", params.slot_save_compress ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --chat-template JINJA_TEMPLATE",
                                                                         "set custom jinja chat template (default: template taken from model's metadata)\n"
                                                                         "only commonly used templates are accepted:\n"
@@ -2448,6 +2608,8 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.check_tensors   = params.check_tensors;
     mparams.repack_tensors  = params.repack_tensors;
     mparams.use_thp         = params.use_thp;
+    mparams.numa_shard      = params.numa_shard;
+    mparams.fuse_weights    = params.fuse_weights;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
     } else {
@@ -2464,7 +2626,7 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     return mparams;
 }
 
-static ggml_type kv_cache_type_from_str(const std::string & s) {
+ggml_type kv_cache_type_from_str(const std::string & s) {
     if (s == "f32") {
         return GGML_TYPE_F32;
     }
@@ -2532,11 +2694,26 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.mla_attn          = params.mla_attn;
     cparams.attn_max_batch    = params.attn_max_batch;
     cparams.fused_moe_up_gate = params.fused_moe_up_gate;
+    cparams.swa_full          = params.swa_full;
+    cparams.kv_swap           = params.kv_swap;
     cparams.min_experts       = params.min_experts;
     cparams.thresh_experts    = params.thresh_experts;
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
+    if (!params.kv_type_overrides.empty()) {
+        GGML_ASSERT(params.kv_type_overrides.back().pattern == nullptr && "KV cache type overrides not terminated with empty pattern");
+        cparams.kv_type_overrides = params.kv_type_overrides.data();
+    }
+    if (!params.kv_swap_type.empty()) {
+        cparams.kv_swap_type = kv_cache_type_from_str(params.kv_swap_type);
+    }
+    if (!params.kv_swap_file.empty()) {
+        cparams.kv_swap_path = params.kv_swap_file.c_str();
+    }
+    cparams.huge_page_size = params.kv_huge_page_size;
+    cparams.numa_mem       = params.numa_mem;
+    cparams.n_top_logits   = params.n_top_logits;
 
     if (!params.offload_policy.empty()) cparams.offload_policy = (void *)&params.offload_policy;
 
@@ -3207,6 +3384,204 @@ float llama_embd_similarity_cos(const float * embd1, const float * embd2, int n)
     return sum / (sqrt(sum1) * sqrt(sum2));
 }
 
+//
+// Scoring utils
+//
+
+// decodes the batch in pieces of at most n_batch tokens, calls on_logits(i, logits) for each token i that has logits
+template <typename F>
+static bool llama_score_decode(llama_context * ctx, llama_batch & batch, int32_t n_batch, const F & on_logits) {
+    for (int32_t i0 = 0; i0 < batch.n_tokens; i0 += n_batch) {
+        const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i0);
+
+        llama_batch batch_view = {
+            n_tokens,
+            batch.token    + i0,
+            nullptr,
+            batch.pos      + i0,
+            batch.n_seq_id + i0,
+            batch.seq_id   + i0,
+            batch.logits   + i0,
+            0, 0, 0, // unused
+        };
+
+        if (llama_decode(ctx, batch_view) != 0) {
+            return false;
+        }
+
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (batch_view.logits[i]) {
+                on_logits(i0 + i, llama_get_logits_ith(ctx, i));
+            }
+        }
+    }
+    return true;
+}
+
+// log-probability of token and whether it is the most likely one
+static std::pair<float, bool> llama_score_logprob(const float * logits, int n_vocab, llama_token token) {
+    int   i_max = 0;
+    float max_logit = logits[0];
+    for (int j = 1; j < n_vocab; ++j) {
+        if (logits[j] > max_logit) {
+            max_logit = logits[j];
+            i_max = j;
+        }
+    }
+    double sum = 0;
+    for (int j = 0; j < n_vocab; ++j) {
+        sum += expf(logits[j] - max_logit);
+    }
+    return { logits[token] - max_logit - (float) log(sum), i_max == token };
+}
+
+bool llama_score(
+        struct llama_context * ctx,
+        const std::vector<llama_score_task> & tasks,
+        std::vector<llama_score_result> & results,
+        llama_seq_id seq_base,
+        int32_t      n_seq,
+        int32_t      n_batch,
+        int32_t      n_tokens_max) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    if (n_tokens_max <= 0) {
+        n_tokens_max = llama_n_ctx(ctx) - llama_get_kv_cache_used_cells(ctx);
+    }
+    n_batch = std::max(1, std::min(n_batch, (int32_t) llama_n_batch(ctx)));
+
+    results.assign(tasks.size(), {});
+
+    // number of KV cells needed by a task (the last token of a continuation is not evaluated)
+    std::vector<int32_t> n_cells(tasks.size());
+    for (size_t it = 0; it < tasks.size(); ++it) {
+        const auto & task = tasks[it];
+        if (task.prefix.empty() || task.continuations.empty() || (int32_t) task.continuations.size() > n_seq) {
+            fprintf(stderr, "%s: task %zu has no prefix, no continuations or more continuations than sequences (%d)\n", __func__, it, n_seq);
+            return false;
+        }
+        n_cells[it] = task.prefix.size();
+        for (const auto & cont : task.continuations) {
+            if (cont.empty()) {
+                fprintf(stderr, "%s: task %zu has an empty continuation\n", __func__, it);
+                return false;
+            }
+            n_cells[it] += cont.size() - 1;
+        }
+        if (n_cells[it] > n_tokens_max) {
+            fprintf(stderr, "%s: task %zu needs %d KV cells, only %d are available\n", __func__, it, n_cells[it], n_tokens_max);
+            return false;
+        }
+    }
+
+    llama_batch batch = llama_batch_init(n_tokens_max, 0, 1);
+
+    // index of the task (prefix) or of the continuation token each output belongs to
+    std::vector<std::pair<int32_t, int32_t>> outputs;
+
+    size_t i0 = 0;
+    size_t max_tasks = tasks.size();
+    bool ok = true;
+    while (ok && i0 < tasks.size()) {
+        // pack as many tasks as possible
+        size_t  i1 = i0;
+        int32_t n_seq_used = 0;
+        int32_t n_cells_used = 0;
+        while (i1 < tasks.size() && i1 - i0 < max_tasks &&
+               n_seq_used + (int32_t) tasks[i1].continuations.size() <= n_seq && n_cells_used + n_cells[i1] <= n_tokens_max) {
+            n_seq_used   += tasks[i1].continuations.size();
+            n_cells_used += n_cells[i1];
+            ++i1;
+        }
+
+        // the prefixes, with the logits of their last token
+        llama_batch_clear(batch);
+        outputs.clear();
+        llama_seq_id s0 = seq_base;
+        for (size_t it = i0; it < i1; ++it) {
+            const auto & task = tasks[it];
+            for (size_t i = 0; i < task.prefix.size(); ++i) {
+                llama_batch_add(batch, task.prefix[i], i, { s0 }, i == task.prefix.size() - 1);
+            }
+            results[it].continuations.assign(task.continuations.size(), {});
+            s0 += task.continuations.size();
+        }
+
+        size_t it_out = i0;
+        ok = llama_score_decode(ctx, batch, n_batch, [&](int32_t, const float * logits) {
+            // the first token of each continuation
+            auto & task = tasks[it_out];
+            auto & res  = results[it_out++];
+            for (size_t ic = 0; ic < task.continuations.size(); ++ic) {
+                const auto lp = llama_score_logprob(logits, n_vocab, task.continuations[ic][0]);
+                res.continuations[ic].logprobs.push_back(lp.first);
+                res.continuations[ic].greedy = lp.second;
+            }
+        });
+
+        // the continuations, sharing the KV cells of the prefix
+        if (ok) {
+            llama_batch_clear(batch);
+            s0 = seq_base;
+            for (size_t it = i0; it < i1; ++it) {
+                const auto & task = tasks[it];
+                const llama_pos n_prefix = task.prefix.size();
+                for (size_t ic = 0; ic < task.continuations.size(); ++ic) {
+                    const llama_seq_id seq_id = s0 + ic;
+                    if (ic > 0) {
+                        llama_kv_cache_seq_cp(ctx, s0, seq_id, -1, -1);
+                    }
+                    const auto & cont = task.continuations[ic];
+                    for (size_t i = 0; i + 1 < cont.size(); ++i) {
+                        llama_batch_add(batch, cont[i], n_prefix + i, { seq_id }, true);
+                        outputs.emplace_back(it, ic);
+                    }
+                }
+                s0 += task.continuations.size();
+            }
+
+            ok = llama_score_decode(ctx, batch, n_batch, [&](int32_t i, const float * logits) {
+                const auto & task = tasks[outputs[i].first];
+                auto & res = results[outputs[i].first].continuations[outputs[i].second];
+                const auto lp = llama_score_logprob(logits, n_vocab, task.continuations[outputs[i].second][res.logprobs.size()]);
+                res.logprobs.push_back(lp.first);
+                res.greedy = res.greedy && lp.second;
+            });
+        }
+
+        for (llama_seq_id seq_id = seq_base; seq_id < seq_base + n_seq_used; ++seq_id) {
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        }
+
+        if (!ok && i1 - i0 > 1) {
+            // the KV cache may be too fragmented for this many tasks: try again with fewer
+            max_tasks = (i1 - i0)/2;
+            ok = true;
+            continue;
+        }
+
+        i0 = i1;
+    }
+
+    llama_batch_free(batch);
+
+    if (!ok) {
+        fprintf(stderr, "%s: failed to decode task %zu\n", __func__, i0);
+        return false;
+    }
+
+    for (auto & res : results) {
+        for (auto & cont : res.continuations) {
+            cont.logprob = 0.0f;
+            for (float lp : cont.logprobs) {
+                cont.logprob += lp;
+            }
+        }
+    }
+
+    return true;
+}
+
 //
 // Control vector utils
 //
@@ -3512,7 +3887,10 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
     fprintf(stream, "repack: %s # default: false\n", params.repack_tensors ? "true" : "false");
+    fprintf(stream, "fuse_weights: %s # default: false\n", params.fuse_weights ? "true" : "false");
     fprintf(stream, "use_thp: %s # default: false\n", params.use_thp ? "true" : "false");
+    fprintf(stream, "kv_huge_page_size: %d # default: 0\n", params.kv_huge_page_size);
+    fprintf(stream, "n_top_logits: %d # default: 0\n", params.n_top_logits);
     fprintf(stream, "penalize_nl: %s # default: false\n", sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
@@ -3544,6 +3922,8 @@ void yaml_dump_non_result_info(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "mla_attn: %d # default: 0\n", params.mla_attn);
     fprintf(stream, "attn_max_batch: %d # default: 0\n", params.attn_max_batch);
     fprintf(stream, "fused_moe: %s # default: false\n", params.fused_moe_up_gate ? "true" : "false");
+    fprintf(stream, "swa_full: %s # default: false\n", params.swa_full ? "true" : "false");
+    fprintf(stream, "kv_swap: %s # default: false\n", params.kv_swap ? "true" : "false");
     fprintf(stream, "ser: %d,%g # defaulr: -1,0\n", params.min_experts, params.thresh_experts);
     fprintf(stream, "temp: %f # default: 0.8\n", sparams.temp);
 
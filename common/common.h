@@ -168,6 +168,7 @@ struct gpt_params {
     size_t multiple_choice_tasks = 0; // number of tasks to use when computing the TruthfulQA score. If 0, all tasks will be computed
 
     bool   kl_divergence    = false; // compute KL divergence
+    int32_t kl_divergence_top_k = 0;  // save only the top-k log-probabilities per token to --kl-divergence-base (0 = all)
 
     bool usage             = false; // print usage
     bool use_color         = false; // use color to distinguish generations and inputs
@@ -186,6 +187,8 @@ struct gpt_params {
     int  mla_attn          = 0;     // MLA 0: standard attention, 1: MLA with K and transposed V cache, 2: MLA with just K cache
     int  attn_max_batch    = 0;     // Max batch size to use when computing attention (only applicable if flash_attn = false)
     bool fused_moe_up_gate = false; // fused up*unary(gate) op for MoE models
+    bool swa_full          = false; // full-size KV cache for the sliding window attention layers
+    bool kv_swap           = false; // swap sequences out of a full KV cache
     int  min_experts       = -1;
     float thresh_experts   = 0;
 
@@ -204,16 +207,30 @@ struct gpt_params {
     bool check_tensors     = false; // validate tensor data
     bool repack_tensors    = false; // repack tensors if interleaved variant is available
     bool use_thp           = false; // use transparent huge pages (linux only)
+    bool numa_shard        = false; // partition weight rows between NUMA nodes (--numa shard)
+    bool fuse_weights      = false; // one matrix multiplication for Q/K/V and for ffn_gate/ffn_up
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
+    std::vector<llama_kv_type_override> kv_type_overrides; // per-layer KV cache data types
+    std::string kv_swap_type = "";    // data type of the swapped out KV cache rows (empty = unchanged)
+    std::string kv_swap_file = "";    // file for the swapped out sequences (empty = host memory)
+
+    int32_t kv_huge_page_size = 0;    // huge page size in MiB for the CPU KV cache and compute buffers (0 = regular pages, -1 = system default)
+    llama_numa_mem_policy numa_mem = LLAMA_NUMA_MEM_POLICY_NONE; // NUMA placement of the CPU KV cache and compute buffers
+    int32_t n_top_logits = 0;         // keep only the top-N logits per output for sampling (0 = full vocabulary)
 
     // multimodal models (see examples/llava)
     std::string mmproj = "";        // path to multimodal projector
     std::vector<std::string> image; // path to image file(s)
+    int32_t n_threads_mmproj = -1;  // number of threads of the image encoder (-1 = n_threads_batch) (server only)
+    int32_t mmproj_cache     = 32;  // number of image embeddings kept in an LRU cache (0 = disabled) (server only)
 
     // embedding
     bool embedding         = false; // get only sentence embedding
+    bool reranking         = false; // score (query, document) pairs with a cross-encoder (server only)
+    bool async_decode      = false; // overlap the next generation batch with the processing of the sampled tokens (server only)
+    int32_t n_score_seq    = 0;     // sequences reserved for scoring continuations with /v1/score (0 = disabled) (server only)
     int32_t embd_normalize = 2;     // normalisation for embendings (-1=none, 0=max absolute int16, 1=taxicab, 2=euclidean, >2=p-norm)
     std::string embd_out   = "";    // empty = default, "array" = [[],[]...], "json" = openai style, "json+" = same "json" + cosine similarity matrix
     std::string embd_sep   = "\n";  // separator of embendings
@@ -242,6 +259,7 @@ struct gpt_params {
     bool log_json = false;
 
     std::string slot_save_path;
+    bool slot_save_compress = false; // LZ compress the saved slot KV cache
 
     float slot_prompt_similarity = 0.5f;
 
@@ -263,6 +281,11 @@ struct gpt_params {
     int32_t n_junk = 250; // number of times to repeat the junk text
     int32_t i_pos  = -1;  // position of the passkey in the junk text
 
+    // kv-sensitivity params
+    std::string kv_sens_type      = "q4_0"; // KV cache type whose effect is measured one layer at a time
+    std::string kv_sens_type_high = "q8_0"; // KV cache type of the most sensitive layers in the proposed mix
+    int32_t     kv_sens_n_high    = -1;     // number of layers in the proposed mix that use kv_sens_type_high (-1 = n_layer/8)
+
     // imatrix params
     std::string out_file = "imatrix.dat"; // save the resulting imatrix to this file
     std::string output_tensor_name = "output.weight"; // name of the output tensor
@@ -358,6 +381,9 @@ struct llama_init_result    llama_init_from_gpt_params(gpt_params & params);
 struct llama_model_params   llama_model_params_from_gpt_params  (const gpt_params & params);
 struct llama_context_params llama_context_params_from_gpt_params(const gpt_params & params);
 
+// KV cache type from its name (f16, q8_0, ...), throws std::runtime_error for unknown names
+ggml_type kv_cache_type_from_str(const std::string & s);
+
 struct llama_model * llama_load_model_from_url(const char * model_url, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 struct llama_model * llama_load_model_from_hf(const char * repo, const char * file, const char * path_model, const char * hf_token, const struct llama_model_params & params);
 
@@ -462,6 +488,40 @@ void llama_embd_normalize(const float * inp, float * out, int n, int embd_norm =
 
 float llama_embd_similarity_cos(const float * embd1, const float * embd2, int n);
 
+//
+// Scoring utils
+//
+
+// candidate continuations of a prefix, scored by their log-likelihood
+struct llama_score_task {
+    std::vector<llama_token> prefix;                     // must not be empty
+    std::vector<std::vector<llama_token>> continuations; // each must not be empty
+};
+
+struct llama_score_continuation {
+    std::vector<float> logprobs;  // log-probability of each token given the prefix and the tokens before it
+    float logprob = 0.0f;         // sum of logprobs
+    bool  greedy  = true;         // all tokens are the most likely ones
+};
+
+struct llama_score_result {
+    std::vector<llama_score_continuation> continuations;
+};
+
+// scores the continuations of the tasks with the sequences [seq_base, seq_base + n_seq) of ctx
+// the prefix of a task is evaluated once and copied to the sequences of its continuations with llama_kv_cache_seq_cp,
+// as many tasks as fit into n_seq sequences and n_tokens_max KV cells (0 = the unused cells) are evaluated together,
+// in llama_decode calls of at most n_batch tokens. The cells of the sequences are removed when done.
+// returns false if a task is invalid, does not fit or decoding fails
+bool llama_score(
+        struct llama_context * ctx,
+        const std::vector<llama_score_task> & tasks,
+        std::vector<llama_score_result> & results,
+        llama_seq_id seq_base,
+        int32_t      n_seq,
+        int32_t      n_batch,
+        int32_t      n_tokens_max = 0);
+
 //
 // Control vector utils
 //
@@ -3,6 +3,19 @@
 #include "llama-vocab.h"
 #include <random>
 
+// sync the penalty counts with the (zero-filled) window of prev
+static void llama_sampling_reset_penalties(llama_sampling_context * ctx) {
+    if (ctx->penalties == nullptr) {
+        return;
+    }
+    llama_sampler_penalties_reset(ctx->penalties);
+    const int32_t n_prev = ctx->prev.size();
+    const int32_t penalty_last_n = std::min(ctx->params.penalty_last_n < 0 ? n_prev : ctx->params.penalty_last_n, n_prev);
+    for (int32_t i = n_prev - penalty_last_n; i < n_prev; ++i) {
+        llama_sampler_penalties_accept(ctx->penalties, ctx->prev[i]);
+    }
+}
+
 struct llama_sampling_context * llama_sampling_init(const struct llama_vocab* vocab, const struct llama_sampling_params & params) {
     struct llama_sampling_context * result = new llama_sampling_context();
 
@@ -41,6 +54,18 @@ struct llama_sampling_context * llama_sampling_init(const struct llama_vocab* vo
 
     result->n_valid = 0;
 
+    // the penalties are applied to the last penalty_last_n tokens of prev, their counts are maintained on accept
+    // (models without a vocabulary use llama_sample_repetition_penalties, which does not need the number of tokens)
+    {
+        const int32_t penalty_last_n = std::min(params.penalty_last_n < 0 ? params.n_prev : params.penalty_last_n, params.n_prev);
+        const bool penalties_enabled = params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f;
+        if (vocab && llama_vocab_n_tokens(vocab) > 0 && penalty_last_n > 0 && penalties_enabled) {
+            result->penalties = llama_sampler_init_penalties(llama_vocab_n_tokens(vocab),
+                    penalty_last_n, params.penalty_repeat, params.penalty_freq, params.penalty_present);
+            llama_sampling_reset_penalties(result);
+        }
+    }
+
     // init DRY
     for (const auto& cnstr : params.samplers_sequence)
     {
@@ -72,6 +97,9 @@ void llama_sampling_free(struct llama_sampling_context * ctx) {
     }
     if (ctx->smpl !=NULL)
         llama_sampler_dry_free(ctx->smpl);
+    if (ctx->penalties != NULL) {
+        llama_sampler_penalties_free(ctx->penalties);
+    }
     delete ctx;
 }
 
@@ -97,6 +125,7 @@ void llama_sampling_reset(llama_sampling_context * ctx) {
     ctx->cur.clear();
     ctx->n_valid = 0;
     llama_sampler_dry_reset(ctx->smpl);
+    llama_sampling_reset_penalties(ctx);
 }
 
 void llama_sampling_set_rng_seed(struct llama_sampling_context * ctx, uint32_t seed) {
@@ -117,7 +146,16 @@ void llama_sampling_cp(llama_sampling_context * src, llama_sampling_context * ds
     }
 
     dst->prev = src->prev;
+
+    if (dst->smpl) {
+        llama_sampler_dry_free(dst->smpl);
+    }
     dst->smpl = llama_sampler_dry_clone(src->smpl);
+
+    if (dst->penalties) {
+        llama_sampler_penalties_free(dst->penalties);
+    }
+    dst->penalties = llama_sampler_penalties_clone(src->penalties);
 }
 
 llama_token llama_sampling_last(llama_sampling_context * ctx) {
@@ -323,9 +361,6 @@ static llama_token llama_sampling_sample_impl(
 
     std::vector<float> original_logits;
     auto cur_p = llama_sampling_prepare(ctx_sampling, ctx_main, ctx_cfg, idx, /* apply_grammar= */ is_resampling, &original_logits);
-    if (ctx_sampling->grammar != NULL && !is_resampling) {
-        GGML_ASSERT(!original_logits.empty());
-    }
     llama_token id = 0;
 
     if (temp < 0.0) {
@@ -384,8 +419,10 @@ static llama_token llama_sampling_sample_impl(
         if (!is_valid) {
             LOG("Resampling because token %d: '%s' does not meet grammar rules\n", id, llama_token_to_piece(ctx_main, id).c_str());
 
-            // Restore logits from the copy
-            std::copy(original_logits.begin(), original_logits.end(), logits);
+            // Restore logits from the copy, if they were modified
+            if (!original_logits.empty()) {
+                std::copy(original_logits.begin(), original_logits.end(), logits);
+            }
 
             return llama_sampling_sample_impl(ctx_sampling, ctx_main, ctx_cfg, idx, /* is_resampling= */ true);
         }
@@ -420,26 +457,53 @@ static llama_token_data_array llama_sampling_prepare_impl(
     // Get a pointer to the logits
     float * logits = llama_get_logits_ith(ctx_main, idx);
 
-    if (ctx_sampling->grammar != NULL && !apply_grammar) {
+    // the logits are modified in place by the logit bias and CFG below, keep a copy for the grammar resampling pass
+    if (ctx_sampling->grammar != NULL && !apply_grammar && (!params.logit_bias.empty() || ctx_cfg)) {
         GGML_ASSERT(original_logits != NULL);
-        // Only make a copy of the original logits if we are not applying grammar checks, not sure if I actually have to do this.
         *original_logits = {logits, logits + n_vocab};
     }
 
-    // apply params.logit_bias map
-    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
-        logits[it->first] += it->second;
+    // if the context computed the top logits in the graph, sample from those only
+    // the grammar resampling pass and CFG need the full vocabulary
+    int32_t n_top = 0;
+    if (!apply_grammar && ctx_cfg == nullptr) {
+        cur.resize(n_vocab);
+        n_top = llama_get_top_logits_ith(ctx_main, idx, cur.data(), nullptr);
     }
 
-    if (ctx_cfg) {
-        float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
-        llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
-    }
+    if (n_top > 0) {
+        cur.resize(n_top);
 
-    cur.resize(n_vocab);
+        // apply params.logit_bias map to the candidates, tokens outside of the set only matter if they are boosted
+        for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+            bool found = false;
+            for (int32_t i = 0; i < n_top; ++i) {
+                if (cur[i].id == it->first) {
+                    cur[i].logit += it->second;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found && it->second > 0.0f) {
+                cur.push_back(llama_token_data{it->first, logits[it->first] + it->second, 0.0f});
+            }
+        }
+    } else {
+        // apply params.logit_bias map
+        for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
+            logits[it->first] += it->second;
+        }
+
+        if (ctx_cfg) {
+            float * logits_guidance = llama_get_logits_ith(ctx_cfg, idx);
+            llama_sample_apply_guidance(ctx_main, logits, logits_guidance, params.cfg_scale);
+        }
 
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        cur.resize(n_vocab);
+
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
     }
 
     llama_token_data_array cur_p = { cur.data(), cur.size(), false };
@@ -448,15 +512,26 @@ static llama_token_data_array llama_sampling_prepare_impl(
     const auto& penalty_tokens = params.use_penalty_prompt_tokens ? params.penalty_prompt_tokens : prev;
     const int penalty_tokens_used_size = std::min((int)penalty_tokens.size(), penalty_last_n);
     if (penalty_tokens_used_size) {
-        const float nl_logit = logits[llama_token_nl(llama_get_model(ctx_main))];
+        const llama_token nl_token = llama_token_nl(llama_get_model(ctx_main));
+        float nl_logit = n_top > 0 ? -INFINITY : logits[nl_token];
+        for (size_t i = 0; n_top > 0 && i < cur.size(); ++i) {
+            if (cur[i].id == nl_token) {
+                nl_logit = cur[i].logit;
+                break;
+            }
+        }
 
-        llama_sample_repetition_penalties(ctx_main, &cur_p,
-                penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
-                penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        if (!params.use_penalty_prompt_tokens && ctx_sampling->penalties) {
+            llama_sample_penalties(ctx_main, ctx_sampling->penalties, &cur_p);
+        } else {
+            llama_sample_repetition_penalties(ctx_main, &cur_p,
+                    penalty_tokens.data() + penalty_tokens.size() - penalty_tokens_used_size,
+                    penalty_tokens_used_size, penalty_repeat, penalty_freq, penalty_present);
+        }
 
         if (!penalize_nl) {
             for (size_t idx = 0; idx < cur_p.size; idx++) {
-                if (cur_p.data[idx].id == llama_token_nl(llama_get_model(ctx_main))) {
+                if (cur_p.data[idx].id == nl_token) {
                     cur_p.data[idx].logit = nl_logit;
                     break;
                 }
@@ -505,4 +580,7 @@ void llama_sampling_accept(
     if (ctx_sampling->smpl) {
         llama_sampler_dry_accept(ctx_sampling->smpl, id);
     }
+    if (ctx_sampling->penalties) {
+        llama_sampler_penalties_accept(ctx_sampling->penalties, id);
+    }
 }
@@ -98,6 +98,7 @@ struct llama_sampling_context {
     std::vector<llama_token>      prev;
     std::vector<llama_token_data> cur;
     llama_sampler_dry* smpl;
+    llama_sampler_penalties * penalties; // counts of the last penalty_last_n tokens of prev
 
     size_t n_valid; // Number of correct top tokens with correct probabilities.
 
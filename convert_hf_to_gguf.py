@@ -2665,7 +2665,7 @@ class InternLM2Model(Model):
             return [(self.map_tensor_name(name), data_torch)]
 
 
-@Model.register("BertModel", "CamembertModel")
+@Model.register("BertModel", "CamembertModel", "BertForSequenceClassification")
 class BertModel(Model):
     model_arch = gguf.MODEL_ARCH.BERT
 
@@ -2673,10 +2673,17 @@ class BertModel(Model):
         super().__init__(*args, **kwargs)
         self.vocab_size = None
 
+        # cross-encoders (rerankers) keep their classification head, applied by the rank pooling
+        self.is_rerank = any(arch.endswith("ForSequenceClassification") for arch in self.hparams.get("architectures", []))
+
     def set_gguf_parameters(self):
         super().set_gguf_parameters()
         self.gguf_writer.add_causal_attention(False)
 
+        if self.is_rerank:
+            self.gguf_writer.add_pooling_type(gguf.PoolingType.RANK)
+            return
+
         # get pooling path
         pooling_path = None
         module_path = self.dir_model / "modules.json"
@@ -2727,13 +2734,25 @@ class BertModel(Model):
         special_vocab = gguf.SpecialVocab(self.dir_model, n_vocab=len(tokens))
         special_vocab.add_to_gguf(self.gguf_writer)
 
+    def get_tensors(self) -> Iterator[tuple[str, Tensor]]:
+        # the encoder of the *ForSequenceClassification models is nested under the model type
+        for name, data in super().get_tensors():
+            for prefix in ("bert.", "roberta."):
+                if name.startswith(prefix):
+                    name = name[len(prefix):]
+                    break
+            yield name, data
+
     def modify_tensors(self, data_torch: Tensor, name: str, bid: int | None) -> Iterable[tuple[str, Tensor]]:
         del bid  # unused
 
-        # we are only using BERT for embeddings so we don't need the pooling layer
-        if name in ("embeddings.position_ids", "pooler.dense.weight", "pooler.dense.bias"):
+        if name == "embeddings.position_ids":
             return [] # we don't need these
 
+        # the pooling layer is only used by the classification head of rerankers
+        if not self.is_rerank and name in ("pooler.dense.weight", "pooler.dense.bias"):
+            return []
+
         return [(self.map_tensor_name(name), data_torch)]
 
 
@@ -2767,7 +2786,7 @@ class NomicBertModel(BertModel):
         self.gguf_writer.add_rope_freq_base(self.hparams["rotary_emb_base"])
 
 
-@Model.register("XLMRobertaModel")
+@Model.register("XLMRobertaModel", "XLMRobertaForSequenceClassification")
 class XLMRobertaModel(BertModel):
     model_arch = gguf.MODEL_ARCH.BERT
 
@@ -3111,7 +3130,7 @@ class OlmoModel(Model):
         return [(self.map_tensor_name(name), data_torch)]
 
 
-@Model.register("JinaBertModel", "JinaBertForMaskedLM")
+@Model.register("JinaBertModel", "JinaBertForMaskedLM", "JinaBertForSequenceClassification")
 class JinaBertV2Model(BertModel):
     model_arch = gguf.MODEL_ARCH.JINA_BERT_V2
 
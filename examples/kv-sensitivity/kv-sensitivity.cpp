@@ -0,0 +1,303 @@
+#include "common.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <string>
+#include <vector>
+
+// Measures how much the output of the model changes when the KV cache of a single layer is stored
+// with a low precision type, and proposes a per-layer mix that keeps the most sensitive layers at a
+// higher precision type (see --cache-type-layers).
+
+static void print_usage(int argc, char ** argv, const gpt_params & params) {
+    gpt_params_print_usage(argc, argv, params);
+
+    LOG_TEE("\nexample usage:\n");
+    LOG_TEE("\n    %s -m model.gguf -f wiki.test.raw -c 2048 --chunks 8 -fa --kv-sens-type q4_0 --kv-sens-type-high q8_0\n", argv[0]);
+    LOG_TEE("\n");
+}
+
+// the baseline distribution of one token: the top k_top log-probabilities and the probability of the rest
+static constexpr int k_top = 32;
+
+struct base_token {
+    int32_t id[k_top];
+    float   logp[k_top];
+    float   logp_tail;
+    float   nll;
+};
+
+struct eval_result {
+    double kld = 0; // mean KL divergence from the baseline
+    double nll = 0; // mean negative log-likelihood of the evaluated tokens
+    bool   ok  = false;
+};
+
+static double log_sum_exp(const float * logits, int n_vocab, float & max_logit) {
+    max_logit = *std::max_element(logits, logits + n_vocab);
+    double sum = 0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += expf(logits[i] - max_logit);
+    }
+    return log(sum);
+}
+
+static void make_base_token(const float * logits, int n_vocab, llama_token tok, std::vector<int32_t> & idx, base_token & b) {
+    float max_logit;
+    const double lse = log_sum_exp(logits, n_vocab, max_logit);
+    std::iota(idx.begin(), idx.end(), 0);
+    std::partial_sort(idx.begin(), idx.begin() + k_top, idx.end(), [logits](int32_t a, int32_t c) { return logits[a] > logits[c]; });
+    double p_top = 0;
+    for (int j = 0; j < k_top; ++j) {
+        b.id[j]   = idx[j];
+        b.logp[j] = logits[idx[j]] - max_logit - lse;
+        p_top += exp(b.logp[j]);
+    }
+    b.logp_tail = log(std::max(1e-10, 1 - p_top));
+    b.nll = -(logits[tok] - max_logit - lse);
+}
+
+// KL divergence between the baseline and the given logits after merging all tokens outside the
+// baseline top k_top into one
+static double kld_token(const float * logits, int n_vocab, const base_token & b) {
+    float max_logit;
+    const double lse = log_sum_exp(logits, n_vocab, max_logit);
+    double kld = 0, q_top = 0;
+    for (int j = 0; j < k_top; ++j) {
+        const double logq = logits[b.id[j]] - max_logit - lse;
+        kld   += exp(b.logp[j])*(b.logp[j] - logq);
+        q_top += exp(logq);
+    }
+    kld += exp(b.logp_tail)*(b.logp_tail - log(std::max(1e-10, 1 - q_top)));
+    return kld;
+}
+
+// evaluates all chunks with the given context parameters, the first call (base empty) fills the baseline
+static eval_result evaluate(llama_model * model, const llama_context_params & cparams, const std::vector<llama_token> & tokens,
+        int n_chunk, int n_ctx, bool add_bos, std::vector<base_token> & base) {
+    eval_result res;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "%s: failed to create the context\n", __func__);
+        return res;
+    }
+
+    const int n_vocab = llama_n_vocab(model);
+    const int n_batch = std::min<int>(cparams.n_batch, n_ctx);
+    const int first   = n_ctx/2;
+    const bool fill_base = base.empty();
+
+    std::vector<int32_t> idx(n_vocab);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    size_t i_base = 0;
+    for (int i = 0; i < n_chunk; ++i) {
+        llama_kv_cache_clear(ctx);
+
+        const int start = i*n_ctx;
+        for (int j = 0; j < n_ctx; j += n_batch) {
+            const int n_eval = std::min(n_batch, n_ctx - j);
+            llama_batch_clear(batch);
+            for (int k = 0; k < n_eval; ++k) {
+                llama_token tok = tokens[start + j + k];
+                if (add_bos && j + k == 0) {
+                    tok = llama_token_bos(model);
+                }
+                llama_batch_add(batch, tok, j + k, { 0 }, j + k >= first && j + k < n_ctx - 1);
+            }
+            if (llama_decode(ctx, batch)) {
+                fprintf(stderr, "%s: failed to decode chunk %d\n", __func__, i);
+                llama_batch_free(batch);
+                llama_free(ctx);
+                return res;
+            }
+            for (int k = 0; k < n_eval; ++k) {
+                if (!batch.logits[k]) {
+                    continue;
+                }
+                const float * logits = llama_get_logits_ith(ctx, k);
+                const llama_token next = tokens[start + j + k + 1];
+                if (fill_base) {
+                    base.emplace_back();
+                    make_base_token(logits, n_vocab, next, idx, base.back());
+                    res.nll += base.back().nll;
+                } else {
+                    const base_token & b = base[i_base++];
+                    float max_logit;
+                    const double lse = log_sum_exp(logits, n_vocab, max_logit);
+                    res.nll += -(logits[next] - max_logit - lse);
+                    res.kld += kld_token(logits, n_vocab, b);
+                }
+            }
+        }
+    }
+
+    const size_t n_tok = base.size();
+    res.nll /= n_tok;
+    res.kld /= n_tok;
+    res.ok = true;
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+static double bits_per_value(ggml_type type) {
+    return 8.0*ggml_type_size(type)/ggml_blck_size(type);
+}
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+
+    if (!gpt_params_parse(argc, argv, params)) {
+        print_usage(argc, argv, params);
+        return 1;
+    }
+
+    ggml_type type_k, type_v, type_low, type_high;
+    try {
+        type_k    = kv_cache_type_from_str(params.cache_type_k);
+        type_v    = kv_cache_type_from_str(params.cache_type_v);
+        type_low  = kv_cache_type_from_str(params.kv_sens_type);
+        type_high = kv_cache_type_from_str(params.kv_sens_type_high);
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s: %s\n", __func__, e.what());
+        return 1;
+    }
+
+    // a quantized V cache needs flash attention, without it only the K cache is measured
+    const bool quant_v = params.flash_attn;
+    if (!quant_v) {
+        fprintf(stderr, "%s: flash attention is disabled (-fa), only the K cache type is varied\n", __func__);
+    }
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_model_params mparams = llama_model_params_from_gpt_params(params);
+    llama_model * model = llama_load_model_from_file(params.model.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    const int n_layer = llama_n_layer(model);
+    const int n_ctx   = params.n_ctx;
+    const bool add_bos = llama_should_add_bos_token(model);
+
+    std::vector<llama_token> tokens = ::llama_tokenize(model, params.prompt, add_bos);
+
+    int n_chunk = tokens.size()/n_ctx;
+    if (params.n_chunks > 0) {
+        n_chunk = std::min(n_chunk, params.n_chunks);
+    }
+    if (n_chunk == 0) {
+        fprintf(stderr, "%s: need at least %d tokens, the input has %zu tokens\n", __func__, n_ctx, tokens.size());
+        llama_free_model(model);
+        return 1;
+    }
+    fprintf(stderr, "%s: %d chunks of %d tokens, %d layers, measuring %s against K %s / V %s\n", __func__,
+            n_chunk, n_ctx, n_layer, ggml_type_name(type_low), ggml_type_name(type_k), ggml_type_name(type_v));
+
+    llama_context_params cparams = llama_context_params_from_gpt_params(params);
+    cparams.n_ctx     = n_ctx;
+    cparams.n_batch   = std::min<uint32_t>(cparams.n_batch, n_ctx);
+    cparams.n_seq_max = 1;
+    cparams.kv_type_overrides = nullptr;
+
+    std::vector<base_token> base;
+    base.reserve(size_t(n_chunk)*(n_ctx - 1 - n_ctx/2));
+
+    const eval_result res_base = evaluate(model, cparams, tokens, n_chunk, n_ctx, add_bos, base);
+    if (!res_base.ok) {
+        llama_free_model(model);
+        return 1;
+    }
+    fprintf(stderr, "%s: baseline PPL = %.4f\n", __func__, exp(res_base.nll));
+
+    // evaluates the given overrides, all other layers use the baseline types
+    auto run = [&](const std::vector<llama_kv_type_override> & overrides) {
+        llama_context_params cp = cparams;
+        cp.kv_type_overrides = overrides.data();
+        return evaluate(model, cp, tokens, n_chunk, n_ctx, add_bos, base);
+    };
+    auto override_for = [&](const std::string & layers, ggml_type type) {
+        return llama_kv_type_override{ layers.c_str(), type, quant_v ? type : GGML_TYPE_COUNT };
+    };
+
+    std::vector<eval_result> res_layer(n_layer);
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string layer = std::to_string(il);
+        res_layer[il] = run({ override_for(layer, type_low), { nullptr, GGML_TYPE_COUNT, GGML_TYPE_COUNT } });
+        if (!res_layer[il].ok) {
+            llama_free_model(model);
+            return 1;
+        }
+        fprintf(stderr, "%s: layer %3d: KLD = %.6f, PPL = %.4f\n", __func__, il, res_layer[il].kld, exp(res_layer[il].nll));
+    }
+
+    std::vector<int> order(n_layer);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return res_layer[a].kld > res_layer[b].kld; });
+
+    printf("\n| layer |        KLD |   ΔPPL (%%) |\n");
+    printf("|------:|-----------:|-----------:|\n");
+    for (int il : order) {
+        printf("| %5d | %10.6f | %10.4f |\n", il, res_layer[il].kld, 100*(exp(res_layer[il].nll - res_base.nll) - 1));
+    }
+
+    // proposed mix: the n_high most sensitive layers at type_high, all others at type_low
+    int n_high = params.kv_sens_n_high >= 0 ? params.kv_sens_n_high : std::max(1, n_layer/8);
+    n_high = std::min(n_high, n_layer);
+
+    std::vector<int> high(order.begin(), order.begin() + n_high);
+    std::sort(high.begin(), high.end());
+    std::string high_layers;
+    for (int il : high) {
+        high_layers += (high_layers.empty() ? "" : "|") + std::to_string(il);
+    }
+    const std::string all_layers = ".*";
+
+    std::vector<llama_kv_type_override> mix;
+    if (n_high > 0) {
+        mix.push_back(override_for(high_layers, type_high));
+    }
+    mix.push_back(override_for(all_layers, type_low));
+    mix.push_back({ nullptr, GGML_TYPE_COUNT, GGML_TYPE_COUNT });
+
+    const eval_result res_low = run({ override_for(all_layers, type_low), { nullptr, GGML_TYPE_COUNT, GGML_TYPE_COUNT } });
+    const eval_result res_mix = run(mix);
+    if (!res_low.ok || !res_mix.ok) {
+        llama_free_model(model);
+        return 1;
+    }
+
+    const double bits_base = 0.5*(bits_per_value(type_k) + bits_per_value(type_v));
+    const double bits_low  = quant_v ? bits_per_value(type_low)  : 0.5*(bits_per_value(type_low)  + bits_per_value(type_v));
+    const double bits_high = quant_v ? bits_per_value(type_high) : 0.5*(bits_per_value(type_high) + bits_per_value(type_v));
+    const double bits_mix  = (n_high*bits_high + (n_layer - n_high)*bits_low)/n_layer;
+
+    printf("\n| cache             | bits/value |        KLD |        PPL |\n");
+    printf("|-------------------|-----------:|-----------:|-----------:|\n");
+    printf("| baseline          | %10.2f | %10.6f | %10.4f |\n", bits_base, 0.0, exp(res_base.nll));
+    printf("| all %-13s | %10.2f | %10.6f | %10.4f |\n", ggml_type_name(type_low), bits_low, res_low.kld, exp(res_low.nll));
+    printf("| proposed mix      | %10.2f | %10.6f | %10.4f |\n", bits_mix, res_mix.kld, exp(res_mix.nll));
+
+    printf("\nproposed mix: -ctk %s%s%s",
+            ggml_type_name(type_low), quant_v ? " -ctv " : "", quant_v ? ggml_type_name(type_low) : "");
+    if (n_high > 0) {
+        printf(" -ctl \"%s=%s%s%s\"", high_layers.c_str(), ggml_type_name(type_high),
+                quant_v ? "" : ":", quant_v ? "" : ggml_type_name(type_v));
+    }
+    printf("\n");
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return 0;
+}
@@ -589,7 +589,7 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
     const int batch_size = imgs->size;
 
-    if (ctx->has_llava_projector || ctx->has_minicpmv_projector) {
+    if ((ctx->has_llava_projector && !clip_supports_batch(ctx)) || ctx->has_minicpmv_projector) {
         GGML_ASSERT(batch_size == 1);
     }
 
@@ -624,7 +624,13 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
             embeddings = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, hidden_size, num_positions, batch_size);
             ggml_set_name(embeddings, "embeddings");
             ggml_set_input(embeddings);
-            embeddings = ggml_acc(ctx0, embeddings, model.class_embedding,
+            struct ggml_tensor * class_embedding = model.class_embedding;
+            if (batch_size > 1) {
+                // one class embedding per image (the input is zero)
+                class_embedding = ggml_add(ctx0, ggml_view_3d(ctx0, embeddings, hidden_size, 1, batch_size,
+                            embeddings->nb[1], embeddings->nb[2], 0), model.class_embedding);
+            }
+            embeddings = ggml_acc(ctx0, embeddings, class_embedding,
                     embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], 0);
             embeddings = ggml_acc(ctx0, embeddings, inp,
                     embeddings->nb[1], embeddings->nb[2], embeddings->nb[3], model.class_embedding->nb[1]);
@@ -748,9 +754,10 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
 
     // llava projector
     if (ctx->has_llava_projector) {
-        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]);
+        // the patches of all images of the batch, one after the other
+        embeddings = ggml_reshape_2d(ctx0, embeddings, embeddings->ne[0], embeddings->ne[1]*embeddings->ne[2]);
 
-        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches);
+        struct ggml_tensor * patches = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, num_patches*batch_size);
         ggml_set_name(patches, "patches");
         ggml_set_input(patches);
 
@@ -2250,6 +2257,30 @@ bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f3
     return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
 }
 
+bool clip_image_batch_encode_u8(struct clip_ctx * ctx, const int n_threads, const struct clip_image_u8 * const * imgs, int n_imgs, float * vec) {
+    if (!clip_supports_batch(ctx)) {
+        LOG_TEE("%s: the projector does not support batches of images\n", __func__);
+        return false;
+    }
+
+    std::vector<clip_image_f32> imgs_f32(n_imgs);
+    for (int i = 0; i < n_imgs; ++i) {
+        clip_image_f32_batch res{};
+        if (!clip_image_preprocess(ctx, imgs[i], &res) || res.size != 1) {
+            LOG_TEE("%s: unable to preprocess image %d\n", __func__, i);
+            clip_image_f32_batch_free(&res);
+            return false;
+        }
+        imgs_f32[i] = std::move(res.data[0]);
+        clip_image_f32_batch_free(&res);
+    }
+
+    clip_image_f32_batch batch{};
+    batch.size = imgs_f32.size();
+    batch.data = imgs_f32.data();
+    return clip_image_batch_encode(ctx, n_threads, &batch, vec);
+}
+
 bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs, float * vec) {
     if (!ctx->has_vision_encoder) {
         LOG_TEE("This gguf file seems to have no vision encoder\n");
@@ -2257,8 +2288,8 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     }
 
     int batch_size = imgs->size;
-    if (ctx->has_llava_projector) {
-        GGML_ASSERT(batch_size == 1); // TODO: support multiple images
+    if (ctx->has_llava_projector && !clip_supports_batch(ctx)) {
+        GGML_ASSERT(batch_size == 1);
     }
     if (ctx->has_minicpmv_projector) {
         GGML_ASSERT(batch_size == 1);
@@ -2296,12 +2327,10 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
 
             const int n = nx * ny;
 
-            for (int b = 0; b < batch_size; b++) {
-                for (int k = 0; k < 3; k++) {
-                    for (int y = 0; y < ny; y++) {
-                        for (int x = 0; x < nx; x++) {
-                            data[(b * 3 * n) + k * n + y * nx + x] = imgs->data[b].buf[3 * (y * nx + x) + k];
-                        }
+            for (int k = 0; k < 3; k++) {
+                for (int y = 0; y < ny; y++) {
+                    for (int x = 0; x < nx; x++) {
+                        data[(i * 3 * n) + k * n + y * nx + x] = imgs->data[i].buf[3 * (y * nx + x) + k];
                     }
                 }
             }
@@ -2372,8 +2401,10 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
         {
             struct ggml_tensor * patches = ggml_graph_get_tensor(gf, "patches");
             int* patches_data = (int*)malloc(ggml_nbytes(patches));
-            for (int i = 0; i < num_patches; i++) {
-                patches_data[i] = i + 1;
+            for (int b = 0; b < (int) (ggml_nelements(patches) / num_patches); b++) {
+                for (int i = 0; i < num_patches; i++) {
+                    patches_data[b*num_patches + i] = b*num_positions + i + 1;
+                }
             }
             ggml_backend_tensor_set(patches, patches_data, 0, ggml_nbytes(patches));
             free(patches_data);
@@ -2558,3 +2589,15 @@ int clip_n_mmproj_embd(const struct clip_ctx * ctx) {
 bool clip_is_minicpmv(const struct clip_ctx * ctx) {
     return ctx->has_minicpmv_projector;
 }
+
+bool clip_supports_batch(const struct clip_ctx * ctx) {
+    if (ctx->has_minicpmv_projector) {
+        return false;
+    }
+    if (!ctx->has_llava_projector) {
+        return true;
+    }
+    return (ctx->proj_type == PROJECTOR_TYPE_MLP || ctx->proj_type == PROJECTOR_TYPE_MLP_NORM) &&
+        strcmp(ctx->vision_model.hparams.mm_patch_merge_type, "flat") == 0 &&
+        ctx->vision_model.hparams.image_grid_pinpoints[0] == 0;
+}
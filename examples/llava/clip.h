@@ -82,11 +82,16 @@ CLIP_API struct ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ct
 
 CLIP_API bool clip_image_encode      (struct clip_ctx * ctx, int n_threads, struct clip_image_f32 * img, float * vec);
 CLIP_API bool clip_image_batch_encode(struct clip_ctx * ctx, int n_threads, const struct clip_image_f32_batch * imgs, float * vec);
+/** preprocess and encode n_imgs images in one batch (see clip_supports_batch), vec receives n_imgs*clip_n_patches(ctx) embeddings */
+CLIP_API bool clip_image_batch_encode_u8(struct clip_ctx * ctx, int n_threads, const struct clip_image_u8 * const * imgs, int n_imgs, float * vec);
 
 CLIP_API bool clip_model_quantize(const char * fname_inp, const char * fname_out, int itype);
 
 CLIP_API bool clip_is_minicpmv(const struct clip_ctx * ctx);
 
+/** true if clip_image_batch_encode accepts more than one image (one preprocessed image per input image) */
+CLIP_API bool clip_supports_batch(const struct clip_ctx * ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -236,8 +236,115 @@ struct kl_divergence_result {
     float  max_p_diff       = 0.0f;
     size_t n_same_top       = 0.0;
     size_t count            = 0.0;
+
+    void add(const kl_divergence_result & other) {
+        sum_nll          += other.sum_nll;
+        sum_nll2         += other.sum_nll2;
+        sum_nll_base     += other.sum_nll_base;
+        sum_nll_base2    += other.sum_nll_base2;
+        sum_nll_nll_base += other.sum_nll_nll_base;
+        sum_kld          += other.sum_kld;
+        sum_kld2         += other.sum_kld2;
+        sum_p_diff       += other.sum_p_diff;
+        sum_p_diff2      += other.sum_p_diff2;
+        sum_p_diff4      += other.sum_p_diff4;
+        n_same_top       += other.n_same_top;
+        max_p_diff        = std::max(max_p_diff, other.max_p_diff);
+        count            += other.count;
+    }
 };
 
+// Sparse base log-probabilities, written instead of the full distribution with --kl-divergence-top-k.
+// Each token has top_k + 1 entries: the observed next token with its log-probability, followed by the
+// top_k most probable tokens in descending order. The remaining tokens are treated as a single tail
+// with probability 1 - sum of the top_k probabilities.
+struct kld_top_k_entry {
+    int32_t id;
+    float   log_p;
+};
+
+static double log_softmax_top_k(int n_vocab, const float * logits, int tok, int top_k, kld_top_k_entry * out,
+        std::vector<std::pair<float, int>> & work) {
+    float max_logit = logits[0];
+    for (int i = 1; i < n_vocab; ++i) {
+        max_logit = std::max(max_logit, logits[i]);
+    }
+    double sum_exp = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum_exp += expf(logits[i] - max_logit);
+    }
+    const float log_norm = max_logit + log(sum_exp);
+
+    work.resize(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) {
+        work[i] = {logits[i], i};
+    }
+    std::partial_sort(work.begin(), work.begin() + top_k, work.end(), std::greater<std::pair<float, int>>());
+
+    out[0] = {tok, logits[tok] - log_norm};
+    for (int j = 0; j < top_k; ++j) {
+        out[j+1] = {work[j].second, work[j].first - log_norm};
+    }
+    return log_norm - logits[tok];
+}
+
+static void process_logits_top_k(std::ostream & out, int n_vocab, const float * logits, const int * tokens, int n_token,
+        std::vector<std::thread> & workers, int top_k, std::vector<kld_top_k_entry> & log_probs, double & nll, double & nll2) {
+    std::mutex mutex;
+    std::atomic<int> counter{0};
+    auto compute = [&] () {
+        std::vector<std::pair<float, int>> work;
+        double local_nll  = 0;
+        double local_nll2 = 0;
+        while (true) {
+            int i = counter++;
+            if (i >= n_token) {
+                break;
+            }
+            const double v = log_softmax_top_k(n_vocab, logits + int64_t(i)*n_vocab, tokens[i+1], top_k,
+                    log_probs.data() + int64_t(i)*(top_k + 1), work);
+            local_nll  += v;
+            local_nll2 += v*v;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        nll += local_nll; nll2 += local_nll2;
+    };
+    for (auto & w : workers) {
+        w = std::thread(compute);
+    }
+    compute();
+    for (auto & w : workers) {
+        w.join();
+    }
+    out.write((const char *)log_probs.data(), int64_t(n_token)*(top_k + 1)*sizeof(kld_top_k_entry));
+}
+
+static std::pair<double, float> kld_accumulate(kl_divergence_result & kld, float nll, float nll_base, double sum, bool same_top) {
+    kld.sum_nll  += nll;
+    kld.sum_nll2 += nll*nll;
+
+    kld.sum_nll_base  += nll_base;
+    kld.sum_nll_base2 += nll_base*nll_base;
+
+    kld.sum_nll_nll_base += nll*nll_base;
+
+    kld.sum_kld  += sum;
+    kld.sum_kld2 += sum*sum;
+    ++kld.count;
+    if (same_top) ++kld.n_same_top;
+
+    const float p_base = expf(-nll_base);
+    const float p = expf(-nll);
+    const float p_diff = p - p_base;
+    kld.sum_p_diff  += p_diff;
+    const double p_diff2 = p_diff*p_diff;
+    kld.sum_p_diff2 += p_diff2;
+    kld.sum_p_diff4 += p_diff2*p_diff2;
+    kld.max_p_diff = std::max(kld.max_p_diff, std::fabs(p_diff));
+
+    return std::make_pair(sum, p_diff);
+}
+
 static std::pair<double, float> log_softmax(int n_vocab, const float * logits, const uint16_t * base_log_prob, int tok, kl_divergence_result & kld) {
     float max_logit = logits[0];
     int imax = 0;
@@ -258,14 +365,7 @@ static std::pair<double, float> log_softmax(int n_vocab, const float * logits, c
     base_log_prob += 4;
 
     const float nll = max_logit + log_sum_exp - logits[tok];
-    kld.sum_nll  += nll;
-    kld.sum_nll2 += nll*nll;
-
     const float nll_base = -(scale*base_log_prob[tok] + min_log_prob);
-    kld.sum_nll_base  += nll_base;
-    kld.sum_nll_base2 += nll_base*nll_base;
-
-    kld.sum_nll_nll_base += nll*nll_base;
 
     max_logit += log_sum_exp;
     double sum = 0;
@@ -282,55 +382,81 @@ static std::pair<double, float> log_softmax(int n_vocab, const float * logits, c
             sum += p_base * (p_log_base - logits[i] + max_logit);
         }
     }
-    kld.sum_kld  += sum;
-    kld.sum_kld2 += sum*sum;
-    ++kld.count;
-    if (imax == imax_base) ++kld.n_same_top;
+    return kld_accumulate(kld, nll, nll_base, sum, imax == imax_base);
+}
 
-    const float p_base = expf(-nll_base);
-    const float p = expf(-nll);
-    const float p_diff = p - p_base;
-    kld.sum_p_diff  += p_diff;
-    const double p_diff2 = p_diff*p_diff;
-    kld.sum_p_diff2 += p_diff2;
-    kld.sum_p_diff4 += p_diff2*p_diff2;
-    kld.max_p_diff = std::max(kld.max_p_diff, std::fabs(p_diff));
+// same as above for sparse base log-probabilities
+static std::pair<double, float> log_softmax(int n_vocab, const float * logits, const kld_top_k_entry * base, int top_k, int tok, kl_divergence_result & kld) {
+    float max_logit = logits[0];
+    int imax = 0;
+    for (int i = 1; i < n_vocab; ++i) {
+        if (logits[i] > max_logit) {
+            max_logit = logits[i];
+            imax = i;
+        }
+    }
+    double sum_exp = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum_exp += expf(logits[i] - max_logit);
+    }
+    const float log_norm = max_logit + log(sum_exp);
 
-    return std::make_pair(sum, p_diff);
+    const float nll      = log_norm - logits[tok];
+    const float nll_base = -base[0].log_p;
+
+    // exact contributions of the top_k base tokens, the rest is lumped into one tail token (a lower bound)
+    double sum = 0, p_base_top = 0, p_top = 0;
+    for (int j = 1; j <= top_k; ++j) {
+        const float p_log_base = base[j].log_p;
+        const float p_log      = logits[base[j].id] - log_norm;
+        const float p_base     = expf(p_log_base);
+        sum        += p_base * (p_log_base - p_log);
+        p_base_top += p_base;
+        p_top      += expf(p_log);
+    }
+    const double p_base_tail = 1 - p_base_top;
+    const double p_tail      = std::max(1 - p_top, 1e-10);
+    if (p_base_tail > 1e-10) {
+        sum += p_base_tail * log(p_base_tail/p_tail);
+    }
+
+    return kld_accumulate(kld, nll, nll_base, sum, top_k > 0 && imax == base[1].id);
 }
 
-static void process_logits(int n_vocab, const float * logits, const int * tokens, int n_token,
-        std::vector<std::thread> & workers, const std::vector<uint16_t> & base_log_probs, kl_divergence_result & kld,
-        float * kld_values, float * p_diff_values) {
+// KL divergence of n_seq sequences of n_token tokens each; the logits of sequence s start at seq_logits[s],
+// its tokens at tokens + s*token_stride, and its base log-probabilities follow those of sequence s-1
+// base_log_probs is used for full distributions (top_k == 0), base_top_k for sparse ones
+static void process_logits(int n_vocab, const std::vector<const float *> & seq_logits, const int * tokens, int token_stride,
+        int n_token, std::vector<std::thread> & workers, int top_k, const uint16_t * base_log_probs, const kld_top_k_entry * base_top_k,
+        kl_divergence_result & kld, float * kld_values, float * p_diff_values) {
+    constexpr int block_size = 8;
+    const int64_t nv = 2*((n_vocab + 1)/2) + 4;
+    const int n_seq = seq_logits.size();
+    const int n_total = n_seq*n_token;
     std::mutex mutex;
-    const int nv = 2*((n_vocab + 1)/2) + 4;
-    int counter = 0;
-    auto compute = [&mutex, &counter, &base_log_probs, &kld, n_vocab, logits, tokens, n_token, nv, kld_values, p_diff_values] () {
+    std::atomic<int> counter{0};
+    auto compute = [&] () {
         kl_divergence_result local_kld;
         while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int i = counter++;
-            if (i >= n_token) {
-                kld.sum_nll          += local_kld.sum_nll;
-                kld.sum_nll2         += local_kld.sum_nll2;
-                kld.sum_nll_base     += local_kld.sum_nll_base;
-                kld.sum_nll_base2    += local_kld.sum_nll_base2;
-                kld.sum_nll_nll_base += local_kld.sum_nll_nll_base;
-                kld.sum_kld          += local_kld.sum_kld;
-                kld.sum_kld2         += local_kld.sum_kld2;
-                kld.sum_p_diff       += local_kld.sum_p_diff;
-                kld.sum_p_diff2      += local_kld.sum_p_diff2;
-                kld.sum_p_diff4      += local_kld.sum_p_diff4;
-                kld.n_same_top       += local_kld.n_same_top;
-                kld.max_p_diff        = std::max(kld.max_p_diff, local_kld.max_p_diff);
-                kld.count            += local_kld.count;
+            const int first = block_size*counter++;
+            if (first >= n_total) {
                 break;
             }
-            lock.unlock();
-            std::pair<double, float> v = log_softmax(n_vocab, logits + i*n_vocab, base_log_probs.data() + i*nv, tokens[i+1], local_kld);
-            kld_values[i]    = (float)v.first;
-            p_diff_values[i] = v.second;
+            const int last = std::min(first + block_size, n_total);
+            for (int i = first; i < last; ++i) {
+                const int seq = i / n_token;
+                const int k   = i % n_token;
+                const float * logits = seq_logits[seq] + int64_t(k)*n_vocab;
+                const int tok = tokens[int64_t(seq)*token_stride + k + 1];
+                std::pair<double, float> v = top_k > 0
+                    ? log_softmax(n_vocab, logits, base_top_k + int64_t(i)*(top_k + 1), top_k, tok, local_kld)
+                    : log_softmax(n_vocab, logits, base_log_probs + int64_t(i)*nv, tok, local_kld);
+                kld_values[i]    = (float)v.first;
+                p_diff_values[i] = v.second;
+            }
         }
+        std::lock_guard<std::mutex> lock(mutex);
+        kld.add(local_kld);
     };
     for (auto & w : workers) {
         w = std::thread(compute);
@@ -497,8 +623,13 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             fprintf(stderr, "%s: failed to open %s for writing\n", __func__, params.logits_file.c_str());
             return {};
         }
-        fprintf(stderr, "%s: saving all logits to %s\n", __func__, params.logits_file.c_str());
-        logits_stream.write("_logits_", 8);
+        if (params.kl_divergence_top_k > 0) {
+            fprintf(stderr, "%s: saving the top %d log-probabilities to %s\n", __func__, params.kl_divergence_top_k, params.logits_file.c_str());
+            logits_stream.write("_logitk_", 8);
+        } else {
+            fprintf(stderr, "%s: saving all logits to %s\n", __func__, params.logits_file.c_str());
+            logits_stream.write("_logits_", 8);
+        }
         logits_stream.write(reinterpret_cast<const char *>(&n_ctx), sizeof(n_ctx));
     }
 
@@ -551,12 +682,19 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
     std::vector<uint16_t> log_probs;
+    std::vector<kld_top_k_entry> log_probs_top_k;
+    const int top_k = std::min(params.kl_divergence_top_k, n_vocab);
     if (!params.logits_file.empty()) {
         logits_stream.write((const char *)&n_vocab, sizeof(n_vocab));
         logits_stream.write((const char *)&n_chunk, sizeof(n_chunk));
+        if (top_k > 0) {
+            logits_stream.write((const char *)&top_k, sizeof(top_k));
+            log_probs_top_k.resize(size_t(n_ctx)*(top_k + 1));
+        } else {
+            const int nv = 2*((n_vocab + 1)/2) + 4;
+            log_probs.resize(n_ctx * nv);
+        }
         logits_stream.write((const char *)tokens.data(), n_chunk*n_ctx*sizeof(tokens[0]));
-        const int nv = 2*((n_vocab + 1)/2) + 4;
-        log_probs.resize(n_ctx * nv);
     }
 
     // We get the logits for all the tokens in the context window (params.n_ctx)
@@ -647,7 +785,11 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
 
             llama_token * tokens_data = tokens.data() + start + seq*n_ctx + first;
-            if (!params.logits_file.empty()) {
+            if (!params.logits_file.empty() && top_k > 0) {
+                process_logits_top_k(logits_stream, n_vocab, all_logits,
+                        tokens_data, n_ctx - 1 - first,
+                        workers, top_k, log_probs_top_k, nll, nll2);
+            } else if (!params.logits_file.empty()) {
                 process_logits(logits_stream, n_vocab, all_logits,
                         tokens_data, n_ctx - 1 - first,
                         workers, log_probs, nll, nll2);
@@ -1704,10 +1846,12 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
         fprintf(stderr, "%s: failed to open %s\n", __func__, params.logits_file.c_str());
         return;
     }
+    bool sparse = false;
     {
         char check[9]; check[8] = 0;
         in.read(check, 8);
-        if (in.fail() || strncmp("_logits_", check, 8) != 0) {
+        sparse = !in.fail() && strncmp("_logitk_", check, 8) == 0;
+        if (in.fail() || (!sparse && strncmp("_logits_", check, 8) != 0)) {
             fprintf(stderr, "%s: %s does not look like a file containing log-probabilities\n", __func__, params.logits_file.c_str());
             return;
         }
@@ -1718,18 +1862,25 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     if (n_ctx > llama_n_ctx(ctx)) {
         fprintf(stderr, "%s: %s has been computed with %u, while the current context is %d. Increase it with -c and retry\n",
                 __func__, params.logits_file.c_str(), n_ctx, params.n_ctx);
+        return;
     }
 
-    int n_vocab, n_chunk;
+    int n_vocab, n_chunk, top_k = 0;
     in.read((char *)&n_vocab, sizeof(n_vocab));
     in.read((char *)&n_chunk, sizeof(n_chunk));
-    if (in.fail()) {
+    if (sparse) {
+        in.read((char *)&top_k, sizeof(top_k));
+    }
+    if (in.fail() || (sparse && (top_k <= 0 || top_k > n_vocab))) {
         fprintf(stderr, "%s: failed reading n_vocab, n_chunk from %s\n", __func__, params.logits_file.c_str());
         return;
     }
     if (n_vocab != llama_n_vocab(llama_get_model(ctx))) {
         fprintf(stderr, "%s: inconsistent vocabulary (%d vs %d)\n", __func__, n_vocab, llama_n_vocab(llama_get_model(ctx)));
     }
+    if (sparse) {
+        fprintf(stderr, "%s: base log-probabilities contain the top %d tokens\n", __func__, top_k);
+    }
 
     std::vector<llama_token> tokens(n_ctx * n_chunk);
     if (in.read((char *)tokens.data(), tokens.size()*sizeof(tokens[0])).fail()) {
@@ -1737,20 +1888,28 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
         return;
     }
 
+    // evaluate several chunks per batch as independent sequences when the batch and the context allow it
     const int n_batch = params.n_batch;
+    const int n_seq = n_batch >= (int)n_ctx ? std::max(1, std::min({n_batch/(int)n_ctx, (int)(llama_n_ctx(ctx)/n_ctx), (int)llama_n_seq_max(ctx)})) : 1;
     const int num_batches = (n_ctx + n_batch - 1)/n_batch;
+    const int first = n_ctx/2;
+    const int n_token = n_ctx - 1 - first;
     const int nv = 2*((n_vocab + 1)/2) + 4;
     const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
     GGML_ASSERT(llama_add_eos_token(llama_get_model(ctx)) != 1);
 
-    std::vector<uint16_t> log_probs_uint16(size_t(n_ctx - 1 - n_ctx/2) * nv);
-    std::vector<float>    kld_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
-    std::vector<float> p_diff_values(size_t(n_ctx - 1 - n_ctx/2)*n_chunk);
+    // the base log-probabilities are read one batch of chunks at a time
+    std::vector<uint16_t>        log_probs_uint16(sparse ? 0 : size_t(n_token) * nv * n_seq);
+    std::vector<kld_top_k_entry> log_probs_top_k (sparse ? size_t(n_token) * (top_k + 1) * n_seq : 0);
+    std::vector<float>    kld_values(size_t(n_token)*n_chunk);
+    std::vector<float> p_diff_values(size_t(n_token)*n_chunk);
     std::vector<float> logits;
     if (num_batches > 1) {
-        logits.reserve(n_ctx * n_vocab);
+        logits.reserve(size_t(n_ctx - first) * n_vocab);
     }
 
+    llama_batch batch = llama_batch_init(std::min(n_batch, (int)n_ctx*n_seq), 0, 1);
+
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
     auto mean_and_uncertainty = [] (double sum, double sum2, size_t count) {
@@ -1771,18 +1930,26 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
         return var;
     };
 
+    fprintf(stderr, "%s: computing KL divergence over %d chunks, n_ctx=%u, batch_size=%d, n_seq=%d\n", __func__, n_chunk, n_ctx, n_batch, n_seq);
+
     kl_divergence_result kld;
     auto    kld_ptr =    kld_values.data();
     auto p_diff_ptr = p_diff_values.data();
 
-    for (int i = 0; i < n_chunk; ++i) {
+    for (int i = 0; i < n_chunk; i += n_seq) {
         const int start =     i * n_ctx;
         const int end   = start + n_ctx;
 
+        const int n_seq_batch = std::min(n_seq, n_chunk - i);
+
         const auto t_start = std::chrono::high_resolution_clock::now();
 
-        if (in.read((char *)log_probs_uint16.data(), log_probs_uint16.size()*sizeof(uint16_t)).fail()) {
+        const bool read_fail = sparse
+            ? in.read((char *)log_probs_top_k.data(), size_t(n_seq_batch)*n_token*(top_k + 1)*sizeof(kld_top_k_entry)).fail()
+            : in.read((char *)log_probs_uint16.data(), size_t(n_seq_batch)*n_token*nv*sizeof(uint16_t)).fail();
+        if (read_fail) {
             fprintf(stderr, "%s: failed reading log-probs for chunk %d\n", __func__, i);
+            llama_batch_free(batch);
             return;
         }
 
@@ -1793,26 +1960,35 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            batch.n_tokens = 0;
+            for (int seq = 0; seq < n_seq_batch; seq++) {
+                const int seq_start = batch_start + seq*n_ctx;
 
-            // add BOS token for the first batch of each chunk
-            if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(llama_get_model(ctx));
+                for (int k = 0; k < batch_size; ++k) {
+                    const int idx = seq*batch_size + k;
+                    // add BOS token for the first batch of each chunk
+                    batch.token   [idx]    = add_bos && j == 0 && k == 0 ? llama_token_bos(llama_get_model(ctx)) : tokens[seq_start + k];
+                    batch.pos     [idx]    = j*n_batch + k;
+                    batch.n_seq_id[idx]    = 1;
+                    batch.seq_id  [idx][0] = seq;
+                    batch.logits  [idx]    = batch.pos[idx] >= first ? 1 : 0;
+                }
+                batch.n_tokens += batch_size;
             }
 
-            // TODO: use llama_batch.logits instead of relying on logits_all == true
-            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0))) {
+            if (llama_decode(ctx, batch)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                llama_batch_free(batch);
                 return;
             }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
             if (num_batches > 1) {
-                const auto * batch_logits = llama_get_logits(ctx);
-                logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+                for (int k = 0; k < batch_size; ++k) {
+                    if (batch.logits[k]) {
+                        const float * row = llama_get_logits_ith(ctx, k);
+                        logits.insert(logits.end(), row, row + n_vocab);
+                    }
+                }
             }
         }
 
@@ -1821,7 +1997,7 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
         if (i == 0) {
             const float t_total = std::chrono::duration<float>(t_end - t_start).count();
             fprintf(stderr, "%s: %.2f seconds per pass - ETA ", __func__, t_total);
-            int total_seconds = (int)(t_total * n_chunk);
+            int total_seconds = (int)(t_total * n_chunk / n_seq);
             if (total_seconds >= 60*60) {
                 fprintf(stderr, "%d hours ", total_seconds / (60*60));
                 total_seconds = total_seconds % (60*60);
@@ -1831,14 +2007,17 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             printf("\nchunk             PPL               ln(PPL(Q)/PPL(base))          KL Divergence              Δp RMS            Same top p\n");
         }
 
-        const int first = n_ctx/2;
-        const float * all_logits = num_batches > 1 ? logits.data() : llama_get_logits(ctx);
-        process_logits(n_vocab, all_logits + first*n_vocab, tokens.data() + start + first, n_ctx - 1 - first,
-                workers, log_probs_uint16, kld, kld_ptr, p_diff_ptr);
-        p_diff_ptr += n_ctx - 1 - first;
-        kld_ptr    += n_ctx - 1 - first;
+        // the output rows of each sequence are contiguous
+        std::vector<const float *> seq_logits(n_seq_batch);
+        for (int seq = 0; seq < n_seq_batch; ++seq) {
+            seq_logits[seq] = num_batches > 1 ? logits.data() : llama_get_logits_ith(ctx, seq*n_ctx + first);
+        }
+        process_logits(n_vocab, seq_logits, tokens.data() + start + first, n_ctx, n_token, workers,
+                top_k, log_probs_uint16.data(), log_probs_top_k.data(), kld, kld_ptr, p_diff_ptr);
+        p_diff_ptr += size_t(n_seq_batch)*n_token;
+        kld_ptr    += size_t(n_seq_batch)*n_token;
 
-        printf("%4d", i+1);
+        printf("%4d", i + n_seq_batch);
 
         auto log_ppl = mean_and_uncertainty(kld.sum_nll, kld.sum_nll2, kld.count);
         const double ppl_val = exp(log_ppl.first);
@@ -1871,6 +2050,8 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     }
     printf("\n");
 
+    llama_batch_free(batch);
+
     if (kld.count < 100) return; // we do not wish to do statistics on so few values
 
     std::sort(kld_values.begin(), kld_values.end());
@@ -1988,7 +2169,7 @@ int main(int argc, char ** argv) {
 
     const bool ppl = !params.hellaswag && !params.winogrande && !params.multiple_choice && !params.kl_divergence;
 
-    if (ppl) {
+    if (ppl || params.kl_divergence) {
         const int32_t n_seq = std::max(1, params.n_batch / n_ctx);
         const int32_t n_kv = n_seq * n_ctx;
 
@@ -1998,12 +2179,8 @@ int main(int argc, char ** argv) {
         params.n_batch = std::min(params.n_batch, n_kv);
     } else {
         params.n_batch = std::min(params.n_batch, params.n_ctx);
-        if (params.kl_divergence) {
-            params.n_parallel = 1;
-        } else {
-            // ensure there's at least enough seq_ids for HellaSwag
-            params.n_parallel = std::max(4, params.n_parallel);
-        }
+        // ensure there's at least enough seq_ids for HellaSwag
+        params.n_parallel = std::max(4, params.n_parallel);
     }
 
     if (params.ppl_stride > 0) {
@@ -5,6 +5,8 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "clip.h"
+#include "llava.h"
 
 #ifndef NDEBUG
 // crash the server in debug mode, otherwise send an http 500 error
@@ -27,7 +29,10 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <cstddef>
+#include <future>
+#include <list>
 #include <set>
 #include <mutex>
 #include <thread>
@@ -75,6 +80,7 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
     SERVER_TASK_TYPE_SET_LORA,
+    SERVER_TASK_TYPE_SCORE,
 };
 
 
@@ -115,6 +121,33 @@ struct result_timings {
     }
 };
 
+// an image encoded by the vision model, shared between the requests and the cache
+struct server_image {
+    uint64_t hash  = 0; // hash of the image file
+    int32_t  n_pos = 0; // number of embeddings (= KV cache positions) of the image
+
+    std::shared_ptr<const std::vector<float>> embd; // n_pos x n_embd
+};
+
+// the positions of an image in the prompt tokens hold a placeholder derived from the image hash,
+// so that the prompt cache only matches a previously evaluated image if it is the same image
+static llama_token server_image_token(uint64_t hash) {
+    return -2 - (llama_token) (hash % (uint64_t) (INT32_MAX - 2));
+}
+
+static bool server_is_image_token(llama_token token) {
+    return token < LLAMA_TOKEN_NULL;
+}
+
+// start of the image chunk that contains position i (runs of the same placeholder are consecutive copies of an image)
+static size_t server_image_chunk_start(const std::vector<llama_token> & tokens, size_t i, int32_t n_pos) {
+    size_t i0 = i;
+    while (i0 > 0 && tokens[i0 - 1] == tokens[i]) {
+        i0--;
+    }
+    return i0 + ((i - i0) / n_pos) * n_pos;
+}
+
 struct server_task {
     int id        = -1; // to be filled by server_queue
     int id_multi  = -1;
@@ -125,6 +158,13 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    // prompt tokenized by the HTTP thread that submitted the task (with special tokens)
+    bool prompt_tokenized = false;
+    std::vector<llama_token> prompt_tokens;
+
+    // images of the prompt (see server_image_token)
+    std::vector<server_image> images;
 };
 
 struct server_task_result {
@@ -139,6 +179,238 @@ struct server_task_result {
 
 };
 
+// a pending input of the embedding scheduler (one sequence of a packed batch)
+struct server_embd_input {
+    int id_task  = -1;
+    int id_multi = -1;
+    int index    =  0; // position of the input in a multi-input request
+
+    std::vector<llama_token> tokens;
+};
+
+// LRU cache of image embeddings keyed by the hash of the image file
+struct server_image_cache {
+    size_t n_max = 0;
+
+    std::list<server_image> entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<server_image>::iterator> index;
+    std::mutex mutex;
+
+    bool get(uint64_t hash, server_image & img) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = index.find(hash);
+        if (it == index.end()) {
+            return false;
+        }
+        entries.splice(entries.begin(), entries, it->second);
+        img = *it->second;
+        return true;
+    }
+
+    void put(const server_image & img) {
+        if (n_max == 0) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = index.find(img.hash);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        entries.push_front(img);
+        index[img.hash] = entries.begin();
+        while (entries.size() > n_max) {
+            index.erase(entries.back().hash);
+            entries.pop_back();
+        }
+    }
+};
+
+// encodes the images of the incoming requests on a dedicated thread - the images submitted while the
+// encoder is busy are encoded together in the next batch (if the projector supports batches)
+struct server_image_encoder {
+    clip_ctx * ctx_clip  = nullptr;
+    int32_t    n_threads = 1;
+    int32_t    n_batch   = 16; // max images per batch
+
+    server_image_cache cache;
+
+    struct pending {
+        uint64_t hash;
+        std::vector<uint8_t> data;
+        std::promise<server_image> promise;
+    };
+
+    bool running = false;
+    std::deque<pending> queue;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread worker;
+
+    // number of images encoded, number of images taken from the cache
+    std::atomic<uint64_t> n_encoded { 0 };
+    std::atomic<uint64_t> n_cached  { 0 };
+
+    static uint64_t hash_data(const std::vector<uint8_t> & data) {
+        uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+        for (uint8_t c : data) {
+            hash ^= c;
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    void start() {
+        running = true;
+        worker = std::thread([this]() { loop(); });
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            running = false;
+        }
+        condition.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // encode the given image files, throws on invalid images
+    std::vector<server_image> encode(std::vector<std::vector<uint8_t>> images) {
+        std::vector<server_image> res(images.size());
+        std::vector<std::pair<size_t, std::future<server_image>>> futures;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (size_t i = 0; i < images.size(); ++i) {
+                const uint64_t hash = hash_data(images[i]);
+                if (cache.get(hash, res[i])) {
+                    n_cached++;
+                    continue;
+                }
+                queue.push_back({ hash, std::move(images[i]), {} });
+                futures.emplace_back(i, queue.back().promise.get_future());
+            }
+        }
+        condition.notify_one();
+
+        for (auto & f : futures) {
+            res[f.first] = f.second.get();
+        }
+        return res;
+    }
+
+    void loop() {
+        while (true) {
+            std::vector<pending> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&] { return !queue.empty() || !running; });
+                if (!running) {
+                    for (auto & p : queue) {
+                        p.promise.set_exception(std::make_exception_ptr(std::runtime_error("server is shutting down")));
+                    }
+                    queue.clear();
+                    return;
+                }
+                while (!queue.empty() && (int32_t) batch.size() < n_batch) {
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+            }
+            encode_batch(batch);
+        }
+    }
+
+    void encode_batch(std::vector<pending> & batch) {
+        const int n_embd = clip_n_mmproj_embd(ctx_clip);
+
+        // the same image may have been submitted by several requests
+        std::vector<server_image> res(batch.size());
+        std::vector<std::string>  err(batch.size());
+        std::vector<size_t>       first(batch.size());
+        std::vector<size_t>       todo;
+        {
+            std::unordered_map<uint64_t, size_t> seen;
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto it = seen.find(batch[i].hash);
+                first[i] = it == seen.end() ? i : it->second;
+                if (it == seen.end()) {
+                    seen[batch[i].hash] = i;
+                    if (!cache.get(batch[i].hash, res[i])) {
+                        todo.push_back(i);
+                    }
+                }
+            }
+        }
+
+        std::vector<clip_image_u8 *> imgs;
+        std::vector<size_t> imgs_idx;
+        for (size_t i : todo) {
+            clip_image_u8 * img = clip_image_u8_init();
+            if (!clip_image_load_from_bytes(batch[i].data.data(), batch[i].data.size(), img)) {
+                clip_image_u8_free(img);
+                err[i] = "failed to load image";
+                continue;
+            }
+            imgs.push_back(img);
+            imgs_idx.push_back(i);
+        }
+
+        if (!imgs.empty() && clip_supports_batch(ctx_clip)) {
+            const int n_pos = clip_n_patches(ctx_clip);
+            std::vector<float> embd((size_t) imgs.size()*n_pos*n_embd);
+            if (clip_image_batch_encode_u8(ctx_clip, n_threads, imgs.data(), (int) imgs.size(), embd.data())) {
+                for (size_t j = 0; j < imgs.size(); ++j) {
+                    const float * src = embd.data() + j*n_pos*n_embd;
+                    server_image & img = res[imgs_idx[j]];
+                    img.hash  = batch[imgs_idx[j]].hash;
+                    img.n_pos = n_pos;
+                    img.embd  = std::make_shared<const std::vector<float>>(src, src + (size_t) n_pos*n_embd);
+                }
+            } else {
+                for (size_t i : imgs_idx) {
+                    err[i] = "failed to encode image";
+                }
+            }
+        } else {
+            // llava-1.6 and minicpmv merge a variable number of patches per image
+            for (size_t j = 0; j < imgs.size(); ++j) {
+                float * embd = nullptr;
+                int n_pos = 0;
+                if (!llava_image_embed_make_with_clip_img(ctx_clip, n_threads, imgs[j], &embd, &n_pos)) {
+                    err[imgs_idx[j]] = "failed to encode image";
+                    continue;
+                }
+                server_image & img = res[imgs_idx[j]];
+                img.hash  = batch[imgs_idx[j]].hash;
+                img.n_pos = n_pos;
+                img.embd  = std::make_shared<const std::vector<float>>(embd, embd + (size_t) n_pos*n_embd);
+                free(embd);
+            }
+        }
+
+        for (clip_image_u8 * img : imgs) {
+            clip_image_u8_free(img);
+        }
+
+        for (size_t i = 0; i < batch.size(); ++i) {
+            const size_t i0 = first[i];
+            if (!err[i0].empty()) {
+                batch[i].promise.set_exception(std::make_exception_ptr(std::runtime_error(err[i0])));
+                continue;
+            }
+            if (i == i0) {
+                cache.put(res[i]);
+            }
+            batch[i].promise.set_value(res[i0]);
+        }
+
+        n_encoded += imgs.size();
+    }
+};
+
 std::unordered_map<int, server_task_result > server_task_result_dict = {};
 
 // Helper functions for content cleaning
@@ -252,6 +524,7 @@ struct server_slot {
     int32_t n_remaining = -1;
     int32_t i_batch     = -1;
     int32_t n_predict   = -1; // TODO: disambiguate from params.n_predict
+    int32_t pos_rm      = -1; // KV cache position of a token submitted ahead (--async-decode) after the slot stopped
 
     int32_t n_prompt_tokens           = 0;
     int32_t n_prompt_tokens_processed = 0;
@@ -260,6 +533,18 @@ struct server_slot {
 
     // when a task is submitted, we first tokenize the prompt and store it here
     std::vector<llama_token> prompt_tokens;
+    bool prompt_tokenized = false; // prompt_tokens were taken from the task, no need to tokenize in update_slots
+
+    std::vector<server_image> images; // images of the prompt
+
+    const server_image * find_image(llama_token token) const {
+        for (const auto & img : images) {
+            if (server_image_token(img.hash) == token) {
+                return &img;
+            }
+        }
+        return nullptr;
+    }
 
     std::string generated_text;
     std::vector<llama_token> cache_tokens;
@@ -295,6 +580,10 @@ struct server_slot {
 
     int32_t n_past_se = 0; // self-extend
 
+    // per-request LoRA adapter (index in server_context::lora_adapters), applied to the tokens of this slot only
+    int32_t lora_id    = -1;
+    float   lora_scale = 0.0f;
+
     // stats
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
@@ -527,6 +816,13 @@ struct server_metrics {
         t_prompt_processing_total       += slot.t_prompt_processing;
     }
 
+    void on_embd_batch(int32_t n_tokens, int64_t t_us) {
+        n_prompt_tokens_processed_total += n_tokens;
+        n_prompt_tokens_processed       += n_tokens;
+        t_prompt_processing             += t_us / 1000;
+        t_prompt_processing_total       += t_us / 1000;
+    }
+
     void on_prediction(const server_slot & slot) {
         n_tokens_predicted_total   += slot.n_decoded;
         n_tokens_predicted         += slot.n_decoded;
@@ -794,6 +1090,24 @@ struct server_context {
 
     llama_batch batch;
 
+    // embedding-only servers (--embeddings) do not run embedding requests through the slots:
+    // the inputs of all pending requests are packed into one batch, one sequence per input
+    bool embd_batching = false;
+    int32_t n_embd_batch = 0; // max tokens in a packed batch, all sequences must fit in one ubatch
+
+    std::deque<server_embd_input> queue_embd;
+    llama_batch batch_embd = {};
+
+    // --async-decode: a generation batch has been submitted with llama_decode_async
+    bool decode_pending = false;
+
+    // --score-seqs: scoring tasks, evaluated between the generation steps with the sequences after those of the slots
+    std::deque<server_task> queue_score;
+
+    // --mmproj: images of the prompts are encoded by the vision model of the projector
+    bool multimodal = false;
+    server_image_encoder img_encoder;
+
     bool clean_kv_cache = true;
     bool add_bos_token  = true;
 
@@ -818,6 +1132,11 @@ struct server_context {
     float slot_prompt_similarity = 0.0f;
 
     ~server_context() {
+        if (multimodal) {
+            img_encoder.stop();
+            clip_free(img_encoder.ctx_clip);
+        }
+
         if (ctx) {
             llama_free(ctx);
             ctx = nullptr;
@@ -836,20 +1155,21 @@ struct server_context {
         }
 
         llama_batch_free(batch);
+        llama_batch_free(batch_embd);
     }
 
     bool load_model(const gpt_params & params_) {
         params = params_;
 
-        // dedicate one sequence to the system prompt
-        params.n_parallel += 1;
+        // dedicate one sequence to the system prompt, and the sequences after those of the slots to scoring
+        params.n_parallel += 1 + params.n_score_seq;
 
         llama_init_result llama_init = llama_init_from_gpt_params(params);
 
         model = llama_init.model;
         ctx = llama_init.context;
         lora_adapters = llama_init.lora_adapters;
-        params.n_parallel -= 1; // but be sneaky about it
+        params.n_parallel -= 1 + params.n_score_seq; // but be sneaky about it
         if (model == nullptr) {
             LOG_ERROR("unable to load model", {{"model", params.model}});
             return false;
@@ -860,6 +1180,34 @@ struct server_context {
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        if (!params.mmproj.empty()) {
+            clip_ctx * ctx_clip = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 1);
+            if (ctx_clip == nullptr) {
+                LOG_ERROR("unable to load multimodal projector", {{"mmproj", params.mmproj}});
+                return false;
+            }
+            if (!llava_validate_embed_size(ctx, ctx_clip)) {
+                LOG_ERROR("the multimodal projector does not match the model", {{"mmproj", params.mmproj}});
+                clip_free(ctx_clip);
+                return false;
+            }
+
+            img_encoder.ctx_clip    = ctx_clip;
+            img_encoder.n_threads   = params.n_threads_mmproj > 0 ? params.n_threads_mmproj :
+                                      params.n_threads_batch  > 0 ? params.n_threads_batch  : params.n_threads;
+            img_encoder.cache.n_max = std::max(0, params.mmproj_cache);
+            img_encoder.start();
+
+            multimodal = true;
+
+            LOG_INFO("multimodal projector loaded", {
+                {"mmproj",        params.mmproj},
+                {"n_threads",     img_encoder.n_threads},
+                {"n_image_cache", img_encoder.cache.n_max},
+                {"batched",       clip_supports_batch(ctx_clip)},
+            });
+        }
+
         return true;
     }
 
@@ -927,6 +1275,17 @@ struct server_context {
             batch = llama_batch_init(n_batch, 0, 1);
         }
 
+        // the packed sequences are evaluated by a single llama_decode and pooled in the graph, so they
+        // must all fit in one ubatch (non-causal attention) and, for causal models, in the KV cache
+        embd_batching = params.embedding && system_prompt.empty();
+        if (embd_batching) {
+            n_embd_batch = std::min<int32_t>({(int32_t) llama_n_ubatch(ctx), (int32_t) llama_n_batch(ctx), n_ctx});
+
+            batch_embd = llama_batch_init(n_embd_batch, 0, 1);
+
+            LOG_INFO("batched embeddings", {{"n_tokens_max", n_embd_batch}});
+        }
+
         metrics.init();
     }
 
@@ -1314,8 +1673,65 @@ struct server_context {
             }
         }
 
+        // per-request LoRA adapter
+        {
+            int32_t lora_id    = -1;
+            float   lora_scale = 0.0f;
+
+            if (data.contains("lora") && !data.at("lora").is_null()) {
+                const auto & lora = data.at("lora");
+                if (!lora.is_array()) {
+                    send_error(task, "\"lora\" must be an array of {\"id\", \"scale\"} objects", ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+                for (const auto & entry : lora) {
+                    const int   id    = json_value(entry, "id",    -1);
+                    const float scale = json_value(entry, "scale", 1.0f);
+                    if (id < 0 || id >= (int) lora_adapters.size()) {
+                        send_error(task, "invalid adapter id", ERROR_TYPE_INVALID_REQUEST);
+                        return false;
+                    }
+                    if (scale == 0.0f) {
+                        continue;
+                    }
+                    if (lora_id >= 0) {
+                        send_error(task, "only one LoRA adapter per request is supported", ERROR_TYPE_NOT_SUPPORTED);
+                        return false;
+                    }
+                    lora_id    = id;
+                    lora_scale = scale;
+                }
+            }
+
+            if (lora_id != slot.lora_id || lora_scale != slot.lora_scale) {
+                llama_lora_adapter * adapter = lora_id >= 0 ? lora_adapters[lora_id].adapter : nullptr;
+                if (llama_lora_adapter_seq_set(ctx, adapter, slot.id + 1, lora_scale) != 0) {
+                    send_error(task, "failed to apply the LoRA adapter", ERROR_TYPE_SERVER);
+                    return false;
+                }
+                slot.lora_id    = lora_id;
+                slot.lora_scale = lora_scale;
+
+                // the cached prompt has been evaluated with another adapter
+                slot.cache_tokens.clear();
+            }
+        }
+
+        if (!task.images.empty() && (!system_prompt.empty() || slot.ga_n != 1)) {
+            send_error(task, "images cannot be used together with a system prompt or self-extend", ERROR_TYPE_NOT_SUPPORTED);
+            return false;
+        }
+
         slot.command = SLOT_COMMAND_LOAD_PROMPT;
         slot.prompt_tokens.clear();
+        slot.prompt_tokenized = false;
+        slot.images = task.images;
+
+        // the task was tokenized with BOS - only usable if there is no system prompt in front of it
+        if (task.prompt_tokenized && system_prompt.empty()) {
+            slot.prompt_tokens    = task.prompt_tokens;
+            slot.prompt_tokenized = true;
+        }
 
         LOG_INFO("slot is processing task", {
             {"id_slot", slot.id},
@@ -1621,7 +2037,7 @@ struct server_context {
             {"content",    ""},  // Empty - clean content provided via diffs
             {"stop",       false},
             {"id_slot",    slot.id},
-            {"multimodal", false}
+            {"multimodal", multimodal}
         };
 
         // Store diffs for format_partial_response_oaicompat to use
@@ -1769,6 +2185,191 @@ struct server_context {
         queue_results.send(res);
     }
 
+    void queue_embedding(const server_task & task) {
+        if (!task.prompt_tokenized) {
+            send_error(task, "\"input\" must be a string, a list of tokens or a list of strings", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        if (task.prompt_tokens.empty()) {
+            send_error(task, "input is empty", ERROR_TYPE_INVALID_REQUEST);
+            return;
+        }
+
+        if ((int32_t) task.prompt_tokens.size() > n_embd_batch) {
+            send_error(task, "input is too large to process. increase the physical batch size", ERROR_TYPE_SERVER);
+            return;
+        }
+
+        server_embd_input input;
+        input.id_task  = task.id;
+        input.id_multi = task.id_multi;
+        input.index    = json_value(task.data, "index", 0);
+        input.tokens   = task.prompt_tokens;
+
+        queue_embd.push_back(std::move(input));
+    }
+
+    // score the continuations of the pending scoring tasks, with the reserved sequences and the unused KV cells
+    void update_scores() {
+        while (!queue_score.empty()) {
+            const server_task task = std::move(queue_score.front());
+            queue_score.pop_front();
+
+            std::vector<llama_score_task> score_tasks;
+            for (const auto & t : task.data.at("tasks")) {
+                llama_score_task st;
+                st.prefix        = t.at("prefix").get<std::vector<llama_token>>();
+                st.continuations = t.at("continuations").get<std::vector<std::vector<llama_token>>>();
+                score_tasks.push_back(std::move(st));
+            }
+
+            const int64_t t_start = ggml_time_us();
+
+            std::vector<llama_score_result> score_results;
+            if (!llama_score(ctx, score_tasks, score_results, params.n_parallel + 1, params.n_score_seq, params.n_batch)) {
+                send_error(task, "failed to score the continuations, the task may not fit into the unused KV cache", ERROR_TYPE_SERVER);
+                continue;
+            }
+
+            json results = json::array();
+            for (const auto & sr : score_results) {
+                json conts = json::array();
+                for (const auto & sc : sr.continuations) {
+                    conts.push_back(json {
+                        { "logprob",  sc.logprob  },
+                        { "greedy",   sc.greedy   },
+                        { "logprobs", sc.logprobs },
+                    });
+                }
+                results.push_back(json {{ "continuations", conts }});
+            }
+
+            server_task_result result;
+            result.id = task.id;
+            result.stop = true;
+            result.error = false;
+            result.data = json {
+                { "results",  results },
+                { "score_ms", (ggml_time_us() - t_start) / 1000.0 },
+            };
+            queue_results.send(result);
+        }
+    }
+
+    // evaluate the oldest pending embedding inputs in a single packed batch
+    // inputs that arrive while the batch is computed are packed into the next one
+    void update_embeddings() {
+        const enum llama_pooling_type pooling_type = llama_pooling_type(ctx);
+
+        std::vector<server_embd_input> inputs;
+        std::vector<int32_t>           i_last;
+
+        llama_batch_clear(batch_embd);
+
+        while (!queue_embd.empty()) {
+            server_embd_input & input = queue_embd.front();
+
+            const int32_t n_tokens = input.tokens.size();
+            if (batch_embd.n_tokens + n_tokens > n_embd_batch) {
+                break;
+            }
+
+            // the sequences are numbered from 0 in each batch: pooling requires seq_id < n_tokens
+            const llama_seq_id seq_id = inputs.size();
+            for (int32_t i = 0; i < n_tokens; ++i) {
+                llama_batch_add(batch_embd, input.tokens[i], i, { seq_id }, i == n_tokens - 1);
+            }
+            i_last.push_back(batch_embd.n_tokens - 1);
+
+            inputs.push_back(std::move(input));
+            queue_embd.pop_front();
+        }
+
+        if (inputs.empty()) {
+            return;
+        }
+
+        LOG_VERBOSE("decoding embedding batch", {
+            {"n_seqs",   inputs.size()},
+            {"n_tokens", batch_embd.n_tokens},
+            {"n_queued", queue_embd.size()},
+        });
+
+        const int64_t t_start = ggml_time_us();
+
+        llama_set_embeddings(ctx, true);
+
+        const int ret = llama_decode(ctx, batch_embd);
+
+        // nothing is kept in the KV cache of causal models either
+        for (llama_seq_id seq_id = 0; seq_id < (llama_seq_id) inputs.size(); ++seq_id) {
+            llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+        }
+
+        if (ret != 0) {
+            LOG_ERROR("failed to decode the embedding batch", {
+                {"n_seqs",   inputs.size()},
+                {"n_tokens", batch_embd.n_tokens},
+                {"ret",      ret},
+            });
+            for (const auto & input : inputs) {
+                send_error(input.id_task, input.id_multi, "failed to compute the embeddings", ERROR_TYPE_SERVER);
+            }
+            return;
+        }
+
+        const int n_embd = llama_n_embd(model);
+
+        std::vector<float> embd_res(n_embd, 0.0f);
+
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            const float * embd = pooling_type == LLAMA_POOLING_TYPE_NONE
+                ? llama_get_embeddings_ith(ctx, i_last[i])
+                : llama_get_embeddings_seq(ctx, i);
+
+            server_task_result res;
+            res.id       = inputs[i].id_task;
+            res.id_multi = inputs[i].id_multi;
+            res.error    = false;
+            res.stop     = true;
+
+            if (pooling_type == LLAMA_POOLING_TYPE_RANK) {
+                if (embd == NULL) {
+                    LOG_ERROR("failed to get the rerank score", {
+                        {"id_task", inputs[i].id_task},
+                        {"seq_id",  i}
+                    });
+                }
+
+                res.data = json {
+                    {"index", inputs[i].index},
+                    {"score", embd == NULL ? -1e6f : embd[0]},
+                    {"tokens_evaluated", inputs[i].tokens.size()},
+                };
+            } else if (embd == NULL) {
+                LOG_ERROR("failed to get embeddings", {
+                    {"id_task", inputs[i].id_task},
+                    {"seq_id",  i}
+                });
+
+                res.data = json {
+                    {"embedding", std::vector<float>(n_embd, 0.0f)},
+                };
+            } else {
+                llama_embd_normalize(embd, embd_res.data(), n_embd);
+
+                res.data = json {
+                    {"embedding", embd_res},
+                };
+            }
+
+            queue_results.send(res);
+        }
+
+        metrics.on_embd_batch(batch_embd.n_tokens, ggml_time_us() - t_start);
+    }
+
     void request_completion(int id_task, int id_multi, json data, bool infill, bool embedding) {
         server_task task;
         task.id        = id_task;
@@ -1779,6 +2380,16 @@ struct server_context {
         task.embedding = embedding;
         task.type      = SERVER_TASK_TYPE_COMPLETION;
 
+        // converting a large schema can take a while - do it here rather than in the main loop
+        // on failure, leave "json_schema" as is so that launch_slot_with_task reports the error
+        if (task.data.contains("json_schema") && !task.data.at("json_schema").is_null() && !task.data.contains("grammar")) {
+            try {
+                task.data["grammar"] = json_schema_to_grammar(task.data.at("json_schema"));
+                task.data.erase("json_schema");
+            } catch (const std::exception &) {
+            }
+        }
+
         // when a completion task's prompt array is not a singleton, we split it into multiple requests
         // otherwise, it's a single-prompt task, we actually queue it
         // if there's numbers in the prompt array it will be treated as an array of tokens
@@ -1797,43 +2408,162 @@ struct server_context {
             // if there are numbers, it needs to be treated like a single prompt,
             // queue_tasks handles a mix of strings and numbers just fine.
             if (numbers) {
+                tokenize_task_prompt(task);
                 queue_tasks.post(task);
             } else {
                 split_multiprompt_task(id_task, task);
             }
+        } else if (task.data.contains("image_data") && !task.data.at("image_data").empty()) {
+            if (tokenize_task_prompt_with_images(task)) {
+                queue_tasks.post(task);
+            }
         } else {
+            tokenize_task_prompt(task);
             queue_tasks.post(task);
         }
     }
 
-    void request_cancel(int id_task) {
-        server_task task;
-        task.type      = SERVER_TASK_TYPE_CANCEL;
-        task.id_target = id_task;
-
-        queue_tasks.post(task);
-    }
-
-    void split_multiprompt_task(int id_multi, const server_task & multiprompt_task) {
-        const int prompt_count = multiprompt_task.data.at("prompt").size();
-        if (prompt_count <= 1) {
-            send_error(multiprompt_task, "error while handling multiple prompts");
+    // tokenize the prompt of a completion task on the calling HTTP thread, so that long prompts
+    // do not stall the main loop (and with it the generation of all other slots)
+    void tokenize_task_prompt(server_task & task) const {
+        if (task.infill) {
             return;
         }
 
-        // generate all the ID for subtask
-        std::vector<int> subtask_ids(prompt_count);
-        for (int i = 0; i < prompt_count; i++) {
-            subtask_ids[i] = queue_tasks.get_new_id();
+        const auto & prompt = task.data.find("prompt");
+        if (prompt == task.data.end()) {
+            return;
         }
 
-        // queue up the multitask so we can track its subtask progression
-        queue_tasks.add_multitask(id_multi, subtask_ids);
-
-        // add subtasks
-        for (int i = 0; i < prompt_count; i++) {
-            json subtask_data = multiprompt_task.data;
-            subtask_data["prompt"] = subtask_data.at("prompt")[i];
+        // same prompt forms as accepted by launch_slot_with_task, anything else is reported there
+        try {
+            if ((prompt->is_string()) ||
+                (prompt->is_array() &&  prompt->size() == 1 && prompt->at(0).is_string()) ||
+                (prompt->is_array() && !prompt->empty()     && prompt->at(0).is_number_integer())) {
+                task.prompt_tokens = tokenize(*prompt, true);
+            } else if (prompt->is_array() && prompt->size() == 1 && prompt->at(0).is_array()) {
+                task.prompt_tokens = tokenize(prompt->at(0), true);
+            } else {
+                return;
+            }
+        } catch (const std::exception &) {
+            task.prompt_tokens.clear();
+            return;
+        }
+
+        task.prompt_tokenized = true;
+    }
+
+    // split the prompt at the [img-N] markers of the images in "image_data", tokenize the text and encode the images
+    // on error, the error is sent to the task and false is returned
+    bool tokenize_task_prompt_with_images(server_task & task) {
+        if (!multimodal) {
+            send_error(task, "this server does not support images, start it with --mmproj", ERROR_TYPE_NOT_SUPPORTED);
+            return false;
+        }
+        if (task.infill || task.embedding || !task.data.contains("prompt") || !task.data.at("prompt").is_string()) {
+            send_error(task, "images can only be used with a single string prompt", ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
+        try {
+            std::unordered_map<int, std::string> data;
+            for (const auto & el : task.data.at("image_data")) {
+                data[el.at("id").get<int>()] = el.at("data").get<std::string>();
+            }
+
+            const std::string prompt = task.data.at("prompt").get<std::string>();
+
+            std::vector<std::string>          texts; // the text before each image, and the text after the last one
+            std::vector<std::vector<uint8_t>> files;
+
+            size_t pos = 0;
+            size_t beg = 0;
+            while ((pos = prompt.find("[img-", pos)) != std::string::npos) {
+                const size_t end = prompt.find(']', pos);
+                if (end == std::string::npos) {
+                    break;
+                }
+                int id;
+                try {
+                    id = std::stoi(prompt.substr(pos + 5, end - pos - 5));
+                } catch (const std::exception &) {
+                    pos = end;
+                    continue;
+                }
+                const auto it = data.find(id);
+                if (it == data.end()) {
+                    throw std::runtime_error("image with id " + std::to_string(id) + " not found in image_data");
+                }
+                texts.push_back(prompt.substr(beg, pos - beg));
+                files.push_back(base64_decode(it->second));
+                pos = beg = end + 1;
+            }
+            texts.push_back(prompt.substr(beg));
+
+            if (tokenize(texts.back(), false).empty()) {
+                throw std::runtime_error("the prompt must not end with an image");
+            }
+
+            const std::vector<server_image> images = img_encoder.encode(std::move(files));
+
+            task.prompt_tokens.clear();
+            for (size_t i = 0; i < texts.size(); ++i) {
+                // BOS in front of the first text only
+                const auto tokens = tokenize(texts[i], i == 0);
+                task.prompt_tokens.insert(task.prompt_tokens.end(), tokens.begin(), tokens.end());
+
+                if (i < images.size()) {
+                    task.prompt_tokens.insert(task.prompt_tokens.end(), images[i].n_pos, server_image_token(images[i].hash));
+
+                    bool seen = false;
+                    for (const auto & img : task.images) {
+                        seen = seen || img.hash == images[i].hash;
+                    }
+                    if (!seen) {
+                        task.images.push_back(images[i]);
+                    }
+                }
+            }
+        } catch (const std::exception & e) {
+            send_error(task, e.what(), ERROR_TYPE_INVALID_REQUEST);
+            return false;
+        }
+
+        task.prompt_tokenized = true;
+
+        return true;
+    }
+
+    void request_cancel(int id_task) {
+        server_task task;
+        task.type      = SERVER_TASK_TYPE_CANCEL;
+        task.id_target = id_task;
+
+        queue_tasks.post(task);
+    }
+
+    void split_multiprompt_task(int id_multi, const server_task & multiprompt_task) {
+        const int prompt_count = multiprompt_task.data.at("prompt").size();
+        if (prompt_count <= 1) {
+            send_error(multiprompt_task, "error while handling multiple prompts");
+            return;
+        }
+
+        // generate all the ID for subtask
+        std::vector<int> subtask_ids(prompt_count);
+        for (int i = 0; i < prompt_count; i++) {
+            subtask_ids[i] = queue_tasks.get_new_id();
+        }
+
+        // queue up the multitask so we can track its subtask progression
+        queue_tasks.add_multitask(id_multi, subtask_ids);
+
+        // add subtasks
+        for (int i = 0; i < prompt_count; i++) {
+            json subtask_data = multiprompt_task.data;
+            subtask_data["prompt"] = subtask_data.at("prompt")[i];
+            subtask_data["index"]  = i;
 
             // subtasks inherit everything else (infill mode, embedding mode, etc.)
             request_completion(subtask_ids[i], id_multi, subtask_data, multiprompt_task.infill, multiprompt_task.embedding);
@@ -1844,6 +2574,11 @@ struct server_context {
         switch (task.type) {
             case SERVER_TASK_TYPE_COMPLETION:
                 {
+                    if (task.embedding && embd_batching) {
+                        queue_embedding(task);
+                        break;
+                    }
+
                     const int id_slot = json_value(task.data, "id_slot", -1);
 
                     server_slot * slot;
@@ -1903,6 +2638,12 @@ struct server_context {
                             break;
                         }
                     }
+
+                    // or drop its pending embedding inputs
+                    queue_embd.erase(std::remove_if(queue_embd.begin(), queue_embd.end(),
+                        [&](const server_embd_input & input) {
+                            return input.id_task == task.id_target || input.id_multi == task.id_target;
+                        }), queue_embd.end());
                 } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
                 {
@@ -1976,6 +2717,9 @@ struct server_context {
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
+                        { "n_images_encoded_total",          img_encoder.n_encoded.load()},
+                        { "n_images_cached_total",           img_encoder.n_cached.load()},
+
                         { "slots",                           slots_data },
                     };
 
@@ -2005,7 +2749,8 @@ struct server_context {
                     std::string filename = task.data.at("filename");
                     std::string filepath = task.data.at("filepath");
 
-                    const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), token_count);
+                    const llama_state_seq_flags flags = params.slot_save_compress ? LLAMA_STATE_SEQ_FLAGS_COMPRESS : 0;
+                    const size_t nwrite = llama_state_seq_save_file_ext(ctx, filepath.c_str(), slot->id + 1, slot->cache_tokens.data(), token_count, flags);
 
                     const int64_t t_end = ggml_time_us();
                     const double t_save_ms = (t_end - t_start) / 1000.0;
@@ -2111,6 +2856,11 @@ struct server_context {
                     result.data = json{{ "success", true }};
                     queue_results.send(result);
                 } break;
+            case SERVER_TASK_TYPE_SCORE:
+                {
+                    // scored in update_slots, after the outputs of a batch submitted with --async-decode are collected
+                    queue_score.push_back(task);
+                } break;
         }
     }
 
@@ -2135,6 +2885,16 @@ struct server_context {
     }
 
     void update_slots() {
+        if (decode_pending && collect_next_batch()) {
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+            task.id_target = -1;
+
+            queue_tasks.post(task);
+
+            return;
+        }
+
         if (system_need_update) {
             system_prompt_update();
         }
@@ -2160,6 +2920,21 @@ struct server_context {
             }
         }
 
+        if (!queue_embd.empty()) {
+            update_embeddings();
+
+            // come back for the remaining inputs and to finish the multitasks of this batch
+            server_task task;
+            task.type      = SERVER_TASK_TYPE_NEXT_RESPONSE;
+            task.id_target = -1;
+
+            queue_tasks.post(task);
+        }
+
+        if (!queue_score.empty()) {
+            update_scores();
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2281,8 +3056,8 @@ struct server_context {
                 if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_LOAD_PROMPT) {
                     auto & prompt_tokens = slot.prompt_tokens;
 
-                    // we haven't tokenized the prompt yet - do it now:
-                    if (prompt_tokens.empty()) {
+                    // we haven't tokenized the prompt yet - do it now (unless it was done by the HTTP thread):
+                    if (prompt_tokens.empty() || slot.prompt_tokenized) {
                         LOG_VERBOSE("tokenizing prompt", {
                             {"id_slot", slot.id},
                             {"id_task", slot.id_task}
@@ -2323,9 +3098,10 @@ struct server_context {
                             }
 
                             prompt_tokens = embd_inp;
-                        } else {
+                        } else if (!slot.prompt_tokenized) {
                             prompt_tokens = tokenize(slot.prompt, system_prompt.empty()); // add BOS if there isn't system prompt
                         }
+                        slot.prompt_tokenized = false;
 
                         slot.n_past = 0;
                         slot.n_prompt_tokens = prompt_tokens.size();
@@ -2369,6 +3145,15 @@ struct server_context {
                             }
                             slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
+                            // the images of a prompt are not truncated
+                            if (!slot.images.empty() && slot.n_prompt_tokens >= slot.n_ctx) {
+                                slot.state = SLOT_STATE_PROCESSING;
+                                slot.command = SLOT_COMMAND_NONE;
+                                slot.release();
+                                send_error(slot, "the prompt with its images does not fit in the context of the slot", ERROR_TYPE_INVALID_REQUEST);
+                                continue;
+                            }
+
                             // if input prompt is too big, truncate it (if group attention self-extend is disabled)
                             if (slot.ga_n == 1 && slot.n_prompt_tokens >= slot.n_ctx) {
                                 const int n_left = slot.n_ctx - slot.params.n_keep;
@@ -2416,7 +3201,9 @@ struct server_context {
 
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
-                                    llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
+                                    if (!server_is_image_token(slot.cache_tokens[i])) {
+                                        llama_sampling_accept(slot.ctx_sampling, ctx, slot.cache_tokens[i], false);
+                                    }
                                 }
                             }
                         }
@@ -2434,6 +3221,13 @@ struct server_context {
                             }
                         }
 
+                        // an image is evaluated as a whole - do not reuse the beginning of it
+                        if (slot.n_past < slot.n_prompt_tokens && server_is_image_token(prompt_tokens[slot.n_past])) {
+                            const server_image * img = slot.find_image(prompt_tokens[slot.n_past]);
+                            GGML_ASSERT(img != nullptr);
+                            slot.n_past = server_image_chunk_start(prompt_tokens, slot.n_past, img->n_pos);
+                        }
+
                         slot.n_prompt_tokens_processed = 0;
                     }
 
@@ -2454,7 +3248,20 @@ struct server_context {
 
                     // keep only the common part
                     int p0 = (int) system_tokens.size() + slot.n_past;
-                    if (!llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
+
+                    // the sliding window attention layers only keep the last n_swa positions of a sequence:
+                    // the common part can be reused only if they still cover the window of the first token to evaluate
+                    const int n_swa = llama_n_swa(model);
+                    const bool swa_covered = n_swa == 0 || llama_kv_cache_seq_pos_min(ctx, slot.id + 1) <= std::max(0, p0 - n_swa + 1);
+                    if (!swa_covered) {
+                        LOG_INFO("the SWA cache does not cover the common part, the prompt is evaluated again", {
+                            { "id_slot", slot.id },
+                            { "id_task", slot.id_task },
+                            { "p0",      p0 }
+                        });
+                    }
+
+                    if (!swa_covered || !llama_kv_cache_seq_rm(ctx, slot.id + 1, p0, -1)) {
                         // could not partially delete (likely using a non-Transformer model)
                         llama_kv_cache_seq_rm(ctx, slot.id + 1, -1, -1);
 
@@ -2487,9 +3294,32 @@ struct server_context {
                     int32_t ga_n = slot.ga_n;
                     int32_t ga_w = slot.ga_w;
 
+                    // the images are evaluated on their own, once the tokens in front of them have been evaluated
+                    // (the prompt tokens added to the batch stop at the next image)
+                    bool image_failed = false;
+                    while (slot.n_past < slot.n_prompt_tokens && server_is_image_token(prompt_tokens[slot.n_past])) {
+                        if (!process_image_chunk(slot)) {
+                            image_failed = true;
+                            break;
+                        }
+                        slot_npast = slot.n_past;
+                    }
+                    if (image_failed) {
+                        slot.cache_tokens.clear();
+                        slot.state = SLOT_STATE_PROCESSING;
+                        slot.command = SLOT_COMMAND_NONE;
+                        slot.release();
+                        send_error(slot, "failed to evaluate the image", ERROR_TYPE_SERVER);
+                        continue;
+                    }
+
                     // add prompt tokens for processing in the current batch
                     // TODO: the self-extend stuff here is a mess - simplify and/or abstract it somehow
                     for (; slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch; ++slot.n_past) {
+                        if (server_is_image_token(prompt_tokens[slot.n_past])) {
+                            break;
+                        }
+
                         if (slot.ga_n != 1) {
                             while (slot_npast >= ga_i + ga_w) {
                                 const int bd = (ga_w/ga_n)*(ga_n - 1);
@@ -2525,7 +3355,7 @@ struct server_context {
                         llama_sampling_reset(slot.ctx_sampling);
                         for (int i = 0; i < slot.n_prompt_tokens; ++i) {
                             llama_token id = slot.prompt_tokens[i];
-                            if (id != LLAMA_TOKEN_NULL) {
+                            if (id != LLAMA_TOKEN_NULL && !server_is_image_token(id)) {
                                 llama_sampling_accept(slot.ctx_sampling, ctx, id, false);
                             }
                         }
@@ -2563,7 +3393,66 @@ struct server_context {
         // make sure we're in the right embedding mode
         llama_set_embeddings(ctx, batch_type == 1);
 
-        // process the created batch of tokens
+        decode_batch();
+
+        LOG_VERBOSE("run slots completed", {});
+    }
+
+    // evaluate the image at the current position of the prompt of the slot (from its embeddings, in chunks of n_batch)
+    bool process_image_chunk(server_slot & slot) {
+        const server_image * img = slot.find_image(slot.prompt_tokens[slot.n_past]);
+        if (img == nullptr) {
+            return false;
+        }
+
+        const int32_t n_embd  = llama_n_embd(model);
+        const int32_t n_batch = llama_n_batch(ctx);
+        const llama_token token = server_image_token(img->hash);
+
+        llama_set_embeddings(ctx, false);
+
+        llama_batch batch_img = llama_batch_init(std::min(n_batch, img->n_pos), n_embd, 1);
+
+        bool ok = true;
+        for (int32_t i = 0; i < img->n_pos; i += n_batch) {
+            const int32_t n_eval = std::min(n_batch, img->n_pos - i);
+
+            batch_img.n_tokens = n_eval;
+            memcpy(batch_img.embd, img->embd->data() + (size_t) i*n_embd, (size_t) n_eval*n_embd*sizeof(float));
+            for (int32_t j = 0; j < n_eval; ++j) {
+                batch_img.pos[j]       = system_tokens.size() + slot.n_past + j;
+                batch_img.n_seq_id[j]  = 1;
+                batch_img.seq_id[j][0] = slot.id + 1;
+                batch_img.logits[j]    = false;
+            }
+
+            if (llama_decode(ctx, batch_img) != 0) {
+                ok = false;
+                break;
+            }
+
+            slot.n_past += n_eval;
+            slot.n_prompt_tokens_processed += n_eval;
+            if (slot.params.cache_prompt) {
+                slot.cache_tokens.insert(slot.cache_tokens.end(), n_eval, token);
+            }
+        }
+
+        llama_batch_free(batch_img);
+
+        LOG_VERBOSE("image evaluated", {
+            {"id_slot", slot.id},
+            {"n_past",  slot.n_past},
+            {"n_pos",   img->n_pos},
+        });
+
+        return ok;
+    }
+
+    // process the created batch of tokens in chunks of n_batch
+    void decode_batch() {
+        int32_t n_batch = llama_n_batch(ctx);
+
         for (int32_t i = 0; i < batch.n_tokens; i += n_batch) {
             const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
 
@@ -2639,73 +3528,208 @@ struct server_context {
                 continue; // continue loop of n_batch
             }
 
-            for (auto & slot : slots) {
-                if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
-                    continue; // continue loop of slots
-                }
+            if (process_batch_view(batch_view, i)) {
+                break; // the next batch has been submitted
+            }
+        }
+    }
 
-                // prompt evaluated for embedding
-                if (slot.embedding) {
-                    send_embedding(slot, batch_view);
-                    slot.release();
-                    slot.i_batch = -1;
-                    continue; // continue loop of slots
-                }
+    // sample the slots whose tokens are in the decoded view of the batch and process the sampled tokens
+    // returns true if the batch of the next step has been submitted with llama_decode_async
+    bool process_batch_view(const llama_batch & batch_view, int32_t i) {
+        const int32_t n_tokens = batch_view.n_tokens;
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+        std::vector<std::pair<server_slot *, completion_token_output>> sampled;
 
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+        for (auto & slot : slots) {
+            if (slot.state != SLOT_STATE_PROCESSING || slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                continue; // continue loop of slots
+            }
 
-                slot.n_decoded += 1;
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
-                }
+            // prompt evaluated for embedding
+            if (slot.embedding) {
+                send_embedding(slot, batch_view);
+                slot.release();
+                slot.i_batch = -1;
+                continue; // continue loop of slots
+            }
+
+            completion_token_output result;
+            const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+
+            llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+            slot.n_decoded += 1;
+            if (slot.n_decoded == 1) {
+                slot.t_start_generation = ggml_time_us();
+                slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                metrics.on_prompt_eval(slot);
+            }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+            llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+            result.tok = id;
 
-                const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
-                if (n_probs > 0) {
-                    const size_t n_valid = slot.ctx_sampling->n_valid;
+            const size_t n_probs = std::min(cur_p.size, (size_t) slot.sparams.n_probs);
+            if (n_probs > 0) {
+                const size_t n_valid = slot.ctx_sampling->n_valid;
 
-                    // Make sure at least n_probs top tokens are at the front of the vector:
-                    if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
-                        llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+                // Make sure at least n_probs top tokens are at the front of the vector:
+                if (slot.sparams.temp == 0.0f && n_probs > n_valid) {
+                    llama_sample_top_k(ctx, &cur_p, n_probs, 0);
+                }
+
+                if (slot.sparams.temp == 0.0f) {
+                    // With greedy sampling the probabilities have possibly not been calculated.
+                    for (size_t i = 0; i < n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p.data[i].id,
+                            i == 0 ? 1.0f : 0.0f
+                        });
+                    }
+                } else {
+                    for (size_t i = 0; i < n_probs; ++i) {
+                        result.probs.push_back({
+                            cur_p.data[i].id,
+                            i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
+                        });
                     }
+                }
+            }
 
-                    if (slot.sparams.temp == 0.0f) {
-                        // With greedy sampling the probabilities have possibly not been calculated.
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i == 0 ? 1.0f : 0.0f
-                            });
-                        }
-                    } else {
-                        for (size_t i = 0; i < n_probs; ++i) {
-                            result.probs.push_back({
-                                cur_p.data[i].id,
-                                i >= n_valid ? 0.0f : cur_p.data[i].p // Tokens filtered out due to e.g. top_k have 0 probability.
-                            });
-                        }
+            slot.i_batch = -1;
+
+            sampled.emplace_back(&slot, std::move(result));
+        }
+
+        // the next step only depends on the sampled tokens, so it can be evaluated while they are processed
+        const bool submitted = submit_next_batch(sampled);
+
+        for (auto & [slot_ptr, result] : sampled) {
+            server_slot & slot = *slot_ptr;
+
+            if (!process_token(result, slot)) {
+                if (slot.i_batch >= 0) {
+                    // the token was submitted ahead, its KV cell is removed once the batch has been evaluated
+                    slot.i_batch = -1;
+                    slot.n_past -= 1;
+                    if (slot.params.cache_prompt) {
+                        slot.cache_tokens.pop_back();
                     }
+                    slot.pos_rm = system_tokens.size() + slot.n_past;
                 }
 
-                if (!process_token(result, slot)) {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+            }
+        }
+
+        return submitted;
+    }
+
+    // --async-decode: submit the batch of the next step with the tokens sampled in this step, before they are
+    // detokenized and sent. This is done only when every active slot has just been sampled, the slots need no
+    // context shift and there is no other work for the next step. The tokens of the slots that stop are
+    // removed from the KV cache in collect_next_batch.
+    bool submit_next_batch(const std::vector<std::pair<server_slot *, completion_token_output>> & sampled) {
+        if (!params.async_decode || sampled.empty() || system_need_update || !queue_embd.empty() || !queue_score.empty() ||
+            (int32_t) sampled.size() > llama_n_batch(ctx)) {
+            return false;
+        }
+
+        for (const auto & slot : slots) {
+            if (slot.state == SLOT_STATE_IDLE && slot.command == SLOT_COMMAND_NONE) {
+                continue;
+            }
+            const bool is_sampled = std::any_of(sampled.begin(), sampled.end(), [&slot](const auto & s) { return s.first == &slot; });
+            if (!is_sampled || slot.command != SLOT_COMMAND_NONE || slot.ga_n != 1 ||
+                (int) system_tokens.size() + slot.n_past >= slot.n_ctx - 1) {
+                return false;
+            }
+        }
+
+        llama_batch_clear(batch);
+
+        for (const auto & [slot, result] : sampled) {
+            slot->i_batch = batch.n_tokens;
+
+            llama_batch_add(batch, result.tok, system_tokens.size() + slot->n_past, { slot->id + 1 }, true);
+
+            slot->n_past += 1;
+
+            if (slot->params.cache_prompt) {
+                slot->cache_tokens.push_back(result.tok);
+            }
+        }
+
+        if (llama_decode_async(ctx, batch) != 0) {
+            for (const auto & [slot, result] : sampled) {
+                slot->i_batch = -1;
+                slot->n_past -= 1;
+                if (slot->params.cache_prompt) {
+                    slot->cache_tokens.pop_back();
                 }
+            }
+            return false;
+        }
 
+        decode_pending = true;
+
+        return true;
+    }
+
+    // wait for the batch submitted by submit_next_batch and sample its outputs
+    // returns false if the batch could not be evaluated, the slots then add their sampled tokens to a new batch
+    bool collect_next_batch() {
+        decode_pending = false;
+
+        const int32_t ret = llama_decode_wait(ctx);
+
+        for (auto & slot : slots) {
+            if (slot.pos_rm >= 0) {
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, slot.pos_rm, -1);
+                slot.pos_rm = -1;
+            }
+        }
+
+        if (ret != 0 || system_need_update) {
+            for (auto & slot : slots) {
+                if (slot.i_batch < 0) {
+                    continue;
+                }
                 slot.i_batch = -1;
+                slot.n_past -= 1;
+                if (slot.params.cache_prompt) {
+                    slot.cache_tokens.pop_back();
+                }
+                llama_kv_cache_seq_rm(ctx, slot.id + 1, system_tokens.size() + slot.n_past, -1);
             }
+
+            if (ret != 0) {
+                LOG_WARNING("failed to decode the submitted batch, retrying", {
+                    {"n_tokens", batch.n_tokens},
+                    {"ret",      ret},
+                });
+            }
+
+            return false;
         }
 
-        LOG_VERBOSE("run slots completed", {});
+        llama_batch batch_view = {
+            batch.n_tokens,
+            batch.token,
+            nullptr,
+            batch.pos,
+            batch.n_seq_id,
+            batch.seq_id,
+            batch.logits,
+            0, 0, 0, // unused
+        };
+
+        process_batch_view(batch_view, 0);
+
+        return true;
     }
 
     json model_meta() const {
@@ -2970,6 +3994,92 @@ static std::vector<json> format_partial_response_oaicompat(server_task_result ta
 }
 
 
+// [CLS] query [SEP] document [SEP] for WordPiece vocabularies, <s> query </s></s> document </s> otherwise
+static std::vector<llama_token> format_rerank(const llama_model * model, const std::vector<llama_token> & query, const std::vector<llama_token> & doc) {
+    std::vector<llama_token> result;
+    result.reserve(query.size() + doc.size() + 4);
+
+    result.push_back(llama_token_bos(model));
+    result.insert(result.end(), query.begin(), query.end());
+    result.push_back(llama_token_eos(model));
+    if (llama_vocab_type(model) != LLAMA_VOCAB_TYPE_WPM) {
+        result.push_back(llama_token_sep(model));
+    }
+    result.insert(result.end(), doc.begin(), doc.end());
+    result.push_back(llama_token_eos(model));
+
+    return result;
+}
+
+static json format_rerank_response(const json & request, const json & ranks, const std::vector<std::string> & documents, int top_n, bool return_documents) {
+    std::vector<json> results;
+    int n_tokens = 0;
+    for (const auto & rank : ranks) {
+        const int index = json_value(rank, "index", 0);
+
+        json elem = json{
+            {"index",           index},
+            {"relevance_score", json_value(rank, "score", 0.0)},
+        };
+        if (return_documents) {
+            elem["document"] = json{{"text", documents[index]}};
+        }
+        results.push_back(elem);
+
+        n_tokens += json_value(rank, "tokens_evaluated", 0);
+    }
+
+    std::stable_sort(results.begin(), results.end(), [](const json & a, const json & b) {
+        return a.at("relevance_score").get<double>() > b.at("relevance_score").get<double>();
+    });
+    if (top_n >= 0 && top_n < (int) results.size()) {
+        results.resize(top_n);
+    }
+
+    return json{
+        {"model",   json_value(request, "model", std::string(DEFAULT_OAICOMPAT_MODEL))},
+        {"object",  "list"},
+        {"usage",   json{
+            {"prompt_tokens", n_tokens},
+            {"total_tokens",  n_tokens}
+        }},
+        {"results", results}
+    };
+}
+
+static json format_score_response(const json & request, const json & scores, const std::vector<llama_score_task> & tasks) {
+    json data = json::array();
+    int n_tokens = 0;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        const auto & task = tasks[i];
+        const json & conts = scores.at(i).at("continuations");
+        json elem = json::array();
+        for (size_t j = 0; j < task.continuations.size(); ++j) {
+            json cont = conts.at(j);
+            cont["index"]  = j;
+            cont["tokens"] = task.continuations[j];
+            elem.push_back(cont);
+            n_tokens += task.continuations[j].size();
+        }
+        n_tokens += task.prefix.size();
+        data.push_back(json{
+            {"index",         i},
+            {"object",        "score"},
+            {"continuations", elem},
+        });
+    }
+
+    return json{
+        {"model",  json_value(request, "model", std::string(DEFAULT_OAICOMPAT_MODEL))},
+        {"object", "list"},
+        {"usage",  json{
+            {"prompt_tokens", n_tokens},
+            {"total_tokens",  n_tokens}
+        }},
+        {"data",   data}
+    };
+}
+
 static json format_embeddings_response_oaicompat(const json& request, const json& embeddings) {
     json data = json::array();
     int i = 0;
@@ -3040,6 +4150,14 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // reranking uses the embedding scheduler with the classification head attached by the rank pooling
+    if (params.reranking) {
+        params.embedding = true;
+        if (params.pooling_type == LLAMA_POOLING_TYPE_UNSPECIFIED) {
+            params.pooling_type = LLAMA_POOLING_TYPE_RANK;
+        }
+    }
+
     // TODO: not great to use extern vars
     server_log_json = params.log_json;
     server_verbose = params.verbosity > 0;
@@ -3201,6 +4319,10 @@ int main(int argc, char ** argv) {
             "/embedding",
             "/embeddings",
             "/v1/embeddings",
+            "/rerank",
+            "/reranking",
+            "/v1/rerank",
+            "/v1/reranking",
         };
 
         // If API key is not set, skip validation
@@ -3372,6 +4494,14 @@ int main(int argc, char ** argv) {
                     {"name",  "tokens_predicted_seconds_total"},
                     {"help",  "Predict process time"},
                     {"value",  (uint64_t) data.at("t_tokens_generation_total") / 1.e3}
+            }, {
+                    {"name",  "images_encoded_total"},
+                    {"help",  "Number of images encoded by the vision model."},
+                    {"value",  (uint64_t) data.at("n_images_encoded_total")}
+            }, {
+                    {"name",  "images_cached_total"},
+                    {"help",  "Number of images taken from the image embedding cache."},
+                    {"value",  (uint64_t) data.at("n_images_cached_total")}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3544,7 +4674,8 @@ int main(int argc, char ** argv) {
             { "system_prompt",               ctx_server.system_prompt.c_str() },
             { "default_generation_settings", ctx_server.default_generation_settings_for_props },
             { "total_slots",                 ctx_server.params.n_parallel },
-            { "chat_template",               curr_tmpl.c_str() }
+            { "chat_template",               curr_tmpl.c_str() },
+            { "multimodal",                  ctx_server.multimodal }
         };
 
         res.set_content(data.dump(), "application/json; charset=utf-8");
@@ -3834,6 +4965,11 @@ int main(int argc, char ** argv) {
     const auto handle_embeddings = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
 
+        if (llama_pooling_type(ctx_server.ctx) == LLAMA_POOLING_TYPE_RANK) {
+            res_error(res, format_error_response("This server does not support embeddings. Start it without `--reranking`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
         const json body = json::parse(req.body);
         bool is_openai = false;
 
@@ -3882,6 +5018,156 @@ int main(int argc, char ** argv) {
         return res.set_content(root.dump(), "application/json; charset=utf-8");
     };
 
+    const auto handle_rerank = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+
+        if (!ctx_server.params.reranking || llama_pooling_type(ctx_server.ctx) != LLAMA_POOLING_TYPE_RANK) {
+            res_error(res, format_error_response("This server does not support reranking. Start it with `--reranking`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        const json body = json::parse(req.body);
+
+        if (!body.contains("query") || !body.at("query").is_string()) {
+            res_error(res, format_error_response("\"query\" must be a string", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        // "texts" is accepted as an alias of "documents"
+        const json & documents_json = body.contains("documents") ? body.at("documents") : body.contains("texts") ? body.at("texts") : json();
+        if (!documents_json.is_array() || documents_json.empty()) {
+            res_error(res, format_error_response("\"documents\" must be a non-empty array of strings", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        std::vector<std::string> documents;
+        for (const auto & doc : documents_json) {
+            if (!doc.is_string()) {
+                res_error(res, format_error_response("\"documents\" must be a non-empty array of strings", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            documents.push_back(doc.get<std::string>());
+        }
+
+        const int  top_n            = json_value(body, "top_n", -1);
+        const bool return_documents = json_value(body, "return_documents", false);
+
+        // one (query, document) sequence per document, they are packed with those of the other requests
+        const std::vector<llama_token> query = ::llama_tokenize(ctx_server.ctx, body.at("query").get<std::string>(), false, true);
+
+        json prompt = json::array();
+        for (const auto & doc : documents) {
+            prompt.push_back(format_rerank(ctx_server.model, query, ::llama_tokenize(ctx_server.ctx, doc, false, true)));
+        }
+
+        json ranks;
+        {
+            const int id_task = ctx_server.queue_tasks.get_new_id();
+            ctx_server.queue_results.add_waiting_task_id(id_task);
+            ctx_server.request_completion(id_task, -1, {{"prompt", prompt}}, false, true);
+
+            server_task_result result = ctx_server.queue_results.recv(id_task);
+            ctx_server.queue_results.remove_waiting_task_id(id_task);
+            if (result.error) {
+                res_error(res, result.data);
+                return;
+            }
+
+            ranks = result.data.count("results") ? result.data.at("results") : json::array({result.data});
+        }
+
+        // the errors of the sub-tasks are reported in their results
+        for (const auto & rank : ranks) {
+            if (!rank.contains("score")) {
+                res_error(res, rank);
+                return;
+            }
+        }
+
+        const json root = format_rerank_response(body, ranks, documents, top_n, return_documents);
+        return res.set_content(root.dump(), "application/json; charset=utf-8");
+    };
+
+    const auto handle_score = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+        res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
+
+        if (ctx_server.params.embedding || ctx_server.params.n_score_seq <= 0) {
+            res_error(res, format_error_response("This server does not support scoring. Start it with `--score-seqs N` and without `--embedding`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        const json body = json::parse(req.body);
+
+        // a single task or a list of tasks, each with a prompt and its candidate continuations (strings or lists of tokens)
+        const json tasks_json = body.contains("tasks") ? body.at("tasks") : json::array({body});
+        if (!tasks_json.is_array() || tasks_json.empty()) {
+            res_error(res, format_error_response("\"tasks\" must be a non-empty array", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        std::vector<llama_score_task> tasks;
+        json tasks_tokens = json::array();
+        for (const auto & t : tasks_json) {
+            if (!t.contains("prompt") || !t.contains("continuations") || !t.at("continuations").is_array() || t.at("continuations").empty()) {
+                res_error(res, format_error_response("each task needs a \"prompt\" and a non-empty array of \"continuations\"", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            if ((int32_t) t.at("continuations").size() > ctx_server.params.n_score_seq) {
+                res_error(res, format_error_response("a task has more continuations than the sequences reserved for scoring (--score-seqs " +
+                            std::to_string(ctx_server.params.n_score_seq) + ")", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            llama_score_task task;
+            task.prefix = ctx_server.tokenize(t.at("prompt"), true);
+            for (const auto & c : t.at("continuations")) {
+                if (!c.is_string()) {
+                    task.continuations.push_back(ctx_server.tokenize(c, false));
+                    continue;
+                }
+                // a text continuation is tokenized together with a text prompt, so that it is split into tokens as
+                // it would be in the context of the prompt; it is tokenized on its own if the prompt tokens change
+                std::vector<llama_token> cont;
+                if (t.at("prompt").is_string()) {
+                    const auto full = ctx_server.tokenize(t.at("prompt").get<std::string>() + c.get<std::string>(), true);
+                    if (full.size() > task.prefix.size() && std::equal(task.prefix.begin(), task.prefix.end(), full.begin())) {
+                        cont.assign(full.begin() + task.prefix.size(), full.end());
+                    }
+                }
+                if (cont.empty()) {
+                    cont = ::llama_tokenize(ctx_server.ctx, c.get<std::string>(), false, false);
+                }
+                task.continuations.push_back(std::move(cont));
+            }
+            if (task.prefix.empty() || std::any_of(task.continuations.begin(), task.continuations.end(), [](const auto & c) { return c.empty(); })) {
+                res_error(res, format_error_response("the prompt and the continuations must not be empty", ERROR_TYPE_INVALID_REQUEST));
+                return;
+            }
+            tasks_tokens.push_back(json {
+                { "prefix",        task.prefix },
+                { "continuations", task.continuations },
+            });
+            tasks.push_back(std::move(task));
+        }
+
+        server_task task;
+        task.type = SERVER_TASK_TYPE_SCORE;
+        task.data = {{ "tasks", tasks_tokens }};
+
+        const int id_task = ctx_server.queue_tasks.post(task);
+        ctx_server.queue_results.add_waiting_task_id(id_task);
+
+        server_task_result result = ctx_server.queue_results.recv(id_task);
+        ctx_server.queue_results.remove_waiting_task_id(id_task);
+
+        if (result.error) {
+            res_error(res, result.data);
+            return;
+        }
+
+        const json root = format_score_response(body, result.data.at("results"), tasks);
+        return res.set_content(root.dump(), "application/json; charset=utf-8");
+    };
+
     const auto handle_lora_adapters_list = [&](const httplib::Request & req, httplib::Response & res) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         json result = json::array();
@@ -4031,6 +5317,12 @@ int main(int argc, char ** argv) {
     svr->Post("/embedding",           handle_embeddings); // legacy
     svr->Post("/embeddings",          handle_embeddings);
     svr->Post("/v1/embeddings",       handle_embeddings);
+    svr->Post("/rerank",              handle_rerank);
+    svr->Post("/reranking",           handle_rerank);
+    svr->Post("/v1/rerank",           handle_rerank);
+    svr->Post("/v1/reranking",        handle_rerank);
+    svr->Post("/score",               handle_score);
+    svr->Post("/v1/score",            handle_score);
     svr->Post("/tokenize",            handle_tokenize);
     svr->Post("/detokenize",          handle_detokenize);
     // LoRA adapters hotswap
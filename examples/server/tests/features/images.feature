@@ -0,0 +1,79 @@
+# run with: ./tests.sh --no-skipped --tags images
+@images
+@slow
+Feature: llama.cpp server
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file ggml-model-q4_k.gguf from HF repo mys/ggml_llava-v1.5-7b
+    And   a multimodal projector file mmproj-model-f16.gguf from HF repo mys/ggml_llava-v1.5-7b
+    And   42 as server seed
+    And   1 slots
+    And   512 as batch size
+    And   4096 KV cache size
+    And   16 max tokens to predict
+    And   prometheus compatible metrics exposed
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: The same image in two requests is encoded once
+    Given an image 1 with seed 1
+    When  an image completion request with the prompt cache enabled:
+      """
+      USER: [img-1]
+      Describe the image.
+      ASSISTANT:
+      """
+    And   an image completion request with the prompt cache disabled:
+      """
+      USER: [img-1]
+      Describe the image.
+      ASSISTANT:
+      """
+    Then  the prompt cache was not used for the last image completion
+    And   the last two image completions are the same
+    When  prometheus metrics are exposed
+    Then  metric llamacpp:images_encoded_total is 1
+    And   metric llamacpp:images_cached_total is 1
+
+  Scenario: The prompt cache is reused up to the end of an image
+    Given an image 1 with seed 1
+    And   an image 2 with seed 2
+    When  an image completion request with the prompt cache enabled:
+      """
+      USER: [img-1][img-1]
+      Are the two images the same?
+      ASSISTANT:
+      """
+    # the common part ends inside the placeholders of the two copies of image 1, after the first one
+    And   an image completion request with the prompt cache enabled:
+      """
+      USER: [img-1][img-2]
+      Are the two images the same?
+      ASSISTANT:
+      """
+    Then  the prompt cache was used for the last image completion
+    When  an image completion request with the prompt cache disabled:
+      """
+      USER: [img-1][img-2]
+      Are the two images the same?
+      ASSISTANT:
+      """
+    Then  the last two image completions are the same
+    # the common part ends inside the placeholders of image 1, in front of the text
+    When  an image completion request with the prompt cache enabled:
+      """
+      USER: [img-1]
+      What is in the image?
+      ASSISTANT:
+      """
+    Then  the prompt cache was used for the last image completion
+    When  an image completion request with the prompt cache disabled:
+      """
+      USER: [img-1]
+      What is in the image?
+      ASSISTANT:
+      """
+    Then  the last two image completions are the same
+    When  prometheus metrics are exposed
+    Then  metric llamacpp:images_encoded_total is 2
@@ -0,0 +1,64 @@
+@llama.cpp
+@rerank
+Feature: llama.cpp server
+
+  Background: Server startup
+    Given a server listening on localhost:8080
+    And   a model file jina-reranker-v1-tiny-en/ggml-model-f16.gguf from HF repo ggml-org/models
+    And   a model alias jina-reranker
+    And   42 as server seed
+    And   2 slots
+    And   512 as batch size
+    And   512 as ubatch size
+    And   512 KV cache size
+    And   reranking
+    Then  the server is starting
+    Then  the server is healthy
+
+  Scenario: Rerank
+    Given a rerank query:
+      """
+      Machine learning is
+      """
+    And   a rerank document:
+      """
+      A machine is a physical system that uses power to apply forces and control movement to perform an action. The term is commonly applied to artificial devices, such as those employing engines or motors, but also to natural biological macromolecules, such as molecular machines.
+      """
+    And   a rerank document:
+      """
+      Learning is the process of acquiring new understanding, knowledge, behaviors, skills, values, attitudes, and preferences. The ability to learn is possessed by humans, some animals, and some machinery; there is also evidence for some kind of learning in certain plants.
+      """
+    And   a rerank document:
+      """
+      Machine learning is a field of study in artificial intelligence concerned with the development and study of statistical algorithms that can learn from data and generalize to unseen data, and thus perform tasks without explicit instructions.
+      """
+    And   a rerank document:
+      """
+      Paris, capitale de la France, est une grande ville européenne et un centre mondial de l'art, de la mode, de la gastronomie et de la culture.
+      """
+    When  reranking request
+    Then  4 rerank results are returned
+    And   the top ranked document is 2
+    And   the bottom ranked document is 3
+    And   the documents reranked one at a time have the same scores
+
+  Scenario: Rerank with top_n
+    Given a rerank query:
+      """
+      Machine learning is
+      """
+    And   a rerank document:
+      """
+      Paris, capitale de la France, est une grande ville européenne.
+      """
+    And   a rerank document:
+      """
+      Machine learning is a field of study in artificial intelligence.
+      """
+    And   a rerank document:
+      """
+      Learning is the process of acquiring new understanding.
+      """
+    When  reranking request with top 2 documents
+    Then  2 rerank results are returned
+    And   the top ranked document is 1
@@ -1,12 +1,15 @@
 import asyncio
+import base64
 import json
 import os
 import re
 import socket
+import struct
 import subprocess
 import sys
 import threading
 import time
+import zlib
 import requests
 from collections.abc import Sequence
 from contextlib import closing
@@ -63,6 +66,7 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.server_api_key = None
     context.server_continuous_batching = False
     context.server_embeddings = False
+    context.server_reranking = False
     context.server_metrics = False
     context.server_process = None
     context.seed = None
@@ -72,8 +76,11 @@ def step_server_config(context, server_fqdn: str, server_port: str):
     context.response_format = None
     context.temperature = None
     context.lora_file = None
+    context.mmproj_file = None
 
     context.tasks_result = []
+    context.images = []
+    context.image_completions = []
     context.concurrent_tasks = []
     context.prompts = []
 
@@ -91,6 +98,13 @@ def step_download_lora_file(context, lora_file_url: str):
     with open(context.lora_file, 'wb') as f:
         f.write(requests.get(lora_file_url).content)
 
+@step('a multimodal projector file {hf_file} from HF repo {hf_repo}')
+def step_download_hf_mmproj(context, hf_file: str, hf_repo: str):
+    context.mmproj_file = f'../../../{os.path.basename(hf_file)}'
+    if not os.path.exists(context.mmproj_file):
+        with open(context.mmproj_file, 'wb') as f:
+            f.write(requests.get(f'https://huggingface.co/{hf_repo}/resolve/main/{hf_file}').content)
+
 @step('a model file {model_file}')
 def step_model_file(context, model_file: str):
     context.model_file = model_file
@@ -171,6 +185,11 @@ def step_server_embeddings(context):
     context.server_embeddings = True
 
 
+@step('reranking')
+def step_server_reranking(context):
+    context.server_reranking = True
+
+
 @step('prometheus compatible metrics exposed')
 def step_server_metrics(context):
     context.server_metrics = True
@@ -687,6 +706,110 @@ async def all_embeddings_are_generated(context):
         assert_embeddings(context.tasks_result.pop().pop())
 
 
+@step('a rerank query')
+def step_rerank_query(context):
+    context.rerank_query = context_text(context)
+    context.rerank_documents = []
+
+
+@step('a rerank document')
+def step_rerank_document(context):
+    context.rerank_documents.append(context_text(context))
+
+
+@step('reranking request')
+@async_run_until_complete
+async def step_rerank(context):
+    context.rerank_results = await request_rerank(context.rerank_query, context.rerank_documents,
+                                                  base_url=context.base_url)
+
+
+@step('reranking request with top {top_n:d} documents')
+@async_run_until_complete
+async def step_rerank_top_n(context, top_n: int):
+    context.rerank_results = await request_rerank(context.rerank_query, context.rerank_documents,
+                                                  base_url=context.base_url, top_n=top_n)
+
+
+@step('{n_results:d} rerank results are returned')
+def step_rerank_n_results(context, n_results: int):
+    assert len(context.rerank_results) == n_results, f"unexpected results: {context.rerank_results}"
+    scores = [result['relevance_score'] for result in context.rerank_results]
+    assert scores == sorted(scores, reverse=True), f"results not sorted by relevance: {scores}"
+    for result in context.rerank_results:
+        assert result['document']['text'] == context.rerank_documents[result['index']]
+
+
+@step('the top ranked document is {index:d}')
+def step_rerank_top(context, index: int):
+    assert context.rerank_results[0]['index'] == index, f"unexpected ranking: {context.rerank_results}"
+
+
+@step('the bottom ranked document is {index:d}')
+def step_rerank_bottom(context, index: int):
+    assert context.rerank_results[-1]['index'] == index, f"unexpected ranking: {context.rerank_results}"
+
+
+@step('the documents reranked one at a time have the same scores')
+@async_run_until_complete
+async def step_rerank_one_at_a_time(context):
+    # the batched request packs all (query, document) pairs into one decode
+    scores = {result['index']: result['relevance_score'] for result in context.rerank_results}
+    for index, document in enumerate(context.rerank_documents):
+        results = await request_rerank(context.rerank_query, [document], base_url=context.base_url)
+        assert len(results) == 1 and results[0]['index'] == 0
+        assert np.isclose(results[0]['relevance_score'], scores[index], rtol=1e-3, atol=1e-3), \
+            f"document {index}: {results[0]['relevance_score']} alone, {scores[index]} in the batch"
+
+
+@step('an image {image_id:d} with seed {seed:d}')
+def step_image(context, image_id: int, seed: int):
+    context.images.append({
+        'id': image_id,
+        'data': base64.b64encode(random_png(seed)).decode('utf-8'),
+    })
+
+
+@step('an image completion request with the prompt cache {enabled}')
+@async_run_until_complete
+async def step_image_completion(context, enabled: str):
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{context.base_url}/completion',
+                                json={
+                                    "prompt": context_text(context),
+                                    "image_data": context.images,
+                                    "n_predict": context.n_predict if context.n_predict is not None else 16,
+                                    "cache_prompt": enabled == 'enabled',
+                                    "id_slot": 0,
+                                    "seed": 42,
+                                    "temperature": 0.0,
+                                }) as response:
+            assert response.status == 200, f"received status code not expected: {response.status}"
+            context.completion = await response.json()
+            context.image_completions.append(context.completion)
+
+
+@step('the last two image completions are the same')
+def step_image_completions_same(context):
+    assert len(context.image_completions) >= 2
+    ref, out = context.image_completions[-2:]
+    assert ref['content'] == out['content'], f"'{ref['content']}' != '{out['content']}'"
+
+
+@step('the prompt cache was used for the last image completion')
+def step_image_prompt_cache_used(context):
+    n_prompt    = context.completion['tokens_evaluated']
+    n_processed = context.completion['timings']['prompt_n']
+    assert 0 < n_processed < n_prompt, f"{n_processed} of {n_prompt} prompt tokens processed"
+
+
+@step('the prompt cache was not used for the last image completion')
+def step_image_prompt_cache_not_used(context):
+    n_prompt    = context.completion['tokens_evaluated']
+    n_processed = context.completion['timings']['prompt_n']
+    assert n_processed == n_prompt, f"{n_processed} of {n_prompt} prompt tokens processed"
+
+
 @step('adding special tokens')
 def step_tokenize_set_add_special(context):
     context.tokenize_add_special = True
@@ -1065,6 +1188,24 @@ async def request_embedding(content, seed, base_url=None) -> list[list[float]]:
             return [response_json['embedding']]
 
 
+async def request_rerank(query, documents, base_url=None, top_n=None):
+    payload = {
+        "query": query,
+        "documents": documents,
+        "return_documents": True,
+    }
+    if top_n is not None:
+        payload['top_n'] = top_n
+    async with aiohttp.ClientSession() as session:
+        async with session.post(f'{base_url}/v1/rerank',
+                                json=payload) as response:
+            assert response.status == 200, f"received status code not expected: {response.status}"
+            response_json = await response.json()
+            assert response_json['object'] == 'list'
+            assert response_json['usage']['prompt_tokens'] > 0
+            return response_json['results']
+
+
 async def request_oai_embeddings(input, seed,
                                  base_url=None, user_api_key=None,
                                  model=None, async_client=False) -> list[list[float]]:
@@ -1287,6 +1428,22 @@ async def completions_seed(context, num_seeds=None):
     return None
 
 
+def random_png(seed):
+    # a 64x64 RGB image of random pixels, written without an imaging library
+    rng = np.random.default_rng(seed)
+    width, height = 64, 64
+    pixels = rng.integers(0, 256, size=(height, width, 3), dtype=np.uint8)
+    raw = b''.join(b'\x00' + pixels[y].tobytes() for y in range(height))
+
+    def chunk(tag, data):
+        return struct.pack('>I', len(data)) + tag + data + struct.pack('>I', zlib.crc32(tag + data) & 0xffffffff)
+
+    return (b'\x89PNG\r\n\x1a\n' +
+            chunk(b'IHDR', struct.pack('>IIBBBBB', width, height, 8, 2, 0, 0, 0)) +
+            chunk(b'IDAT', zlib.compress(raw)) +
+            chunk(b'IEND', b''))
+
+
 def context_text(context):
     return context.text.replace('\r', '')
 
@@ -1325,6 +1482,8 @@ def start_server_background(context):
         server_args.append('--cont-batching')
     if context.server_embeddings:
         server_args.append('--embedding')
+    if context.server_reranking:
+        server_args.append('--reranking')
     if context.server_metrics:
         server_args.append('--metrics')
     if context.model_alias:
@@ -1347,6 +1506,8 @@ def start_server_background(context):
         server_args.append('--verbose')
     if context.lora_file:
         server_args.extend(['--lora', context.lora_file])
+    if context.mmproj_file:
+        server_args.extend(['--mmproj', context.mmproj_file])
     if 'SERVER_LOG_FORMAT_JSON' not in os.environ:
         server_args.extend(['--log-format', "text"])
 
@@ -337,6 +337,9 @@ template <class Iter>
 static std::string tokens_to_str(llama_context * ctx, Iter begin, Iter end) {
     std::string ret;
     for (; begin != end; ++begin) {
+        if (*begin < 0) {
+            continue; // image positions
+        }
         ret += llama_token_to_piece(ctx, *begin);
     }
 
@@ -471,8 +474,37 @@ static json oaicompat_completion_params_parse(
     // Extract model name from the request body
     std::string model_name = json_value(body, "model", std::string(DEFAULT_OAICOMPAT_MODEL));
 
+    // the images of the messages are passed in "image_data" and referenced in the prompt by [img-N] markers
+    json messages   = body.at("messages");
+    json image_data = json::array();
+    for (auto & msg : messages) {
+        if (!msg.contains("content") || !msg.at("content").is_array()) {
+            continue;
+        }
+        for (auto & part : msg.at("content")) {
+            if (json_value(part, "type", std::string()) != "image_url") {
+                continue;
+            }
+            const json & image_url = part.at("image_url");
+            const std::string url = image_url.is_string() ? image_url.get<std::string>() : image_url.at("url").get<std::string>();
+
+            // data:image/png;base64,...
+            const size_t comma = url.find(',');
+            if (url.rfind("data:", 0) != 0 || comma == std::string::npos || url.substr(0, comma).find(";base64") == std::string::npos) {
+                throw std::runtime_error("only base64 encoded data URLs are supported for images");
+            }
+
+            const int id = image_data.size();
+            image_data.push_back({{"id", id}, {"data", url.substr(comma + 1)}});
+            part = {{"type", "text"}, {"text", "[img-" + std::to_string(id) + "]"}};
+        }
+    }
+    if (!image_data.empty()) {
+        llama_params["image_data"] = image_data;
+    }
+
     // Apply chat template to the list of messages with tools
-    llama_params["prompt"] = format_chat(model, chat_template, body.at("messages"), tools, model_name);
+    llama_params["prompt"] = format_chat(model, chat_template, messages, tools, model_name);
 
     // Handle "stop" field
     if (body.contains("stop") && body.at("stop").is_string()) {
@@ -113,6 +113,19 @@ extern "C" {
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
 
+    // placement of the pages of a CPU buffer on NUMA systems
+    #define GGML_NUMA_NODE_ANY        -1 // first touch (the kernel default)
+    #define GGML_NUMA_NODE_INTERLEAVE -2 // interleave the pages over all NUMA nodes
+
+    // CPU buffer type backed by anonymous mappings with explicit huge pages and a NUMA memory policy
+    // page_size: huge page size in bytes (e.g. 2 MiB or 1 GiB), 0 = regular pages (only the NUMA policy is applied)
+    //            if no huge pages of the requested size are reserved, it falls back to transparent huge pages
+    // numa_node: NUMA node to bind the pages to, or one of GGML_NUMA_NODE_ANY, GGML_NUMA_NODE_INTERLEAVE
+    // on platforms other than Linux this is the same as ggml_backend_cpu_buffer_type()
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node);
+    // default huge page size of the system in bytes (0 if huge pages are not supported)
+    GGML_API size_t ggml_backend_cpu_default_hugepage_size(void);
+
     //
     // Backend registry
     //
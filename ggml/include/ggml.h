@@ -627,6 +627,7 @@ extern "C" {
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
         GGML_OP_ARGSORT_THRESH,
+        GGML_OP_TOP_K_LSE,
         GGML_OP_LEAKY_RELU,
         GGML_OP_SOFTCAP,
         GGML_OP_SOFT_CAP_MAX,
@@ -693,6 +694,7 @@ extern "C" {
         GGML_TENSOR_FLAG_INPUT  = 1,
         GGML_TENSOR_FLAG_OUTPUT = 2,
         GGML_TENSOR_FLAG_PARAM  = 4,
+        GGML_TENSOR_FLAG_NUMA_SHARD = 8, // rows are partitioned between NUMA nodes, see ggml_numa_shard_tensor()
     };
 
     // ggml object
@@ -759,6 +761,7 @@ extern "C" {
     struct ggml_cplan {
         size_t    work_size; // size of work buffer, calculated by `ggml_graph_plan()`
         uint8_t * work_data; // work buffer, to be allocated by caller before calling to `ggml_graph_compute()`
+        size_t    work_size_src1; // part of the work buffer holding the src1 of matrix multiplications converted to vec_dot_type
 
         int n_threads;
 
@@ -843,6 +846,16 @@ extern "C" {
 
     GGML_API void    ggml_numa_init(enum ggml_numa_strategy numa); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
+    GGML_API int     ggml_numa_n_nodes(void); // number of NUMA nodes detected by ggml_numa_init (0 if not initialized)
+
+    // NUMA row sharding of weight tensors
+    // the rows of each matrix are split into n_nodes contiguous partitions (aligned to GGML_NUMA_SHARD_ROWS rows),
+    // the pages of partition i are moved to node i, and matrix multiplications with the tensor as src0 have
+    // the threads pinned to node i (ith % n_nodes == i with GGML_NUMA_STRATEGY_DISTRIBUTE) only process partition i
+    #define GGML_NUMA_SHARD_ROWS 64
+    GGML_API void    ggml_numa_shard_rows(int64_t nrows, int node, int n_nodes, int64_t * first, int64_t * last);
+    GGML_API bool    ggml_numa_shard_tensor(struct ggml_tensor * tensor); // returns false if the tensor cannot be sharded
+    GGML_API bool    ggml_numa_can_shard(void); // true if ggml_numa_init() was called with GGML_NUMA_STRATEGY_DISTRIBUTE on a NUMA system
 
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
@@ -1975,6 +1988,14 @@ extern "C" {
             int                   min_entries,
             float                 thresh);
 
+    // top k elements of each row (in descending order) together with the log-sum-exp of the row
+    // result: F32 [2*k + 1, ne1, ne2, ne3], each row holding the k indices (as float, exact for ne0 <= 2^24),
+    // the k values and the log-sum-exp
+    GGML_API struct ggml_tensor * ggml_top_k_lse(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
 #define GGML_KQ_MASK_PAD 64
 
     // q:    [n_embd, n_batch,     n_head,    1]
@@ -4,6 +4,7 @@
 #include "ggml-rpc.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -768,6 +769,235 @@ ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void) {
 }
 #endif
 
+// buffer type huge pages
+
+#if defined(__linux__)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+// from <numaif.h>, which is only available with libnuma installed
+#define GGML_MPOL_BIND       2
+#define GGML_MPOL_INTERLEAVE 3
+
+#define GGML_HUGEPAGE_MAX_BUFT 32
+
+struct ggml_backend_cpu_hugepage_buffer_type_context {
+    size_t page_size;
+    int    numa_node;
+    char   name[32];
+};
+
+struct ggml_backend_cpu_hugepage_buffer_context {
+    void * data;
+    size_t size; // size of the mapping
+};
+
+size_t ggml_backend_cpu_default_hugepage_size(void) {
+    static size_t page_size = 0;
+    static bool   checked   = false;
+    if (!checked) {
+        checked = true;
+        FILE * f = fopen("/proc/meminfo", "r");
+        if (f) {
+            char line[256];
+            while (fgets(line, sizeof(line), f)) {
+                unsigned long kib;
+                if (sscanf(line, "Hugepagesize: %lu kB", &kib) == 1) {
+                    page_size = (size_t)kib*1024;
+                    break;
+                }
+            }
+            fclose(f);
+        }
+    }
+    return page_size;
+}
+
+static void ggml_backend_cpu_hugepage_mbind(void * data, size_t size, int numa_node) {
+    if (numa_node == GGML_NUMA_NODE_ANY) {
+        return;
+    }
+    int n_nodes = ggml_numa_n_nodes();
+    if (n_nodes == 1) {
+        return;
+    }
+    if (n_nodes <= 0) {
+        n_nodes = 8*sizeof(unsigned long); // ggml_numa_init() not called, the kernel ignores nodes that do not exist
+    }
+    unsigned long mask = 0;
+    int mode;
+    if (numa_node == GGML_NUMA_NODE_INTERLEAVE) {
+        mask = n_nodes >= (int)(8*sizeof(unsigned long)) ? ~0ul : (1ul << n_nodes) - 1;
+        mode = GGML_MPOL_INTERLEAVE;
+    } else {
+        GGML_ASSERT(numa_node >= 0 && numa_node < (int)(8*sizeof(unsigned long)));
+        mask = 1ul << numa_node;
+        mode = GGML_MPOL_BIND;
+    }
+    if (syscall(SYS_mbind, data, size, mode, &mask, 8*sizeof(unsigned long), 0) != 0) {
+        fprintf(stderr, "%s: warning: mbind(node = %d) failed: %s\n", __func__, numa_node, strerror(errno));
+    }
+}
+
+GGML_CALL static const char * ggml_backend_cpu_hugepage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    struct ggml_backend_cpu_hugepage_buffer_type_context * ctx = (struct ggml_backend_cpu_hugepage_buffer_type_context *)buft->context;
+    return ctx->name;
+}
+
+GGML_CALL static const char * ggml_backend_cpu_hugepage_buffer_get_name(ggml_backend_buffer_t buffer) {
+    return ggml_backend_cpu_hugepage_buffer_type_get_name(buffer->buft);
+}
+
+GGML_CALL static void * ggml_backend_cpu_hugepage_buffer_get_base(ggml_backend_buffer_t buffer) {
+    struct ggml_backend_cpu_hugepage_buffer_context * ctx = (struct ggml_backend_cpu_hugepage_buffer_context *)buffer->context;
+    return ctx->data;
+}
+
+GGML_CALL static void ggml_backend_cpu_hugepage_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    struct ggml_backend_cpu_hugepage_buffer_context * ctx = (struct ggml_backend_cpu_hugepage_buffer_context *)buffer->context;
+    munmap(ctx->data, ctx->size);
+    free(ctx);
+}
+
+GGML_CALL static void ggml_backend_cpu_hugepage_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    struct ggml_backend_cpu_hugepage_buffer_context * ctx = (struct ggml_backend_cpu_hugepage_buffer_context *)buffer->context;
+    memset(ctx->data, value, buffer->size);
+}
+
+static struct ggml_backend_buffer_i cpu_hugepage_backend_buffer_i = {
+    /* .get_name        = */ ggml_backend_cpu_hugepage_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_cpu_hugepage_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_hugepage_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_hugepage_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+// maps size bytes aligned to align, releasing the over-allocated head and tail of the mapping
+static void * ggml_backend_cpu_mmap_aligned(size_t size, size_t align) {
+    size_t map_size = size + align;
+    char * ptr = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    char * data = (char *)GGML_PAD((uintptr_t)ptr, align);
+    if (data > ptr) {
+        munmap(ptr, data - ptr);
+    }
+    if (ptr + map_size > data + size) {
+        munmap(data + size, ptr + map_size - (data + size));
+    }
+    return data;
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_hugepage_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    struct ggml_backend_cpu_hugepage_buffer_type_context * buft_ctx = (struct ggml_backend_cpu_hugepage_buffer_type_context *)buft->context;
+
+    const size_t page_size = buft_ctx->page_size > 0 ? buft_ctx->page_size : (size_t)sysconf(_SC_PAGESIZE);
+    const size_t map_size  = GGML_PAD(MAX(size, 1), page_size);
+
+    void * data = NULL;
+    if (buft_ctx->page_size > 0) {
+        // explicit huge pages from the hugetlbfs pool of the requested size
+        int log2_page = 0;
+        while (((size_t)1 << log2_page) < page_size) ++log2_page;
+        data = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (log2_page << MAP_HUGE_SHIFT), -1, 0);
+        if (data == MAP_FAILED) {
+            // no huge pages reserved -> transparent huge pages on a huge page aligned mapping
+            data = ggml_backend_cpu_mmap_aligned(map_size, page_size);
+            if (data) {
+#ifdef MADV_HUGEPAGE
+                if (madvise(data, map_size, MADV_HUGEPAGE) != 0) {
+                    fprintf(stderr, "%s: warning: madvise(MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+                }
+#endif
+            }
+        }
+    } else {
+        data = ggml_backend_cpu_mmap_aligned(map_size, page_size);
+    }
+    if (data == NULL) {
+        fprintf(stderr, "%s: failed to allocate buffer of size %zu\n", __func__, size);
+        return NULL;
+    }
+
+    // the policy must be set before the pages are touched for the first time
+    ggml_backend_cpu_hugepage_mbind(data, map_size, buft_ctx->numa_node);
+
+    struct ggml_backend_cpu_hugepage_buffer_context * ctx = (struct ggml_backend_cpu_hugepage_buffer_context *)malloc(sizeof(struct ggml_backend_cpu_hugepage_buffer_context));
+    ctx->data = data;
+    ctx->size = map_size;
+
+    return ggml_backend_buffer_init(buft, cpu_hugepage_backend_buffer_i, ctx, size);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node) {
+    static struct ggml_backend_cpu_hugepage_buffer_type_context buft_ctx[GGML_HUGEPAGE_MAX_BUFT];
+    static struct ggml_backend_buffer_type buft[GGML_HUGEPAGE_MAX_BUFT];
+    static int n_buft = 0;
+
+    for (int i = 0; i < n_buft; ++i) {
+        if (buft_ctx[i].page_size == page_size && buft_ctx[i].numa_node == numa_node) {
+            return &buft[i];
+        }
+    }
+    if (n_buft == GGML_HUGEPAGE_MAX_BUFT) {
+        fprintf(stderr, "%s: too many huge page buffer types, using the default CPU buffer type\n", __func__);
+        return ggml_backend_cpu_buffer_type();
+    }
+
+    struct ggml_backend_cpu_hugepage_buffer_type_context * ctx = &buft_ctx[n_buft];
+    ctx->page_size = page_size;
+    ctx->numa_node = numa_node;
+    const char * prefix = page_size > 0 ? "CPU_HP" : "CPU";
+    if (numa_node == GGML_NUMA_NODE_INTERLEAVE) {
+        snprintf(ctx->name, sizeof(ctx->name), "%s_IL", prefix);
+    } else if (numa_node >= 0) {
+        snprintf(ctx->name, sizeof(ctx->name), "%s_N%d", prefix, numa_node);
+    } else {
+        snprintf(ctx->name, sizeof(ctx->name), "%s", prefix);
+    }
+
+    buft[n_buft] = (struct ggml_backend_buffer_type) {
+        /* .iface    = */ {
+            /* .get_name         = */ ggml_backend_cpu_hugepage_buffer_type_get_name,
+            /* .alloc_buffer     = */ ggml_backend_cpu_hugepage_buffer_type_alloc_buffer,
+            /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+            /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+            /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+            /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+        },
+        /* .context  = */ ctx,
+    };
+
+    return &buft[n_buft++];
+}
+
+#else
+
+size_t ggml_backend_cpu_default_hugepage_size(void) {
+    return 0;
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node) {
+    return ggml_backend_cpu_buffer_type();
+
+    GGML_UNUSED(page_size);
+    GGML_UNUSED(numa_node);
+}
+
+#endif
+
 struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
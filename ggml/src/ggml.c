@@ -2793,9 +2793,30 @@ struct ggml_compute_params {
     size_t wsize;
     void * wdata;
 
+    // work buffer for the src1 of matrix multiplications converted to vec_dot_type
+    // it is not used by other ops, so the conversion of src1_conv can be reused by the following
+    // matrix multiplications with the same src1 (e.g. Q, K and V or ffn_up and ffn_gate)
+    size_t wsize_src1;
+    void * wdata_src1;
+
+    const struct ggml_tensor * src1_conv;
+    enum ggml_type             src1_conv_type;
+
     struct ggml_compute_state_shared * shared;
 };
 
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a_data = (const char *) a->data;
+    const char * b_data = (const char *) b->data;
+    return a_data < b_data + ggml_nbytes(b) && b_data < a_data + ggml_nbytes(a);
+}
+
+static bool ggml_src1_is_converted(const struct ggml_compute_params * params, const struct ggml_tensor * src1, enum ggml_type vec_dot_type) {
+    const struct ggml_tensor * conv = params->src1_conv;
+    return conv && params->src1_conv_type == vec_dot_type && conv->data == src1->data && conv->type == src1->type &&
+        ggml_are_same_shape(conv, src1) && ggml_are_same_stride(conv, src1);
+}
+
 //
 // fundamental operations
 //
@@ -3649,6 +3670,18 @@ static void ggml_vec_tanh_f32(const int n, float * y, const float * x) {
     }
 }
 
+// the number of elements ggml_vec_softcap_f32() and ggml_vec_cpy_softcap_f32() compute at once,
+// the elements after the last full step are computed with tanhf()
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+#define GGML_SOFTCAP_STEP 16
+#elif defined(__AVX2__) && defined(__FMA__)
+#define GGML_SOFTCAP_STEP 8
+#elif defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+#define GGML_SOFTCAP_STEP 4
+#else
+#define GGML_SOFTCAP_STEP 1
+#endif
+
 static void ggml_vec_cpy_softcap_f32(const int n, const float * x, float * y, float s_before, float s_after) {
     int i = 0;
 #if defined(__AVX512F__) && defined(__AVX512DQ__)
@@ -4049,6 +4082,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
     "ARGSORT_THRESH",
+    "TOP_K_LSE",
     "LEAKY_RELU",
     "SOFTCAP",
     "SOFT_CAP_MAX",
@@ -4079,7 +4113,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4144,6 +4178,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
     "argsort_thresh(x)",
+    "top_k_lse(x)",
     "leaky_relu(x)",
     "k2*tanh(k1*x)",
     "soft_max(k2*tanh(k1*x))",
@@ -4174,7 +4209,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 81, "GGML_OP_COUNT != 81");
+static_assert(GGML_OP_COUNT == 82, "GGML_OP_COUNT != 82");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4405,6 +4440,66 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+int ggml_numa_n_nodes(void) {
+    return g_state.numa.n_nodes;
+}
+
+bool ggml_numa_can_shard(void) {
+    return ggml_is_numa() && g_state.numa.numa_strategy == GGML_NUMA_STRATEGY_DISTRIBUTE;
+}
+
+void ggml_numa_shard_rows(int64_t nrows, int node, int n_nodes, int64_t * first, int64_t * last) {
+    GGML_ASSERT(node >= 0 && node < n_nodes);
+    // the remainder of rows not filling a GGML_NUMA_SHARD_ROWS block goes to the last node,
+    // so partition boundaries are always a multiple of the row interleaving of repacked types
+    const int64_t nblocks = nrows/GGML_NUMA_SHARD_ROWS;
+    *first = GGML_NUMA_SHARD_ROWS*(nblocks*node/n_nodes);
+    *last  = node == n_nodes - 1 ? nrows : GGML_NUMA_SHARD_ROWS*(nblocks*(node + 1)/n_nodes);
+}
+
+#if defined(__gnu_linux__)
+// from <numaif.h>, which is only available with libnuma installed
+#define GGML_MPOL_BIND     2
+#define GGML_MPOL_MF_MOVE  (1 << 1)
+#endif
+
+bool ggml_numa_shard_tensor(struct ggml_tensor * tensor) {
+#if defined(__gnu_linux__)
+    const int n_nodes = g_state.numa.n_nodes;
+    if (!ggml_numa_can_shard() || tensor->data == NULL || !ggml_is_contiguous(tensor) ||
+        tensor->ne[1] < GGML_NUMA_SHARD_ROWS*n_nodes) {
+        return false;
+    }
+
+    const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    const int64_t n_mat = tensor->ne[2]*tensor->ne[3];
+    for (int64_t i = 0; i < n_mat; ++i) {
+        const uintptr_t base = (uintptr_t)tensor->data + i*tensor->nb[2];
+        for (int node = 0; node < n_nodes; ++node) {
+            int64_t first, last;
+            ggml_numa_shard_rows(tensor->ne[1], node, n_nodes, &first, &last);
+            // pages straddling a partition boundary go to the node owning the start of the page
+            uintptr_t start = (base + first*tensor->nb[1]) & ~(page_size - 1);
+            uintptr_t end   = base + last*tensor->nb[1];
+            end = node == n_nodes - 1 ? (end + page_size - 1) & ~(page_size - 1) : end & ~(page_size - 1);
+            if (end <= start) {
+                continue;
+            }
+            unsigned long mask = 1ul << node;
+            if (syscall(SYS_mbind, (void *)start, end - start, GGML_MPOL_BIND, &mask, 8*sizeof(mask), GGML_MPOL_MF_MOVE) != 0) {
+                GGML_PRINT_DEBUG("%s: mbind(%s, node %d) failed: %s\n", __func__, tensor->name, node, strerror(errno));
+                return false;
+            }
+        }
+    }
+    tensor->flags |= GGML_TENSOR_FLAG_NUMA_SHARD;
+    return true;
+#else
+    UNUSED(tensor);
+    return false;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -6092,7 +6187,7 @@ static struct ggml_tensor * ggml_fused_mul_unary_impl(
         enum ggml_unary_op   op,
         bool inplace) {
     GGML_ASSERT(ggml_are_same_shape(b, a));
-    GGML_ASSERT(ggml_is_contiguous(a));
+    GGML_ASSERT(ggml_is_contiguous_1(a) && ggml_is_contiguous_1(b));
     GGML_ASSERT(op == GGML_UNARY_OP_GELU || op == GGML_UNARY_OP_RELU || op == GGML_UNARY_OP_SILU);
 
     bool is_node = false;
@@ -8755,6 +8850,29 @@ struct ggml_tensor * ggml_top_k_thresh(
     return result;
 }
 
+// ggml_top_k_lse
+
+struct ggml_tensor * ggml_top_k_lse(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   k) {
+    GGML_ASSERT(a->type == GGML_TYPE_F32);
+    GGML_ASSERT(k > 0 && a->ne[0] >= k);
+    GGML_ASSERT(a->ne[0] <= (1 << 24)); // the indices are stored as float
+
+    bool is_node = false;
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, 2*k + 1, a->ne[1], a->ne[2], a->ne[3]);
+
+    ggml_set_op_params_i32(result, 0, k);
+
+    result->op   = GGML_OP_TOP_K_LSE;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+
+    return result;
+}
+
 // ggml_flash_attn_ext
 
 struct ggml_tensor * ggml_flash_attn_ext(
@@ -13753,7 +13871,7 @@ static void ggml_compute_forward_fused_mul_unary_f32(
     const struct ggml_tensor * src1 = dst->src[1];
     enum ggml_unary_op op = (enum ggml_unary_op)dst->op_params[0];
 
-    GGML_ASSERT(ggml_is_contiguous_1(src0));
+    GGML_ASSERT(ggml_is_contiguous_1(src0) && ggml_is_contiguous_1(src1));
     GGML_ASSERT(ggml_are_same_shape(src0, dst));
     GGML_ASSERT(ggml_are_same_shape(src0, src1));
     GGML_ASSERT(op == GGML_UNARY_OP_GELU || op == GGML_UNARY_OP_RELU || op == GGML_UNARY_OP_SILU);
@@ -14514,7 +14632,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
         return;
     }
 
-    const void * wdata = (src1->type == vec_dot_type) ? src1->data : (char *)params->wdata;
+    const void * wdata = (src1->type == vec_dot_type) ? src1->data : (char *)params->wdata_src1;
     const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
     assert(ne12 % ne02 == 0);
@@ -14548,7 +14666,7 @@ static void ggml_compute_forward_mul_mat_one_chunk(
                 const char * src0_row = (const char*)src0->data + (0 + i02 * nb02 + i03 * nb03);
 
                 // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                //       if it is, then we have either copied the data to params->wdata_src1 and made it contiguous or we are using
                 //       the original src1 data pointer, so we should index using the indices directly
                 // TODO: this is a bit of a hack, we should probably have a better way to handle this
                 const char * src1_col = (const char*)wdata +
@@ -14581,9 +14699,124 @@ static inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     return a;
 }
 
-static void ggml_compute_forward_mul_mat(
-        const struct ggml_compute_params * params,
-              struct ggml_tensor * dst) {
+#if GGML_USE_IQK_MULMAT
+// A matrix multiplication followed by an element-wise operation on its result (adding a bias or a residual,
+// scaling, softcap). Each thread computes the next node on the tile of the result it has just written,
+// while it is still in cache, and the barrier between the two nodes is not needed. The result of the
+// matrix multiplication is still stored for its other consumers.
+struct ggml_mul_mat_epilogue {
+    const struct ggml_tensor * mm;
+    struct ggml_tensor       * next;
+    const struct ggml_tensor * other; // the other operand of GGML_OP_ADD
+};
+
+static bool ggml_mul_mat_epilogue_init(struct ggml_mul_mat_epilogue * ep) {
+    const struct ggml_tensor * mm   = ep->mm;
+    const struct ggml_tensor * next = ep->next;
+
+    if (!next || mm->type != GGML_TYPE_F32 || next->type != GGML_TYPE_F32) {
+        return false;
+    }
+    if (mm->src[0]->ne[2] != 1 || mm->src[0]->ne[3] != 1 || mm->ne[2] != 1 || mm->ne[3] != 1) {
+        return false;
+    }
+    if (!ggml_is_contiguous(mm) || !ggml_is_contiguous(next) || !ggml_are_same_shape(mm, next)) {
+        return false;
+    }
+    // the other threads are still reading the inputs of the matrix multiplication
+    if (ggml_tensors_overlap(next, mm->src[0]) || ggml_tensors_overlap(next, mm->src[1])) {
+        return false;
+    }
+    if (next->data != mm->data && ggml_tensors_overlap(next, mm)) {
+        return false;
+    }
+
+    switch (next->op) {
+        case GGML_OP_ADD:
+            {
+                const struct ggml_tensor * other = next->src[0] == mm ? next->src[1] : next->src[1] == mm ? next->src[0] : NULL;
+                if (!other || other->type != GGML_TYPE_F32 || other->nb[0] != sizeof(float) || other->ne[0] != mm->ne[0] ||
+                    (other->ne[1] != 1 && other->ne[1] != mm->ne[1]) || other->ne[2] != 1 || other->ne[3] != 1) {
+                    return false;
+                }
+                if (other != mm && ggml_tensors_overlap(other, mm)) {
+                    return false;
+                }
+                ep->other = other;
+                return true;
+            }
+        case GGML_OP_SCALE:
+        case GGML_OP_SOFTCAP:
+            return next->src[0] == mm;
+        default:
+            return false;
+    }
+}
+
+// softcap of the elements [ix0, ix0 + nx) of a row of ne0 elements, with the same results as ggml_vec_softcap_f32()
+// on the whole row: the elements before the last full step of the row are computed with the vector function, even
+// when the tile does not start or end at a multiple of the step
+static void ggml_mul_mat_epilogue_softcap(int64_t nx, int64_t ix0, int64_t ne0, const float * x, float * y, float s_before, float s_after) {
+    const int64_t n_vec = MIN(ix0 + nx, ne0 - ne0 % GGML_SOFTCAP_STEP) - ix0;
+    const int64_t n_full = n_vec > 0 ? n_vec - n_vec % GGML_SOFTCAP_STEP : 0;
+
+    ggml_vec_cpy_softcap_f32(n_full, x, y, s_before, s_after);
+    if (n_vec > n_full) {
+        float tmp[GGML_SOFTCAP_STEP] = { 0.0f };
+        memcpy(tmp, x + n_full, (n_vec - n_full)*sizeof(float));
+        ggml_vec_softcap_f32(GGML_SOFTCAP_STEP, tmp, s_before, s_after);
+        memcpy(y + n_full, tmp, (n_vec - n_full)*sizeof(float));
+    }
+    const int64_t n_done = MAX(n_vec, 0);
+    ggml_vec_cpy_softcap_f32(nx - n_done, x + n_done, y + n_done, s_before, s_after);
+}
+
+static void ggml_mul_mat_epilogue_f32(void * ctx, const float * C, long nx, long ny) {
+    const struct ggml_mul_mat_epilogue * ep = ctx;
+    const struct ggml_tensor * mm   = ep->mm;
+    const struct ggml_tensor * next = ep->next;
+
+    // the first row and column of the tile
+    const int64_t offs = C - (const float *) mm->data;
+    const int64_t ix0  = offs % (mm->nb[1]/sizeof(float));
+    const int64_t iy0  = offs / (mm->nb[1]/sizeof(float));
+
+    for (long iy = iy0; iy < iy0 + ny; ++iy) {
+        const float * x = (const float *)((const char *) mm->data   + iy*mm->nb[1])   + ix0;
+        float       * y = (float       *)((char       *) next->data + iy*next->nb[1]) + ix0;
+        switch (next->op) {
+            case GGML_OP_ADD:
+                {
+                    const struct ggml_tensor * other = ep->other;
+                    const float * z = (const float *)((const char *) other->data + (other->ne[1] == 1 ? 0 : iy*other->nb[1])) + ix0;
+                    ggml_vec_add_f32(nx, y, x, z);
+                } break;
+            case GGML_OP_SCALE:
+                {
+                    float v;
+                    memcpy(&v, next->op_params, sizeof(float));
+                    if (y != x) {
+                        memcpy(y, x, nx*sizeof(float));
+                    }
+                    ggml_vec_scale_f32(nx, y, v);
+                } break;
+            case GGML_OP_SOFTCAP:
+                {
+                    float val[2];
+                    memcpy(val, next->op_params, sizeof(val));
+                    ggml_mul_mat_epilogue_softcap(nx, ix0, mm->ne[0], x, y, val[0], val[1]);
+                } break;
+            default:
+                GGML_ABORT("fatal error");
+        }
+    }
+}
+#endif
+
+static bool ggml_compute_forward_mul_mat(
+        struct ggml_compute_params * params,
+              struct ggml_tensor * dst,
+              struct ggml_tensor * next) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -14631,13 +14864,21 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
 #if GGML_USE_IQK_MULMAT
+    // threads only process the rows that live on their own node
+    const int n_numa_shards = (src0->flags & GGML_TENSOR_FLAG_NUMA_SHARD) && ggml_numa_can_shard() ? (int)g_state.numa.n_nodes : 1;
+    // the next node may be computed by the threads on their part of the result
+    struct ggml_mul_mat_epilogue epilogue = { dst, next, NULL };
+    const bool fuse_next = ggml_mul_mat_epilogue_init(&epilogue);
+    const iqk_mul_mat_epilogue_t epilogue_func = fuse_next ? ggml_mul_mat_epilogue_f32 : NULL;
     if (dst->type == GGML_TYPE_F32) {
-        if (iqk_mul_mat_4d(ne01, ne11, ne00,
+        if (iqk_mul_mat_4d_numa(ne01, ne11, ne00,
                     ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2/sizeof(float), nb3/sizeof(float),
                     src0->type, src0->data, nb01,
                     src1->type, src1->data, nb11,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return;
+                    (float *)dst->data, nb1/sizeof(float), epilogue_func, &epilogue, n_numa_shards, ith, nth)) return fuse_next;
     }
+#else
+    GGML_UNUSED(next);
 #endif
 
 #if GGML_USE_LLAMAFILE
@@ -14659,13 +14900,13 @@ static void ggml_compute_forward_mul_mat(
                                      src1->type,
                                      dst->type))
                     goto UseGgmlGemm1;
-        return;
+        return false;
     }
 UseGgmlGemm1:;
 #endif
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    if (src1->type != vec_dot_type && !ggml_src1_is_converted(params, src1, vec_dot_type)) {
+        char * wdata = params->wdata_src1;
 
 #if IK_PRINT_TIMING
         int64_t t1 = ggml_time_us();
@@ -14675,11 +14916,11 @@ UseGgmlGemm1:;
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
+        assert(params->wsize_src1 >= ne13*nbw3);
         if (src1->type != GGML_TYPE_F32) {
 #if GGML_USE_IQK_MULMAT
-            char * work_buffer = wdata + ne13*nbw3 + ith*ne10*sizeof(float);
-            GGML_ASSERT(params->wsize >= ne13*nbw3 + nth*ne10*sizeof(float));
+            char * work_buffer = (char *)params->wdata + ith*ne10*sizeof(float);
+            GGML_ASSERT(params->wsize >= nth*ne10*sizeof(float));
             iqk_quantize_any(src1->type, vec_dot_type, ne10, ne11, ne12, ne13, nb10, nb11, nb12, nb13,
                     src1->data, wdata, work_buffer, type_traits[src1->type].to_float, from_float, ith, nth);
 #else
@@ -14736,6 +14977,9 @@ UseGgmlGemm1:;
 
         ggml_barrier(params->shared);
 
+        params->src1_conv      = src1;
+        params->src1_conv_type = vec_dot_type;
+
 #if IK_PRINT_TIMING
         int64_t t2 = ggml_time_us();
         if (ith == 0) printf("quantize(%s): %d us\n", dst->name, (int)(t2 - t1));
@@ -14749,17 +14993,17 @@ UseGgmlGemm1:;
         ggml_barrier(params->shared);
     }
 
-    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata_src1;
 
 #if GGML_USE_IQK_MULMAT
     if (src1->type != vec_dot_type && dst->type == GGML_TYPE_F32) {
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
-        if (iqk_mul_mat_4d(ne01, ne11, ne00,
+        if (iqk_mul_mat_4d_numa(ne01, ne11, ne00,
                     ne02, ne03, ne12, ne13, nb02, nb03, row_size*ne11, row_size*ne11*ne12,
                     nb2/sizeof(float), nb3/sizeof(float),
                     src0->type, src0->data, nb01,
                     vec_dot_type, wdata, row_size,
-                    (float *)dst->data, nb1/sizeof(float), ith, nth)) return;
+                    (float *)dst->data, nb1/sizeof(float), epilogue_func, &epilogue, n_numa_shards, ith, nth)) return fuse_next;
     }
 #endif
 
@@ -14781,7 +15025,7 @@ UseGgmlGemm1:;
                                      vec_dot_type,
                                      dst->type))
                     goto UseGgmlGemm2;
-        return;
+        return false;
     }
 UseGgmlGemm2:;
 #endif
@@ -14833,13 +15077,13 @@ UseGgmlGemm2:;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
     if ((ggml_n_dims(src0) == 2) && gemv) {
-        const void * src1_wdata      = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+        const void * src1_wdata      = (src1->type == vec_dot_type) ? src1->data : params->wdata_src1;
         const size_t src1_col_stride = ggml_is_contiguous(src1) || src1->type != vec_dot_type ? ggml_row_size(vec_dot_type, ne10) : nb11;
         int64_t src0_start = (ith * ne01) / nth;
         int64_t src0_end   = ((ith + 1) * ne01) / nth;
         src0_start = (src0_start % matmul_num_cols) ? src0_start + matmul_num_cols - (src0_start % matmul_num_cols): src0_start;
         src0_end   = (src0_end   % matmul_num_cols) ? src0_end   + matmul_num_cols - (src0_end   % matmul_num_cols): src0_end;
-        if (src0_start >= src0_end) return;
+        if (src0_start >= src0_end) return false;
 
         // If there are more than three rows in src1, use gemm; otherwise, use gemv.
         if (gemm && (ne11 > 3)) {
@@ -14851,7 +15095,7 @@ UseGgmlGemm2:;
                  (const char *) src0->data + src0_start * nb01, (const char *) src1_wdata + (src1_col_stride * iter), 1,
                  src0_end - src0_start);
         }
-        return;
+        return false;
     }
 
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
@@ -14875,12 +15119,14 @@ UseGgmlGemm2:;
 
         current_chunk = atomic_fetch_add(&params->shared->current_chunk, 1);
     }
+
+    return false;
 }
 
 // ggml_compute_forward_mul_mat_id
 
 static void ggml_compute_forward_mul_mat_id(
-        const struct ggml_compute_params * params,
+        struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
 
     const struct ggml_tensor * src0 = dst->src[0];
@@ -14916,26 +15162,22 @@ static void ggml_compute_forward_mul_mat_id(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
-    char * wdata_src1_end = (src1->type == vec_dot_type) ?
-            (char *) params->wdata :
-            (char *) params->wdata + GGML_PAD(ggml_row_size(vec_dot_type, src1->ne[0])*ggml_nrows(src1), sizeof(int64_t));
-
     struct mmid_row_mapping {
         int32_t i1;
         int32_t i2;
     };
 
-    int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
+    int64_t * matrix_row_counts = (int64_t *) (params->wdata); // [n_as]
     struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
 
-    if (src1->type != vec_dot_type) {
-        char * wdata = params->wdata;
+    if (src1->type != vec_dot_type && !ggml_src1_is_converted(params, src1, vec_dot_type)) {
+        char * wdata = params->wdata_src1;
 
         const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
+        assert(params->wsize_src1 >= ne13*nbw3);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
         for (int64_t i13 = 0; i13 < ne13; ++i13) {
@@ -14947,6 +15189,10 @@ static void ggml_compute_forward_mul_mat_id(
                 }
             }
         }
+
+        // made visible to the other threads by the barrier after grouping the rows
+        params->src1_conv      = src1;
+        params->src1_conv_type = vec_dot_type;
     }
 
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
@@ -14993,7 +15239,7 @@ static void ggml_compute_forward_mul_mat_id(
 
         const char * src0_cur = (const char *) src0->data + cur_a*nb02;
 
-        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata_src1;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
         const int64_t nr0 = ne01; // src0 rows
@@ -15112,7 +15358,7 @@ IQK_MulMat_Not_Available:;
                     const int64_t  i2 = i12; // row
 
                     // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                    //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                    //       if it is, then we have either copied the data to params->wdata_src1 and made it contiguous or we are using
                     //       the original src1 data pointer, so we should index using the indices directly
                     // TODO: this is a bit of a hack, we should probably have a better way to handle this
                     const char * src1_col = (const char *) wdata +
@@ -15141,7 +15387,7 @@ IQK_MulMat_Not_Available:;
 
 #if GGML_USE_IQK_MULMAT
 static void ggml_compute_forward_mul_mat_id_up_gate(
-        const struct ggml_compute_params * params,
+        struct ggml_compute_params * params,
               struct ggml_tensor * dst) {
 
     GGML_ASSERT(dst->src[0]->type == dst->src[1]->type);
@@ -15178,29 +15424,25 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
     const int n_ids = ids->ne[0]; // n_expert_used
     const int n_as  = ne02;       // n_expert
 
-    char * wdata_src1_end = (src1->type == vec_dot_type) ?
-            (char *) params->wdata :
-            (char *) params->wdata + GGML_PAD(ggml_row_size(vec_dot_type, src1->ne[0])*ggml_nrows(src1), sizeof(int64_t));
-
     struct mmid_row_mapping {
         int32_t i1;
         int32_t i2;
     };
 
-    int64_t * matrix_row_counts = (int64_t *) (wdata_src1_end); // [n_as]
+    int64_t * matrix_row_counts = (int64_t *) (params->wdata); // [n_as]
     struct mmid_row_mapping * matrix_rows = (struct mmid_row_mapping *)(matrix_row_counts + n_as); // [n_as][ne11]
 
-    if (src1->type != vec_dot_type) {
+    if (src1->type != vec_dot_type && !ggml_src1_is_converted(params, src1, vec_dot_type)) {
 
         ggml_from_float_t const from_float = type_traits[vec_dot_type].from_float;
 
-        char * wdata = params->wdata;
+        char * wdata = params->wdata_src1;
 
         const size_t nbw1 = ggml_row_size(vec_dot_type, ne10);
         const size_t nbw2 = nbw1*ne11;
         const size_t nbw3 = nbw2*ne12;
 
-        assert(params->wsize >= ne13*nbw3);
+        assert(params->wsize_src1 >= ne13*nbw3);
         GGML_ASSERT(src1->type == GGML_TYPE_F32);
 
         for (int64_t i13 = 0; i13 < ne13; ++i13) {
@@ -15212,6 +15454,10 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
                 }
             }
         }
+
+        // made visible to the other threads by the barrier after grouping the rows
+        params->src1_conv      = src1;
+        params->src1_conv_type = vec_dot_type;
     }
 
 #define MMID_MATRIX_ROW(row_id, i1) matrix_rows[(row_id)*ne12 + (i1)]
@@ -15262,7 +15508,7 @@ static void ggml_compute_forward_mul_mat_id_up_gate(
         const char * src0_1_cur = (const char *) src0_1->data + cur_a*nb02;
         const char * src0_2_cur = (const char *) src0_2->data + cur_a*nb02;
 
-        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+        const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata_src1;
         const size_t row_size = ggml_row_size(vec_dot_type, ne10);
 
         const int64_t nr0 = ne01; // src0 rows
@@ -17308,6 +17554,56 @@ static void ggml_compute_forward_rope(
     }
 }
 
+// a ROPE followed by a CPY of its result (typically into the K cache): each thread converts the rows it has
+// just rotated, as ggml_compute_forward_rope_f32() partitions them, while they are still in cache
+static bool ggml_compute_forward_rope_cpy(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * rope,
+        struct ggml_tensor * next) {
+
+    if (!next || next->op != GGML_OP_CPY || next->src[0] != rope) {
+        return false;
+    }
+    if (rope->type != GGML_TYPE_F32 || rope->src[0]->type != GGML_TYPE_F32 || !ggml_is_contiguous(rope) || !ggml_is_contiguous(next)) {
+        return false;
+    }
+    if (ggml_nelements(next) != ggml_nelements(rope) || rope->ne[0] % ggml_blck_size(next->type) != 0 || ggml_packed_rows(next->type) != 1) {
+        return false;
+    }
+    if (next->type != GGML_TYPE_F32 && !type_traits[next->type].from_float) {
+        return false;
+    }
+    // the other threads are still reading the inputs of the rope
+    for (int j = 0; j < 3; ++j) {
+        if (rope->src[j] && ggml_tensors_overlap(next, rope->src[j])) {
+            return false;
+        }
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nr = ggml_nrows(rope);
+    const int dr = (nr + nth - 1)/nth;
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    const int64_t ne0 = rope->ne[0];
+    const size_t  rs  = ggml_row_size(next->type, ne0);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        const float * x = (const float *)((const char *) rope->data + ir*rope->nb[1]);
+        char        * y = (char *) next->data + ir*rs;
+        if (next->type == GGML_TYPE_F32) {
+            memcpy(y, x, ne0*sizeof(float));
+        } else {
+            type_traits[next->type].from_float(x, y, ne0);
+        }
+    }
+
+    return true;
+}
+
 // ggml_compute_forward_rope_back
 
 static void ggml_compute_forward_rope_back(
@@ -18283,6 +18579,106 @@ static void ggml_compute_forward_argsort_thresh(
     }
 }
 
+// ggml_compute_forward_top_k_lse
+
+// min-heap of indices into x, the root is the worst of the kept entries (lowest value, highest index on ties)
+static inline bool ggml_top_k_worse(const float * x, int32_t a, int32_t b) {
+    return x[a] < x[b] || (x[a] == x[b] && a > b);
+}
+
+static void ggml_top_k_sift_down(int32_t * heap, int n, int i, const float * x) {
+    for (;;) {
+        int l = 2*i + 1;
+        if (l >= n) {
+            break;
+        }
+        if (l + 1 < n && ggml_top_k_worse(x, heap[l + 1], heap[l])) {
+            ++l;
+        }
+        if (!ggml_top_k_worse(x, heap[l], heap[i])) {
+            break;
+        }
+        int32_t tmp = heap[i]; heap[i] = heap[l]; heap[l] = tmp;
+        i = l;
+    }
+}
+
+static void ggml_compute_forward_top_k_lse_f32(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int k = ggml_get_op_params_i32(dst, 0);
+
+    float   * wp   = (float *) params->wdata + (ne00 + k + CACHE_LINE_SIZE_F32) * ith;
+    int32_t * heap = (int32_t *)(wp + ne00);
+
+    const int64_t nr = ggml_nrows(src0);
+
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const int64_t i03 = ir/(ne02*ne01);
+        const int64_t i02 = (ir - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (ir - i03*ne02*ne01 - i02*ne01);
+
+        const float * x = (const float *)((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+        float       * y = (float       *)((      char *)  dst->data + i01*nb1  + i02*nb2  + i03*nb3);
+
+        for (int j = 0; j < k; ++j) {
+            heap[j] = j;
+        }
+        for (int j = k/2 - 1; j >= 0; --j) {
+            ggml_top_k_sift_down(heap, k, j, x);
+        }
+        for (int32_t j = k; j < ne00; ++j) {
+            if (x[j] > x[heap[0]]) {
+                heap[0] = j;
+                ggml_top_k_sift_down(heap, k, 0, x);
+            }
+        }
+
+        // heap sort: moving the worst entry to the back leaves the best one in front
+        for (int n = k - 1; n > 0; --n) {
+            int32_t tmp = heap[0]; heap[0] = heap[n]; heap[n] = tmp;
+            ggml_top_k_sift_down(heap, n, 0, x);
+        }
+
+        const float max = x[heap[0]];
+        ggml_float sum = max == -INFINITY ? 0.0 : ggml_vec_soft_max_f32(ne00, wp, x, max);
+
+        for (int j = 0; j < k; ++j) {
+            y[j]     = (float) heap[j];
+            y[k + j] = x[heap[j]];
+        }
+        y[2*k] = sum > 0 ? max + (float) log(sum) : -INFINITY;
+    }
+}
+
+static void ggml_compute_forward_top_k_lse(
+    const struct ggml_compute_params * params,
+    struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_top_k_lse_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_flash_attn_ext
 
 static void ggml_compute_forward_flash_attn_ext_f16(
@@ -19857,7 +20253,6 @@ static void ggml_compute_forward_cross_entropy_loss_back(
 
 static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor, struct ggml_tensor * next) {
     GGML_ASSERT(params);
-    GGML_UNUSED(next);
 
     if (tensor->op == GGML_OP_NONE || ggml_is_empty(tensor)) {
         return false;
@@ -19971,7 +20366,7 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_MUL_MAT:
             {
-                ggml_compute_forward_mul_mat(params, tensor);
+                skip_next = ggml_compute_forward_mul_mat(params, tensor, next);
             } break;
         case GGML_OP_MUL_MAT_ID:
             {
@@ -20056,6 +20451,7 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
         case GGML_OP_ROPE:
             {
                 ggml_compute_forward_rope(params, tensor);
+                skip_next = ggml_compute_forward_rope_cpy(params, tensor, next);
             } break;
         case GGML_OP_ROPE_BACK:
             {
@@ -20109,6 +20505,10 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort_thresh(params, tensor);
             } break;
+        case GGML_OP_TOP_K_LSE:
+            {
+                ggml_compute_forward_top_k_lse(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -21098,6 +21498,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
             }
+        case GGML_OP_TOP_K_LSE:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_LEAKY_RELU:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -21819,6 +22223,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
         case GGML_OP_ARGSORT_THRESH:
+        case GGML_OP_TOP_K_LSE:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -21903,6 +22308,7 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
     }
 
     size_t work_size = 0;
+    size_t work_size_src1 = 0;
 
     struct ggml_cplan cplan;
     memset(&cplan, 0, sizeof(struct ggml_cplan));
@@ -21948,9 +22354,9 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
 
                     if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                        work_size_src1 = MAX(work_size_src1, ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]));
                         if (node->src[1]->type != GGML_TYPE_F32) {
-                            cur += n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
+                            cur = n_tasks*node->src[1]->ne[0]*sizeof(float); // src1->type -> f32 -> vec_dot_type
                         }
                     }
                 } break;
@@ -21961,10 +22367,9 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     const struct ggml_tensor * src1 = node->src[1];
                     const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
                     if (src1->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                        work_size_src1 = MAX(work_size_src1, ggml_row_size(vec_dot_type, src1->ne[0]) * ggml_nrows(src1));
                     }
                     const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src1->ne[2] * sizeof(int64_t); // matrix_rows
                 } break;
@@ -21975,10 +22380,9 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     const struct ggml_tensor * src2 = node->src[2];
                     const enum ggml_type vec_dot_type = type_traits[src0->type].vec_dot_type;
                     if (src2->type != vec_dot_type) {
-                        cur += ggml_row_size(vec_dot_type, node->src[1]->ne[0]) * ggml_nrows(node->src[1]);
+                        work_size_src1 = MAX(work_size_src1, ggml_row_size(vec_dot_type, src2->ne[0]) * ggml_nrows(src2));
                     }
                     const int n_as = src0->ne[2];
-                    cur += GGML_PAD(cur, sizeof(int64_t));       // align
                     cur += n_as * sizeof(int64_t);               // matrix_row_counts
                     cur += n_as * src2->ne[2] * sizeof(int64_t); // matrix_rows
                 } break;
@@ -21989,10 +22393,17 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
                     }
                 } break;
             case GGML_OP_SOFT_MAX:
+            case GGML_OP_SOFT_CAP_MAX:
             case GGML_OP_ROPE:
                 {
                     cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
                 } break;
+            case GGML_OP_TOP_K_LSE:
+                {
+                    // exp buffer + heap of k indices per thread
+                    const int k = ggml_get_op_params_i32(node, 0);
+                    cur = sizeof(float) * (node->src[0]->ne[0] + k + CACHE_LINE_SIZE_F32) * n_tasks;
+                } break;
             case GGML_OP_CONV_TRANSPOSE_1D:
                 {
                     GGML_ASSERT(node->src[0]->ne[3] == 1);
@@ -22128,8 +22539,12 @@ struct ggml_cplan ggml_graph_plan(const struct ggml_cgraph * cgraph, int n_threa
         work_size += CACHE_LINE_SIZE*(n_threads - 1);
     }
 
+    // the converted src1 of matrix multiplications goes in front of the work buffer of the other ops
+    work_size_src1 = GGML_PAD(work_size_src1, CACHE_LINE_SIZE);
+
     cplan.n_threads = MIN(max_tasks, n_threads);
-    cplan.work_size = work_size;
+    cplan.work_size = work_size_src1 + work_size;
+    cplan.work_size_src1 = work_size_src1;
     cplan.work_data = NULL;
 
     return cplan;
@@ -22144,11 +22559,15 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     set_numa_thread_affinity(state->ith);
 
     struct ggml_compute_params params = {
-        /*.ith   =*/ state->ith,
-        /*.nth   =*/ state->shared->n_threads,
-        /*.wsize =*/ cplan->work_size,
-        /*.wdata =*/ cplan->work_data,
-        /*.shared=*/ state->shared,
+        /*.ith           =*/ state->ith,
+        /*.nth           =*/ state->shared->n_threads,
+        /*.wsize         =*/ cplan->work_size - cplan->work_size_src1,
+        /*.wdata         =*/ cplan->work_data ? cplan->work_data + cplan->work_size_src1 : NULL,
+        /*.wsize_src1    =*/ cplan->work_size_src1,
+        /*.wdata_src1    =*/ cplan->work_data,
+        /*.src1_conv     =*/ NULL,
+        /*.src1_conv_type=*/ GGML_TYPE_COUNT,
+        /*.shared        =*/ state->shared,
     };
 
 #if IK_PRINT_TIMING
@@ -22164,8 +22583,19 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 #if IK_PRINT_TIMING
         int64_t tim1 = ggml_time_us();
 #endif
-        if (ggml_compute_forward(&params, node, node_n < cgraph->n_nodes-1 ? cgraph->nodes[node_n+1] : NULL)) {
-            ++node_n;
+        // views in between do not prevent computing the next node together with this one
+        int next_n = node_n + 1;
+        while (next_n < cgraph->n_nodes && ggml_is_noop(cgraph->nodes[next_n])) {
+            ++next_n;
+        }
+        if (ggml_compute_forward(&params, node, next_n < cgraph->n_nodes ? cgraph->nodes[next_n] : NULL)) {
+            node_n = next_n;
+        }
+
+        // the converted src1 can no longer be reused once a node wrote to it
+        if (params.src1_conv && (ggml_tensors_overlap(node, params.src1_conv) ||
+                                 ggml_tensors_overlap(cgraph->nodes[node_n], params.src1_conv))) {
+            params.src1_conv = NULL;
         }
 #if IK_PRINT_TIMING
         int64_t tim2 = ggml_time_us();
@@ -486,15 +486,17 @@ extern "C" IQK_API int iqk_dequant_type(int type, int Ny) {
     return MulMat::is_dequant_better(ggml_type(type), Ny);
 }
 
-extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
+// Ny_all is the number of columns of the whole product when the threads also split the columns of B,
+// so that all of them choose the same kernels
+static bool iqk_mul_mat_impl(long Nx, long Ny, long ne00,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
-        float * C, long stride_C, int ith, int nth) {
+        float * C, long stride_C, iqk_mul_mat_epilogue_t epilogue, void * epilogue_ctx, int ith, int nth, long Ny_all) {
 
     MulMat mm;
 
     auto etypeA = ggml_type(typeA);
-    if (auto dequant_type = MulMat::is_dequant_better(etypeA, Ny); dequant_type != etypeA) {
+    if (auto dequant_type = MulMat::is_dequant_better(etypeA, Ny_all); dequant_type != etypeA) {
         if (!MulMat::prepare(dequant_type, typeB, ne00, mm, Ny)) {
             return false;
         }
@@ -527,6 +529,7 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
                 GGML_ABORT("Fatal error");
             }
             mm.mul_mat_NxM(ne00, f.data(), row_size_qx, this_info, this_nrc_x, Ny);
+            if (epilogue) epilogue(epilogue_ctx, this_info.s, this_nrc_x, Ny);
         }
 
         return true;
@@ -551,9 +554,18 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
 
     mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x*num_rows, row_size_qx, info, nrc_x*num_rows, Ny);
 
+    if (epilogue && nrc_x > 0) epilogue(epilogue_ctx, info.s, nrc_x*num_rows, Ny);
+
     return true;
 }
 
+extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
+    return iqk_mul_mat_impl(Nx, Ny, ne00, typeA, A, strideA, typeB, B, strideB, C, stride_C, nullptr, nullptr, ith, nth, Ny);
+}
+
 namespace {
 inline uint32_t simple_gcd(uint32_t a, uint32_t b) {
     while (a != b) {
@@ -569,11 +581,34 @@ extern "C" IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
         long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
-        float * C, long stride_C, int ith, int nth) {
+        float * C, long stride_C, iqk_mul_mat_epilogue_t epilogue, void * epilogue_ctx, int ith, int nth) {
 
     auto r2 = ne12 / ne02;
     auto r3 = ne13 / ne03;
 
+    if (epilogue) {
+        GGML_ASSERT(ne02 == 1 && ne03 == 1 && ne12 == 1 && ne13 == 1);
+        // with fewer blocks of rows than threads, the threads also split the columns of B (in multiples of IQK_MAX_NY),
+        // and each one calls the epilogue with its own tile of the result
+        auto dequant_type = MulMat::is_dequant_better(ggml_type(typeA), Ny);
+        auto num_rows = MulMat::num_rows(dequant_type);
+        int nth_x = std::max(1, (int)std::min<long>(nth, Nx/num_rows));
+        int nth_y = (int)std::min<long>(nth/nth_x, (Ny + IQK_MAX_NY - 1)/IQK_MAX_NY);
+        if (nth_y <= 1) {
+            return iqk_mul_mat_impl(Nx, Ny, ne00, typeA, A, strideA, typeB, B, strideB, C, stride_C, epilogue, epilogue_ctx, ith, nth, Ny);
+        }
+        // the threads without a tile must return the same as the others
+        MulMat mm;
+        if (!MulMat::prepare(dequant_type, typeB, ne00, mm, Ny)) return false;
+        if (ith >= nth_x*nth_y) return true;
+        long ny  = IQK_MAX_NY*((Ny + IQK_MAX_NY*nth_y - 1)/(IQK_MAX_NY*nth_y));
+        long iy0 = (ith/nth_x)*ny;
+        if (iy0 >= Ny) return true;
+        if (iy0 + ny > Ny) ny = Ny - iy0;
+        return iqk_mul_mat_impl(Nx, ny, ne00, typeA, A, strideA, typeB, (const char *)B + iy0*strideB, strideB,
+                C + iy0*stride_C, stride_C, epilogue, epilogue_ctx, ith%nth_x, nth_x, Ny);
+    }
+
     if (ne13 == 1 && Ny == 1 && r2 > 1) {
         if (Nx >= 256 && Nx%32 == 0) {
             int nx32 = Nx/32;
@@ -653,6 +688,29 @@ extern "C" IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
     return true;
 }
 
+extern "C" IQK_API bool iqk_mul_mat_4d_numa(long Nx, long Ny, long ne00,
+        long ne02, long ne03, long ne12, long ne13,
+        long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, iqk_mul_mat_epilogue_t epilogue, void * epilogue_ctx, int n_nodes, int ith, int nth) {
+
+    if (n_nodes < 2 || nth < n_nodes) {
+        return iqk_mul_mat_4d(Nx, Ny, ne00, ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2, nb3,
+                typeA, A, strideA, typeB, B, strideB, C, stride_C, epilogue, epilogue_ctx, ith, nth);
+    }
+
+    int node = ith % n_nodes;
+    int nth_node = (nth - node + n_nodes - 1)/n_nodes;
+    int64_t first, last;
+    ggml_numa_shard_rows(Nx, node, n_nodes, &first, &last);
+
+    // all row offsets below are relative to the row index in A and C, so we simply shift both
+    return iqk_mul_mat_4d(last - first, Ny, ne00, ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2, nb3,
+            typeA, (const char *)A + first*strideA, strideA, typeB, B, strideB, C + first, stride_C, epilogue, epilogue_ctx,
+            ith/n_nodes, nth_node);
+}
+
 extern "C" IQK_API bool iqk_mul_mat_moe(long Nx, long Ny, long ne00, int ne11,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
@@ -1236,7 +1294,17 @@ extern "C" IQK_API bool iqk_mul_mat_4d(long /*Nx*/, long /*Ny*/, long /*ne00*/,
         long /*nb02*/, long /*nb03*/, long /*nb12*/, long /*nb13*/, long /*nb2*/, long /*nb3*/,
         int /*typeA*/, const void * /*A*/, long /*strideA*/,
         int /*typeB*/, const void * /*B*/, long /*strideB*/,
-        float * /*C*/, long /*stride_C*/, int /*ith*/, int /*nth*/) {
+        float * /*C*/, long /*stride_C*/, iqk_mul_mat_epilogue_t /*epilogue*/, void * /*epilogue_ctx*/, int /*ith*/, int /*nth*/) {
+    GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
+    return false;
+}
+
+extern "C" IQK_API bool iqk_mul_mat_4d_numa(long /*Nx*/, long /*Ny*/, long /*ne00*/,
+        long /*ne02*/, long /*ne03*/, long /*ne12*/, long /*ne13*/,
+        long /*nb02*/, long /*nb03*/, long /*nb12*/, long /*nb13*/, long /*nb2*/, long /*nb3*/,
+        int /*typeA*/, const void * /*A*/, long /*strideA*/,
+        int /*typeB*/, const void * /*B*/, long /*strideB*/,
+        float * /*C*/, long /*stride_C*/, iqk_mul_mat_epilogue_t /*epilogue*/, void * /*epilogue_ctx*/, int /*n_nodes*/, int /*ith*/, int /*nth*/) {
     GGML_ABORT("Unsupported CPU. You may need to manually set compilation flags\n");
     return false;
 }
@@ -17,12 +17,27 @@ IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
         int typeB, const void * B, long strideB,
         float * C, long stride_C, int ith, int nth);
 
+// Called by a thread with a tile of the result it has just computed: nx consecutive rows of A times ny consecutive
+// columns of B, starting at C (with the stride of the result). Used to apply element-wise operations on the result
+// while it is still in cache.
+typedef void (*iqk_mul_mat_epilogue_t)(void * ctx, const float * C, long nx, long ny);
+
+// The epilogue may be NULL. It is only supported when A and B are 2D (ne02 = ne03 = ne12 = ne13 = 1).
 IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
         long ne02, long ne03, long ne12, long ne13,
         long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
-        float * C, long stride_C, int ith, int nth);
+        float * C, long stride_C, iqk_mul_mat_epilogue_t epilogue, void * epilogue_ctx, int ith, int nth);
+
+// Same as iqk_mul_mat_4d, but with the rows of A partitioned between n_nodes NUMA nodes as per ggml_numa_shard_rows().
+// Thread ith is assumed to be pinned to node ith % n_nodes and only processes the rows of that node's partition.
+IQK_API bool iqk_mul_mat_4d_numa(long Nx, long Ny, long ne00,
+        long ne02, long ne03, long ne12, long ne13,
+        long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, iqk_mul_mat_epilogue_t epilogue, void * epilogue_ctx, int n_nodes, int ith, int nth);
 
 IQK_API bool iqk_mul_mat_moe(long Nx, long Ny, long ne00, int ne11,
         int typeA, const void * A, long strideA,
@@ -30,6 +30,7 @@
 #include <atomic>
 #include <unordered_map>
 #include <string>
+#include <type_traits>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -8018,13 +8019,23 @@ public:
         }
     }
 private:
+    using value_type = std::conditional_t<is_int, int8_t, float>;
+    // index of the point closest to x (in the w weighted L2 norm) among the npoint points stored (transposed) in values
+    template <typename T>
+    static inline int find_closest(int npoint, const T * values, const float * x, const float * w);
+    template <typename T>
+    static std::vector<T> transpose_points(int npoint, const float * values);
     static std::vector<float> cluster_points(const std::vector<float>& points, int ncluster, int niter, float * mid);
     static std::vector<std::vector<int>> finalize_clusters(int num_neighbours, const std::vector<float>& points, const std::vector<float>& clusters,
             std::vector<std::vector<float>>& c_values);
     std::vector<float> m_values;
     std::vector<float> m_clusters;
     std::vector<std::vector<int>> m_in_cluster;
-    std::vector<std::vector<float>> m_c_values;
+    // The points searched by find_best_match, transposed and padded for find_closest. With is_int all values are
+    // integers in [-126, 126] and are stored as int8_t, so that the points of a cluster fit into the L1 cache.
+    std::vector<value_type> m_values_t;
+    std::vector<std::vector<value_type>> m_c_values_t;
+    std::vector<float> m_clusters_t;
     float m_mid[4*kGroupSize];
 };
 
@@ -8042,7 +8053,28 @@ QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::QuantizerIQKT(i
     //       at the expense of almost doubling the quantization time.
     m_clusters = cluster_points(m_values, num_clusters, 200, m_mid);
     GGML_ASSERT(!m_clusters.empty());
-    m_in_cluster = finalize_clusters(num_neighbours, m_values, m_clusters, m_c_values);
+    std::vector<std::vector<float>> c_values;
+    m_in_cluster = finalize_clusters(num_neighbours, m_values, m_clusters, c_values);
+    m_values_t = transpose_points<value_type>(kNumVal, m_values.data());
+    m_c_values_t.resize(c_values.size());
+    for (int i = 0; i < int(c_values.size()); ++i) {
+        m_c_values_t[i] = transpose_points<value_type>(c_values[i].size()/kGroupSize, c_values[i].data());
+    }
+    m_clusters_t = transpose_points<float>(m_clusters.size()/kGroupSize, m_clusters.data());
+}
+
+template <int block_size, int group_size, int num_bits, bool is_abs, bool is_int>
+template <typename T>
+std::vector<T> QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::transpose_points(int npoint, const float * values) {
+    // The number of points is padded to a multiple of 16 with copies of the last point. Because find_closest returns
+    // the lowest index among equal scores, a copy is never selected over the original.
+    int npad = 16*((npoint + 15)/16);
+    std::vector<T> result(kGroupSize*npad);
+    for (int j = 0; j < npad; ++j) {
+        auto v = values + kGroupSize*std::min(j, npoint-1);
+        for (int k = 0; k < kGroupSize; ++k) result[k*npad + j] = T(v[k]);
+    }
+    return result;
 }
 
 template <int block_size, int group_size, int num_bits, bool is_abs, bool is_int>
@@ -8064,6 +8096,19 @@ std::pair<float, float> QuantizerIQKT<block_size, group_size, num_bits, is_abs,
     }
     sumqx = hsum_float_8(vqx);
     sumq2 = hsum_float_8(vq2);
+#elif defined __ARM_NEON
+    auto vqx = vdupq_n_f32(0.f);
+    auto vq2 = vdupq_n_f32(0.f);
+    for (int l = 0; l < kBlockSize; l += 4) {
+        auto vx = vld1q_f32(xb+l);
+        auto vw = vld1q_f32(weight+l);
+        auto vq = vld1q_f32(m_values.data() + kGroupSize*best_idx[l/kGroupSize] + l%kGroupSize);
+        auto vqw = vmulq_f32(vq, vw);
+        vqx = vfmaq_f32(vqx, vqw, vx);
+        vq2 = vfmaq_f32(vq2, vqw, vq);
+    }
+    sumqx = vaddvq_f32(vqx);
+    sumq2 = vaddvq_f32(vq2);
 #else
     for (int l = 0; l < kNg; ++l) {
         auto xl = xb + kGroupSize*l;
@@ -8097,6 +8142,19 @@ float QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_best
     }
     sumqx = hsum_float_8(vqx);
     sumx2 = hsum_float_8(vx2);
+#elif defined __ARM_NEON
+    auto vqx = vdupq_n_f32(0.f);
+    auto vx2 = vdupq_n_f32(0.f);
+    for (int l = 0; l < kBlockSize; l += 4) {
+        auto vx = vld1q_f32(xb+l);
+        auto vw = vld1q_f32(weight+l);
+        auto vq = vld1q_f32(m_values.data() + kGroupSize*best_idx[l/kGroupSize] + l%kGroupSize);
+        auto vxw = vmulq_f32(vx, vw);
+        vx2 = vfmaq_f32(vx2, vxw, vx);
+        vqx = vfmaq_f32(vqx, vxw, vq);
+    }
+    sumqx = vaddvq_f32(vqx);
+    sumx2 = vaddvq_f32(vx2);
 #else
     for (int l = 0; l < kNg; ++l) {
         auto xl = xb + kGroupSize*l;
@@ -8111,6 +8169,143 @@ float QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_best
     return sumx2 > 0 ? sumqx/sumx2 : 0.f;
 }
 
+#ifdef __AVX512F__
+static inline __m512 load_16_values(const float  * v) { return _mm512_loadu_ps(v); }
+static inline __m512 load_16_values(const int8_t * v) { return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128((const __m128i *)v))); }
+#endif
+#ifdef __AVX2__
+static inline __m256 load_8_values(const float  * v) { return _mm256_loadu_ps(v); }
+static inline __m256 load_8_values(const int8_t * v) { return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)v))); }
+#elif defined __ARM_NEON
+static inline void load_8_values(const float * v, float32x4_t * r) {
+    r[0] = vld1q_f32(v);
+    r[1] = vld1q_f32(v + 4);
+}
+static inline void load_8_values(const int8_t * v, float32x4_t * r) {
+    auto i16 = vmovl_s8(vld1_s8(v));
+    r[0] = vcvtq_f32_s32(vmovl_s16(vget_low_s16(i16)));
+    r[1] = vcvtq_f32_s32(vmovl_s16(vget_high_s16(i16)));
+}
+#endif
+
+template <int block_size, int group_size, int num_bits, bool is_abs, bool is_int>
+template <typename T>
+int QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_closest(int npoint, const T * values, const float * x, const float * w) {
+    // values holds the points transposed, i.e., coordinate k of point j is values[k*npoint + j], and npoint is a multiple
+    // of 16. This allows to compute the scores of 16 (8, 4) points at once without horizontal sums.
+    // Ties are resolved in favor of the point with the lower index.
+    int jbest = -1;
+    float best = INFINITY;
+#ifdef __AVX512F__
+    __m512 vx[kGroupSize], vw[kGroupSize];
+    for (int k = 0; k < kGroupSize; ++k) {
+        vx[k] = _mm512_set1_ps(x[k]);
+        vw[k] = _mm512_set1_ps(w[k]);
+    }
+    auto vbest = _mm512_set1_ps(INFINITY);
+    auto best_index = _mm512_set1_epi32(-1);
+    auto idx = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    auto add16 = _mm512_set1_epi32(16);
+    for (int j = 0; j < npoint; j += 16) {
+        auto vdiff = _mm512_sub_ps(load_16_values(values + j), vx[0]);
+        auto score = _mm512_mul_ps(vw[0], _mm512_mul_ps(vdiff, vdiff));
+        for (int k = 1; k < kGroupSize; ++k) {
+            vdiff = _mm512_sub_ps(load_16_values(values + k*npoint + j), vx[k]);
+            score = _mm512_fmadd_ps(_mm512_mul_ps(vw[k], vdiff), vdiff, score);
+        }
+        auto mask = _mm512_cmp_ps_mask(score, vbest, _CMP_LT_OQ);
+        best_index = _mm512_mask_mov_epi32(best_index, mask, idx);
+        vbest = _mm512_mask_mov_ps(vbest, mask, score);
+        idx = _mm512_add_epi32(idx, add16);
+    }
+    float sx[16];
+    int   index[16];
+    _mm512_storeu_ps(sx, vbest);
+    _mm512_storeu_si512((__m512i *)index, best_index);
+    for (int i = 0; i < 16; ++i) {
+        if (sx[i] < best || (sx[i] == best && index[i] < jbest)) { best = sx[i]; jbest = index[i]; }
+    }
+#elif defined __AVX2__
+    __m256 vx[kGroupSize], vw[kGroupSize];
+    for (int k = 0; k < kGroupSize; ++k) {
+        vx[k] = _mm256_set1_ps(x[k]);
+        vw[k] = _mm256_set1_ps(w[k]);
+    }
+    auto vbest = _mm256_set1_ps(INFINITY);
+    auto best_index = _mm256_set1_epi32(-1);
+    auto idx = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    auto add8 = _mm256_set1_epi32(8);
+    for (int j = 0; j < npoint; j += 8) {
+        auto vdiff = _mm256_sub_ps(load_8_values(values + j), vx[0]);
+        auto score = _mm256_mul_ps(vw[0], _mm256_mul_ps(vdiff, vdiff));
+        for (int k = 1; k < kGroupSize; ++k) {
+            vdiff = _mm256_sub_ps(load_8_values(values + k*npoint + j), vx[k]);
+            score = _mm256_fmadd_ps(_mm256_mul_ps(vw[k], vdiff), vdiff, score);
+        }
+        auto mask  = _mm256_cmp_ps(score, vbest, _CMP_LT_OQ);
+        best_index = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(mask), idx),
+                _mm256_andnot_si256(_mm256_castps_si256(mask), best_index));
+        vbest = _mm256_min_ps(vbest, score);
+        idx = _mm256_add_epi32(idx, add8);
+    }
+    float sx[8];
+    int   index[8];
+    _mm256_storeu_ps(sx, vbest);
+    _mm256_storeu_si256((__m256i *)index, best_index);
+    for (int i = 0; i < 8; ++i) {
+        if (sx[i] < best || (sx[i] == best && index[i] < jbest)) { best = sx[i]; jbest = index[i]; }
+    }
+#elif defined __ARM_NEON
+    // 8 points per iteration
+    float32x4_t vx[kGroupSize], vw[kGroupSize];
+    for (int k = 0; k < kGroupSize; ++k) {
+        vx[k] = vdupq_n_f32(x[k]);
+        vw[k] = vdupq_n_f32(w[k]);
+    }
+    float32x4_t vbest[2] = {vdupq_n_f32(INFINITY), vdupq_n_f32(INFINITY)};
+    uint32x4_t best_index[2] = {vdupq_n_u32(-1), vdupq_n_u32(-1)};
+    const uint32_t k_idx[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    uint32x4_t idx[2] = {vld1q_u32(k_idx), vld1q_u32(k_idx + 4)};
+    auto add8 = vdupq_n_u32(8);
+    float32x4_t vq[2];
+    for (int j = 0; j < npoint; j += 8) {
+        float32x4_t score[2] = {vdupq_n_f32(0.f), vdupq_n_f32(0.f)};
+        for (int k = 0; k < kGroupSize; ++k) {
+            load_8_values(values + k*npoint + j, vq);
+            for (int i = 0; i < 2; ++i) {
+                auto vdiff = vsubq_f32(vq[i], vx[k]);
+                score[i] = vfmaq_f32(score[i], vmulq_f32(vw[k], vdiff), vdiff);
+            }
+        }
+        for (int i = 0; i < 2; ++i) {
+            auto mask = vcltq_f32(score[i], vbest[i]);
+            best_index[i] = vbslq_u32(mask, idx[i], best_index[i]);
+            vbest[i] = vbslq_f32(mask, score[i], vbest[i]);
+            idx[i] = vaddq_u32(idx[i], add8);
+        }
+    }
+    float sx[8];
+    int   index[8];
+    for (int i = 0; i < 2; ++i) {
+        vst1q_f32(sx + 4*i, vbest[i]);
+        vst1q_s32(index + 4*i, vreinterpretq_s32_u32(best_index[i]));
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (sx[i] < best || (sx[i] == best && index[i] < jbest)) { best = sx[i]; jbest = index[i]; }
+    }
+#else
+    for (int j = 0; j < npoint; ++j) {
+        float score = 0;
+        for (int k = 0; k < kGroupSize; ++k) {
+            float diff = values[k*npoint + j] - x[k];
+            score += w[k]*diff*diff;
+        }
+        if (score < best) { best = score; jbest = j; }
+    }
+#endif
+    return jbest;
+}
+
 template <int block_size, int group_size, int num_bits, bool is_abs, bool is_int>
 void QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_best_match(float d, const float * xb, const float * weight, int * best_idx) const {
     if (!d) {
@@ -8119,22 +8314,14 @@ void QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_best_
     }
     int ncluster = m_clusters.size()/kGroupSize;
     float id = 1/d;
-#ifdef __AVX2__
-    if constexpr (kGroupSize == 8) {
-        __m256 sqx[8];
-        const __m256i add_idx = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
-        float sx[8];
-        int   index[8];
-        auto vid = _mm256_set1_ps(id);
-        auto add8 = _mm256_set1_epi32(8);
-        for (int l = 0; l < kNg; ++l) {
-            auto xl = xb + 8*l;
-            auto wl = weight + 8*l;
-            auto vx = _mm256_mul_ps(vid, _mm256_loadu_ps(xl));
-            auto vw = _mm256_loadu_ps(wl);
-            int jbest = -1;
-            if (kGroupSize == 8 && (ncluster == 256 || ncluster == 6561)) {
-                _mm256_store_ps(sx, vx);
+    float sx[kGroupSize];
+    for (int l = 0; l < kNg; ++l) {
+        auto xl = xb + kGroupSize*l;
+        auto wl = weight + kGroupSize*l;
+        for (int k = 0; k < kGroupSize; ++k) sx[k] = id*xl[k];
+        int jbest = -1;
+        if constexpr (kGroupSize == 8) {
+            if (ncluster == 256 || ncluster == 6561) {
                 uint16_t u = 0;
                 if (ncluster == 256) {
                     for (int j = 0; j < 8; ++j) if (sx[j] > m_mid[j]) u |= (1 << j);
@@ -8144,150 +8331,42 @@ void QuantizerIQKT<block_size, group_size, num_bits, is_abs, is_int>::find_best_
                 }
                 jbest = u;
             } else {
-                auto vbest = _mm256_set1_ps(INFINITY);
-                auto best_index = _mm256_set1_epi32(-1);
-                float best = INFINITY;
-                auto idx = add_idx;
-                for (int j = 0; j < ncluster; j += 8) {
-                    for (int i = 0; i < 8; ++i) {
-                        auto vq = _mm256_loadu_ps(m_clusters.data() + kGroupSize*(j+i));
-                        auto vdiff = _mm256_sub_ps(vq, vx);
-                        sqx[i] = _mm256_mul_ps(vw, _mm256_mul_ps(vdiff, vdiff));
-                    }
-                    auto score = hsum_float_8x8(sqx);
-                    auto mask  = _mm256_cmp_ps(score, vbest, _CMP_LT_OQ);
-                    best_index = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(mask), idx),
-                            _mm256_andnot_si256(_mm256_castps_si256(mask), best_index));
-                    vbest = _mm256_min_ps(vbest, score);
-                    idx = _mm256_add_epi32(idx, add8);
-                }
-                _mm256_store_ps(sx, vbest);
-                _mm256_store_si256((__m256i *)index, best_index);
-                for (int i = 0; i < 8; ++i) {
-                    if (sx[i] < best) { best = sx[i]; jbest = index[i]; }
-                }
-            }
-            auto& points = m_in_cluster[jbest];
-            auto& values = points.empty() ? m_values : m_c_values[jbest];
-            int npoint = values.size()/kGroupSize;
-            GGML_ASSERT(npoint > 0 && npoint%8 == 0);
-            int jbest_cluster = jbest;
-            auto vbest = _mm256_set1_ps(INFINITY);
-            auto best_index = _mm256_set1_epi32(-1);
-            auto best = INFINITY; jbest = -1;
-            auto idx = add_idx;
-            for (int j = 0; j < npoint; j += 8) {
-                for (int i = 0; i < 8; ++i) {
-                    auto vq = _mm256_loadu_ps(values.data() + kGroupSize*(j+i));
-                    auto vdiff = _mm256_sub_ps(vq, vx);
-                    sqx[i] = _mm256_mul_ps(vw, _mm256_mul_ps(vdiff, vdiff));
-                }
-                auto score = hsum_float_8x8(sqx);
-                auto mask  = _mm256_cmp_ps(score, vbest, _CMP_LT_OQ);
-                best_index = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(mask), idx),
-                        _mm256_andnot_si256(_mm256_castps_si256(mask), best_index));
-                vbest = _mm256_min_ps(vbest, score);
-                idx = _mm256_add_epi32(idx, add8);
+                jbest = find_closest(m_clusters_t.size()/kGroupSize, m_clusters_t.data(), sx, wl);
             }
-            _mm256_store_ps(sx, vbest);
-            _mm256_store_si256((__m256i *)index, best_index);
-            for (int i = 0; i < 8; ++i) {
-                if (sx[i] < best) { best = sx[i]; jbest = index[i]; }
-            }
-            if (jbest < 0) {
-                fprintf(stderr, "Oops: jbest = %d for cluster %d with %d points\n", jbest, jbest_cluster, int(points.size()));
-                GGML_ASSERT(false);
-            }
-            best_idx[l] = points.empty() ? jbest : points[jbest];
-        }
-    } else {
-        __m256 sqx[4];
-        const __m256i add_idx = _mm256_set_epi32(7, 5, 3, 1, 6, 4, 2, 0);
-        const __m256 sign_bit = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
-        float sx[8];
-        int   index[8];
-        auto vid_p = _mm256_set1_ps(id);
-        auto add8 = _mm256_set1_epi32(8);
-        for (int l = 0; l < kNg; ++l) {
-            auto xl = xb + 4*l;
-            auto wl = weight + 4*l;
-            auto vx4 = _mm_loadu_ps(xl);
-            auto vx = _mm256_mul_ps(vid_p, _mm256_set_m128(vx4, vx4));
-            auto vw4 = _mm_loadu_ps(wl);
-            auto vw = _mm256_set_m128(vw4, vw4);
-            int jbest = -1;
+        } else {
             if (ncluster == 256 || ncluster == 625) {
-                _mm256_storeu_ps(sx, vx);
                 uint16_t u = 0;
                 if (ncluster == 256) {
                     for (int k = 0; k < 4; ++k) u |= (bin4(sx[k]) << 2*k);
                 } else {
-                    int l = 1;
-                    for (int k = 0; k < 4; ++k) { u += bin5(sx[k])*l; l *= 5; }
+                    int s = 1;
+                    for (int k = 0; k < 4; ++k) { u += bin5(sx[k])*s; s *= 5; }
                 }
                 jbest = u;
             } else {
-                auto vbest = _mm256_set1_ps(INFINITY);
-                auto best_index = _mm256_set1_epi32(-1);
+                // clusters of 4 values are selected with the weighted |q - x|^3 distance
                 float best = INFINITY;
-                auto idx = add_idx;
-                for (int j = 0; j < ncluster; j += 8) {
-                    for (int i = 0; i < 4; ++i) {
-                        auto vq = _mm256_loadu_ps(m_clusters.data() + kGroupSize*(j+2*i));
-                        auto vdiff = _mm256_sub_ps(vq, vx);
-                        vdiff = _mm256_and_ps(sign_bit, vdiff);
-                        sqx[i] = _mm256_mul_ps(vw, _mm256_mul_ps(vdiff, _mm256_mul_ps(vdiff, vdiff)));
+                for (int j = 0; j < ncluster; ++j) {
+                    auto vc = m_clusters.data() + kGroupSize*j;
+                    float score = 0;
+                    for (int k = 0; k < kGroupSize; ++k) {
+                        float diff = std::abs(vc[k] - sx[k]);
+                        score += wl[k]*diff*diff*diff;
                     }
-                    auto score = hsum_float_4x8(sqx);
-                    auto mask  = _mm256_cmp_ps(score, vbest, _CMP_LT_OQ);
-                    best_index = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(mask), idx),
-                            _mm256_andnot_si256(_mm256_castps_si256(mask), best_index));
-                    vbest = _mm256_min_ps(vbest, score);
-                    idx = _mm256_add_epi32(idx, add8);
-                }
-                _mm256_store_ps(sx, vbest);
-                _mm256_store_si256((__m256i *)index, best_index);
-                for (int i = 0; i < 8; ++i) {
-                    if (sx[i] < best) { best = sx[i]; jbest = index[i]; }
-                }
-            }
-            auto& points = m_in_cluster[jbest];
-            auto& values = m_c_values[jbest];
-            GGML_ASSERT(!points.empty() && points.size()%8 == 0);
-            int jbest_cluster = jbest;
-            auto vbest = _mm256_set1_ps(INFINITY);
-            auto best_index = _mm256_set1_epi32(-1);
-            float best = INFINITY; jbest = -1;
-            auto idx = add_idx;
-            for (int j = 0; j < int(points.size()); j += 8) {
-                for (int i = 0; i < 4; ++i) {
-                    auto vq = _mm256_loadu_ps(values.data() + kGroupSize*(j+2*i));
-                    auto vdiff = _mm256_sub_ps(vq, vx);
-                    sqx[i] = _mm256_mul_ps(vw, _mm256_mul_ps(vdiff, vdiff));
+                    if (score < best) { best = score; jbest = j; }
                 }
-                auto score = hsum_float_4x8(sqx);
-                auto mask  = _mm256_cmp_ps(score, vbest, _CMP_LT_OQ);
-                best_index = _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(mask), idx),
-                                       _mm256_andnot_si256(_mm256_castps_si256(mask), best_index));
-                vbest = _mm256_min_ps(vbest, score);
-                idx = _mm256_add_epi32(idx, add8);
-            }
-            _mm256_store_ps(sx, vbest);
-            _mm256_store_si256((__m256i *)index, best_index);
-            for (int i = 0; i < 8; ++i) {
-                if (sx[i] < best) { best = sx[i]; jbest = index[i]; }
             }
-            if (jbest < 0) {
-                fprintf(stderr, "Oops: jbest = %d for cluster %d with %d points\n", jbest, jbest_cluster, int(points.size()));
-                GGML_ASSERT(false);
-            }
-            best_idx[l] = points[jbest];
         }
+        auto& points = m_in_cluster[jbest];
+        auto& values = points.empty() ? m_values_t : m_c_values_t[jbest];
+        int jbest_cluster = jbest;
+        jbest = find_closest(values.size()/kGroupSize, values.data(), sx, wl);
+        if (jbest < 0) {
+            fprintf(stderr, "Oops: jbest = %d for cluster %d with %d points\n", jbest, jbest_cluster, int(points.size()));
+            GGML_ASSERT(false);
+        }
+        best_idx[l] = points.empty() ? jbest : points[jbest];
     }
-#else
-    // TODO
-    std::memset(best_idx, 0, kNg*sizeof(int));
-#endif
 }
 
 template <int block_size, int group_size, int num_bits, bool is_abs, bool is_int>
@@ -592,6 +592,16 @@ class TensorNameMap:
         MODEL_TENSOR.ENC_OUTPUT_NORM: (
             "encoder.final_layer_norm", # t5
         ),
+
+        MODEL_TENSOR.CLS: (
+            "pooler.dense",     # bert
+            "classifier.dense", # roberta
+        ),
+
+        MODEL_TENSOR.CLS_OUT: (
+            "classifier",          # bert jina-bert-v2
+            "classifier.out_proj", # roberta
+        ),
     }
 
     # architecture-specific block mappings
@@ -45,12 +45,17 @@
 #define LLAMA_FILE_MAGIC_GGLA 0x67676c61u // 'ggla'
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 #define LLAMA_FILE_MAGIC_GGSQ 0x67677371u // 'ggsq'
+#define LLAMA_FILE_MAGIC_GGSZ 0x6767737au // 'ggsz'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 8
 
-#define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
-#define LLAMA_STATE_SEQ_VERSION 2
+#define LLAMA_STATE_SEQ_MAGIC    LLAMA_FILE_MAGIC_GGSQ
+#define LLAMA_STATE_SEQ_MAGIC_LZ LLAMA_FILE_MAGIC_GGSZ // LZ compressed sequence state
+#define LLAMA_STATE_SEQ_VERSION  2
+
+// flags for llama_state_seq_save_file_ext
+#define LLAMA_STATE_SEQ_FLAGS_COMPRESS 1 // compress the KV cache data
 
 #ifdef __cplusplus
 extern "C" {
@@ -68,6 +73,7 @@ extern "C" {
     typedef int32_t llama_pos;
     typedef int32_t llama_token;
     typedef int32_t llama_seq_id;
+    typedef uint32_t llama_state_seq_flags;
 
     enum llama_vocab_type {
         LLAMA_VOCAB_TYPE_NONE = 0, // For models without vocab
@@ -255,6 +261,7 @@ extern "C" {
         LLAMA_POOLING_TYPE_MEAN = 1,
         LLAMA_POOLING_TYPE_CLS  = 2,
         LLAMA_POOLING_TYPE_LAST = 3,
+        LLAMA_POOLING_TYPE_RANK = 4, // used by reranking models to attach the classification head to the graph
     };
 
     enum llama_attention_type {
@@ -263,6 +270,13 @@ extern "C" {
         LLAMA_ATTENTION_TYPE_NON_CAUSAL  = 1,
     };
 
+    // NUMA placement of the CPU KV cache and compute buffers
+    enum llama_numa_mem_policy {
+        LLAMA_NUMA_MEM_POLICY_NONE       = 0, // first touch
+        LLAMA_NUMA_MEM_POLICY_INTERLEAVE = 1, // interleave the pages over all nodes
+        LLAMA_NUMA_MEM_POLICY_BIND       = 2, // bind the KV cache of consecutive layers to the same node, compute buffers are interleaved
+    };
+
     enum llama_split_mode {
         LLAMA_SPLIT_MODE_NONE    = 0, // single GPU
         LLAMA_SPLIT_MODE_LAYER   = 1, // split layers and KV across GPUs
@@ -338,6 +352,13 @@ extern "C" {
         ggml_backend_buffer_type_t buft;
     };
 
+    // KV cache type of the layers whose index matches pattern, see llama_context_params.kv_type_overrides
+    struct llama_kv_type_override {
+        const char * pattern;  // regex that has to match the whole layer index, e.g. "0|1|4[67]"
+        enum ggml_type type_k; // GGML_TYPE_COUNT = keep llama_context_params.type_k
+        enum ggml_type type_v; // GGML_TYPE_COUNT = keep llama_context_params.type_v
+    };
+
     struct llama_model_params {
         int32_t n_gpu_layers; // number of layers to store in VRAM
         int32_t mla;          // MLA implementation to use (only applicable to DeepSeek models at this point)
@@ -375,6 +396,8 @@ extern "C" {
         bool check_tensors; // validate model tensor data
         bool repack_tensors;// repack if available
         bool use_thp;       // uase transparent huge pages (linux only)
+        bool numa_shard;    // partition the rows of CPU weight matrices between NUMA nodes (requires GGML_NUMA_STRATEGY_DISTRIBUTE)
+        bool fuse_weights;  // concatenate Q/K/V and ffn_gate/ffn_up weights of the same type, so that each is one matrix multiplication
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -408,6 +431,17 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        // per-layer K/V cache types, terminated by an entry with a NULL pattern (the first matching entry wins)
+        const struct llama_kv_type_override * kv_type_overrides;
+
+        enum ggml_type kv_swap_type; // store swapped out f16/bf16/f32 K/V data as this type, GGML_TYPE_COUNT = unchanged
+        const char *   kv_swap_path; // file for the swapped out sequences, NULL = host memory
+
+        int32_t huge_page_size;              // huge page size in MiB for the CPU KV cache and compute buffers, 0 = regular pages, -1 = system default
+        enum llama_numa_mem_policy numa_mem; // NUMA placement of the CPU KV cache and compute buffers
+
+        int32_t n_top_logits; // if > 0, the graph also computes the top n_top_logits logits of each output, see llama_get_top_logits_ith
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool logits_all;  // the llama_decode() call computes all logits, not just the last one (DEPRECATED - set llama_batch.logits instead)
         bool embeddings;  // if true, extract embeddings (together with logits)
@@ -416,6 +450,9 @@ extern "C" {
         int  mla_attn;    // whether to use MLA attention [EXPERIMENTAL]
         int  attn_max_batch;    // maximum batch size for attention computations [EXPERIMENTAL]
         bool fused_moe_up_gate; // whether to use fused MoE up/down op [EXPERIMENTAL]
+        bool graph_reuse;       // evaluate the graph of the previous ubatch again when the next one has the same shape
+        bool swa_full;          // keep all n_ctx positions for the sliding window attention layers instead of only the window
+        bool kv_swap;           // swap out the least recently used sequences when the KV cache is full, see llama_kv_cache_seq_swap_out
         int  min_experts;
         float thresh_experts;
 
@@ -448,6 +485,7 @@ extern "C" {
         bool keep_split;                     // quantize to the same number of shards
         bool ignore_imatrix_rules;           // If set to true, the built-in rules for refusing to quantize into certain quants without imatrix are ignored
         bool only_repack;                    // Only repack tensors
+        bool fuse_weights;                   // store Q/K/V and ffn_gate/ffn_up as one tensor (attn_qkv, ffn_gate_up) if they have the same type
         void * imatrix;                      // pointer to importance matrix data
         void * kv_overrides;                 // pointer to vector containing overrides
         void * custom_quants;                // pointer to vector containing custom quantization rules
@@ -503,6 +541,8 @@ extern "C" {
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+
+        int32_t n_graph_reuse; // number of ubatches that evaluated the graph of the previous ubatch again
     };
 
     // used in chat template
@@ -567,10 +607,14 @@ extern "C" {
 
     LLAMA_API int32_t llama_n_vocab    (const struct llama_model * model);
     LLAMA_API const struct llama_vocab* llama_get_model_vocab(const struct llama_model* model);
+    LLAMA_API int32_t llama_vocab_n_tokens(const struct llama_vocab * vocab);
     LLAMA_API int32_t llama_n_ctx_train(const struct llama_model * model);
     LLAMA_API int32_t llama_n_embd     (const struct llama_model * model);
     LLAMA_API int32_t llama_n_layer    (const struct llama_model * model);
 
+    // Number of past positions a token attends to in the sliding window (or chunked) attention layers, 0 if there are none
+    LLAMA_API int32_t llama_n_swa      (const struct llama_model * model);
+
     // Get the model's RoPE frequency scaling factor
     LLAMA_API float llama_rope_freq_scale_train(const struct llama_model * model);
 
@@ -642,6 +686,21 @@ extern "C" {
     LLAMA_API void llama_lora_adapter_clear(
             struct llama_context * ctx);
 
+    // Use a loaded LoRA adapter for the tokens of one sequence only, in addition to the adapters added with
+    // llama_lora_adapter_set. Tokens of different sequences in the same batch can use different adapters.
+    // A sequence has at most one such adapter, a NULL adapter removes it. Tokens that belong to several
+    // sequences use the adapter of their first seq_id. Not applied to the MoE expert tensors.
+    // Return -1 on error
+    LLAMA_API int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale);
+
+    // Remove the per-sequence LoRA adapters of all sequences
+    LLAMA_API void llama_lora_adapter_seq_clear(
+            struct llama_context * ctx);
+
     // Manually free a LoRA adapter
     // Note: loaded adapters will be free when the associated model is deleted
     LLAMA_API void llama_lora_adapter_free(struct llama_lora_adapter * adapter);
@@ -781,6 +840,33 @@ extern "C" {
             struct llama_context * ctx,
                     llama_seq_id   seq_id);
 
+    // Returns the smallest position present in the KV cache of all layers for the specified sequence, -1 if it is empty
+    // The sliding window attention layers only keep the last llama_n_swa() positions of a sequence (unless
+    // llama_context_params.swa_full is set), so the sequence can only be continued from a position p with
+    // llama_kv_cache_seq_pos_min() <= max(0, p - llama_n_swa() + 1)
+    LLAMA_API llama_pos llama_kv_cache_seq_pos_min(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Moves the cells of the specified sequence out of the KV cache into host memory (or the file set with
+    // llama_context_params.kv_swap_path) and frees them. Returns false if the sequence has no cells.
+    // llama_decode swaps a sequence back in when a batch uses it, with llama_context_params.kv_swap it also swaps out
+    // the least recently used sequences that are not in the batch when there is no room for the batch.
+    // The other llama_kv_cache_seq_* functions and the state functions work on swapped out sequences as well.
+    LLAMA_API bool llama_kv_cache_seq_swap_out(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Moves a swapped out sequence back into the KV cache. Returns false if there are not enough free cells.
+    LLAMA_API bool llama_kv_cache_seq_swap_in(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Returns true if the specified sequence is swapped out
+    LLAMA_API bool llama_kv_cache_seq_swapped(
+      const struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
     // Defragment the KV cache
     // This will be applied:
     //   - lazily on next llama_decode()
@@ -880,6 +966,17 @@ extern "C" {
                const llama_token * tokens,
                           size_t   n_token_count);
 
+    // Same as llama_state_seq_save_file, with LLAMA_STATE_SEQ_FLAGS_* flags
+    // The KV cache data is streamed to the file, directly from the cache when it is in host memory
+    // Compressed files are recognized by llama_state_seq_load_file
+    LLAMA_API size_t llama_state_seq_save_file_ext(
+            struct llama_context * ctx,
+                      const char * filepath,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_token_count,
+           llama_state_seq_flags   flags);
+
     LLAMA_API size_t llama_state_seq_load_file(
             struct llama_context * ctx,
                       const char * filepath,
@@ -933,6 +1030,21 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Same as llama_decode, but the batch is evaluated on a worker thread of the context and the call returns
+    // as soon as the batch has been submitted. The batch is copied, so it can be reused right away.
+    // Functions that access the outputs, the KV cache or the context state wait for the evaluation to finish.
+    // The outputs are double-buffered: the pointers returned by llama_get_logits*/llama_get_embeddings* for the
+    // previous batch remain valid and unchanged while this batch is evaluated, until the next llama_decode_async.
+    //   0 - submitted, use llama_decode_wait to get the result
+    // < 0 - error
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Wait for the batch submitted with llama_decode_async, returns what llama_decode would have returned
+    // Returns 0 if no batch is pending
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -973,6 +1085,12 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Top logits of the ith token, computed in the graph when llama_context_params.n_top_logits > 0.
+    // Writes n_top_logits candidates, sorted by logit in descending order, to data (p is set to 0).
+    // If lse is not NULL, it receives the log-sum-exp over all n_vocab logits.
+    // Returns the number of candidates written, 0 if they are not available for this output.
+    LLAMA_API int32_t llama_get_top_logits_ith(struct llama_context * ctx, int32_t i, llama_token_data * data, float * lse);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -990,6 +1108,7 @@ extern "C" {
 
     // Get the embeddings for a sequence id
     // Returns NULL if pooling_type is LLAMA_POOLING_TYPE_NONE
+    // when pooling_type == LLAMA_POOLING_TYPE_RANK, returns the classifier outputs, the first being the rank score
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
@@ -1255,6 +1374,27 @@ extern "C" {
 
     void llama_sampler_dry_accept(struct llama_sampler_dry* smpl, llama_token token);
 
+    /// @details Repetition penalty described in CTRL academic paper https://arxiv.org/abs/1909.05858, with negative logit fix,
+    /// and frequency and presence penalties described in OpenAI API https://platform.openai.com/docs/api-reference/parameter-details.
+    /// Same as llama_sample_repetition_penalties over the last penalty_last_n accepted tokens, but the token counts are
+    /// maintained as tokens are accepted, so the cost of applying the penalties does not depend on penalty_last_n.
+    LLAMA_API struct llama_sampler_penalties * llama_sampler_init_penalties(
+                         int32_t   n_vocab,
+                         int32_t   penalty_last_n,
+                           float   penalty_repeat,
+                           float   penalty_freq,
+                           float   penalty_present);
+
+    LLAMA_API void llama_sample_penalties(struct llama_context * ctx, struct llama_sampler_penalties * smpl, llama_token_data_array * candidates);
+
+    LLAMA_API void llama_sampler_penalties_accept(struct llama_sampler_penalties * smpl, llama_token token);
+
+    LLAMA_API void llama_sampler_penalties_reset(struct llama_sampler_penalties * smpl);
+
+    LLAMA_API struct llama_sampler_penalties * llama_sampler_penalties_clone(struct llama_sampler_penalties * smpl);
+
+    LLAMA_API void llama_sampler_penalties_free(struct llama_sampler_penalties * smpl);
+
     ///  @details DRY sampler, designed by p-e-w, as described in: https://github.com/oobabooga/text-generation-webui/pull/5677, porting Koboldcpp implementation authored by pi6am: https://github.com/LostRuins/koboldcpp/pull/982
 
 
@@ -1331,6 +1471,7 @@ extern "C" {
 // Internal API to be implemented by llama.cpp and used by tests/benchmarks only
 #ifdef LLAMA_API_INTERNAL
 
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
@@ -1341,6 +1482,15 @@ const std::vector<std::pair<std::string, struct ggml_tensor *>> & llama_internal
     struct llama_context * ctx
 );
 
+// DRY sampler with the sequence breakers given as token sequences instead of strings (no vocab needed), used by the tests
+struct llama_sampler_dry * llama_sampler_init_dry_testing(
+        int32_t   context_size,
+        float     dry_multiplier,
+        float     dry_base,
+        int32_t   dry_allowed_length,
+        int32_t   dry_penalty_last_n,
+        const std::vector<std::vector<llama_token>> & seq_breakers);
+
 struct llama_partial_utf8 {
     uint32_t value;    // bit value so far (unshifted)
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
@@ -1377,6 +1527,27 @@ std::pair<std::vector<uint32_t>, llama_partial_utf8> decode_utf8(
         const std::string & src,
         llama_partial_utf8 partial_start);
 
+struct llama_grammar_token_trie;
+
+// code point trie over the pieces of a vocabulary (indexed by token id), used to find all tokens
+// that a grammar state accepts in a single walk instead of matching every token separately
+std::shared_ptr<llama_grammar_token_trie> llama_grammar_token_trie_init(const std::vector<std::string> & pieces);
+
+// sets bit id of allowed for every token whose piece can follow the given stacks
+// the state must not be inside a partial UTF-8 sequence
+void llama_grammar_token_mask(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_stacks     & stacks,
+        const llama_grammar_token_trie & trie,
+              std::vector<uint64_t>    & allowed);
+
+// same as llama_grammar_token_mask for the current state of grammar, using the states and masks cached
+// by all grammars with the same rules
+void llama_grammar_get_token_mask(
+        const struct llama_grammar     * grammar,
+        const llama_grammar_token_trie & trie,
+              std::vector<uint64_t>    & allowed);
+
 // Randomly selects a token from the candidates based on their probabilities using given std::mt19937.
 // This is a temporary workaround in order to fix race conditions when sampling with multiple sequences.
 llama_token llama_sample_token_with_rng(struct llama_context * ctx, llama_token_data_array * candidates, std::mt19937 & rng);
@@ -4,6 +4,11 @@
 #include "llama-sampling.h"
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 
 // Decodes a UTF-8 string which may end in an incomplete sequence. Adds a terminating 0 for use as
 // pointer. If an invalid sequence is encountered, returns `llama_partial_utf8.n_remain == -1`.
@@ -380,6 +385,367 @@ static bool llama_grammar_detect_left_recursion(
     return false;
 }
 
+//
+// token trie
+//
+
+// below this number of candidates, matching them one by one is cheaper than computing the mask of a new state
+#define LLAMA_GRAMMAR_MASK_MIN_CANDIDATES 64
+
+struct llama_grammar_token_trie {
+    struct node {
+        uint32_t chr;         // code point of the edge from the parent
+        uint32_t child_begin; // children are stored contiguously in nodes
+        uint32_t child_end;
+        uint32_t token_begin; // tokens whose full code points end at this node
+        uint32_t token_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // incomplete UTF-8 sequence at the end of the piece
+    };
+
+    std::vector<node>  nodes; // nodes[0] is the root
+    std::vector<token> tokens;
+
+    size_t n_vocab   = 0;
+    size_t max_depth = 0;
+
+    uint64_t id = 0; // unique, identifies the trie in caches
+};
+
+using llama_grammar_trie_entry = std::pair<std::vector<uint32_t>, llama_grammar_token_trie::token>;
+
+static void llama_grammar_token_trie_build(
+        llama_grammar_token_trie              & trie,
+        const std::vector<llama_grammar_trie_entry> & entries,
+        size_t begin, size_t end, size_t depth, uint32_t inode) {
+    // entries are sorted, so the pieces ending at this depth come first
+    size_t i = begin;
+    trie.nodes[inode].token_begin = trie.tokens.size();
+    while (i < end && entries[i].first.size() == depth) {
+        trie.tokens.push_back(entries[i].second);
+        ++i;
+    }
+    trie.nodes[inode].token_end = trie.tokens.size();
+
+    std::vector<std::pair<size_t, size_t>> groups;
+    while (i < end) {
+        size_t j = i + 1;
+        while (j < end && entries[j].first[depth] == entries[i].first[depth]) {
+            ++j;
+        }
+        groups.emplace_back(i, j);
+        i = j;
+    }
+
+    const uint32_t child_begin = trie.nodes.size();
+    trie.nodes[inode].child_begin = child_begin;
+    trie.nodes[inode].child_end   = child_begin + groups.size();
+    for (const auto & group : groups) {
+        trie.nodes.push_back({ entries[group.first].first[depth], 0, 0, 0, 0 });
+    }
+    for (size_t ig = 0; ig < groups.size(); ++ig) {
+        llama_grammar_token_trie_build(trie, entries, groups[ig].first, groups[ig].second, depth + 1, child_begin + ig);
+    }
+}
+
+std::shared_ptr<llama_grammar_token_trie> llama_grammar_token_trie_init(const std::vector<std::string> & pieces) {
+    static std::atomic<uint64_t> n_tries{0};
+
+    auto trie = std::make_shared<llama_grammar_token_trie>();
+    trie->n_vocab = pieces.size();
+    trie->id      = ++n_tries;
+
+    std::vector<llama_grammar_trie_entry> entries;
+    entries.reserve(pieces.size());
+
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        const std::string & piece = pieces[id];
+        if (piece.empty() || piece[0] == 0) {
+            // never allowed, see llama_grammar_sample_impl
+            continue;
+        }
+        auto decoded = decode_utf8(piece, {});
+        if (decoded.second.n_remain < 0) {
+            // invalid UTF-8, rejected by every state
+            continue;
+        }
+        decoded.first.pop_back(); // terminating 0
+        trie->max_depth = std::max(trie->max_depth, decoded.first.size());
+        entries.emplace_back(std::move(decoded.first), llama_grammar_token_trie::token{ (llama_token) id, decoded.second });
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const llama_grammar_trie_entry & a, const llama_grammar_trie_entry & b) {
+        return a.first < b.first || (a.first == b.first && a.second.id < b.second.id);
+    });
+
+    trie->nodes.push_back({ 0, 0, 0, 0, 0 });
+    llama_grammar_token_trie_build(*trie, entries, 0, entries.size(), 0, 0);
+
+    return trie;
+}
+
+static void llama_grammar_token_mask_walk(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_token_trie & trie,
+        uint32_t                         inode,
+        size_t                           depth,
+        const llama_grammar_stacks     & stacks,
+        std::vector<llama_grammar_stacks> & scratch,
+              std::vector<uint64_t>    & allowed) {
+    const auto & node = trie.nodes[inode];
+
+    // all code points of these tokens were accepted, check the trailing partial sequence if any
+    for (uint32_t it = node.token_begin; it < node.token_end; ++it) {
+        const auto & tok = trie.tokens[it];
+        bool ok = tok.partial_utf8.n_remain == 0;
+        for (size_t is = 0; !ok && is < stacks.size(); ++is) {
+            ok = !stacks[is].empty() && llama_grammar_match_partial_char(stacks[is].back(), tok.partial_utf8);
+        }
+        if (ok) {
+            allowed[tok.id >> 6] |= uint64_t(1) << (tok.id & 63);
+        }
+    }
+
+    // the stacks of a child only depend on its code point, so a rejected prefix prunes all tokens below it
+    auto & next_stacks = scratch[depth];
+    for (uint32_t ic = node.child_begin; ic < node.child_end; ++ic) {
+        llama_grammar_accept(rules, stacks, trie.nodes[ic].chr, next_stacks);
+        if (!next_stacks.empty()) {
+            llama_grammar_token_mask_walk(rules, trie, ic, depth + 1, next_stacks, scratch, allowed);
+        }
+    }
+}
+
+void llama_grammar_token_mask(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_stacks     & stacks,
+        const llama_grammar_token_trie & trie,
+              std::vector<uint64_t>    & allowed) {
+    allowed.assign((trie.n_vocab + 63)/64, 0);
+    if (stacks.empty()) {
+        return;
+    }
+
+    std::vector<llama_grammar_stacks> scratch(trie.max_depth + 1);
+    llama_grammar_token_mask_walk(rules, trie, 0, 0, stacks, scratch, allowed);
+}
+
+// rules of a grammar together with the states reached so far, the transitions between them and the
+// token masks of the most recently used states
+// grammars with the same rules share one instance (e.g. server slots using the same JSON schema); their
+// stacks point into its rules, so a state is identified by the element pointers of its stacks
+struct llama_grammar_compiled {
+    static constexpr size_t max_states      = 1 << 16;
+    static constexpr size_t max_transitions = 1 << 22;
+    static constexpr size_t max_masks       = 512;
+
+    llama_grammar_rules rules;
+
+    std::mutex mutex;
+
+    std::unordered_map<std::string, int32_t> state_ids;
+    std::deque<llama_grammar_stacks>         states;      // references stay valid when adding states
+    std::unordered_map<uint64_t, int32_t>    transitions; // (state << 32) | chr -> next state, -1 if rejected
+
+    // token masks, most recently used first
+    uint64_t mask_trie_id = 0;
+    std::list<int32_t> mask_lru;
+    std::unordered_map<int32_t, std::pair<std::vector<uint64_t>, std::list<int32_t>::iterator>> masks;
+
+    std::string key;
+    llama_grammar_stacks next_stacks;
+
+    // state ids are only valid while the mutex is held, the caches are dropped when they grow too large
+    void check_limits() {
+        if (states.size() < max_states && transitions.size() < max_transitions) {
+            return;
+        }
+        state_ids.clear();
+        states.clear();
+        transitions.clear();
+        mask_lru.clear();
+        masks.clear();
+    }
+
+    int32_t intern(const llama_grammar_stacks & stacks) {
+        key.clear();
+        for (const auto & stack : stacks) {
+            const size_t n = stack.size();
+            key.append((const char *) &n, sizeof(n));
+            key.append((const char *) stack.data(), n*sizeof(stack[0]));
+        }
+        auto it = state_ids.find(key);
+        if (it != state_ids.end()) {
+            return it->second;
+        }
+        const int32_t id = states.size();
+        states.push_back(stacks);
+        state_ids.emplace(key, id);
+        return id;
+    }
+
+    int32_t next(int32_t state, uint32_t chr) {
+        const uint64_t tkey = (uint64_t(state) << 32) | chr;
+        auto it = transitions.find(tkey);
+        if (it != transitions.end()) {
+            return it->second;
+        }
+        llama_grammar_accept(rules, states[state], chr, next_stacks);
+        const int32_t result = next_stacks.empty() ? -1 : intern(next_stacks);
+        transitions.emplace(tkey, result);
+        return result;
+    }
+
+    void mask_walk(const llama_grammar_token_trie & trie, uint32_t inode, int32_t state, std::vector<uint64_t> & allowed) {
+        const auto & node   = trie.nodes[inode];
+        const auto & stacks = states[state];
+
+        for (uint32_t it = node.token_begin; it < node.token_end; ++it) {
+            const auto & tok = trie.tokens[it];
+            bool ok = tok.partial_utf8.n_remain == 0;
+            for (size_t is = 0; !ok && is < stacks.size(); ++is) {
+                ok = !stacks[is].empty() && llama_grammar_match_partial_char(stacks[is].back(), tok.partial_utf8);
+            }
+            if (ok) {
+                allowed[tok.id >> 6] |= uint64_t(1) << (tok.id & 63);
+            }
+        }
+
+        for (uint32_t ic = node.child_begin; ic < node.child_end; ++ic) {
+            const int32_t next_state = next(state, trie.nodes[ic].chr);
+            if (next_state >= 0) {
+                mask_walk(trie, ic, next_state, allowed);
+            }
+        }
+    }
+
+    // returns nullptr if the mask is not cached and compute is false
+    const std::vector<uint64_t> * get_mask(const llama_grammar_stacks & stacks, const llama_grammar_token_trie & trie, bool compute) {
+        if (mask_trie_id != trie.id) {
+            mask_lru.clear();
+            masks.clear();
+            mask_trie_id = trie.id;
+        }
+        check_limits();
+
+        const int32_t state = intern(stacks);
+
+        auto it = masks.find(state);
+        if (it != masks.end()) {
+            mask_lru.splice(mask_lru.begin(), mask_lru, it->second.second);
+            return &it->second.first;
+        }
+        if (!compute) {
+            return nullptr;
+        }
+
+        std::vector<uint64_t> allowed((trie.n_vocab + 63)/64, 0);
+        if (!stacks.empty()) {
+            mask_walk(trie, 0, state, allowed);
+        }
+
+        if (masks.size() >= max_masks) {
+            masks.erase(mask_lru.back());
+            mask_lru.pop_back();
+        }
+        mask_lru.push_front(state);
+        return &masks.emplace(state, std::make_pair(std::move(allowed), mask_lru.begin())).first->second.first;
+    }
+};
+
+static std::shared_ptr<llama_grammar_compiled> llama_grammar_compile(llama_grammar_rules && rules) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::weak_ptr<llama_grammar_compiled>> registry;
+
+    std::string key;
+    for (const auto & rule : rules) {
+        const size_t n = rule.size();
+        key.append((const char *) &n, sizeof(n));
+        for (const auto & elem : rule) {
+            const uint32_t type = elem.type;
+            key.append((const char *) &type, sizeof(type));
+            key.append((const char *) &elem.value, sizeof(elem.value));
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = registry.find(key);
+    if (it != registry.end()) {
+        if (auto compiled = it->second.lock()) {
+            return compiled;
+        }
+    }
+
+    for (auto jt = registry.begin(); jt != registry.end(); ) {
+        jt = jt->second.expired() ? registry.erase(jt) : std::next(jt);
+    }
+
+    auto compiled = std::make_shared<llama_grammar_compiled>();
+    compiled->rules = std::move(rules);
+    registry[key] = compiled;
+
+    return compiled;
+}
+
+static const llama_grammar_token_trie * llama_grammar_get_token_trie(const struct llama_vocab * vocab, bool build) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (!vocab->grammar_trie && build) {
+        vocab->grammar_trie = llama_grammar_token_trie_init(vocab->cache_token_to_piece);
+    }
+    return vocab->grammar_trie.get();
+}
+
+void llama_grammar_get_token_mask(
+        const struct llama_grammar     * grammar,
+        const llama_grammar_token_trie & trie,
+              std::vector<uint64_t>    & allowed) {
+    auto & compiled = *grammar->compiled;
+    std::lock_guard<std::mutex> lock(compiled.mutex);
+
+    allowed = *compiled.get_mask(grammar->stacks, trie, true);
+}
+
+// sets the logits of the candidates rejected by the token mask of the current state to -INFINITY
+// returns false if the mask is not cached and compute is false
+static bool llama_grammar_apply_token_mask(
+        const struct llama_grammar * grammar,
+        const struct llama_vocab   * vocab,
+        llama_token_data_array     * candidates,
+        bool allow_eog,
+        bool compute) {
+    const llama_grammar_token_trie * trie = llama_grammar_get_token_trie(vocab, compute);
+    if (!trie) {
+        return false;
+    }
+
+    auto & compiled = *grammar->compiled;
+    std::lock_guard<std::mutex> lock(compiled.mutex);
+
+    const auto * mask = compiled.get_mask(grammar->stacks, *trie, compute);
+    if (!mask) {
+        return false;
+    }
+
+    for (size_t i = 0; i < candidates->size; ++i) {
+        const llama_token id = candidates->data[i].id;
+        if (llama_token_is_eog_impl(*vocab, id)) {
+            if (!allow_eog) {
+                candidates->data[i].logit = -INFINITY;
+            }
+        } else if (!((*mask)[id >> 6] & (uint64_t(1) << (id & 63)))) {
+            candidates->data[i].logit = -INFINITY;
+        }
+    }
+
+    return true;
+}
+
 //
 // grammar - external
 //
@@ -413,16 +779,19 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     }
 
+    // the stacks point into the rules of the shared compiled grammar, which outlives this grammar
+    auto compiled = llama_grammar_compile(std::move(vec_rules));
+
     // loop over alternates of start rule to build initial stacks
     llama_grammar_stacks stacks;
-    pos = vec_rules[start_rule_index].data();
+    pos = compiled->rules[start_rule_index].data();
     do {
         llama_grammar_stack stack;
         if (!llama_grammar_is_end_of_sequence(pos)) {
             // if alternate is nonempty, add to stack
             stack.push_back(pos);
         }
-        llama_grammar_advance_stack(vec_rules, stack, stacks);
+        llama_grammar_advance_stack(compiled->rules, stack, stacks);
         while (!llama_grammar_is_end_of_sequence(pos)) {
             // scan to end of alternate def
             pos++;
@@ -435,10 +804,8 @@ struct llama_grammar * llama_grammar_init_impl(
         }
     } while (true);
 
-    // Important: vec_rules has to be moved here, not copied, because stacks contains
-    // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
-    // then the pointers would be invalidated when the local vec_rules goes out of scope.
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    const llama_grammar_rules & rules_ref = compiled->rules;
+    return new llama_grammar{ std::move(compiled), rules_ref, std::move(stacks), {} };
 }
 
 void llama_grammar_free_impl(struct llama_grammar * grammar) {
@@ -446,20 +813,8 @@ void llama_grammar_free_impl(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy_impl(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
-
-    // redirect elements in stacks to point to new rules
-    for (size_t is = 0; is < result->stacks.size(); is++) {
-        for (size_t ie = 0; ie < result->stacks[is].size(); ie++) {
-            for (size_t ir0 = 0; ir0 < grammar->rules.size(); ir0++) {
-                for (size_t ir1 = 0; ir1 < grammar->rules[ir0].size(); ir1++) {
-                    if (grammar->stacks[is][ie] == &grammar->rules[ir0][ir1]) {
-                         result->stacks[is][ie]  =  &result->rules[ir0][ir1];
-                    }
-                }
-            }
-        }
-    }
+    // the rules are shared, so the stacks can be copied as they are
+    llama_grammar * result = new llama_grammar{ grammar->compiled, grammar->rules, grammar->stacks, grammar->partial_utf8 };
 
     return result;
 }
@@ -478,6 +833,15 @@ void llama_grammar_sample_impl(const struct llama_grammar * grammar, const struc
         }
     }
 
+    // outside of a partial UTF-8 sequence the allowed tokens only depend on the stacks, so use the
+    // (cached) token mask of the state when filtering many candidates or when it is already known
+    if (grammar->partial_utf8.n_remain == 0) {
+        if (llama_grammar_apply_token_mask(grammar, vocab, candidates, allow_eog, candidates->size >= LLAMA_GRAMMAR_MASK_MIN_CANDIDATES)) {
+            smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+            return;
+        }
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     candidates_decoded.reserve(candidates->size);
 
@@ -526,10 +890,21 @@ void llama_grammar_accept_token_impl(struct llama_grammar * grammar, const struc
     const auto   decoded     = decode_utf8(piece, grammar->partial_utf8);
     const auto & code_points = decoded.first;
 
-    llama_grammar_stacks tmp_new_stacks;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        llama_grammar_accept(grammar->rules, grammar->stacks, *it, tmp_new_stacks);
-        grammar->stacks = tmp_new_stacks;
+    {
+        // follow the cached transitions of the compiled grammar
+        auto & compiled = *grammar->compiled;
+        std::lock_guard<std::mutex> lock(compiled.mutex);
+        compiled.check_limits();
+
+        int32_t state = compiled.intern(grammar->stacks);
+        for (auto it = code_points.begin(), end = code_points.end() - 1; it != end && state >= 0; ++it) {
+            state = compiled.next(state, *it);
+        }
+        if (state >= 0) {
+            grammar->stacks = compiled.states[state];
+        } else {
+            grammar->stacks.clear();
+        }
     }
 
     grammar->partial_utf8 = decoded.second;
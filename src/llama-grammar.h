@@ -2,12 +2,18 @@
 
 #include "llama-impl.h"
 
+#include <memory>
+
 struct llama_vocab;
 struct llama_sampling;
+struct llama_grammar_compiled;
 
 struct llama_grammar {
-    const llama_grammar_rules  rules;
-          llama_grammar_stacks stacks;
+    // rules, states and token masks shared by all grammars with the same rules
+    std::shared_ptr<llama_grammar_compiled> compiled;
+
+    const llama_grammar_rules  & rules; // compiled->rules
+          llama_grammar_stacks   stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8 partial_utf8;
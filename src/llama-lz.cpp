@@ -0,0 +1,162 @@
+#include "llama-lz.h"
+
+#include <cstring>
+#include <vector>
+
+static constexpr size_t   LZ_MIN_MATCH  = 4;
+static constexpr size_t   LZ_MAX_OFFSET = 65535;
+static constexpr int      LZ_HASH_BITS  = 16;
+
+static inline uint32_t lz_read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t * lz_write_len(uint8_t * op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static uint8_t * lz_write_record(uint8_t * op, const uint8_t * lit, size_t n_lit, size_t offset, size_t match_len) {
+    uint8_t * token = op++;
+
+    *token = (uint8_t) ((n_lit < 15 ? n_lit : 15) << 4);
+    if (n_lit >= 15) {
+        op = lz_write_len(op, n_lit - 15);
+    }
+    memcpy(op, lit, n_lit);
+    op += n_lit;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = (uint8_t) (offset & 0xff);
+    *op++ = (uint8_t) (offset >> 8);
+
+    const size_t ml = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t) (ml < 15 ? ml : 15);
+    if (ml >= 15) {
+        op = lz_write_len(op, ml - 15);
+    }
+
+    return op;
+}
+
+size_t llama_lz_compress_bound(size_t n) {
+    return n + n/255 + 16;
+}
+
+size_t llama_lz_compress(const uint8_t * src, size_t n, uint8_t * dst) {
+    uint8_t * op = dst;
+
+    if (n >= LZ_MIN_MATCH) {
+        // positions + 1 of the last occurrence of each hashed 4-byte sequence
+        std::vector<uint32_t> table(size_t(1) << LZ_HASH_BITS, 0);
+
+        size_t anchor = 0;
+        size_t i = 0;
+        while (i + LZ_MIN_MATCH <= n) {
+            const uint32_t v = lz_read32(src + i);
+            uint32_t & entry = table[lz_hash(v)];
+            const size_t ref = entry;
+            entry = (uint32_t) (i + 1);
+
+            if (ref == 0 || i + 1 - ref > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != v) {
+                // skip ahead faster in data that does not compress
+                i += 1 + ((i - anchor) >> 6);
+                continue;
+            }
+
+            const size_t cand = ref - 1;
+            size_t len = LZ_MIN_MATCH;
+            while (i + len < n && src[cand + len] == src[i + len]) {
+                ++len;
+            }
+
+            op = lz_write_record(op, src + anchor, i - anchor, i - cand, len);
+
+            i += len;
+            anchor = i;
+        }
+
+        if (anchor < n) {
+            op = lz_write_record(op, src + anchor, n - anchor, 0, 0);
+        }
+    } else if (n > 0) {
+        op = lz_write_record(op, src, n, 0, 0);
+    }
+
+    return op - dst;
+}
+
+size_t llama_lz_decompress(const uint8_t * src, size_t n, uint8_t * dst, size_t dst_size) {
+    const uint8_t * ip  = src;
+    const uint8_t * end = src + n;
+    uint8_t       * op  = dst;
+    uint8_t       * oend = dst + dst_size;
+
+    auto read_len = [&](size_t & len) {
+        uint8_t b;
+        do {
+            if (ip == end) {
+                return false;
+            }
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < end) {
+        const uint8_t token = *ip++;
+
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !read_len(n_lit)) {
+            return 0;
+        }
+        if (n_lit > size_t(end - ip) || n_lit > size_t(oend - op)) {
+            return 0;
+        }
+        memcpy(op, ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+
+        if (ip == end) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return 0;
+        }
+        const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+        ip += 2;
+
+        size_t len = token & 15;
+        if (len == 15 && !read_len(len)) {
+            return 0;
+        }
+        len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > size_t(op - dst) || len > size_t(oend - op)) {
+            return 0;
+        }
+
+        // the match may overlap the output, so copy byte by byte
+        const uint8_t * match = op - offset;
+        for (size_t k = 0; k < len; ++k) {
+            op[k] = match[k];
+        }
+        op += len;
+    }
+
+    return op - dst;
+}
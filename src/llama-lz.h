@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+//
+// a small LZ77 block codec (LZ4-like byte format) used for compressed state files
+//
+// a block is a sequence of (token, literals, match) records:
+//   token: upper 4 bits literal count, lower 4 bits match length - 4 (15 = continued in the following bytes, 255 = continue)
+//   the literals follow the extra literal count bytes, then a 16-bit little endian offset and the extra match length bytes
+//   the last record only has literals
+//
+
+// maximum size of the compressed data for n bytes of input
+size_t llama_lz_compress_bound(size_t n);
+
+// compresses n bytes of src into dst, which must hold llama_lz_compress_bound(n) bytes, returns the compressed size
+size_t llama_lz_compress(const uint8_t * src, size_t n, uint8_t * dst);
+
+// decompresses n bytes of src into dst, returns the decompressed size or 0 if the data is not a valid block
+// or does not fit in dst_size bytes
+size_t llama_lz_decompress(const uint8_t * src, size_t n, uint8_t * dst, size_t dst_size);
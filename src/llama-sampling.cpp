@@ -575,6 +575,118 @@ void llama_sample_repetition_penalties_impl(
     }
 }
 
+static inline float llama_penalize_logit(float logit, int32_t count, float penalty_repeat, float penalty_freq, float penalty_present) {
+    // same as llama_sample_repetition_penalties_impl
+    if (logit <= 0) {
+        logit *= penalty_repeat;
+    } else {
+        logit /= penalty_repeat;
+    }
+    return logit - (float(count) * penalty_freq + float(count > 0) * penalty_present);
+}
+
+struct llama_sampler_penalties * llama_sampler_init_penalties_impl(
+                         int32_t    n_vocab,
+                         int32_t    penalty_last_n,
+                           float    penalty_repeat,
+                           float    penalty_freq,
+                           float    penalty_present) {
+    GGML_ASSERT(n_vocab > 0);
+    penalty_last_n = std::max(penalty_last_n, 0);
+
+    return new llama_sampler_penalties {
+        /* .penalty_last_n  = */ penalty_last_n,
+        /* .penalty_repeat  = */ penalty_repeat,
+        /* .penalty_freq    = */ penalty_freq,
+        /* .penalty_present = */ penalty_present,
+        /* .last_tokens     = */ ring_buffer<llama_token>(penalty_last_n),
+        /* .token_count     = */ std::vector<int32_t>(n_vocab, 0),
+        /* .token_index     = */ std::vector<int32_t>(n_vocab, -1),
+        /* .tokens          = */ {},
+    };
+}
+
+void llama_sampler_penalties_accept_impl(struct llama_sampler_penalties * smpl, llama_token token) {
+    if (smpl->penalty_last_n == 0) {
+        return;
+    }
+
+    const int32_t n_vocab = smpl->token_count.size();
+
+    if (smpl->last_tokens.size() == smpl->last_tokens.capacity) {
+        const llama_token old = smpl->last_tokens.front();
+        if (old >= 0 && old < n_vocab && --smpl->token_count[old] == 0) {
+            // swap-remove from the list of distinct tokens
+            const int32_t idx  = smpl->token_index[old];
+            const llama_token last = smpl->tokens.back();
+            smpl->tokens[idx] = last;
+            smpl->token_index[last] = idx;
+            smpl->tokens.pop_back();
+            smpl->token_index[old] = -1;
+        }
+    }
+
+    smpl->last_tokens.push_back(token);
+
+    if (token >= 0 && token < n_vocab && smpl->token_count[token]++ == 0) {
+        smpl->token_index[token] = smpl->tokens.size();
+        smpl->tokens.push_back(token);
+    }
+}
+
+void llama_sampler_penalties_reset_impl(struct llama_sampler_penalties * smpl) {
+    for (llama_token token : smpl->tokens) {
+        smpl->token_count[token] =  0;
+        smpl->token_index[token] = -1;
+    }
+    smpl->tokens.clear();
+    smpl->last_tokens.clear();
+}
+
+void llama_sampler_penalties_apply_impl(struct llama_sampling * smpl, struct llama_sampler_penalties * pen, llama_token_data_array * candidates) {
+    if (pen->tokens.empty() || (pen->penalty_repeat == 1.0f && pen->penalty_freq == 0.0f && pen->penalty_present == 0.0f)) {
+        return;
+    }
+
+    const int64_t t_start_sample_us = ggml_time_us();
+
+    const float penalty_repeat  = pen->penalty_repeat;
+    const float penalty_freq    = pen->penalty_freq;
+    const float penalty_present = pen->penalty_present;
+
+    // the candidates are usually the whole vocabulary in token order, in that case only the tokens in the window are visited
+    bool in_order = true;
+    for (llama_token token : pen->tokens) {
+        if ((size_t) token >= candidates->size || candidates->data[token].id != token) {
+            in_order = false;
+            break;
+        }
+    }
+
+    if (in_order) {
+        for (llama_token token : pen->tokens) {
+            float & logit = candidates->data[token].logit;
+            logit = llama_penalize_logit(logit, pen->token_count[token], penalty_repeat, penalty_freq, penalty_present);
+        }
+    } else {
+        const int32_t n_vocab = pen->token_count.size();
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const llama_token token = candidates->data[i].id;
+            if (token < 0 || token >= n_vocab || pen->token_count[token] == 0) {
+                continue;
+            }
+            float & logit = candidates->data[i].logit;
+            logit = llama_penalize_logit(logit, pen->token_count[token], penalty_repeat, penalty_freq, penalty_present);
+        }
+    }
+
+    candidates->sorted = false;
+
+    if (smpl) {
+        smpl->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
 void llama_sample_apply_guidance_impl(
         struct llama_sampling * smpl,
                         float * logits,
@@ -793,79 +905,32 @@ void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_ar
         return;
     }
 
-    smpl->dry_repeat_count.assign(last_n_repeat, 0);
-    smpl->dry_max_token_repeat.clear();
-
-    // Step 1: Look for restart sequences to limit the maximum repetition length.
-    // Work backwards through the context looking for any token that begins a restart sequence.
-    //
-    // The collection `restart_sequences` is a mapping from a "head" token to all "tail"
-    // sequences that together comprise a restart sequence. This allows us to quickly check
-    // whether each token is the head of a complete sequence. Most restart sequences are actually
-    // a single token, and for these the "tail" is an empty vector.
+    // Step 1: Limit the maximum repetition length by the most recent restart sequence.
     //
-    // If the token is a "head", test all restart sequences that begin with this token
-    // (there will often only be one sequence for each token, but if sequences like 'aaaq1' and
-    // 'aaa1' are used as restart strings, both could start with 'aaa' when tokenized). The
-    // longest matching sequence (if any) is used to limit the maximum repetition length.
+    // The restart sequences are detected as they are completed in llama_sampler_dry_accept_impl,
+    // which keeps the one whose head is closest to the end of the context (the longest one if
+    // several start at the same token). This is what a backward scan over the context for the first
+    // token that begins a complete restart sequence would find.
     //
     // Note that in the case case of a short sequence contained in a longer one, this might fail to
     // find the smallest value for `rep_limit`. For example, if 'amniotic' and 'ni' are both used as
     // restart sequences, 'ni' will be found first, and since it's shorter it will fail to suppress
     // 'otic'. This is a minor issue since fully contained restart sequences are likely to be rare.
-    //
-    // This is theoretically worst-case O(N^2) for arbitrary restart sequences, which is why we
-    // have already clamped the maximum tail sequence length when generating `restart_sequences`.
-    // With clamping, this scan is O(N) in the context length.
+
+    const int64_t last     = smpl->n_accepted - 1;
+    const int64_t first    = smpl->n_accepted - last_n_repeat;
 
     int rep_limit = last_n_repeat;
-    for (int i = 0; i < last_n_repeat; ++i) {
-        llama_token token = smpl->last_tokens.rat(i);
-        auto its = smpl->dry_processed_breakers.equal_range(token);
-        if (its.first == smpl->dry_processed_breakers.end()) {
-            continue;
-        }
-        int longest_match = -1;
-        for (auto it = its.first; it != its.second; ++it) {
-            // Note that (*it) does not contain the head character, so seq_len will be
-            // the restart sequence length minus 1.
-            // In the common case of a single-token restart sequence, (*it) will be empty
-            // and we will trivially match.
-            int seq_len = (int)it->second.size();
-            if (seq_len > longest_match && seq_len <= (int)i) {
-                bool match = true;
-                for (int offset = 0; offset < seq_len; ++offset) {
-                    // The -1 when indexing `last_tokens` is because we already matched the head.
-                    if (it->second[offset] != smpl->last_tokens.rat(i - offset - 1)) {
-                        match = false;
-                        break;
-                    }
-                }
-                if (match) {
-                    longest_match = seq_len;
-                }
-            }
-        }
-        if (longest_match >= 0) {
-            // We found a restart sequence starting `i` tokens from the end and continuing for
-            // `longest_match` tokens.
-            rep_limit = i - longest_match;
-            break;
-        }
+    if (smpl->dry_breaker_head >= first) {
+        rep_limit = int(last - smpl->dry_breaker_head) - smpl->dry_breaker_tail;
     }
     if (rep_limit < smpl->dry_allowed_length) {
         return;
     }
 
-    // Step 2: Iterate in reverse over the last N tokens of the context, using the "Z-algorithm" (in
-    // the reverse direction) to efficiently compute the positions and lengths of suffixes appearing
-    // elsewhere in the context. We limit the suffix length to `rep_limit` to respect restart sequences.
-    //
-    // This algorithm is not currently documented on Wikipedia, but there is a clear description here:
-    // https://ivanyu.me/blog/2014/10/15/z-algorithm/
-    //
-    // The code below is adapted from the public domain implementation by the same author here:
-    // https://github.com/ivanyu/string-algorithms/blob/master/z_algorithm.py
+    // Step 2: The positions where a suffix of the context ends that is also a suffix of the whole
+    // context, and the length of that suffix, are maintained incrementally on accept (see
+    // llama_sampler_dry_accept_impl). Here they only need to be clamped to the window and to `rep_limit`.
     //
     // Example:
     // Last N tokens: a b c c b c y a b c
@@ -873,73 +938,33 @@ void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_ar
     //                    ^
     //   This `3` means that the last three tokens of the context (a b c) also appear here.
     //
-    // This step is worst case O(N) since the Z-algorithm is linear, despite the appearance of nested
-    // for/while loops. This can be seen by observing that the `lt` and `rt` bounds are set after each
-    // repeated suffix is detected (i.e. after each while loop when n > 0). These bound variables
-    // ensure that the inner while loops only examine each token in the context once as the outer
-    // for loop iterates over the context.
-
-    {
-        const int last = last_n_repeat - 1;
-        int rt = 0, lt = 0;
-
-        for (int k = 1; k < last_n_repeat; ++k) {
-            if (k > rt) {
-                // If k is outside the current Z-box, do naive computation.
-                int n = 0;
-                while (n + k < last_n_repeat && smpl->last_tokens.rat(n) == smpl->last_tokens.rat(n + k)) {
-                    ++n;
-                }
-                smpl->dry_repeat_count[last - k] = std::min(n, rep_limit);
-                if (n > 0) {
-                    lt = k;
-                    rt = k + n - 1;
-                }
-            }
-            else {
-                // If k is inside the current Z-box, consider two cases.
-
-                int p = k - lt; // Pair index.
-                int right_part_len = rt - k + 1;
+    // Step 3: For each such position, look ahead one token. This token, if emitted, would extend the
+    // repetition.
+    // c: 3 -> 4 (from `a b c` to `a b c c`)
+    // b: 1 -> 2 (from `c` to `c b`)
+    // y: 2 -> 3 (from `b c` to `b c y`)
+    //
+    // Both steps only visit earlier occurrences of the last token, not the whole window.
 
-                if (smpl->dry_repeat_count[last - p] < right_part_len) {
-                    int n = std::min(smpl->dry_repeat_count[last - p], rep_limit);
-                    smpl->dry_repeat_count[last - k] = n;
-                }
-                else {
-                    int i = rt + 1;
-                    while (i < last_n_repeat && smpl->last_tokens.rat(i) == smpl->last_tokens.rat(i - k)) {
-                        i += 1;
-                    }
+    smpl->dry_max_token_repeat.clear();
 
-                    int n = std::min(i - k, rep_limit);
-                    smpl->dry_repeat_count[last - k] = n;
-                    lt = k;
-                    rt = i - 1;
-                }
-            }
+    if (smpl->dry_allowed_length <= 0) {
+        // every token that follows another one in the window continues a repeat of length 0
+        for (int64_t pos = first; pos < last; ++pos) {
+            smpl->dry_max_token_repeat.emplace(smpl->last_tokens.rat(last - pos - 1), 0);
         }
     }
 
-    // Step 3: Iterate over dry_repeat_count and last_tokens, examining the maximum repeat length
-    // that would be generated by emitting each new token that would extend a sequence.
-    //
-    // Following the same example as above:
-    // Last N tokens: a b c c b c y a b c
-    // Repeat counts: 0 0 3 1 0 2 0 0 0 0
-    //
-    // For each non-zero, look ahead one token. This token, if emitted, would extend the repetition.
-    // c: 3 -> 4 (from `a b c` to `a b c c`)
-    // b: 1 -> 2 (from `c` to `c b`)
-    // y: 2 -> 3 (from `b c` to `b c y`)
-
-    for (int i = 0; i < last_n_repeat - 1; ++i) {
-        int repeat_len = smpl->dry_repeat_count[i];
+    for (const auto & [pos, len] : smpl->dry_suffix_match) {
+        if (pos < first) {
+            break;
+        }
+        const int repeat_len = std::min<int64_t>(std::min(len, rep_limit), pos - first + 1);
         if (repeat_len >= smpl->dry_allowed_length) {
             // This token ends a repeat, so the next token would continue one.
             // By convention, the value of `repeat_len` only includes the tokens currently
             // in the context, not the new token that would be added.
-            llama_token token = smpl->last_tokens.rat(last_n_repeat - 2 - i);
+            llama_token token = smpl->last_tokens.rat(last - pos - 1);
             // Track the maximum sequence ending in this token.
             const auto& it = smpl->dry_max_token_repeat.find(token);
             if (it == smpl->dry_max_token_repeat.end() || it->second < repeat_len) {
@@ -948,6 +973,10 @@ void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_ar
         }
     }
 
+    if (smpl->dry_max_token_repeat.empty()) {
+        return;
+    }
+
     // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
@@ -958,28 +987,47 @@ void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_ar
         max_exponent = FLOAT_MAX_LOG / std::log(smpl->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = smpl->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != smpl->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = smpl->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
+    auto apply_penalty = [&](llama_token_data & cur, int max_repeat) {
+        // Check all sequence breakers starting with this token
+        auto range = smpl->dry_processed_breakers.equal_range(cur.id);
+        bool is_single_token_breaker = false;
 
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.empty()) {
+                is_single_token_breaker = true;
+                break;
             }
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - smpl->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = smpl->dry_multiplier * std::pow(smpl->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (!is_single_token_breaker) {
+            int repeat_exp = max_repeat - smpl->dry_allowed_length;
+            if (max_exponent > 0 && repeat_exp > max_exponent) {
+                repeat_exp = max_exponent;
+            }
+            float penalty = smpl->dry_multiplier * std::pow(smpl->dry_base, repeat_exp);
+            cur.logit -= penalty;
+        }
+    };
+
+    // the candidates are usually the whole vocabulary in token order, then the penalized tokens can be indexed directly
+    bool in_order = true;
+    for (const auto & kvp : smpl->dry_max_token_repeat) {
+        if ((size_t) kvp.first >= cur_p->size || cur_p->data[kvp.first].id != kvp.first) {
+            in_order = false;
+            break;
+        }
+    }
+
+    if (in_order) {
+        for (const auto & kvp : smpl->dry_max_token_repeat) {
+            apply_penalty(cur_p->data[kvp.first], kvp.second);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto& af_kvp = smpl->dry_max_token_repeat.find(cur_p->data[i].id);
+            if (af_kvp != smpl->dry_max_token_repeat.end()) {
+                apply_penalty(cur_p->data[i], af_kvp->second);
             }
         }
     }
@@ -990,7 +1038,6 @@ void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_ar
 
 
 struct llama_sampler_dry* llama_sampler_init_dry_impl(const struct llama_vocab& vocab, int32_t context_size, float dry_multiplier, float dry_base, int32_t dry_allowed_length, int32_t dry_penalty_last_n, const char** seq_breakers, size_t num_breakers) {
-    int32_t effective_dry_penalty_last_n = (dry_penalty_last_n == -1) ? context_size : std::max(dry_penalty_last_n, 0);
     std::unordered_multimap<llama_token, std::vector<llama_token>> processed_breakers;
     const int MAX_CHAR_LEN = 40;
     const int MAX_SEQ_LEN = 20;
@@ -1020,6 +1067,30 @@ struct llama_sampler_dry* llama_sampler_init_dry_impl(const struct llama_vocab&
         }
     }
 
+    return llama_sampler_init_dry_breakers_impl(context_size, dry_multiplier, dry_base, dry_allowed_length, dry_penalty_last_n,
+            std::move(processed_breakers));
+}
+
+struct llama_sampler_dry * llama_sampler_init_dry_breakers_impl(
+                         int32_t    context_size,
+                           float    dry_multiplier,
+                           float    dry_base,
+                         int32_t    dry_allowed_length,
+                         int32_t    dry_penalty_last_n,
+        std::unordered_multimap<llama_token, std::vector<llama_token>> processed_breakers) {
+    int32_t effective_dry_penalty_last_n = (dry_penalty_last_n == -1) ? context_size : std::max(dry_penalty_last_n, 0);
+
+    const bool dry_enabled = (dry_multiplier != 0.0f && dry_base >= 1.0f && dry_penalty_last_n != 0);
+
+    std::unordered_multimap<llama_token, std::vector<llama_token>> breakers_by_last;
+    for (const auto & [head, tail] : processed_breakers) {
+        std::vector<llama_token> seq;
+        seq.reserve(tail.size() + 1);
+        seq.push_back(head);
+        seq.insert(seq.end(), tail.begin(), tail.end());
+        breakers_by_last.emplace(seq.back(), std::move(seq));
+    }
+
     return  new llama_sampler_dry {
             /* .total_context_size     = */ context_size,
             /* .dry_multiplier         = */ dry_multiplier,
@@ -1027,10 +1098,87 @@ struct llama_sampler_dry* llama_sampler_init_dry_impl(const struct llama_vocab&
             /* .dry_allowed_length     = */ dry_allowed_length,
             /* .dry_penalty_last_n     = */ dry_penalty_last_n,
             /* .dry_processed_breakers = */ std::move(processed_breakers),
-            /* .dry_repeat_count       = */ dry_enabled ? std::vector<int>(effective_dry_penalty_last_n, 0) : std::vector<int>{},
             /* .dry_max_token_repeat   = */ {},
             /* .last_tokens            = */ dry_enabled ? ring_buffer<llama_token>(effective_dry_penalty_last_n) : ring_buffer<llama_token>(0),
+            /* .dry_breakers_by_last   = */ std::move(breakers_by_last),
+            /* .n_accepted             = */ 0,
+            /* .dry_last_pos           = */ {},
+            /* .dry_prev_pos           = */ dry_enabled ? std::vector<int64_t>(effective_dry_penalty_last_n, -1) : std::vector<int64_t>{},
+            /* .dry_suffix_match       = */ {},
+            /* .dry_suffix_match_tmp   = */ {},
+            /* .dry_breaker_head       = */ -1,
+            /* .dry_breaker_tail       = */ 0,
     };
 }
 
+void llama_sampler_dry_accept_impl(struct llama_sampler_dry * smpl, llama_token token) {
+    if (smpl->dry_multiplier == 0.0f || smpl->dry_base < 1.0f || smpl->dry_penalty_last_n == 0 || smpl->last_tokens.capacity == 0) {
+        return;
+    }
+
+    const int64_t pos      = smpl->n_accepted++;
+    const int64_t capacity = smpl->last_tokens.capacity;
+
+    // The suffixes of the new context that repeat earlier are the old repeated suffixes extended by the
+    // new token: a suffix ending at an earlier occurrence q of the token has length 1 + the length of the
+    // old repeated suffix ending at q - 1. Only the occurrences of the token still in the ring are visited,
+    // by following the chain of previous positions, in descending order as dry_suffix_match.
+    auto & cur  = smpl->dry_suffix_match;
+    auto & next = smpl->dry_suffix_match_tmp;
+    next.clear();
+
+    auto it_last = smpl->dry_last_pos.find(token);
+    int64_t q = it_last != smpl->dry_last_pos.end() ? it_last->second : -1;
+    size_t  j = 0;
+    while (q >= 0 && q > pos - capacity) {
+        while (j < cur.size() && cur[j].first > q - 1) {
+            ++j;
+        }
+        const int32_t len = j < cur.size() && cur[j].first == q - 1 ? cur[j].second : 0;
+        next.emplace_back(q, len + 1);
+        q = smpl->dry_prev_pos[q % capacity];
+    }
+    std::swap(cur, next);
+
+    smpl->dry_prev_pos[pos % capacity] = it_last != smpl->dry_last_pos.end() ? it_last->second : -1;
+    smpl->dry_last_pos[token] = pos;
+    smpl->last_tokens.push_back(token);
+
+    // check for restart sequences ending in the new token
+    auto range = smpl->dry_breakers_by_last.equal_range(token);
+    for (auto it = range.first; it != range.second; ++it) {
+        const auto & seq = it->second;
+        const int seq_len = seq.size();
+        if (seq_len > (int) smpl->last_tokens.size()) {
+            continue;
+        }
+        bool match = true;
+        for (int offset = 1; offset < seq_len; ++offset) {
+            if (seq[seq_len - 1 - offset] != smpl->last_tokens.rat(offset)) {
+                match = false;
+                break;
+            }
+        }
+        if (!match) {
+            continue;
+        }
+        const int64_t head = pos - (seq_len - 1);
+        if (head > smpl->dry_breaker_head || (head == smpl->dry_breaker_head && seq_len - 1 > smpl->dry_breaker_tail)) {
+            smpl->dry_breaker_head = head;
+            smpl->dry_breaker_tail = seq_len - 1;
+        }
+    }
+}
+
+void llama_sampler_dry_reset_impl(struct llama_sampler_dry * smpl) {
+    smpl->last_tokens.clear();
+    smpl->dry_max_token_repeat.clear();
+    smpl->n_accepted = 0;
+    smpl->dry_last_pos.clear();
+    std::fill(smpl->dry_prev_pos.begin(), smpl->dry_prev_pos.end(), -1);
+    smpl->dry_suffix_match.clear();
+    smpl->dry_breaker_head = -1;
+    smpl->dry_breaker_tail = 0;
+}
+
 
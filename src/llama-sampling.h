@@ -44,9 +44,26 @@ struct llama_sampler_dry {
     const int32_t dry_penalty_last_n;
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
-    std::vector<int> dry_repeat_count;
     std::unordered_map<llama_token, int> dry_max_token_repeat;
     ring_buffer<llama_token> last_tokens;
+
+    // incremental state, updated on accept so that applying the penalty does not rescan the window
+    // positions are absolute token counts since the last reset
+
+    // complete breaker sequences (head + tail) keyed by their last token
+    std::unordered_multimap<llama_token, std::vector<llama_token>> dry_breakers_by_last;
+
+    int64_t n_accepted = 0;
+    std::unordered_map<llama_token, int64_t> dry_last_pos; // last position of each token
+    std::vector<int64_t> dry_prev_pos;                     // previous position of the token at each ring slot
+
+    // positions (descending) at which a suffix of the context ends that also ends the context, with its length
+    std::vector<std::pair<int64_t, int32_t>> dry_suffix_match;
+    std::vector<std::pair<int64_t, int32_t>> dry_suffix_match_tmp;
+
+    // head position and tail length of the most recent sequence breaker
+    int64_t dry_breaker_head = -1;
+    int32_t dry_breaker_tail = 0;
 };
 
 struct llama_sampler_dry * llama_sampler_init_dry_impl(
@@ -59,7 +76,44 @@ struct llama_sampler_dry * llama_sampler_init_dry_impl(
                       const char ** seq_breakers,
                           size_t    num_breakers);
 
+// same as llama_sampler_init_dry_impl with the sequence breakers already tokenized (head token -> tail tokens)
+struct llama_sampler_dry * llama_sampler_init_dry_breakers_impl(
+                         int32_t    context_size,
+                           float    dry_multiplier,
+                           float    dry_base,
+                         int32_t    dry_allowed_length,
+                         int32_t    dry_penalty_last_n,
+        std::unordered_multimap<llama_token, std::vector<llama_token>> processed_breakers);
+
 void llama_sampler_dry_apply(struct llama_sampler_dry* smpl, llama_token_data_array* cur_p);
+void llama_sampler_dry_accept_impl(struct llama_sampler_dry * smpl, llama_token token);
+void llama_sampler_dry_reset_impl(struct llama_sampler_dry * smpl);
+
+// repetition/frequency/presence penalties over the last penalty_last_n accepted tokens
+// the token counts are maintained on accept, applying them only visits the distinct tokens in the window
+struct llama_sampler_penalties {
+    const int32_t penalty_last_n;
+    const float   penalty_repeat;
+    const float   penalty_freq;
+    const float   penalty_present;
+
+    ring_buffer<llama_token> last_tokens;
+
+    std::vector<int32_t>     token_count; // occurrences of each token in last_tokens
+    std::vector<int32_t>     token_index; // index of each token in tokens, -1 if absent
+    std::vector<llama_token> tokens;      // distinct tokens in last_tokens
+};
+
+struct llama_sampler_penalties * llama_sampler_init_penalties_impl(
+                         int32_t    n_vocab,
+                         int32_t    penalty_last_n,
+                           float    penalty_repeat,
+                           float    penalty_freq,
+                           float    penalty_present);
+
+void llama_sampler_penalties_accept_impl(struct llama_sampler_penalties * smpl, llama_token token);
+void llama_sampler_penalties_reset_impl (struct llama_sampler_penalties * smpl);
+void llama_sampler_penalties_apply_impl (struct llama_sampling * smpl, struct llama_sampler_penalties * pen, llama_token_data_array * candidates);
 
 
 
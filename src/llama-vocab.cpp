@@ -9,8 +9,10 @@
 #include <cstdarg>
 #include <cstring>
 #include <forward_list>
+#include <mutex>
 #include <queue>
 #include <sstream>
+#include <thread>
 
 //
 // helpers
@@ -75,6 +77,52 @@ struct naive_trie {
     llama_token value;
 };
 
+// word -> tokens cache of the BPE tokenizer
+// sharded to keep lock contention low when tokenizing from several threads
+struct llama_bpe_cache {
+    static constexpr size_t n_shards       = 16;
+    static constexpr size_t max_shard_size = 16384; // words per shard before it is flushed
+    static constexpr size_t max_word_len   = 64;    // longer words are rare, don't cache them
+
+    struct shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<llama_token>> words;
+    };
+
+    shard shards[n_shards];
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string>{}(word) % n_shards];
+    }
+
+    // append the cached tokens of word to output, returns false if not cached
+    bool find(const std::string & word, std::vector<llama_token> & output) {
+        if (word.size() > max_word_len) {
+            return false;
+        }
+        auto & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        auto it = sh.words.find(word);
+        if (it == sh.words.end()) {
+            return false;
+        }
+        output.insert(output.end(), it->second.begin(), it->second.end());
+        return true;
+    }
+
+    void insert(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (word.size() > max_word_len) {
+            return;
+        }
+        auto & sh = get_shard(word);
+        std::lock_guard<std::mutex> lock(sh.mutex);
+        if (sh.words.size() >= max_shard_size) {
+            sh.words.clear();
+        }
+        sh.words.emplace(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+    }
+};
+
 uint32_t llama_vocab::n_tokens() const {
     return (uint32_t)id_to_token.size();
 }
@@ -96,6 +144,45 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+static inline uint64_t llama_bpe_merge_key(llama_token left, llama_token right) {
+    return ((uint64_t)(uint32_t)left << 32) | (uint32_t)right;
+}
+
+int llama_vocab::find_bpe_rank(id token_left, id token_right, id & result) const {
+    auto it = bpe_merges.find(llama_bpe_merge_key(token_left, token_right));
+    if (it == bpe_merges.end()) {
+        result = -1;
+        return -1;
+    }
+
+    result = it->second.result;
+    return it->second.rank;
+}
+
+void llama_vocab::init_bpe() {
+    bpe_merges.clear();
+    bpe_merges.reserve(bpe_ranks.size());
+
+    for (const auto & it : bpe_ranks) {
+        const auto left  = token_to_id.find(it.first.first);
+        const auto right = token_to_id.find(it.first.second);
+        if (left == token_to_id.end() || right == token_to_id.end()) {
+            // left to the string lookup
+            continue;
+        }
+
+        const auto merged = token_to_id.find(it.first.first + it.first.second);
+
+        bpe_merge merge;
+        merge.rank   = it.second;
+        merge.result = merged == token_to_id.end() ? -1 : merged->second;
+
+        bpe_merges.emplace(llama_bpe_merge_key(left->second, right->second), merge);
+    }
+
+    bpe_cache = std::make_shared<llama_bpe_cache>();
+}
+
 static enum llama_vocab_type llama_vocab_get_type(const llama_vocab & vocab) {
     return vocab.type;
 }
@@ -335,9 +422,9 @@ struct llm_bigram_bpe {
     using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
-    size_t size;
+    size_t left_n;  // symbol sizes when the bigram was queued, the bigram is outdated if they changed
+    size_t right_n;
 };
 
 struct llm_tokenizer_bpe {
@@ -542,123 +629,191 @@ struct llm_tokenizer_bpe {
     }
 
     void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-
         const auto word_collection = unicode_regex_split(text, regex_exprs);
 
-        symbols_final.clear();
+        // long texts: merge the words in parallel, the words are independent of each other
+        const size_t n_words = word_collection.size();
+        const size_t n_threads_max = vocab.n_threads_bpe > 0 ? vocab.n_threads_bpe : std::min<size_t>(std::thread::hardware_concurrency(), k_max_threads);
+        const size_t n_threads = std::min<size_t>(n_words / k_words_per_thread, n_threads_max);
 
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+        if (n_threads < 2) {
+            word_state state;
+            for (const auto & word : word_collection) {
+                tokenize_word(word, state, output);
+            }
+            return;
+        }
 
-            int index = 0;
-            size_t offset = 0;
+        std::vector<std::vector<llama_vocab::id>> outputs(n_threads);
+        std::vector<std::thread> workers;
+        workers.reserve(n_threads - 1);
 
-            if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
+        auto compute = [&](size_t ith) {
+            const size_t first = n_words * ith / n_threads;
+            const size_t last  = n_words * (ith + 1) / n_threads;
+            word_state state;
+            for (size_t i = first; i < last; ++i) {
+                tokenize_word(word_collection[i], state, outputs[ith]);
             }
+        };
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (size_t i = 1; i < symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
+        for (size_t ith = 1; ith < n_threads; ++ith) {
+            workers.emplace_back(compute, ith);
+        }
+        compute(0);
+        for (auto & w : workers) {
+            w.join();
+        }
+
+        for (const auto & out : outputs) {
+            output.insert(output.end(), out.begin(), out.end());
+        }
+    }
+
+private:
+    static constexpr size_t k_words_per_thread = 16384;
+    static constexpr size_t k_max_threads      = 8;
+
+    // scratch buffers used while merging a single word
+    struct word_state {
+        std::vector<llm_symbol>       symbols;
+        std::vector<llama_vocab::id>  ids; // token id of each symbol, -1 if the symbol text is not a token
+        llm_bigram_bpe::queue         work_queue;
+    };
+
+    void tokenize_word(const std::string & word, word_state & state, std::vector<llama_vocab::id> & output) const {
+        if (vocab.bpe_cache && vocab.bpe_cache->find(word, output)) {
+            return;
+        }
+
+        const size_t n_output = output.size();
+
+        auto & symbols    = state.symbols;
+        auto & ids        = state.ids;
+        auto & work_queue = state.work_queue;
+
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        ids.clear();
+
+        int index = 0;
+        size_t offset = 0;
+
+        if (vocab.tokenizer_ignore_merges) {
+            const auto token = vocab.token_to_id.find(word);
+            if (token != vocab.token_to_id.end()) {
+                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+                ids.push_back(token->second);
+                offset = word.size();
             }
+        }
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+            const auto token = vocab.token_to_id.find(std::string(sym.text, sym.n));
+            ids.push_back(token == vocab.token_to_id.end() ? -1 : token->second);
+        }
+        for (size_t i = 1; i < symbols.size(); ++i) {
+            add_new_bigram(state, i - 1, i);
+        }
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.top();
+            work_queue.pop();
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            if (left_symbol.n != bigram.left_n || right_symbol.n != bigram.right_n) {
+                continue;  // Skip this bigram if it's outdated
+            }
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            llama_vocab::id merged = -1;
+            if (ids[bigram.left] >= 0 && ids[bigram.right] >= 0) {
+                vocab.find_bpe_rank(ids[bigram.left], ids[bigram.right], merged);
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            ids[bigram.left] = merged;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
+
+            add_new_bigram(state, left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(state, bigram.left, left_symbol.next);  // right side of current symbol
         }
 
-        symbols = symbols_final;
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+            if (ids[i] >= 0) {
+                output.push_back(ids[i]);
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.token_to_id.find(str);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte != vocab.token_to_id.end()) {
-                            output.push_back(token_multibyte->second);
-                        }
+            if (token == vocab.token_to_id.end()) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.token_to_id.find(byte_str);
+                    if (token_multibyte != vocab.token_to_id.end()) {
+                        output.push_back(token_multibyte->second);
                     }
-                } else {
-                    output.push_back((*token).second);
                 }
+            } else {
+                output.push_back((*token).second);
             }
         }
+
+        if (vocab.bpe_cache) {
+            vocab.bpe_cache->insert(word, output.data() + n_output, output.size() - n_output);
+        }
     }
 
-private:
-    void add_new_bigram(int left, int right) {
+    void add_new_bigram(word_state & state, int left, int right) const {
         if (left == -1 || right == -1) {
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
+        const auto & symbols = state.symbols;
 
         int rank_found = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (state.ids[left] >= 0 && state.ids[right] >= 0) {
+            llama_vocab::id merged;
+            rank_found = vocab.find_bpe_rank(state.ids[left], state.ids[right], merged);
+        }
+
+        // merges where a side is not a token are only in the string table
+        if (rank_found < 0 && (state.ids[left] < 0 || state.ids[right] < 0)) {
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+        }
 
         if (rank_found < 0) {
             return;
@@ -666,23 +821,18 @@ private:
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left    = left;
+        bigram.right   = right;
+        bigram.rank    = rank_found;
+        bigram.left_n  = symbols[left].n;
+        bigram.right_n = symbols[right].n;
 
-        work_queue.push(bigram);
+        state.work_queue.push(bigram);
     }
 
     const llama_vocab & vocab;
 
     std::vector<std::string> regex_exprs;
-
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
-
-    llm_bigram_bpe::queue work_queue;
 };
 
 //
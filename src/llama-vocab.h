@@ -6,6 +6,10 @@
 #include <vector>
 #include <unordered_map>
 #include <map>
+#include <memory>
+
+struct llama_bpe_cache;
+struct llama_grammar_token_trie;
 
 struct llama_vocab {
     using id    = llama_token;
@@ -33,6 +37,22 @@ struct llama_vocab {
 
     std::map<std::pair<std::string, std::string>, int> bpe_ranks;
 
+    // bpe_ranks keyed by the token ids of both sides (for merges where both sides are tokens)
+    struct bpe_merge {
+        int rank;
+        id  result; // token id of the merged text, -1 if it is not a token
+    };
+    std::unordered_map<uint64_t, bpe_merge> bpe_merges;
+
+    // word -> tokens cache of the BPE tokenizer, shared by all threads using this vocab
+    std::shared_ptr<llama_bpe_cache> bpe_cache;
+
+    // threads merging the words of long texts in the BPE tokenizer, 0 = hardware concurrency (at most 8)
+    uint32_t n_threads_bpe = 0;
+
+    // code point trie over cache_token_to_piece, built on first use by grammar sampling
+    mutable std::shared_ptr<llama_grammar_token_trie> grammar_trie;
+
     // default LLaMA special tokens
     id special_bos_id  = 1;
     id special_eos_id  = 2;
@@ -62,6 +82,10 @@ struct llama_vocab {
     std::vector<char> precompiled_charsmap;
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
+    int find_bpe_rank(id token_left, id token_right, id & result) const;
+
+    // build bpe_merges and bpe_cache - call after the tokens and merges are loaded
+    void init_bpe();
 };
 
 const struct llama_vocab * llama_get_vocab(const struct llama_context * ctx);
@@ -9,6 +9,7 @@
 #include "llama-vocab.h"
 #include "llama-grammar.h"
 #include "llama-sampling.h"
+#include "llama-lz.h"
 
 #include "unicode.h"
 
@@ -92,8 +93,10 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <condition_variable>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <future>
@@ -549,6 +552,7 @@ enum llm_tensor {
     LLM_TENSOR_FFN_GATE,
     LLM_TENSOR_FFN_DOWN,
     LLM_TENSOR_FFN_UP,
+    LLM_TENSOR_FFN_GATE_UP,  // ffn_gate and ffn_up stored as one tensor
     LLM_TENSOR_FFN_ACT,
     LLM_TENSOR_FFN_DOWN_EXP,  // split experts for backward compatibility
     LLM_TENSOR_FFN_GATE_EXP,
@@ -609,6 +613,8 @@ enum llm_tensor {
     LLM_TENSOR_ENC_FFN_DOWN,
     LLM_TENSOR_ENC_FFN_UP,
     LLM_TENSOR_ENC_OUTPUT_NORM,
+    LLM_TENSOR_CLS,
+    LLM_TENSOR_CLS_OUT,
 };
 
 static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NAMES = {
@@ -623,6 +629,7 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_ATTN_Q,          "blk.%d.attn_q" },
             { LLM_TENSOR_ATTN_K,          "blk.%d.attn_k" },
             { LLM_TENSOR_ATTN_V,          "blk.%d.attn_v" },
+            { LLM_TENSOR_ATTN_QKV,        "blk.%d.attn_qkv" },
             { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
             { LLM_TENSOR_ATTN_ROT_EMBD,   "blk.%d.attn_rot_embd" },
             { LLM_TENSOR_FFN_GATE_INP,    "blk.%d.ffn_gate_inp" },
@@ -630,6 +637,7 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_FFN_GATE,        "blk.%d.ffn_gate" },
             { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
             { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
+            { LLM_TENSOR_FFN_GATE_UP,     "blk.%d.ffn_gate_up" },
             { LLM_TENSOR_FFN_GATE_EXP,    "blk.%d.ffn_gate.%d" },
             { LLM_TENSOR_FFN_DOWN_EXP,    "blk.%d.ffn_down.%d" },
             { LLM_TENSOR_FFN_UP_EXP,      "blk.%d.ffn_up.%d" },
@@ -851,6 +859,8 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_LAYER_OUT_NORM,  "blk.%d.layer_output_norm" },
             { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
             { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
+            { LLM_TENSOR_CLS,             "cls" },
+            { LLM_TENSOR_CLS_OUT,         "cls.output" },
         },
     },
     {
@@ -886,6 +896,8 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
             { LLM_TENSOR_FFN_GATE,        "blk.%d.ffn_gate" },
             { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
+            { LLM_TENSOR_CLS,             "cls" },
+            { LLM_TENSOR_CLS_OUT,         "cls.output" },
         },
     },
     {
@@ -1559,11 +1571,13 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_ATTN_Q,          "blk.%d.attn_q" },
             { LLM_TENSOR_ATTN_K,          "blk.%d.attn_k" },
             { LLM_TENSOR_ATTN_V,          "blk.%d.attn_v" },
+            { LLM_TENSOR_ATTN_QKV,        "blk.%d.attn_qkv" },
             { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
             { LLM_TENSOR_FFN_NORM,        "blk.%d.ffn_norm" },
             { LLM_TENSOR_FFN_GATE,        "blk.%d.ffn_gate" },
             { LLM_TENSOR_FFN_DOWN,        "blk.%d.ffn_down" },
             { LLM_TENSOR_FFN_UP,          "blk.%d.ffn_up" },
+            { LLM_TENSOR_FFN_GATE_UP,     "blk.%d.ffn_gate_up" },
         },
     },
     {
@@ -1576,6 +1590,7 @@ static const std::map<llm_arch, std::map<llm_tensor, std::string>> LLM_TENSOR_NA
             { LLM_TENSOR_ATTN_Q,          "blk.%d.attn_q" },
             { LLM_TENSOR_ATTN_K,          "blk.%d.attn_k" },
             { LLM_TENSOR_ATTN_V,          "blk.%d.attn_v" },
+            { LLM_TENSOR_ATTN_QKV,        "blk.%d.attn_qkv" },
             { LLM_TENSOR_ATTN_OUT,        "blk.%d.attn_output" },
             { LLM_TENSOR_FFN_NORM,        "blk.%d.ffn_norm" },
             { LLM_TENSOR_FFN_GATE_INP,    "blk.%d.ffn_gate_inp" },
@@ -2834,6 +2849,25 @@ struct llama_hparams {
         return n_embd_head_v * n_head_kv;
     }
 
+    // whether layer il uses sliding window (or chunked) attention
+    bool is_swa(uint32_t il) const {
+        return n_swa > 0 && n_swa_pattern > 1 && il % n_swa_pattern < n_swa_pattern - 1;
+    }
+
+    // number of past positions (including the current one) a token attends to in the SWA layers
+    uint32_t n_swa_window() const {
+        return n_attn_chunk ? n_attn_chunk : n_swa;
+    }
+
+    // whether the KV cell at position p_cell is outside the window of a token at position p in the SWA layers
+    bool is_masked_swa(llama_pos p_cell, llama_pos p) const {
+        if (n_attn_chunk) {
+            const llama_pos p_chunk_start = (p / n_attn_chunk) * n_attn_chunk;
+            return p_cell < p_chunk_start || p < p_chunk_start;
+        }
+        return p - p_cell >= (llama_pos) n_swa;
+    }
+
     uint32_t n_embd_k_s() const { // dimension of the rolling state embeddings
         // corresponds to Mamba's conv_states size
         // TODO: maybe support other convolution strides than 1
@@ -2876,9 +2910,17 @@ struct llama_cparams {
     int  mla_attn;
     int  attn_max_batch;
     bool fused_moe_up_gate;
+    bool graph_reuse;
+    bool swa_full;
+    bool kv_swap;
     int  min_experts;
     float thresh_experts;
 
+    int32_t huge_page_size;
+    enum llama_numa_mem_policy numa_mem;
+
+    int32_t n_top_logits;
+
     enum llama_pooling_type pooling_type;
 
     ggml_backend_sched_eval_callback cb_eval;
@@ -3047,9 +3089,6 @@ struct llama_kv_cache {
     // computed before each graph build
     uint32_t n = 0;
 
-    ggml_type type_k = GGML_TYPE_F16;
-    ggml_type type_v = GGML_TYPE_F16;
-
     std::vector<llama_kv_cell> cells;
 
     std::vector<struct ggml_tensor *> k_l; // per layer
@@ -3076,6 +3115,93 @@ struct llama_kv_cache {
     }
 };
 
+// sequences swapped out of the KV cache (llama_kv_cache_seq_swap_out), kept in host memory or in a file
+struct llama_kv_swap_store {
+    // the cells of one sequence in one cache, the K/V data of the layers follows in the order of the layers
+    struct cells {
+        std::vector<llama_pos> pos;
+        std::vector<llama_pos> delta; // K shift that has not been applied yet
+        size_t offs = 0; // offset of the data in the file
+        size_t size = 0;
+        std::vector<uint8_t> data; // the data, if kept in host memory
+    };
+
+    struct seq {
+        cells kv[2]; // kv_self, kv_swa
+    };
+
+    ggml_type type = GGML_TYPE_COUNT; // f16/bf16/f32 K/V rows are stored as this type (GGML_TYPE_COUNT = as is)
+
+    std::unique_ptr<llama_file> file; // if not set, the data is kept in host memory
+    std::map<size_t, size_t> file_free; // offset -> size of the unused ranges of the file
+    size_t file_end = 0;
+
+    std::map<llama_seq_id, seq> seqs;
+
+    // llama_decode call that last used each sequence, to swap out the least recently used ones first
+    std::map<llama_seq_id, uint64_t> last_use;
+    uint64_t n_decode = 0;
+
+    size_t n_bytes = 0; // size of the swapped data
+
+    size_t file_alloc(size_t size) {
+        for (auto it = file_free.begin(); it != file_free.end(); ++it) {
+            if (it->second >= size) {
+                const size_t offs = it->first;
+                if (it->second > size) {
+                    file_free[offs + size] = it->second - size;
+                }
+                file_free.erase(it);
+                return offs;
+            }
+        }
+        const size_t offs = file_end;
+        file_end += size;
+        return offs;
+    }
+
+    void file_release(size_t offs, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        auto it = file_free.emplace(offs, size).first;
+        // merge with the following and the preceding range
+        auto next = std::next(it);
+        if (next != file_free.end() && it->first + it->second == next->first) {
+            it->second += next->second;
+            file_free.erase(next);
+        }
+        if (it != file_free.begin()) {
+            auto prev = std::prev(it);
+            if (prev->first + prev->second == it->first) {
+                prev->second += it->second;
+                file_free.erase(it);
+            }
+        }
+    }
+
+    void erase(llama_seq_id seq_id) {
+        auto it = seqs.find(seq_id);
+        if (it == seqs.end()) {
+            return;
+        }
+        for (auto & c : it->second.kv) {
+            if (file) {
+                file_release(c.offs, c.size);
+            }
+            n_bytes -= c.size;
+        }
+        seqs.erase(it);
+    }
+
+    void clear() {
+        seqs.clear();
+        file_free.clear();
+        file_end = 0;
+        n_bytes  = 0;
+    }
+};
+
 struct llama_control_vector {
     std::vector<struct ggml_tensor *> tensors; // per layer
     std::vector<struct ggml_context *> ctxs;
@@ -3131,6 +3257,12 @@ struct llama_model {
     struct ggml_tensor * output_b;
     struct ggml_tensor * output_norm_enc;
 
+    // classification head of cross-encoders (reranking), used by LLAMA_POOLING_TYPE_RANK
+    struct ggml_tensor * cls       = nullptr;
+    struct ggml_tensor * cls_b     = nullptr;
+    struct ggml_tensor * cls_out   = nullptr;
+    struct ggml_tensor * cls_out_b = nullptr;
+
     std::vector<llama_layer> layers;
 
     llama_split_mode split_mode;
@@ -3172,6 +3304,9 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // weights concatenated along the rows at load time or stored so in the model file, and their parts (views of it)
+    std::vector<std::pair<struct ggml_tensor *, std::vector<struct ggml_tensor *>>> fused_weights;
+
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
@@ -3204,6 +3339,15 @@ struct llama_context {
         , t_load_us(model.t_load_us) {}
 
     ~llama_context() {
+        if (async_worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(async_mutex);
+                async_stop = true;
+            }
+            async_cv.notify_all();
+            async_worker.join();
+        }
+
         ggml_backend_sched_free(sched);
 
         for (ggml_backend_t backend : backends) {
@@ -3211,6 +3355,7 @@ struct llama_context {
         }
 
         ggml_backend_buffer_free(buf_output);
+        ggml_backend_buffer_free(output_spare.buf_output);
     }
 
     const struct llama_model & model;
@@ -3218,12 +3363,32 @@ struct llama_context {
     struct llama_cparams        cparams;
     struct llama_sampling       sampling;
     struct llama_kv_cache       kv_self;
+    struct llama_kv_cache       kv_swa; // KV data of the sliding window attention layers (empty if kept in kv_self)
+    struct llama_kv_swap_store  kv_swap_store;
     struct llama_control_vector cvec;
 
     std::vector<float> scale_data;
 
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
 
+    // per-sequence LoRA adapters (llama_lora_adapter_seq_set)
+    std::unordered_map<llama_seq_id, std::pair<struct llama_lora_adapter *, float>> lora_seq;
+
+    // the per-sequence adapters used by the current ubatch (see llama_lora_seq_prepare)
+    // index 0 refers to the tokens of the ubatch, index 1 to its outputs
+    struct lora_seq_group {
+        struct llama_lora_adapter * adapter;
+        float   scale;
+        int32_t n_rows[2];
+
+        bool operator==(const lora_seq_group & other) const {
+            return adapter == other.adapter && scale == other.scale &&
+                   n_rows[0] == other.n_rows[0] && n_rows[1] == other.n_rows[1];
+        }
+    };
+    std::vector<lora_seq_group> lora_seq_groups;
+    std::vector<int32_t>        lora_seq_rows[2]; // group of each token/output, -1 if none
+
     std::vector<ggml_backend_t> backends;
 #ifdef GGML_USE_METAL
     ggml_backend_t backend_metal = nullptr;
@@ -3246,6 +3411,8 @@ struct llama_context {
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
+    int32_t n_graph_reuse = 0; // number of ubatches that evaluated graph_cached again
+
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_t buf_output = nullptr;
 
@@ -3253,6 +3420,12 @@ struct llama_context {
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // top logits output (2-dimensional array: [n_outputs][2*n_top_logits + 1], see ggml_top_k_lse)
+    // populated only when cparams.n_top_logits > 0
+    size_t  top_logits_size  = 0; // capacity (of floats) for top logits
+    float * top_logits       = nullptr;
+    bool    top_logits_valid = false; // false if the last decode did not compute them
+
     std::vector<int32_t> output_ids; // map batch token positions to ids of the logits and embd buffers
     size_t  output_size = 0; // capacity (of tokens positions) for the output buffers
     int32_t n_outputs   = 0; // number of actually-used outputs in the current ubatch or last logical batch
@@ -3268,6 +3441,77 @@ struct llama_context {
     // populated only when pooling_type != LLAMA_POOLING_TYPE_NONE
     std::map<llama_seq_id, std::vector<float>> embd_seq;
 
+    // the other half of the double-buffered outputs used by llama_decode_async, swapped with the fields above
+    struct output_buffers {
+        ggml_backend_buffer_t buf_output = nullptr;
+
+        size_t  logits_size      = 0;
+        float * logits           = nullptr;
+        size_t  top_logits_size  = 0;
+        float * top_logits       = nullptr;
+        bool    top_logits_valid = false;
+        size_t  embd_size        = 0;
+        float * embd             = nullptr;
+
+        std::vector<int32_t> output_ids;
+        size_t  output_size = 0;
+        int32_t n_outputs   = 0;
+
+        std::map<llama_seq_id, std::vector<float>> embd_seq;
+    } output_spare;
+
+    // asynchronous decode (llama_decode_async): the batch is copied and evaluated on async_worker
+    std::thread             async_worker;
+    std::mutex              async_mutex;
+    std::condition_variable async_cv;
+    bool    async_queued = false; // a batch has been submitted but not picked up yet
+    bool    async_busy   = false; // a batch has been submitted and not finished yet
+    bool    async_stop   = false;
+    int32_t async_result = 0;
+
+    struct llama_batch                 async_batch = {};
+    std::vector<llama_token>           async_token;
+    std::vector<float>                 async_embd;
+    std::vector<llama_pos>             async_pos;
+    std::vector<int32_t>               async_n_seq_id;
+    std::vector<llama_seq_id>          async_seq_id_data;
+    std::vector<llama_seq_id *>        async_seq_id;
+    std::vector<int8_t>                async_logits;
+
+    // graph reuse: the graph of the last ubatch is kept allocated and evaluated again if the next ubatch has the
+    // same shape, only the views of the KV cache cells written by the ubatch are moved (see llama_decode_graph)
+    struct graph_key {
+        int32_t  n_tokens      = -1;
+        int32_t  n_outputs     = -1;
+        int32_t  n_outputs_enc = -1;
+        uint32_t n_kv          = 0;
+        uint32_t n_kv_swa      = 0;
+        bool     embd_inp      = false;
+        bool     embeddings    = false;
+        bool     causal_attn   = false;
+        bool     warmup        = false;
+
+        std::vector<lora_seq_group> lora_seq_groups;
+
+        bool operator==(const graph_key & other) const {
+            return n_tokens == other.n_tokens && n_outputs == other.n_outputs && n_outputs_enc == other.n_outputs_enc &&
+                   n_kv == other.n_kv && n_kv_swa == other.n_kv_swa && embd_inp == other.embd_inp && embeddings == other.embeddings &&
+                   causal_attn == other.causal_attn && warmup == other.warmup && lora_seq_groups == other.lora_seq_groups;
+        }
+    };
+
+    struct graph_kv_view {
+        struct ggml_tensor * tensor;
+        int64_t offs;   // view offset for graph_kv_head
+        int64_t stride; // change of the view offset per KV cell
+    };
+
+    graph_key            graph_last_key;         // key of the last decode graph, cached or not
+    struct ggml_cgraph * graph_cached = nullptr; // cleared whenever another graph is built in buf_compute_meta
+    uint32_t             graph_kv_head = 0;      // kv_self.head the cached graph was built for
+    uint32_t             graph_kv_head_swa = 0;  // kv_swa.head the cached graph was built for
+    std::vector<graph_kv_view> graph_kv_views;
+
     // whether we are computing encoder output or decoder output
     bool is_encoding = false;
 
@@ -3290,6 +3534,7 @@ struct llama_context {
     struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_shift_swa; // I32 [kv_swa.size]
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -3298,6 +3543,9 @@ struct llama_context {
     struct ggml_tensor * inp_pos_bucket;    // I32 [n_batch|n_kv, n_batch]
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
+    struct ggml_tensor * inp_lora_perm[2];  // I32 [n_batch|n_outputs] row of each token/output in the per-sequence LoRA results
+    struct ggml_tensor * inp_lora_mask[2];  // F32 [1, n_batch|n_outputs] 1 if the token/output has a per-sequence adapter
+    std::vector<struct ggml_tensor *> inp_lora_rows[2]; // I32 [n_rows] tokens/outputs of each lora_seq_group
     struct ggml_tensor * inp_scale = nullptr; // F32 [n_tokens]
 };
 
@@ -3464,13 +3712,42 @@ static size_t llama_get_device_memory(const llama_model & model, int device) {
 // kv cache helpers
 //
 
+// CPU buffer type for the KV cache of layer il, or for the compute buffers if il < 0,
+// honoring the huge page and NUMA settings of the context
+static ggml_backend_buffer_type_t llama_cpu_buffer_type_for(const llama_cparams & cparams, ggml_backend_buffer_type_t buft, int il, int n_layer) {
+    if (buft != ggml_backend_cpu_buffer_type()) {
+        // GPU or pinned host memory
+        return buft;
+    }
+    if (cparams.huge_page_size == 0 && cparams.numa_mem == LLAMA_NUMA_MEM_POLICY_NONE) {
+        return buft;
+    }
+    size_t page_size = 0;
+    if (cparams.huge_page_size < 0) {
+        page_size = ggml_backend_cpu_default_hugepage_size();
+    } else if (cparams.huge_page_size > 0) {
+        page_size = (size_t)cparams.huge_page_size*1024*1024;
+    }
+    int numa_node = GGML_NUMA_NODE_ANY;
+    const int n_nodes = ggml_numa_n_nodes();
+    if (cparams.numa_mem == LLAMA_NUMA_MEM_POLICY_INTERLEAVE || (cparams.numa_mem == LLAMA_NUMA_MEM_POLICY_BIND && il < 0)) {
+        numa_node = GGML_NUMA_NODE_INTERLEAVE;
+    } else if (cparams.numa_mem == LLAMA_NUMA_MEM_POLICY_BIND && n_nodes > 1) {
+        numa_node = il*n_nodes/std::max(n_layer, 1);
+    }
+    return ggml_backend_cpu_hugepage_buffer_type(page_size, numa_node);
+}
+
+// type_k and type_v hold the cache types of each layer
+// layer_filter selects the layers stored in the cache (all if not set), the other layers have no tensors in it
 static bool llama_kv_cache_init(
              struct llama_kv_cache & cache,
                const llama_context * ctx,
-                         ggml_type   type_k,
-                         ggml_type   type_v,
+  const std::vector<ggml_type>     & type_k,
+  const std::vector<ggml_type>     & type_v,
                           uint32_t   kv_size,
-                              bool   offload) {
+                              bool   offload,
+   const std::function<bool(int)> & layer_filter = nullptr) {
     const llama_model & model = ctx->model;
     const llama_cparams & cparams = ctx->cparams;
 
@@ -3488,9 +3765,6 @@ static bool llama_kv_cache_init(
     cache.size = kv_size;
     cache.used = 0;
 
-    cache.type_k  = type_k;
-    cache.type_v  = type_v;
-
     cache.cells.clear();
     cache.cells.resize(kv_size);
 
@@ -3502,13 +3776,14 @@ static bool llama_kv_cache_init(
     }
 
     // count used buffer types
+    std::vector<ggml_backend_buffer_type_t> buft_layer(n_layer);
     std::map<ggml_backend_buffer_type_t, int> buft_layer_count;
-    if (offload) {
-        for (int64_t i = 0; i < n_layer; ++i) {
-            buft_layer_count[model.buft_layer[i].buft]++;
+    for (int64_t i = 0; i < n_layer; ++i) {
+        auto buft = offload ? model.buft_layer[i].buft : llama_default_buffer_type_cpu(true);
+        buft_layer[i] = llama_cpu_buffer_type_for(cparams, buft, i, n_layer);
+        if (!layer_filter || layer_filter(i)) {
+            buft_layer_count[buft_layer[i]]++;
         }
-    } else {
-        buft_layer_count[llama_default_buffer_type_cpu(true)] = n_layer;
     }
 
     // create a context for each buffer type
@@ -3563,6 +3838,12 @@ static bool llama_kv_cache_init(
     bool warn = true;
     int n_mla = 0;
     for (int i = 0; i < (int) n_layer; i++) {
+        if (layer_filter && !layer_filter(i)) {
+            cache.k_l.push_back(nullptr);
+            if (needs_v_cache) cache.v_l.push_back(nullptr);
+            continue;
+        }
+
         const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(i) + hparams.n_embd_k_s();
         const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(i) + hparams.n_embd_v_s();
         const uint32_t n_head       = hparams.n_head(i);
@@ -3570,7 +3851,7 @@ static bool llama_kv_cache_init(
         const uint32_t n_embd_head_k= hparams.n_embd_head_k;
 
 
-        struct ggml_context * ctx = offload ? ctx_map.at(model.buft_layer[i].buft) : cache.ctxs.front();
+        struct ggml_context * ctx = ctx_map.at(buft_layer[i]);
         ggml_tensor * k;
         ggml_tensor * v;
         if (cparams.mla_attn) {
@@ -3580,16 +3861,16 @@ static bool llama_kv_cache_init(
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
             //LLAMA_LOG_INFO("%s: layer %d: n_embd_head_qk_rope = %d, kv_lora_rank = %d\n", __func__, i, n_embd_head_qk_rope, kv_lora_rank);
             if (cparams.flash_attn) {
-                ggml_tensor * kv = ggml_new_tensor_2d(ctx, cache.type_k, kv_lora_rank + n_embd_head_qk_rope, kv_size);
+                ggml_tensor * kv = ggml_new_tensor_2d(ctx, type_k[i], kv_lora_rank + n_embd_head_qk_rope, kv_size);
                 ggml_format_name(kv, "cache_k_l%d", i);
                 cache.k_l.push_back(kv);
             } else {
-                auto kv_type = cparams.mla_attn == 1 ? cache.type_k : cache.type_v;
+                auto kv_type = cparams.mla_attn == 1 ? type_k[i] : type_v[i];
                 ggml_tensor * kv = ggml_new_tensor_2d(ctx, kv_type, kv_lora_rank + n_embd_head_qk_rope, kv_size);
                 ggml_format_name(kv, "cache_k_l%d", i);
                 cache.k_l.push_back(kv);
                 if (cparams.mla_attn == 1) {
-                    ggml_tensor * kvt = ggml_new_tensor_1d(ctx, cache.type_v, kv_lora_rank*kv_size);
+                    ggml_tensor * kvt = ggml_new_tensor_1d(ctx, type_v[i], kv_lora_rank*kv_size);
                     ggml_format_name(kvt, "cache_v_l%d", i);
                     cache.v_l.push_back(kvt);
                 }
@@ -3597,8 +3878,8 @@ static bool llama_kv_cache_init(
             n_mla++;
         }
         else {
-            k = ggml_new_tensor_2d(ctx, type_k, n_embd_head_k, n_head_kv*kv_size);
-            v = ggml_new_tensor_1d(ctx, type_v, n_embd_v_gqa*kv_size);
+            k = ggml_new_tensor_2d(ctx, type_k[i], n_embd_head_k, n_head_kv*kv_size);
+            v = ggml_new_tensor_1d(ctx, type_v[i], n_embd_v_gqa*kv_size);
             ggml_format_name(k, "cache_k_l%d", i);
             ggml_format_name(v, "cache_v_l%d", i);
             cache.k_l.push_back(k);
@@ -3967,6 +4248,58 @@ static llama_pos llama_kv_cache_seq_pos_max(struct llama_kv_cache & cache, llama
     return result;
 }
 
+// smallest position of the sequence in the cache, -1 if the sequence is empty
+static llama_pos llama_kv_cache_seq_pos_min(const struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    llama_pos result = -1;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id) && (result < 0 || cache.cells[i].pos < result)) {
+            result = cache.cells[i].pos;
+        }
+    }
+
+    return result;
+}
+
+// free the cells of the sliding window attention cache that are outside the attention window of the tokens of the batch
+// since positions only increase within a sequence, no later token of the sequence attends to these cells either
+static void llama_kv_cache_swa_prune(
+           struct llama_kv_cache & cache,
+         const llama_hparams     & hparams,
+        const struct llama_batch & batch) {
+    // smallest position of each sequence in the batch
+    std::map<llama_seq_id, llama_pos> seq_pos_min;
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            auto it = seq_pos_min.find(batch.seq_id[i][j]);
+            if (it == seq_pos_min.end()) {
+                seq_pos_min.emplace(batch.seq_id[i][j], batch.pos[i]);
+            } else {
+                it->second = std::min(it->second, batch.pos[i]);
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        llama_kv_cell & cell = cache.cells[i];
+        if (cell.pos < 0 || cell.is_empty()) {
+            continue;
+        }
+
+        for (const auto & it : seq_pos_min) {
+            if (cell.has_seq_id(it.first) && hparams.is_masked_swa(cell.pos, it.second)) {
+                cell.seq_id.erase(it.first);
+            }
+        }
+
+        if (cell.is_empty()) {
+            cache.used--;
+            cell.pos = -1;
+        }
+    }
+}
+
 static void llama_kv_cache_defrag(struct llama_kv_cache & cache) {
     cache.do_defrag = true;
 }
@@ -4217,6 +4550,8 @@ struct llama_model_loader {
 
         ggml_tensor * tensor;
 
+        bool split = false; // loaded as separate tensors of its row ranges instead (split_tensor_rows)
+
         llama_tensor_weight(const llama_file * file, uint16_t idx, const char * name, const struct gguf_context * gguf_ctx, ggml_tensor * tensor) : idx(idx), tensor(tensor) {
             const int tensor_idx = gguf_find_tensor(gguf_ctx, name);
             offs = gguf_get_data_offset(gguf_ctx) + gguf_get_tensor_offset(gguf_ctx, tensor_idx);
@@ -4225,6 +4560,8 @@ struct llama_model_loader {
                 throw std::runtime_error(format("tensor '%s' data is not within the file bounds, model is corrupted or incomplete", name));
             }
         }
+
+        llama_tensor_weight(uint16_t idx, size_t offs, ggml_tensor * tensor) : idx(idx), offs(offs), tensor(tensor) {}
     };
     std::vector<llama_tensor_weight> weights;
 
@@ -4835,6 +5172,37 @@ struct llama_model_loader {
         return tensor;
     }
 
+    // makes consecutive row ranges of a 2D tensor in the file available as separate tensors, named parts[k].first
+    // with parts[k].second rows, for buffers that cannot hold views (split buffers)
+    void split_tensor_rows(const std::string & name, const std::vector<std::pair<std::string, int64_t>> & parts) {
+        for (auto & weight : weights) {
+            if (name == weight.tensor->name) {
+                weight.split = true;
+            }
+        }
+        const llama_tensor_weight w = require_weight(name.c_str());
+
+        ggml_init_params params = {
+            /*.mem_size   =*/ parts.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context * ctx = ggml_init(params);
+        contexts.push_back(ctx);
+
+        int64_t n_rows = 0;
+        for (const auto & part : parts) {
+            ggml_tensor * t = ggml_new_tensor_2d(ctx, w.tensor->type, w.tensor->ne[0], part.second);
+            ggml_set_name(t, part.first.c_str());
+            weights.emplace_back(w.idx, w.offs + n_rows*w.tensor->nb[1], t);
+            n_rows += part.second;
+        }
+        GGML_ASSERT(n_rows == w.tensor->ne[1]);
+
+        // the parts are created instead of the tensor
+        n_tensors += parts.size() - 1;
+    }
+
     void done_getting_tensors() const {
         if (n_created != n_tensors) {
             throw std::runtime_error(format("%s: wrong number of tensors; expected %d, got %d", __func__, n_tensors, n_created));
@@ -4859,7 +5227,7 @@ struct llama_model_loader {
 
         // compute the total size of all tensors for progress reporting
         for (auto & w : weights) {
-            size_data += ggml_nbytes(w.tensor);
+            size_data += w.split ? 0 : ggml_nbytes(w.tensor);
         }
     }
 
@@ -5773,6 +6141,7 @@ static void llm_load_hparams(
         case LLM_ARCH_GEMMA2:
             {
                 hparams.n_swa = 4096; // default value of gemma 2
+                hparams.n_swa_pattern = 2; // pattern: 1 sliding - 1 full
                 ml.get_key(LLM_KV_ATTENTION_SLIDING_WINDOW, hparams.n_swa, false);
                 ml.get_key(LLM_KV_ATTENTION_LAYERNORM_RMS_EPS, hparams.f_norm_rms_eps);
                 ml.get_key(LLM_KV_ATTN_LOGIT_SOFTCAPPING, hparams.f_attn_logit_softcapping, false);
@@ -6505,6 +6874,10 @@ static void llm_load_vocab(
     }
     GGML_ASSERT(vocab.id_to_token.size() == vocab.token_to_id.size());
 
+    if (vocab.type == LLAMA_VOCAB_TYPE_BPE) {
+        vocab.init_bpe();
+    }
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         // For Fill-In-the-Middle (FIM)/infill models which where converted
@@ -7181,6 +7554,11 @@ static void llm_prepare_mla(llama_model & model, int mla) {
     ggml_free(ctx);
 }
 
+// architectures that can load Q/K/V and ffn_gate/ffn_up as one tensor (see create_fused in llm_load_tensors)
+static bool llm_arch_supports_fused_weights(llm_arch arch) {
+    return arch == LLM_ARCH_LLAMA || arch == LLM_ARCH_GRANITE || arch == LLM_ARCH_GRANITE_MOE;
+}
+
 // Returns false if cancelled by progress_callback
 static bool llm_load_tensors(
         llama_model_loader & ml,
@@ -7191,6 +7569,7 @@ static bool llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool fuse_weights,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -7295,6 +7674,9 @@ static bool llm_load_tensors(
     // for moe merged tensors
     ctx_size += ggml_tensor_overhead()*n_layer*3;
 
+    // for fused Q/K/V and ffn_gate/ffn_up weights
+    ctx_size += ggml_tensor_overhead()*n_layer*5;
+
     std::map<ggml_backend_buffer_type_t, ggml_context *> ctx_map;
     for (auto & it : buft_layer_count) {
         struct ggml_init_params params = {
@@ -7364,21 +7746,115 @@ static bool llm_load_tensors(
 
         model.layers.resize(n_layer);
 
-        auto create_tensor = [&ml, &ctx_map, &ctx_for_buft] (ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, int flags = 0) {
+        auto buft_override = [&ml] (const std::string & name) -> ggml_backend_buffer_type_t {
             if (ml.tensor_buft_overrides) {
                 for (const auto * overrides = ml.tensor_buft_overrides; overrides->pattern != nullptr; ++overrides) {
                     std::regex pattern(overrides->pattern);
                     if (std::regex_search(name, pattern)) {
-                        LLAMA_LOG_INFO("Tensor %s buffer type overriden to %s\n", name.c_str(), ggml_backend_buft_name(overrides->buft));
-                        ctx = ctx_for_buft(overrides->buft);
-                        break;
+                        return overrides->buft;
                     }
                 }
             }
+            return nullptr;
+        };
+
+        auto create_tensor = [&ml, &ctx_for_buft, &buft_override] (ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, int flags = 0) {
+            if (auto buft = buft_override(name)) {
+                LLAMA_LOG_INFO("Tensor %s buffer type overriden to %s\n", name.c_str(), ggml_backend_buft_name(buft));
+                ctx = ctx_for_buft(buft);
+            }
             return ml.create_tensor(ctx, name, ne, flags);
         };
 
         const auto tn = LLM_TN(model.arch);
+
+        // 2D weights that multiply the same activations (Q/K/V, ffn_gate/ffn_up) as the rows of one tensor,
+        // so that the graph can use a single matrix multiplication (see llm_build_lora_mm_fused)
+        // the parts become views of the fused tensor, which is
+        //  - read from the model file if it has been stored so by llama-quantize --fuse-weights
+        //  - otherwise created from the parts when fuse_weights is set and they all have the same type,
+        //    which requires disabling mmap
+        // returns false if the parts have to be created as separate tensors
+        auto create_fused = [&](int i, llm_tensor fused, const std::vector<std::pair<llm_tensor, int64_t>> & parts,
+                const std::vector<ggml_tensor **> & outs) -> bool {
+            if (!llm_arch_supports_fused_weights(model.arch) || LLM_TENSOR_NAMES.at(model.arch).count(fused) == 0) {
+                return false;
+            }
+            ggml_context * ctx_split = ctx_for_layer_split(i);
+
+            int64_t n_rows = 0;
+            for (const auto & part : parts) {
+                n_rows += part.second;
+            }
+
+            const std::string fused_name = tn(fused, "weight", i);
+            const bool stored = ml.get_tensor_meta(fused_name.c_str()) != nullptr;
+
+            // split buffers (-sm row) cannot hold views: a stored fused tensor is loaded as separate parts
+            if (stored && model.buft_layer[i].buft_matrix != model.buft_layer[i].buft && !buft_override(fused_name)) {
+                std::vector<std::pair<std::string, int64_t>> part_names;
+                for (const auto & part : parts) {
+                    part_names.emplace_back(tn(part.first, "weight", i), part.second);
+                }
+                ml.check_tensor_dims(fused_name, {n_embd, n_rows}, true);
+                ml.split_tensor_rows(fused_name, part_names);
+                return false;
+            }
+
+            ggml_tensor * base = nullptr;
+            if (stored) {
+                if (auto buft = buft_override(fused_name)) {
+                    ctx_split = ctx_for_buft(buft);
+                }
+                base = create_tensor(ctx_split, fused_name, {n_embd, n_rows});
+            } else {
+                // the graph uses the fused tensor only in host buffers (see llm_build_lora_mm_fused)
+                if (!fuse_weights || model.buft_layer[i].buft_matrix != model.buft_layer[i].buft ||
+                    !ggml_backend_buft_is_host(model.buft_layer[i].buft_matrix)) {
+                    return false;
+                }
+                ggml_type type = GGML_TYPE_COUNT;
+                for (const auto & part : parts) {
+                    const std::string name = tn(part.first, "weight", i);
+                    const ggml_tensor * meta = ml.get_tensor_meta(name.c_str());
+                    if (!meta || meta->ne[0] != n_embd || meta->ne[1] != part.second || ggml_n_dims(meta) != 2 ||
+                        (type != GGML_TYPE_COUNT && meta->type != type) || buft_override(name)) {
+                        return false;
+                    }
+                    type = meta->type;
+                }
+                base = ggml_new_tensor_2d(ctx_split, type, n_embd, n_rows);
+                ggml_set_name(base, fused_name.c_str());
+                use_mmap_buffer = false;
+            }
+
+            std::vector<ggml_tensor *> views;
+            size_t offset = 0;
+            for (size_t k = 0; k < parts.size(); ++k) {
+                const std::string name = tn(parts[k].first, "weight", i);
+                if (stored) {
+                    *outs[k] = ggml_view_2d(ctx_split, base, n_embd, parts[k].second, base->nb[1], offset);
+                    ggml_set_name(*outs[k], name.c_str());
+                } else {
+                    *outs[k] = ml.create_tensor_as_view(ctx_split, base, name, {n_embd, parts[k].second}, offset);
+                }
+                offset += parts[k].second*base->nb[1];
+                views.push_back(*outs[k]);
+            }
+            model.fused_weights.emplace_back(base, std::move(views));
+            return true;
+        };
+
+        // optional classification head of cross-encoders (dense + tanh, then the output projection)
+        auto create_cls_head = [&]() {
+            const struct ggml_tensor * meta = ml.get_tensor_meta(tn(LLM_TENSOR_CLS_OUT, "weight").c_str());
+            const int64_t n_cls_out = meta ? meta->ne[1] : 1;
+
+            model.cls       = create_tensor(ctx_output_split, tn(LLM_TENSOR_CLS,     "weight"), {n_embd, n_embd},    llama_model_loader::TENSOR_NOT_REQUIRED);
+            model.cls_b     = create_tensor(ctx_output,       tn(LLM_TENSOR_CLS,     "bias"),   {n_embd},            llama_model_loader::TENSOR_NOT_REQUIRED);
+            model.cls_out   = create_tensor(ctx_output_split, tn(LLM_TENSOR_CLS_OUT, "weight"), {n_embd, n_cls_out}, llama_model_loader::TENSOR_NOT_REQUIRED);
+            model.cls_out_b = create_tensor(ctx_output,       tn(LLM_TENSOR_CLS_OUT, "bias"),   {n_cls_out},         llama_model_loader::TENSOR_NOT_REQUIRED);
+        };
         switch (model.arch) {
             case LLM_ARCH_LLAMA:
             case LLM_ARCH_REFACT:
@@ -7407,9 +7883,13 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        if (!create_fused(i, LLM_TENSOR_ATTN_QKV,
+                                    {{LLM_TENSOR_ATTN_Q, n_embd_head_k * n_head}, {LLM_TENSOR_ATTN_K, n_embd_k_gqa}, {LLM_TENSOR_ATTN_V, n_embd_v_gqa}},
+                                    {&layer.wq, &layer.wk, &layer.wv})) {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                        }
                         layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
 
                         // optional bias tensors
@@ -7423,9 +7903,12 @@ static bool llm_load_tensors(
                         layer.rope_freqs = create_tensor(ctx_layer, tn(LLM_TENSOR_ROPE_FREQS, "weight"), {n_embd/n_head/2}, llama_model_loader::TENSOR_NOT_REQUIRED | (i != 0 ? llama_model_loader::TENSOR_DUPLICATED : 0));
 
                         if (n_expert == 0) {
-                            layer.ffn_gate = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff});
+                            if (!create_fused(i, LLM_TENSOR_FFN_GATE_UP, {{LLM_TENSOR_FFN_GATE, n_ff}, {LLM_TENSOR_FFN_UP, n_ff}},
+                                        {&layer.ffn_gate, &layer.ffn_up})) {
+                                layer.ffn_gate = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff});
+                                layer.ffn_up   = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff});
+                            }
                             layer.ffn_down = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd});
-                            layer.ffn_up   = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff});
 
                             // optional MLP bias
                             layer.ffn_gate_b = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, llama_model_loader::TENSOR_NOT_REQUIRED);
@@ -7810,6 +8293,10 @@ static bool llm_load_tensors(
                     model.tok_norm   = create_tensor(ctx_output, tn(LLM_TENSOR_TOKEN_EMBD_NORM, "weight"), {n_embd});
                     model.tok_norm_b = create_tensor(ctx_output, tn(LLM_TENSOR_TOKEN_EMBD_NORM, "bias"),   {n_embd});
 
+                    if (model.arch == LLM_ARCH_BERT) {
+                        create_cls_head();
+                    }
+
                     for (int i = 0; i < n_layer; ++i) {
                         ggml_context * ctx_layer = ctx_for_layer(i);
                         ggml_context * ctx_split = ctx_for_layer_split(i);
@@ -7857,6 +8344,8 @@ static bool llm_load_tensors(
                     model.tok_norm   = create_tensor(ctx_output, tn(LLM_TENSOR_TOKEN_EMBD_NORM, "weight"), {n_embd}); // LayerNorm
                     model.tok_norm_b = create_tensor(ctx_output, tn(LLM_TENSOR_TOKEN_EMBD_NORM, "bias"),   {n_embd}); //LayerNorm bias
 
+                    create_cls_head();
+
                     for (int i = 0; i < n_layer; ++i) {
                         ggml_context * ctx_layer = ctx_for_layer(i);
                         ggml_context * ctx_split = ctx_for_layer_split(i);
@@ -9497,8 +9986,16 @@ static bool llm_load_tensors(
     }
 
     // populate tensors_by_name
+    // fused weights are listed by their parts, so that each weight is found under its usual name and counted once
+    std::set<const ggml_tensor *> fused_bases;
+    for (const auto & fused : model.fused_weights) {
+        fused_bases.insert(fused.first);
+    }
     for (ggml_context * ctx : model.ctxs) {
         for (auto * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            if (fused_bases.count(cur)) {
+                continue;
+            }
             model.tensors_by_name.emplace_back(ggml_get_name(cur), cur);
         }
     }
@@ -9512,6 +10009,15 @@ static bool llm_load_tensors(
         }
     }
 
+    // the parts of fused weights read from a memory mapped file are views of the mapped tensor
+    for (const auto & fused : model.fused_weights) {
+        for (auto * part : fused.second) {
+            if (part->buffer == nullptr) {
+                ggml_backend_view_init(part);
+            }
+        }
+    }
+
     llm_prepare_mla(model, mla_attn);
 
     if (use_mmap_buffer) {
@@ -9541,6 +10047,14 @@ static bool llm_load_tensors(
             }
         }
         if (n_repacked > 0) printf("============ Repacked %d tensors\n", n_repacked);
+
+        // the parts of fused weights are repacked in place, the fused tensor can only be used if they all still have the same type
+        for (const auto & fused : model.fused_weights) {
+            auto type = fused.second.front()->type;
+            if (std::all_of(fused.second.begin(), fused.second.end(), [type](const ggml_tensor * part) { return part->type == type; })) {
+                fused.first->type = type;
+            }
+        }
     }
 
     if (model.arch == LLM_ARCH_BITNET) {
@@ -9575,6 +10089,47 @@ static bool llm_load_tensors(
     return true;
 }
 
+// partition the rows of the CPU weight matrices between NUMA nodes so that matrix multiplications
+// only read weights from the node the thread is running on (see ggml_numa_shard_tensor)
+static void llm_numa_shard_tensors(llama_model & model, bool use_mmap) {
+    if (!ggml_numa_can_shard()) {
+        LLAMA_LOG_WARN("%s: NUMA sharding requires the distribute NUMA strategy on a system with more than one node - ignoring\n", __func__);
+        return;
+    }
+    if (use_mmap) {
+        LLAMA_LOG_WARN("%s: with mmap, pages that are shared with the page cache may not be migrated - consider using --no-mmap\n", __func__);
+    }
+    // the matrix multiplications with fused weights use the fused tensor, so that one is sharded instead of its parts
+    std::map<const ggml_tensor *, ggml_tensor *> fused_parts;
+    for (const auto & fused : model.fused_weights) {
+        for (const auto * part : fused.second) {
+            fused_parts[part] = fused.first;
+        }
+    }
+    std::set<const ggml_tensor *> sharded;
+    int n_sharded = 0;
+    size_t size_sharded = 0;
+    for (auto & it : model.tensors_by_name) {
+        auto * t = it.second;
+        if (auto fp = fused_parts.find(t); fp != fused_parts.end()) {
+            t = fp->second;
+        }
+        if (!sharded.insert(t).second) {
+            continue;
+        }
+        // MoE expert tensors go through MUL_MAT_ID, which does not use the NUMA row split
+        if (!t->buffer || !ggml_backend_buffer_is_host(t->buffer) || ggml_n_dims(t) != 2) {
+            continue;
+        }
+        if (ggml_numa_shard_tensor(t)) {
+            ++n_sharded;
+            size_sharded += ggml_nbytes(t);
+        }
+    }
+    LLAMA_LOG_INFO("%s: sharded %d tensors (%.2f MiB) between %d NUMA nodes\n", __func__, n_sharded,
+            size_sharded/1024.0/1024.0, ggml_numa_n_nodes());
+}
+
 // Returns 0 on success, -1 on error, and -2 on cancellation via llama_progress_callback
 static int llama_model_load(const std::string & fname, llama_model & model, llama_model_params & params) {
     try {
@@ -9629,11 +10184,15 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 #endif
 
         if (!llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.mla, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock,
+            ml, model, params.n_gpu_layers, params.mla, params.split_mode,  params.main_gpu, params.tensor_split, params.use_mlock, params.fuse_weights,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
         }
+
+        if (params.numa_shard) {
+            llm_numa_shard_tensors(model, ml.use_mmap);
+        }
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error loading model: %s\n", __func__, err.what());
         return -1;
@@ -9711,8 +10270,6 @@ static void llm_build_kv_store(
                     int32_t   kv_head,
          const llm_build_cb & cb,
                     int64_t   il) {
-    const int64_t n_ctx = cparams.n_ctx;
-
     const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
     const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
@@ -9721,7 +10278,8 @@ static void llm_build_kv_store(
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
     const int64_t n_embd_head_v = hparams.n_embd_head_v;
 
-    GGML_ASSERT(kv.size == n_ctx);
+    // the sliding window attention layers may use a smaller cache
+    const int64_t n_ctx = kv.size;
 
     //struct ggml_tensor * k_cache_view = ggml_view_1d(ctx, kv.k_l[il], n_tokens*n_embd_k_gqa,
     //        (ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa))*kv_head);
@@ -9752,6 +10310,129 @@ static void llm_build_kv_store(
     ggml_build_forward_expand(graph, ggml_cpy(ctx, v_cur, v_cache_view));
 }
 
+// input tensors of the per-sequence LoRA adapters, created on first use
+static void llm_build_lora_seq_inputs(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+                         int   k) {
+    if (lctx.inp_lora_perm[k]) {
+        return;
+    }
+
+    const int64_t n = lctx.lora_seq_rows[k].size();
+
+    lctx.inp_lora_perm[k] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n);
+    ggml_format_name(lctx.inp_lora_perm[k], "inp_lora_perm-%d", k);
+    ggml_set_input(lctx.inp_lora_perm[k]);
+
+    lctx.inp_lora_mask[k] = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 1, n);
+    ggml_format_name(lctx.inp_lora_mask[k], "inp_lora_mask-%d", k);
+    ggml_set_input(lctx.inp_lora_mask[k]);
+
+    lctx.inp_lora_rows[k].assign(lctx.lora_seq_groups.size(), nullptr);
+    for (size_t ig = 0; ig < lctx.lora_seq_groups.size(); ++ig) {
+        const int32_t n_rows = lctx.lora_seq_groups[ig].n_rows[k];
+        if (n_rows > 0) {
+            struct ggml_tensor * rows = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_rows);
+            ggml_format_name(rows, "inp_lora_rows-%d-%d", k, (int) ig);
+            ggml_set_input(rows);
+            lctx.inp_lora_rows[k][ig] = rows;
+        }
+    }
+}
+
+static struct ggml_tensor * llm_build_lora_ab(
+         struct ggml_context * ctx0,
+  struct llama_lora_adapter * adapter,
+    struct llama_lora_weight * lora,
+                        float   user_scale,
+          struct ggml_tensor * cur) {
+    const float alpha = adapter->alpha;
+    const float rank  = (float) lora->b->ne[0];
+    const float scale = alpha ? user_scale * alpha / rank : user_scale;
+    struct ggml_tensor * ab_cur = ggml_mul_mat(
+        ctx0, lora->b,
+        ggml_mul_mat(ctx0, lora->a, cur)
+    );
+    return ggml_scale(ctx0, ab_cur, scale);
+}
+
+// add the per-sequence LoRA adapters of the ubatch to res = w*cur (segmented low-rank matmul)
+// the rows of each adapter are gathered and multiplied by its A/B pair, the results are written one after the other
+// into a single buffer which is then gathered back in token order
+static struct ggml_tensor * llm_build_lora_seq_mm(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,
+          struct ggml_tensor * cur,
+          struct ggml_tensor * res) {
+    const auto & groups = lctx.lora_seq_groups;
+
+    // the last layer may already be reduced to the outputs
+    int k;
+    if (cur->ne[1] == (int64_t) lctx.lora_seq_rows[0].size()) {
+        k = 0;
+    } else if (cur->ne[1] == (int64_t) lctx.lora_seq_rows[1].size()) {
+        k = 1;
+    } else {
+        return res;
+    }
+    if (cur->ne[1] == 0 || cur->ne[2] != 1 || cur->ne[3] != 1) {
+        return res;
+    }
+
+    int64_t n_rows = 0;
+    bool    used   = false;
+    for (const auto & g : groups) {
+        n_rows += g.n_rows[k];
+        used = used || (g.n_rows[k] > 0 && g.adapter->get_weight(w) != nullptr);
+    }
+    if (!used) {
+        return res;
+    }
+
+    // all rows use the same adapter
+    if (groups.size() == 1 && n_rows == cur->ne[1]) {
+        return ggml_add(ctx0, res, llm_build_lora_ab(ctx0, groups[0].adapter, groups[0].adapter->get_weight(w), groups[0].scale, cur));
+    }
+
+    llm_build_lora_seq_inputs(lctx, ctx0, k);
+
+    // the results of the first group are padded with zeros to all rows, the other groups are written in place
+    struct ggml_tensor * ab_all = nullptr;
+
+    int64_t i_row = 0;
+    for (size_t ig = 0; ig < groups.size(); ++ig) {
+        const auto & g = groups[ig];
+        if (g.n_rows[k] == 0) {
+            continue;
+        }
+
+        struct llama_lora_weight * lora = g.adapter->get_weight(w);
+
+        if (ab_all == nullptr) {
+            struct ggml_tensor * ab;
+            if (lora) {
+                ab = llm_build_lora_ab(ctx0, g.adapter, lora, g.scale, ggml_get_rows(ctx0, cur, lctx.inp_lora_rows[k][ig]));
+            } else {
+                // the adapter does not modify w
+                ab = ggml_scale(ctx0, ggml_get_rows(ctx0, res, lctx.inp_lora_rows[k][ig]), 0.0f);
+            }
+            ab_all = ggml_pad(ctx0, ab, 0, n_rows - g.n_rows[k], 0, 0);
+        } else if (lora) {
+            struct ggml_tensor * ab = llm_build_lora_ab(ctx0, g.adapter, lora, g.scale, ggml_get_rows(ctx0, cur, lctx.inp_lora_rows[k][ig]));
+            ab_all = ggml_set_2d_inplace(ctx0, ab_all, ab, ab_all->nb[1], i_row*ab_all->nb[1]);
+        }
+
+        i_row += g.n_rows[k];
+    }
+
+    struct ggml_tensor * ab_cur = ggml_get_rows(ctx0, ab_all, lctx.inp_lora_perm[k]);
+    ab_cur = ggml_mul(ctx0, ab_cur, lctx.inp_lora_mask[k]);
+
+    return ggml_add(ctx0, res, ab_cur);
+}
+
 // do mat_mul, while optionally apply lora
 static struct ggml_tensor * llm_build_lora_mm(
         struct llama_context & lctx,
@@ -9764,34 +10445,88 @@ static struct ggml_tensor * llm_build_lora_mm(
         if (lora == nullptr) {
             continue;
         }
-        const float alpha = it.first->alpha;
-        const float rank  = (float) lora->b->ne[0];
-        const float scale = alpha ? it.second * alpha / rank : it.second;
-        struct ggml_tensor * ab_cur = ggml_mul_mat(
-            ctx0, lora->b,
-            ggml_mul_mat(ctx0, lora->a, cur)
-        );
-        ab_cur = ggml_scale(ctx0, ab_cur, scale);
-        res = ggml_add(ctx0, res, ab_cur);
+        res = ggml_add(ctx0, res, llm_build_lora_ab(ctx0, it.first, lora, it.second, cur));
+    }
+    if (!lctx.lora_seq_groups.empty()) {
+        res = llm_build_lora_seq_mm(lctx, ctx0, w, cur, res);
     }
     return res;
 }
 
-// do mat_mul_id, while optionally apply lora
-static struct ggml_tensor * llm_build_lora_mm_id(
+// multiply cur with weights that are consecutive row ranges of one fused tensor (see create_fused in llm_load_tensors)
+// with a single mat_mul, res receives the results for the individual weights as views
+// returns false if the weights are not fused or LoRA adapters apply to them
+static bool llm_build_lora_mm_fused(
         struct llama_context & lctx,
          struct ggml_context * ctx0,
-          struct ggml_tensor * w,   // struct ggml_tensor * as
-          struct ggml_tensor * cur, // struct ggml_tensor * b
-          struct ggml_tensor * ids) {
-    struct ggml_tensor * res = ggml_mul_mat_id(ctx0, w, cur, ids);
-    for (auto & it : lctx.lora_adapters) {
-        struct llama_lora_weight * lora = it.first->get_weight(w);
-        if (lora == nullptr) {
-            continue;
+        const std::vector<ggml_tensor *> & ws,
+          struct ggml_tensor * cur,
+        std::vector<ggml_tensor *> & res) {
+    ggml_tensor * base = ws.front() ? ws.front()->view_src : nullptr;
+    if (!base || ggml_n_dims(base) != 2 || !lctx.lora_seq_groups.empty()) {
+        return false;
+    }
+    // the ops that use the strided views of the result (e.g. FUSED_MUL_UNARY) are not supported by all backends,
+    // a stored fused tensor in another buffer is multiplied by its parts
+    if (!base->buffer || !ggml_backend_buffer_is_host(base->buffer)) {
+        return false;
+    }
+    int64_t n_rows = 0;
+    for (auto * w : ws) {
+        if (!w || w->view_src != base || w->type != base->type || w->ne[0] != base->ne[0] ||
+            w->view_offs != n_rows*base->nb[1]) {
+            return false;
         }
-        const float alpha = it.first->alpha;
-        const float rank  = (float) lora->b->ne[0];
+        for (auto & it : lctx.lora_adapters) {
+            if (it.first->get_weight(w)) {
+                return false;
+            }
+        }
+        n_rows += w->ne[1];
+    }
+    if (n_rows != base->ne[1]) {
+        return false;
+    }
+
+    ggml_tensor * mm = ggml_mul_mat(ctx0, base, cur);
+    res.clear();
+    n_rows = 0;
+    for (auto * w : ws) {
+        res.push_back(ggml_view_2d(ctx0, mm, w->ne[1], mm->ne[1], mm->nb[1], n_rows*ggml_element_size(mm)));
+        n_rows += w->ne[1];
+    }
+    return true;
+}
+
+// reshape that also works for the (non-contiguous) results of llm_build_lora_mm_fused
+static struct ggml_tensor * llm_build_reshape_3d(
+         struct ggml_context * ctx0,
+          struct ggml_tensor * cur,
+                     int64_t   ne0,
+                     int64_t   ne1,
+                     int64_t   ne2) {
+    if (ggml_is_contiguous(cur)) {
+        return ggml_reshape_3d(ctx0, cur, ne0, ne1, ne2);
+    }
+    GGML_ASSERT(ne0*ne1 == cur->ne[0] && ne2 == cur->ne[1]);
+    return ggml_view_3d(ctx0, cur, ne0, ne1, ne2, ggml_row_size(cur->type, ne0), cur->nb[1], 0);
+}
+
+// do mat_mul_id, while optionally apply lora
+static struct ggml_tensor * llm_build_lora_mm_id(
+        struct llama_context & lctx,
+         struct ggml_context * ctx0,
+          struct ggml_tensor * w,   // struct ggml_tensor * as
+          struct ggml_tensor * cur, // struct ggml_tensor * b
+          struct ggml_tensor * ids) {
+    struct ggml_tensor * res = ggml_mul_mat_id(ctx0, w, cur, ids);
+    for (auto & it : lctx.lora_adapters) {
+        struct llama_lora_weight * lora = it.first->get_weight(w);
+        if (lora == nullptr) {
+            continue;
+        }
+        const float alpha = it.first->alpha;
+        const float rank  = (float) lora->b->ne[0];
         const float scale = alpha ? it.second * alpha / rank : it.second;
         struct ggml_tensor * ab_cur = ggml_mul_mat_id(
             ctx0, lora->b,
@@ -9864,7 +10599,13 @@ static struct ggml_tensor * llm_build_ffn(
           llm_ffn_gate_type   type_gate,
          const llm_build_cb & cb,
                         int   il) {
-    struct ggml_tensor * tmp = up ? llm_build_lora_mm(lctx, ctx, up, cur) : cur;
+    // ffn_gate and ffn_up in one matrix multiplication if they have been fused at load time
+    std::vector<ggml_tensor *> gate_up;
+    const bool fused_gate_up = up && gate && type_gate == LLM_FFN_PAR && !up_b && !up_s && !gate_b && !gate_s &&
+        (type_op == LLM_FFN_SILU || type_op == LLM_FFN_RELU || (type_op == LLM_FFN_GELU && !act_scales)) &&
+        llm_build_lora_mm_fused(lctx, ctx, {gate, up}, cur, gate_up);
+
+    struct ggml_tensor * tmp = fused_gate_up ? gate_up[1] : up ? llm_build_lora_mm(lctx, ctx, up, cur) : cur;
     cb(tmp, "ffn_up", il);
 
     if (up_b) {
@@ -9886,7 +10627,7 @@ static struct ggml_tensor * llm_build_ffn(
                 } break;
             case LLM_FFN_PAR:
                 {
-                    cur = llm_build_lora_mm(lctx, ctx, gate, cur);
+                    cur = fused_gate_up ? gate_up[0] : llm_build_lora_mm(lctx, ctx, gate, cur);
                     cb(cur, "ffn_gate", il);
                 } break;
         }
@@ -10139,7 +10880,7 @@ static struct ggml_tensor * llm_build_kqv(
     const llama_hparams & hparams = lctx.model.hparams;
     const llama_cparams & cparams = lctx.cparams;
 
-    const int64_t n_ctx         = cparams.n_ctx;
+    const int64_t n_ctx         = kv.size; // the sliding window attention layers may use a smaller cache
     const int64_t n_head        = hparams.n_head(il);
     const int64_t n_head_kv     = hparams.n_head_kv(il);
     const int64_t n_embd_head_k = hparams.n_embd_head_k;
@@ -10242,8 +10983,6 @@ static struct ggml_tensor * llm_build_kqv(
             }
             cb(kq, "kq_soft_max_ext", il);
 
-            GGML_ASSERT(kv.size == n_ctx);
-
             struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
             cb(kqv, "kqv", il);
 
@@ -10360,6 +11099,7 @@ struct llm_build_context {
     const llama_cparams  & cparams;
     const llama_batch    & batch;
     const llama_kv_cache & kv_self;
+    const llama_kv_cache & kv_swa;
 
     const int64_t n_embd;
     const int64_t n_layer;
@@ -10388,6 +11128,8 @@ struct llm_build_context {
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
     const int32_t kv_head;  // index of where we store new KV data in the cache
+    const int32_t n_kv_swa;    // same as n_kv and kv_head, for the layers stored in kv_swa
+    const int32_t kv_head_swa;
     const int32_t n_ctx_orig;
 
     const bool flash_attn;
@@ -10419,6 +11161,7 @@ struct llm_build_context {
         cparams          (lctx.cparams),
         batch            (batch),
         kv_self          (lctx.kv_self),
+        kv_swa           (lctx.kv_swa),
         n_embd           (hparams.n_embd),
         n_layer          (hparams.n_layer),
         n_rot            (hparams.n_rot),
@@ -10444,6 +11187,8 @@ struct llm_build_context {
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
+        n_kv_swa         (worst_case ? kv_swa.size : kv_swa.n),
+        kv_head_swa      (worst_case ? kv_swa.size - std::min<uint32_t>(kv_swa.size, n_tokens) : kv_swa.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
         mla_attn         (cparams.mla_attn),
@@ -10467,6 +11212,9 @@ struct llm_build_context {
 
         ctx0 = ggml_init(params);
 
+        // the new graph overwrites the tensors of the cached one
+        lctx.graph_cached = nullptr;
+
         lctx.inp_tokens      = nullptr;
         lctx.inp_embd        = nullptr;
         lctx.inp_pos         = nullptr;
@@ -10474,6 +11222,7 @@ struct llm_build_context {
         lctx.inp_KQ_mask     = nullptr;
         lctx.inp_KQ_mask_swa = nullptr;
         lctx.inp_K_shift     = nullptr;
+        lctx.inp_K_shift_swa = nullptr;
         lctx.inp_mean        = nullptr;
         lctx.inp_cls         = nullptr;
         lctx.inp_s_copy      = nullptr;
@@ -10482,6 +11231,11 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        for (int k = 0; k < 2; ++k) {
+            lctx.inp_lora_perm[k] = nullptr;
+            lctx.inp_lora_mask[k] = nullptr;
+            lctx.inp_lora_rows[k].clear();
+        }
     }
 
     void free() {
@@ -10491,6 +11245,16 @@ struct llm_build_context {
         }
     }
 
+    // the cache holding the KV data of layer il, with the head and the number of cells to use in this graph
+    // (the sliding window attention layers have their own cache, unless it is full size)
+    bool uses_kv_swa(int il) const { return kv_swa.size > 0 && hparams.is_swa(il); }
+
+    const llama_kv_cache & kv_l(int il) const { return uses_kv_swa(il) ? kv_swa : kv_self; }
+
+    int32_t kv_head_l(int il) const { return uses_kv_swa(il) ? kv_head_swa : kv_head; }
+
+    int32_t n_kv_l(int il) const { return uses_kv_swa(il) ? n_kv_swa : n_kv; }
+
     struct ggml_cgraph * build_k_shift() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
@@ -10500,19 +11264,27 @@ struct llm_build_context {
         cb(lctx.inp_K_shift, "K_shift", -1);
         ggml_set_input(lctx.inp_K_shift);
 
+        if (kv_swa.size > 0) {
+            lctx.inp_K_shift_swa = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, kv_swa.size);
+            cb(lctx.inp_K_shift_swa, "K_shift_swa", -1);
+            ggml_set_input(lctx.inp_K_shift_swa);
+        }
+
         for (int il = 0; il < n_layer; ++il) {
+            const bool in_swa = kv_swa.size > 0 && kv_swa.k_l[il];
+            const llama_kv_cache & kv = in_swa ? kv_swa : kv_self;
             const int64_t n_head_kv = hparams.n_head_kv(il);
             const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
             struct ggml_tensor * rope_factors = build_rope_factors(il);
             struct ggml_tensor * tmp =
                 // we rotate only the first n_rot dimensions
                 ggml_rope_ext_inplace(ctx0,
-                        ggml_view_3d(ctx0, kv_self.k_l[il],
-                            n_embd_head_k, n_head_kv, n_ctx,
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_head_k),
-                            ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
+                        ggml_view_3d(ctx0, kv.k_l[il],
+                            n_embd_head_k, n_head_kv, kv.size,
+                            ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                            ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
                             0),
-                        lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
+                        in_swa ? lctx.inp_K_shift_swa : lctx.inp_K_shift, rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
 
             cb(tmp, "K_shifted", il);
@@ -10545,7 +11317,7 @@ struct llm_build_context {
         return gf;
     }
 
-    struct ggml_cgraph * build_defrag(const std::vector<uint32_t> & ids) {
+    struct ggml_cgraph * build_defrag(const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
         for (uint32_t i = 0; i < ids.size(); ++i) {
@@ -10562,45 +11334,50 @@ struct llm_build_context {
             }
 
             for (int il = 0; il < n_layer; ++il) {
+                if (!kv.k_l[il]) {
+                    // the layer is stored in the other cache
+                    continue;
+                }
+
                 const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
                 const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
 
-                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_src = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*i));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*i));
 
-                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv_self.k_l[il],
+                ggml_tensor * view_k_dst = ggml_view_2d(ctx0, kv.k_l[il],
                         n_embd_k_gqa, nm,
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa),
-                        ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*id));
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                        ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*id));
 
                 ggml_tensor * view_v_src = nullptr;
                 ggml_tensor * view_v_dst = nullptr;
 
-                if (kv_self.v_l.size() > il) {
+                if (kv.v_l.size() > il && kv.v_l[il]) {
                     // Note: with MLA the V cache may not be present.
                     if (flash_attn) {
                         // NOTE: the V cache is not transposed when using flash attention
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*i));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 n_embd_v_gqa, nm,
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa),
-                                ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa*id));
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa),
+                                ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa*id));
                     } else {
-                        view_v_src = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_src = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, i));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, i));
 
-                        view_v_dst = ggml_view_2d(ctx0, kv_self.v_l[il],
+                        view_v_dst = ggml_view_2d(ctx0, kv.v_l[il],
                                 nm, n_embd_v_gqa,
-                                ggml_row_size(kv_self.v_l[il]->type, kv_self.size),
-                                ggml_row_size(kv_self.v_l[il]->type, id));
+                                ggml_row_size(kv.v_l[il]->type, kv.size),
+                                ggml_row_size(kv.v_l[il]->type, id));
                     }
                 }
 
@@ -10669,7 +11446,7 @@ struct llm_build_context {
         GGML_ASSERT(hparams.n_swa > 0);
 
         lctx.inp_KQ_mask_swa = causal
-            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
+            ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, kv_swa.size > 0 ? n_kv_swa : n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
             : ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_tokens, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         cb(lctx.inp_KQ_mask_swa, "KQ_mask_swa", -1);
         ggml_set_input(lctx.inp_KQ_mask_swa);
@@ -10712,6 +11489,23 @@ struct llm_build_context {
         return lctx.inp_s_seq;
     }
 
+    struct ggml_cgraph * append_top_logits(struct ggml_cgraph * gf) {
+        struct ggml_tensor * logits = gf->nodes[gf->n_nodes - 1];
+        if (strcmp(logits->name, "result_output") != 0) {
+            return gf;
+        }
+
+        // the full logits are still read back, so keep them alive
+        ggml_set_output(logits);
+
+        struct ggml_tensor * cur = ggml_top_k_lse(ctx0, logits, cparams.n_top_logits);
+        cb(cur, "result_top_logits", -1);
+
+        ggml_build_forward_expand(gf, cur);
+
+        return gf;
+    }
+
     struct ggml_cgraph * append_pooling(struct ggml_cgraph * gf) {
         // find result_norm tensor for input
         struct ggml_tensor * inp = nullptr;
@@ -10739,6 +11533,26 @@ struct llm_build_context {
                     struct ggml_tensor * inp_cls = build_inp_cls();
                     cur = ggml_get_rows(ctx0, inp, inp_cls);
                 } break;
+            case LLAMA_POOLING_TYPE_RANK:
+                {
+                    // the classification head is applied to the first token of each sequence
+                    struct ggml_tensor * inp_cls = build_inp_cls();
+                    cur = ggml_get_rows(ctx0, inp, inp_cls);
+
+                    if (model.cls) {
+                        cur = ggml_mul_mat(ctx0, model.cls, cur);
+                        if (model.cls_b) {
+                            cur = ggml_add(ctx0, cur, model.cls_b);
+                        }
+                        cur = ggml_tanh(ctx0, cur);
+                    }
+
+                    GGML_ASSERT(model.cls_out && "pooling type rank requires a classification head");
+                    cur = ggml_mul_mat(ctx0, model.cls_out, cur);
+                    if (model.cls_out_b) {
+                        cur = ggml_add(ctx0, cur, model.cls_out_b);
+                    }
+                } break;
             case LLAMA_POOLING_TYPE_NONE:
                 {
                     cur = inp;
@@ -10855,10 +11669,21 @@ struct llm_build_context {
                 struct ggml_tensor * rope_factors = build_rope_factors(il);
 
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                std::vector<ggml_tensor *> qkv;
+                if (llm_build_lora_mm_fused(lctx, ctx0, {model.layers[il].wq, model.layers[il].wk, model.layers[il].wv}, cur, qkv)) {
+                    Qcur = qkv[0];
+                    Kcur = qkv[1];
+                    Vcur = qkv[2];
+                } else {
+                    Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
+                    Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
+                    Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
+                }
+
                 if (hparams.f_attention_scale != 0) {
                     // Why is hparams.f_attention_scale not simply absorbed into model.layers[il].wq ?
-                    Qcur = ggml_scale(ctx0, Qcur, hparams.f_attention_scale);
+                    Qcur = ggml_scale(ctx0, ggml_is_contiguous(Qcur) ? Qcur : ggml_cont(ctx0, Qcur), hparams.f_attention_scale);
                 }
                 cb(Qcur, "Qcur", il);
                 if (model.layers[il].bq) {
@@ -10866,14 +11691,12 @@ struct llm_build_context {
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -10881,15 +11704,15 @@ struct llm_build_context {
                 }
 
                 if (use_rope) {
-                    Qcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                    Qcur = ggml_rope_ext(ctx0, llm_build_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
 
-                    Kcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                    Kcur = ggml_rope_ext(ctx0, llm_build_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
                 } else if (inp_attn_scale) {
-                    Qcur = ggml_mul(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_attn_scale);
+                    Qcur = ggml_mul(ctx0, llm_build_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_attn_scale);
                 }
 
                 cb(Qcur, "Qcur", il);
@@ -10904,9 +11727,9 @@ struct llm_build_context {
                     cb(Kcur, "Kcur_normed", il);
                 }
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, kv_l(il), gf,
                         model.layers[il].wo, model.layers[il].bo,
-                        Kcur, Vcur, Qcur, this_KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il);
+                        Kcur, Vcur, Qcur, this_KQ_mask, n_tokens, kv_head_l(il), n_kv_l(il), kq_scale, cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -14336,9 +15159,9 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf,
+                cur = llm_build_kv(ctx0, lctx, kv_l(il), gf,
                         model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f, cb, il);
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head_l(il), n_kv_l(il), 1.0f, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams,
@@ -14474,8 +15297,8 @@ struct llm_build_context {
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, NULL,
-                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head, n_kv, hparams.f_attention_scale, cb, il);
+                cur = llm_build_kv(ctx0, lctx, kv_l(il), gf, model.layers[il].wo, NULL,
+                        Kcur, Vcur, Qcur, KQ_mask_l, n_tokens, kv_head_l(il), n_kv_l(il), hparams.f_attention_scale, cb, il);
             }
 
             cur = llm_build_norm(ctx0, cur, hparams, model.layers[il].attn_post_norm, NULL, LLM_NORM_RMS, cb, il);
@@ -16363,8 +17186,8 @@ struct llm_build_context {
                     cb(Kcur, "Kcur", il);
                 }
 
-                cur = llm_build_kv(ctx0, lctx, kv_self, gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
-                                   KQ_mask_l, n_tokens, kv_head, n_kv, 1.0f / sqrtf(float(n_embd_head)), cb, il);
+                cur = llm_build_kv(ctx0, lctx, kv_l(il), gf, model.layers[il].wo, model.layers[il].bo, Kcur, Vcur, Qcur,
+                                   KQ_mask_l, n_tokens, kv_head_l(il), n_kv_l(il), 1.0f / sqrtf(float(n_embd_head)), cb, il);
             }
 
             if (il == n_layer - 1) {
@@ -17391,7 +18214,7 @@ struct llm_build_context {
     }
 };
 
-static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const std::vector<uint32_t> & ids) {
+static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const llama_kv_cache & kv, const std::vector<uint32_t> & ids) {
     llama_batch dummy;
     dummy.n_tokens = 0;
 
@@ -17401,7 +18224,7 @@ static struct ggml_cgraph * llama_build_graph_defrag(llama_context & lctx, const
 
     llm.init();
 
-    struct ggml_cgraph * result = llm.build_defrag(ids);
+    struct ggml_cgraph * result = llm.build_defrag(kv, ids);
 
     llm.free();
 
@@ -17442,6 +18265,13 @@ static struct ggml_cgraph * llama_build_graph_s_copy(llama_context & lctx) {
     return result;
 }
 
+static bool llama_is_warming_up(const llama_context & lctx, const llama_batch & batch) {
+    const llama_vocab * vocab = &lctx.model.vocab;
+    llama_token bos = llama_token_bos_impl(*vocab);
+    llama_token eos = llama_token_eos_impl(*vocab);
+    return lctx.n_eval == 0 && batch.token && (batch.n_tokens == 1 && (batch.token[0] == ((bos != -1) ? bos : eos)));
+}
+
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
      const llama_batch & batch,
@@ -17485,11 +18315,14 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
-    const llama_vocab * vocab = llama_get_vocab(&lctx);
-    llama_token bos = llama_token_bos_impl(*vocab);
-    llama_token eos = llama_token_eos_impl(*vocab);
-    bool is_warming_up = lctx.n_eval == 0 && (batch.n_tokens == 1 && (batch.token[0] == ((bos != -1) ? bos : eos)));
-    struct llm_build_context llm(lctx, batch, cb, worst_case, is_warming_up);
+    if (worst_case) {
+        // the reserved graph does not depend on the sequences of a batch
+        lctx.lora_seq_groups.clear();
+        lctx.lora_seq_rows[0].clear();
+        lctx.lora_seq_rows[1].clear();
+    }
+
+    struct llm_build_context llm(lctx, batch, cb, worst_case, llama_is_warming_up(lctx, batch));
 
     llm.init();
 
@@ -17699,6 +18532,8 @@ static struct ggml_cgraph * llama_build_graph(
     // add on pooling layer
     if (lctx.cparams.embeddings) {
         result = llm.append_pooling(result);
+    } else if (lctx.cparams.n_top_logits > 0 && !lctx.is_encoding) {
+        result = llm.append_top_logits(result);
     }
 
     llm.free();
@@ -17721,6 +18556,16 @@ static void llama_set_k_shift(llama_context & lctx) {
     for (int i = 0; i < kv_size; ++i) {
         data[i] = lctx.kv_self.cells[i].delta;
     }
+
+    if (lctx.inp_K_shift_swa) {
+        assert(ggml_backend_buffer_is_host(lctx.inp_K_shift_swa->buffer));
+
+        int32_t * data_swa = (int32_t *) lctx.inp_K_shift_swa->data;
+
+        for (uint32_t i = 0; i < lctx.kv_swa.size; ++i) {
+            data_swa[i] = lctx.kv_swa.cells[i].delta;
+        }
+    }
 }
 
 static void llama_set_s_copy(llama_context & lctx) {
@@ -17851,7 +18696,10 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                 data = (float *) lctx.inp_KQ_mask->data;
             }
 
-            if (lctx.inp_KQ_mask_swa) {
+            // with a separate SWA cache, the SWA mask is filled below from its cells
+            const bool has_kv_swa = lctx.kv_swa.size > 0;
+
+            if (lctx.inp_KQ_mask_swa && !has_kv_swa) {
                 GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask_swa->buffer));
                 data_swa = (float *) lctx.inp_KQ_mask_swa->data;
             }
@@ -17882,15 +18730,8 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
 
                         // may need to cut off old tokens for sliding window
                         if (data_swa) {
-                            if (hparams.n_attn_chunk) {
-                                llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (lctx.kv_self.cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
-                                }
-                            } else {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
-                                }
+                            if (hparams.is_masked_swa(lctx.kv_self.cells[i].pos, pos)) {
+                                f = -INFINITY;
                             }
                             data_swa[h*(n_kv*n_tokens) + j*n_kv + i] = f;
                         }
@@ -17913,6 +18754,36 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
                     }
                 }
             }
+
+            if (lctx.inp_KQ_mask_swa && has_kv_swa) {
+                const auto & kv_swa = lctx.kv_swa;
+                const int64_t n_kv_swa = kv_swa.n;
+
+                GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_KQ_mask_swa->buffer));
+                data_swa = (float *) lctx.inp_KQ_mask_swa->data;
+
+                for (int j = 0; j < n_tokens; ++j) {
+                    const llama_pos    pos    = batch.pos[j];
+                    const llama_seq_id seq_id = batch.seq_id[j][0];
+
+                    for (int i = 0; i < n_kv_swa; ++i) {
+                        const llama_kv_cell & cell = kv_swa.cells[i];
+                        float f;
+                        if (!cell.has_seq_id(seq_id) || cell.pos > pos || hparams.is_masked_swa(cell.pos, pos)) {
+                            f = -INFINITY;
+                        } else {
+                            f = hparams.use_alibi ? -std::abs(cell.pos - pos) : 0.0f;
+                        }
+                        data_swa[j*n_kv_swa + i] = f;
+                    }
+                }
+
+                for (int j = n_tokens; j < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++j) {
+                    for (int i = 0; i < n_kv_swa; ++i) {
+                        data_swa[j*n_kv_swa + i] = -INFINITY;
+                    }
+                }
+            }
         } else {
             // when using kv cache, the mask needs to match the kv cache size
             const int64_t n_tokens = batch.n_tokens;
@@ -17982,7 +18853,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         }
     }
 
-    if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_CLS) {
+    if (cparams.embeddings && (cparams.pooling_type == LLAMA_POOLING_TYPE_CLS || cparams.pooling_type == LLAMA_POOLING_TYPE_RANK)) {
         const int64_t n_tokens = batch.n_tokens;
 
         GGML_ASSERT(lctx.inp_cls);
@@ -18144,6 +19015,42 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             }
         }
     }
+
+    for (int k = 0; k < 2; ++k) {
+        if (!lctx.inp_lora_perm[k]) {
+            continue;
+        }
+
+        const auto & groups = lctx.lora_seq_groups;
+        const auto & rows   = lctx.lora_seq_rows[k];
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_lora_perm[k]->buffer));
+        GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_lora_mask[k]->buffer));
+
+        int32_t * perm = (int32_t *) lctx.inp_lora_perm[k]->data;
+        float   * mask = (float   *) lctx.inp_lora_mask[k]->data;
+
+        // first row of each group in the results, and number of rows assigned so far
+        std::vector<int32_t> first(groups.size(), 0);
+        std::vector<int32_t> count(groups.size(), 0);
+        for (size_t ig = 1; ig < groups.size(); ++ig) {
+            first[ig] = first[ig - 1] + groups[ig - 1].n_rows[k];
+        }
+
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const int32_t ig = rows[i];
+            if (ig < 0) {
+                perm[i] = 0;
+                mask[i] = 0.0f;
+                continue;
+            }
+            struct ggml_tensor * inp_rows = lctx.inp_lora_rows[k][ig];
+            GGML_ASSERT(ggml_backend_buffer_is_host(inp_rows->buffer));
+            ((int32_t *) inp_rows->data)[count[ig]] = i;
+            perm[i] = first[ig] + count[ig]++;
+            mask[i] = 1.0f;
+        }
+    }
 #if IK_PRINT_TIMING
     auto tim2 = ggml_time_us();
     printf("%s(...): %d us\n", __func__, int(tim2-tim1));
@@ -18168,6 +19075,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 
     const size_t logits_size = has_logits ? n_vocab*n_outputs_max : 0;
     const size_t embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    const size_t top_size    = has_logits && cparams.n_top_logits > 0 ? (2*cparams.n_top_logits + 1)*n_outputs_max : 0;
 
     if (lctx.output_ids.empty()) {
         // init, never resized afterwards
@@ -18175,7 +19083,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
     }
 
     const size_t prev_size = lctx.buf_output ? ggml_backend_buffer_get_size(lctx.buf_output) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size + top_size) * sizeof(float);
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -18189,6 +19097,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
             lctx.buf_output = nullptr;
             lctx.logits = nullptr;
             lctx.embd = nullptr;
+            lctx.top_logits = nullptr;
         }
 
         lctx.buf_output = ggml_backend_buft_alloc_buffer(llama_default_buffer_type_cpu(true), new_size);
@@ -18200,12 +19109,16 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 
     float * output_base = (float *) ggml_backend_buffer_get_base(lctx.buf_output);
 
-    lctx.logits = has_logits ? output_base               : nullptr;
-    lctx.embd   = has_embd   ? output_base + logits_size : nullptr;
+    lctx.logits     = has_logits ? output_base                           : nullptr;
+    lctx.embd       = has_embd   ? output_base + logits_size             : nullptr;
+    lctx.top_logits = top_size   ? output_base + logits_size + embd_size : nullptr;
 
-    lctx.output_size = n_outputs_max;
-    lctx.logits_size = logits_size;
-    lctx.embd_size   = embd_size;
+    lctx.output_size     = n_outputs_max;
+    lctx.logits_size     = logits_size;
+    lctx.embd_size       = embd_size;
+    lctx.top_logits_size = top_size;
+
+    lctx.top_logits_valid = false;
 
     // set all ids as invalid (negative)
     std::fill(lctx.output_ids.begin(), lctx.output_ids.end(), -1);
@@ -18243,111 +19156,831 @@ static void llama_graph_compute(
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
 }
 
-// decode a batch of tokens by evaluating the transformer
-//
-//   - lctx:      llama context
-//   - batch:     batch to evaluate
-//
-// return 0 on success
-// return positive int on warning
-// return negative int on error
-//
-static int llama_decode_internal(
-         llama_context & lctx,
-           llama_batch   batch_all) { // TODO: rename back to batch
+static void llama_kv_cache_update_internal(struct llama_context & lctx);
+static void llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & kv);
 
-    lctx.is_encoding = false;
-    const uint32_t n_tokens_all = batch_all.n_tokens;
+// find a slot for the batch in the sliding window attention cache
+// the cells of the cache are freed in ring-buffer order, if the free cells are too fragmented the cache is compacted first
+static bool llama_kv_cache_swa_find_slot(struct llama_context & lctx, const struct llama_batch & batch) {
+    auto & kv_swa = lctx.kv_swa;
 
-    if (n_tokens_all == 0) {
-        LLAMA_LOG_ERROR("%s: n_tokens == 0", __func__);
-        return -1;
+    if (llama_kv_cache_find_slot(kv_swa, batch)) {
+        return true;
     }
 
-    const auto & model   = lctx.model;
-    const auto & hparams = model.hparams;
-    const auto & cparams = lctx.cparams;
+    if (kv_swa.used + batch.n_tokens > kv_swa.size) {
+        return false;
+    }
 
-    GGML_ASSERT((!batch_all.token && batch_all.embd) || (batch_all.token && !batch_all.embd)); // NOLINT
+    llama_kv_cache_defrag_internal(lctx, kv_swa);
 
-    GGML_ASSERT(n_tokens_all <= cparams.n_batch);
+    return llama_kv_cache_find_slot(kv_swa, batch);
+}
 
-    GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
+//
+// swapping sequences out of the KV cache
+//
 
-    if (lctx.t_compute_start_us == 0) {
-        lctx.t_compute_start_us = ggml_time_us();
+// whether the K/V rows of a cache tensor are converted to the store type when swapped out
+static bool llama_kv_swap_converts(const llama_kv_swap_store & store, const ggml_tensor * t, int64_t n_per_cell) {
+    return store.type != GGML_TYPE_COUNT && store.type != t->type &&
+           (t->type == GGML_TYPE_F32 || t->type == GGML_TYPE_F16 || t->type == GGML_TYPE_BF16) &&
+           n_per_cell % ggml_blck_size(store.type) == 0;
+}
+
+// ranges of consecutive cells in a sorted list of cells
+static std::vector<std::pair<uint32_t, uint32_t>> llama_kv_swap_ranges(const std::vector<uint32_t> & ids) {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    for (uint32_t i : ids) {
+        if (!ranges.empty() && ranges.back().second == i) {
+            ranges.back().second++;
+        } else {
+            ranges.emplace_back(i, i + 1);
+        }
     }
-    lctx.n_queued_tokens += n_tokens_all;
+    return ranges;
+}
 
-    auto & kv_self = lctx.kv_self;
+// copies (to_store = true) the K/V data of the cells ids of all layers of a cache into data, or back
+// the rows of a transposed V cache are copied as they are, the other rows are converted to the store type if requested
+static void llama_kv_swap_copy(const llama_kv_swap_store & store, llama_kv_cache & kv, const std::vector<uint32_t> & ids,
+        std::vector<uint8_t> & data, bool to_store) {
+    const auto ranges = llama_kv_swap_ranges(ids);
+    const size_t n_cells = ids.size();
+
+    std::vector<uint8_t> tmp;
+    std::vector<float>   tmp_f32;
+
+    size_t offs = 0;
+    auto copy = [&](ggml_tensor * t, size_t t_offs, size_t size) {
+        if (to_store) {
+            data.resize(offs + size);
+            ggml_backend_tensor_get(t, data.data() + offs, t_offs, size);
+        } else {
+            ggml_backend_tensor_set(t, data.data() + offs, t_offs, size);
+        }
+        offs += size;
+    };
 
-    const int64_t n_embd  = hparams.n_embd;
-    const int64_t n_vocab = hparams.n_vocab;
+    // one row per cell
+    auto copy_rows = [&](ggml_tensor * t) {
+        const size_t  cell_size  = ggml_nbytes(t)/kv.size;
+        const int64_t n_per_cell = ggml_nelements(t)/kv.size;
 
-    uint32_t n_outputs = 0;
-    uint32_t n_outputs_prev = 0;
+        if (!llama_kv_swap_converts(store, t, n_per_cell)) {
+            for (const auto & r : ranges) {
+                copy(t, r.first*cell_size, (r.second - r.first)*cell_size);
+            }
+            return;
+        }
 
-    const auto n_ubatch = cparams.n_ubatch;
+        const size_t store_size = ggml_row_size(store.type, n_per_cell);
+        tmp.resize(n_cells*cell_size);
+        tmp_f32.resize(n_cells*n_per_cell);
 
-    // TODO: simplify or deprecate
-    std::vector<llama_pos> pos;
-    std::vector<int32_t>                   n_seq_id;
-    std::vector<llama_seq_id *>            seq_id_arr;
-    std::vector<std::vector<llama_seq_id>> seq_id;
+        if (to_store) {
+            size_t i_tmp = 0;
+            for (const auto & r : ranges) {
+                ggml_backend_tensor_get(t, tmp.data() + i_tmp, r.first*cell_size, (r.second - r.first)*cell_size);
+                i_tmp += (r.second - r.first)*cell_size;
+            }
+            if (t->type == GGML_TYPE_F32) {
+                memcpy(tmp_f32.data(), tmp.data(), tmp.size());
+            } else {
+                ggml_internal_get_type_traits(t->type).to_float(tmp.data(), tmp_f32.data(), tmp_f32.size());
+            }
+            data.resize(offs + n_cells*store_size);
+            ggml_quantize_chunk(store.type, tmp_f32.data(), data.data() + offs, 0, n_cells, n_per_cell, nullptr);
+            offs += n_cells*store_size;
+        } else {
+            ggml_internal_get_type_traits(store.type).to_float(data.data() + offs, tmp_f32.data(), tmp_f32.size());
+            offs += n_cells*store_size;
+            switch (t->type) {
+                case GGML_TYPE_F32:  memcpy(tmp.data(), tmp_f32.data(), tmp.size()); break;
+                case GGML_TYPE_F16:  ggml_fp32_to_fp16_row(tmp_f32.data(), (ggml_fp16_t *) tmp.data(), tmp_f32.size()); break;
+                case GGML_TYPE_BF16: ggml_fp32_to_bf16_row(tmp_f32.data(), (ggml_bf16_t *) tmp.data(), tmp_f32.size()); break;
+                default: GGML_ABORT("fatal error");
+            }
+            size_t i_tmp = 0;
+            for (const auto & r : ranges) {
+                ggml_backend_tensor_set(t, tmp.data() + i_tmp, r.first*cell_size, (r.second - r.first)*cell_size);
+                i_tmp += (r.second - r.first)*cell_size;
+            }
+        }
+    };
 
-    // this indicates we are doing pooled embedding, so we ignore batch.logits and output all tokens
-    const bool embd_pooled = cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE;
+    for (size_t il = 0; il < kv.k_l.size(); ++il) {
+        if (kv.k_l[il]) {
+            copy_rows(kv.k_l[il]);
+        }
+        if (il >= kv.v_l.size() || !kv.v_l[il]) {
+            continue;
+        }
+        ggml_tensor * v = kv.v_l[il];
+        if (!kv.v_trans) {
+            copy_rows(v);
+            continue;
+        }
+        // transposed V: the values of a cell are kv.size elements apart
+        const size_t  el_size = ggml_type_size(v->type);
+        const int64_t n_embd_v = ggml_nelements(v)/kv.size;
+        for (int64_t j = 0; j < n_embd_v; ++j) {
+            for (const auto & r : ranges) {
+                copy(v, (j*kv.size + r.first)*el_size, (r.second - r.first)*el_size);
+            }
+        }
+    }
+}
 
-    // count outputs
-    if (batch_all.logits && !embd_pooled) {
-        for (uint32_t i = 0; i < n_tokens_all; ++i) {
-            n_outputs += batch_all.logits[i] != 0;
+// moves the cells of a sequence from the KV cache into the swap store
+static bool llama_kv_swap_out(struct llama_context & lctx, llama_seq_id seq_id) {
+    auto & store = lctx.kv_swap_store;
+
+    if (lctx.kv_self.recurrent || seq_id < 0 || store.seqs.count(seq_id)) {
+        return false;
+    }
+
+    // pending K shifts are not applied here, as this can happen while a ubatch is being placed in the cache:
+    // the data is copied unshifted and the shifts are kept with the cells and applied when they are back in the cache
+    llama_kv_swap_store::seq sseq;
+    std::vector<uint32_t> ids[2];
+
+    llama_kv_cache * caches[2] = { &lctx.kv_self, &lctx.kv_swa };
+    for (int ic = 0; ic < 2; ++ic) {
+        auto & kv = *caches[ic];
+        auto & c  = sseq.kv[ic];
+        for (uint32_t i = 0; i < kv.size; ++i) {
+            if (kv.cells[i].has_seq_id(seq_id)) {
+                ids[ic].push_back(i);
+                c.pos.push_back(kv.cells[i].pos);
+                c.delta.push_back(kv.cells[i].delta);
+            }
         }
-    } else if (lctx.logits_all || embd_pooled) {
-        n_outputs = n_tokens_all;
-    } else {
-        // keep last output only
-        n_outputs = 1;
     }
 
-    // reserve output buffer
-    if (llama_output_reserve(lctx, n_outputs) < n_outputs) {
-        LLAMA_LOG_ERROR("%s: could not reserve space for batch with %u outputs\n", __func__, n_outputs);
-        return -2;
-    };
+    if (ids[0].empty() && ids[1].empty()) {
+        return false;
+    }
 
-    // set output mappings
-    if (batch_all.logits) {
-        int32_t i_logits = 0;
-        for (uint32_t i = 0; i < n_tokens_all; ++i) {
-            if (batch_all.logits[i]) {
-                lctx.output_ids[i] = i_logits++;
+    try {
+        for (int ic = 0; ic < 2; ++ic) {
+            auto & c = sseq.kv[ic];
+            if (ids[ic].empty()) {
+                continue;
+            }
+            llama_kv_swap_copy(store, *caches[ic], ids[ic], c.data, true);
+            c.size = c.data.size();
+            if (store.file) {
+                c.offs = store.file_alloc(c.size);
+                store.file->seek(c.offs, SEEK_SET);
+                store.file->write_raw(c.data.data(), c.size);
+                std::vector<uint8_t>().swap(c.data);
             }
         }
-    } else {
-        for (uint32_t i = 0; i < n_outputs; ++i) {
-            lctx.output_ids[i] = i;
+    } catch (const std::exception & e) {
+        LLAMA_LOG_ERROR("%s: failed to swap out sequence %d: %s\n", __func__, seq_id, e.what());
+        for (auto & c : sseq.kv) {
+            if (store.file) {
+                store.file_release(c.offs, c.size);
+            }
         }
+        return false;
     }
 
-    for (uint32_t cur_token = 0; cur_token < n_tokens_all; cur_token += n_ubatch) {
-        const uint32_t n_tokens = std::min(n_ubatch, n_tokens_all - cur_token);
-        llama_batch u_batch = {
-            /* .n_tokens   = */ (int32_t) n_tokens,
-            /* .token      = */ batch_all.token     ? batch_all.token    + cur_token        : nullptr,
-            /* .embd       = */ batch_all.embd      ? batch_all.embd     + cur_token*n_embd : nullptr,
-            /* .pos        = */ batch_all.pos       ? batch_all.pos      + cur_token        : nullptr,
-            /* .n_seq_id   = */ batch_all.n_seq_id  ? batch_all.n_seq_id + cur_token        : nullptr,
-            /* .seq_id     = */ batch_all.seq_id    ? batch_all.seq_id   + cur_token        : nullptr,
-            /* .logits     = */ batch_all.logits    ? batch_all.logits   + cur_token        : nullptr,
-            /* .all_pos_0  = */ batch_all.all_pos_0 + (llama_pos) cur_token*batch_all.all_pos_1,
-            /* .all_pos_1  = */ batch_all.all_pos_1,
-            /* .all_seq_id = */ batch_all.all_seq_id,
-        };
+    for (int ic = 0; ic < 2; ++ic) {
+        auto & kv = *caches[ic];
+        for (uint32_t i : ids[ic]) {
+            auto & cell = kv.cells[i];
+            cell.seq_id.erase(seq_id);
+            if (cell.is_empty()) {
+                cell.pos   = -1;
+                cell.delta = 0;
+                kv.used--;
+            }
+        }
+        // kv.head is left alone: a sequence can be swapped out while searching a slot in the SWA cache,
+        // after the ubatch has been placed at the head of the self-attention cache
+        store.n_bytes += sseq.kv[ic].size;
+    }
 
-        // count the outputs in this u_batch
-        {
-            int32_t n_outputs_new = 0;
+    store.seqs[seq_id] = std::move(sseq);
+
+    return true;
+}
+
+static bool llama_kv_swap_in(struct llama_context & lctx, llama_seq_id seq_id, const std::set<llama_seq_id> & keep);
+
+// swaps out the least recently used sequence that is not in keep, returns false if there is none
+static bool llama_kv_swap_evict(struct llama_context & lctx, const std::set<llama_seq_id> & keep) {
+    auto & store = lctx.kv_swap_store;
+
+    std::set<llama_seq_id> cached;
+    for (const auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+        for (uint32_t i = 0; i < kv->size; ++i) {
+            cached.insert(kv->cells[i].seq_id.begin(), kv->cells[i].seq_id.end());
+        }
+    }
+
+    llama_seq_id lru = -1;
+    uint64_t lru_use = 0;
+    for (llama_seq_id s : cached) {
+        if (keep.count(s)) {
+            continue;
+        }
+        const auto it = store.last_use.find(s);
+        const uint64_t use = it == store.last_use.end() ? 0 : it->second;
+        if (lru < 0 || use < lru_use) {
+            lru     = s;
+            lru_use = use;
+        }
+    }
+
+    return lru >= 0 && llama_kv_swap_out(lctx, lru);
+}
+
+// swaps out sequences not in keep until the cache has at least n free cells
+static bool llama_kv_swap_make_room(struct llama_context & lctx, llama_kv_cache & kv, uint32_t n, const std::set<llama_seq_id> & keep) {
+    while (kv.size - kv.used < n) {
+        if (!lctx.cparams.kv_swap || !llama_kv_swap_evict(lctx, keep)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// moves a swapped out sequence back into free cells of the KV cache
+// with automatic swapping enabled, sequences not in keep are swapped out if there is not enough room
+static bool llama_kv_swap_in(struct llama_context & lctx, llama_seq_id seq_id, const std::set<llama_seq_id> & keep) {
+    auto & store = lctx.kv_swap_store;
+
+    auto it = store.seqs.find(seq_id);
+    if (it == store.seqs.end()) {
+        return false;
+    }
+
+    std::set<llama_seq_id> keep_seq = keep;
+    keep_seq.insert(seq_id);
+
+    llama_kv_cache * caches[2] = { &lctx.kv_self, &lctx.kv_swa };
+    for (int ic = 0; ic < 2; ++ic) {
+        if (!llama_kv_swap_make_room(lctx, *caches[ic], it->second.kv[ic].pos.size(), keep_seq)) {
+            return false;
+        }
+    }
+
+    auto & sseq = it->second;
+    for (int ic = 0; ic < 2; ++ic) {
+        auto & kv = *caches[ic];
+        auto & c  = sseq.kv[ic];
+        if (c.pos.empty()) {
+            continue;
+        }
+
+        std::vector<uint32_t> ids;
+        for (uint32_t i = 0; i < kv.size && ids.size() < c.pos.size(); ++i) {
+            if (kv.cells[i].pos < 0) {
+                ids.push_back(i);
+            }
+        }
+        GGML_ASSERT(ids.size() == c.pos.size());
+
+        try {
+            if (store.file) {
+                c.data.resize(c.size);
+                store.file->seek(c.offs, SEEK_SET);
+                store.file->read_raw(c.data.data(), c.size);
+            }
+        } catch (const std::exception & e) {
+            LLAMA_LOG_ERROR("%s: failed to swap in sequence %d: %s\n", __func__, seq_id, e.what());
+            return false;
+        }
+        llama_kv_swap_copy(store, kv, ids, c.data, false);
+
+        for (size_t j = 0; j < ids.size(); ++j) {
+            if (c.pos[j] < 0) {
+                // shifted out by llama_kv_cache_seq_add while swapped out
+                continue;
+            }
+            auto & cell = kv.cells[ids[j]];
+            cell.pos   = c.pos[j];
+            cell.delta = c.delta[j];
+            cell.seq_id.insert(seq_id);
+            kv.has_shift |= cell.delta != 0;
+            kv.used++;
+        }
+    }
+
+    store.erase(seq_id);
+
+    return true;
+}
+
+// sequence operations on swapped out sequences: the positions are changed in the store, sequences that are
+// removed completely are dropped from it, all other changes need the sequence to be swapped in first
+
+static bool llama_kv_swap_seq_rm(struct llama_context & lctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    auto & store = lctx.kv_swap_store;
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    std::vector<llama_seq_id> seqs;
+    for (const auto & it : store.seqs) {
+        if (seq_id < 0 || it.first == seq_id) {
+            seqs.push_back(it.first);
+        }
+    }
+
+    for (llama_seq_id s : seqs) {
+        bool all = true;
+        for (const auto & c : store.seqs[s].kv) {
+            for (llama_pos p : c.pos) {
+                all = all && (p < 0 || (p >= p0 && p < p1));
+            }
+        }
+        if (all) {
+            store.erase(s);
+        } else if (!llama_kv_swap_in(lctx, s, {})) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void llama_kv_swap_seq_add(struct llama_context & lctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    auto it = lctx.kv_swap_store.seqs.find(seq_id);
+    if (it == lctx.kv_swap_store.seqs.end()) {
+        return;
+    }
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    for (auto & c : it->second.kv) {
+        for (size_t j = 0; j < c.pos.size(); ++j) {
+            if (c.pos[j] >= p0 && c.pos[j] < p1) {
+                c.pos[j]   += delta;
+                c.delta[j] += delta;
+                if (c.pos[j] < 0) {
+                    c.pos[j] = -1;
+                }
+            }
+        }
+    }
+}
+
+static void llama_kv_swap_seq_div(struct llama_context & lctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    auto it = lctx.kv_swap_store.seqs.find(seq_id);
+    if (it == lctx.kv_swap_store.seqs.end()) {
+        return;
+    }
+
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    for (auto & c : it->second.kv) {
+        for (size_t j = 0; j < c.pos.size(); ++j) {
+            if (c.pos[j] >= p0 && c.pos[j] < p1) {
+                const llama_pos p_old = c.pos[j];
+                c.pos[j]   /= d;
+                c.delta[j] += c.pos[j] - p_old;
+            }
+        }
+    }
+}
+
+// smallest (max = false) or largest position of a swapped out sequence in a cache, -1 if it has none
+static llama_pos llama_kv_swap_seq_pos(const struct llama_context & lctx, llama_seq_id seq_id, int ic, bool max) {
+    const auto it = lctx.kv_swap_store.seqs.find(seq_id);
+    if (it == lctx.kv_swap_store.seqs.end()) {
+        return -1;
+    }
+
+    llama_pos result = -1;
+    for (llama_pos p : it->second.kv[ic].pos) {
+        if (p >= 0 && (result < 0 || (max ? p > result : p < result))) {
+            result = p;
+        }
+    }
+    return result;
+}
+
+// swaps in a sequence (all sequences if seq_id < 0) before its state is saved
+static void llama_kv_swap_in_all(struct llama_context & lctx, llama_seq_id seq_id) {
+    auto & store = lctx.kv_swap_store;
+
+    std::set<llama_seq_id> seqs;
+    for (const auto & it : store.seqs) {
+        if (seq_id < 0 || it.first == seq_id) {
+            seqs.insert(it.first);
+        }
+    }
+
+    for (llama_seq_id s : seqs) {
+        if (!llama_kv_swap_in(lctx, s, seqs)) {
+            LLAMA_LOG_WARN("%s: not enough free cells to swap in sequence %d, it is not saved\n", __func__, s);
+        }
+    }
+}
+
+// size of the state (llama_data_write::write_kv_cache) of the swapped out sequences (all sequences if seq_id < 0)
+// once they are swapped back in, so that the size of the state can be computed without swapping them in
+static size_t llama_kv_swap_state_size(const struct llama_context & lctx, llama_seq_id seq_id) {
+    const llama_kv_cache * caches[2] = { &lctx.kv_self, &lctx.kv_swa };
+
+    size_t size = 0;
+    for (const auto & it : lctx.kv_swap_store.seqs) {
+        if (seq_id >= 0 && it.first != seq_id) {
+            continue;
+        }
+        for (int ic = 0; ic < 2; ++ic) {
+            const auto & kv = *caches[ic];
+
+            // position, number of sequences and the sequence (it is only written for the whole state)
+            size_t cell_size = sizeof(llama_pos) + sizeof(uint32_t) + (seq_id < 0 ? sizeof(llama_seq_id) : 0);
+            for (size_t il = 0; il < kv.k_l.size(); ++il) {
+                if (kv.k_l[il]) {
+                    cell_size += ggml_nbytes(kv.k_l[il])/kv.size;
+                }
+                if (il < kv.v_l.size() && kv.v_l[il]) {
+                    cell_size += ggml_nbytes(kv.v_l[il])/kv.size;
+                }
+            }
+
+            for (llama_pos p : it.second.kv[ic].pos) {
+                // cells shifted out while swapped out are not swapped back in
+                size += p >= 0 ? cell_size : 0;
+            }
+        }
+    }
+
+    return size;
+}
+
+// the sequences of a batch, they are not swapped out while the batch is processed
+static std::set<llama_seq_id> llama_kv_swap_batch_seqs(const llama_batch & batch) {
+    std::set<llama_seq_id> seqs;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const int32_t n_seq = batch.n_seq_id ? batch.n_seq_id[i] : 1;
+        for (int32_t j = 0; j < n_seq; ++j) {
+            seqs.insert(batch.seq_id ? batch.seq_id[i][j] : batch.all_seq_id);
+        }
+    }
+    return seqs;
+}
+
+// swaps in the sequences of a ubatch that are swapped out
+static bool llama_kv_swap_in_batch(struct llama_context & lctx, const llama_batch & batch, const std::set<llama_seq_id> & keep) {
+    auto & store = lctx.kv_swap_store;
+
+    for (llama_seq_id s : llama_kv_swap_batch_seqs(batch)) {
+        if (store.seqs.count(s) && !llama_kv_swap_in(lctx, s, keep)) {
+            LLAMA_LOG_ERROR("%s: not enough free cells to swap in sequence %d\n", __func__, s);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// finds a slot for n_tokens cells, swapping out the least recently used sequences that are not in keep if there is no room
+static bool llama_kv_swap_find_slot(struct llama_context & lctx, llama_kv_cache & kv, uint32_t n_tokens,
+        const std::set<llama_seq_id> & keep, const std::function<bool()> & find_slot) {
+    if (find_slot()) {
+        return true;
+    }
+    if (!lctx.cparams.kv_swap || kv.recurrent) {
+        return false;
+    }
+
+    while (true) {
+        if (kv.size - kv.used >= n_tokens) {
+            // enough free cells, but not in one piece
+            llama_kv_cache_defrag_internal(lctx, kv);
+            return find_slot();
+        }
+        if (!llama_kv_swap_evict(lctx, keep)) {
+            return false;
+        }
+        if (find_slot()) {
+            return true;
+        }
+    }
+}
+
+// assign the tokens and the outputs of a ubatch to the per-sequence LoRA adapters of their first sequence
+// needs to happen before the graph is built, after lctx.n_outputs has been set
+static void llama_lora_seq_prepare(llama_context & lctx, const llama_batch & batch) {
+    auto & groups = lctx.lora_seq_groups;
+    auto & rows   = lctx.lora_seq_rows;
+
+    groups.clear();
+    rows[0].clear();
+    rows[1].clear();
+
+    if (lctx.lora_seq.empty()) {
+        return;
+    }
+
+    const int32_t n_tokens = batch.n_tokens;
+
+    rows[0].assign(n_tokens, -1);
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (batch.n_seq_id[i] < 1) {
+            continue;
+        }
+        auto it = lctx.lora_seq.find(batch.seq_id[i][0]);
+        if (it == lctx.lora_seq.end()) {
+            continue;
+        }
+        int32_t ig = 0;
+        while (ig < (int32_t) groups.size() && (groups[ig].adapter != it->second.first || groups[ig].scale != it->second.second)) {
+            ++ig;
+        }
+        if (ig == (int32_t) groups.size()) {
+            groups.push_back({ it->second.first, it->second.second, { 0, 0 } });
+        }
+        rows[0][i] = ig;
+        groups[ig].n_rows[0]++;
+    }
+
+    if (groups.empty()) {
+        rows[0].clear();
+        return;
+    }
+
+    // same order as inp_out_ids
+    if (lctx.n_outputs == n_tokens) {
+        rows[1] = rows[0];
+    } else if (batch.logits) {
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            if (batch.logits[i]) {
+                rows[1].push_back(rows[0][i]);
+            }
+        }
+    } else if (lctx.n_outputs == 1) {
+        rows[1].push_back(rows[0][n_tokens - 1]);
+    }
+    for (int32_t ig : rows[1]) {
+        if (ig >= 0) {
+            groups[ig].n_rows[1]++;
+        }
+    }
+}
+
+// build the graph of a ubatch, or reuse the graph of the previous ubatch if it has the same shape
+//
+// The only part of a decode graph that depends on the position of the ubatch in the KV cache are the views of the
+// cells written by the ubatch. When a key is seen for the second time in a row, the graph is built once more for a
+// neighbouring kv_self.head and the two graphs are compared node by node: if they differ only in view offsets, the
+// graph is kept allocated and the next ubatches with the same key only move these views.
+// With a separate SWA cache, both heads are moved together, so the graph is reused only while they advance in step.
+//
+// returns the graph and sets reused if it is already allocated
+static struct ggml_cgraph * llama_decode_graph(llama_context & lctx, const llama_batch & u_batch, bool & reused) {
+    auto & kv_self = lctx.kv_self;
+    auto & kv_swa  = lctx.kv_swa;
+
+    llama_context::graph_key key;
+    key.n_tokens      = u_batch.n_tokens;
+    key.n_outputs     = lctx.n_outputs;
+    key.n_outputs_enc = lctx.embd_enc.size() / lctx.model.hparams.n_embd;
+    key.n_kv          = kv_self.n;
+    key.n_kv_swa      = kv_swa.n;
+    key.embd_inp      = u_batch.token == nullptr;
+    key.embeddings    = lctx.cparams.embeddings;
+    key.causal_attn   = lctx.cparams.causal_attn;
+    key.warmup        = llama_is_warming_up(lctx, u_batch);
+    key.lora_seq_groups = lctx.lora_seq_groups;
+
+    reused = false;
+
+    const int64_t delta = (int64_t) kv_self.head - lctx.graph_kv_head;
+
+    if (lctx.graph_cached && key == lctx.graph_last_key &&
+        (kv_swa.size == 0 || (int64_t) kv_swa.head - lctx.graph_kv_head_swa == delta)) {
+        for (auto & view : lctx.graph_kv_views) {
+            struct ggml_tensor * t = view.tensor;
+            const size_t offs = view.offs + delta*view.stride;
+            t->view_offs = offs;
+            t->data = (char *) t->view_src->data + offs;
+            if (t->op == GGML_OP_VIEW) {
+                memcpy(t->op_params, &offs, sizeof(offs));
+            }
+        }
+        reused = true;
+        return lctx.graph_cached;
+    }
+
+    // probe only for keys that repeat, so that prompt processing does not pay for a second build
+    int32_t probe_delta = 0;
+    if (lctx.cparams.graph_reuse && key == lctx.graph_last_key && !key.warmup && !kv_self.recurrent &&
+        ggml_backend_sched_get_n_copies(lctx.sched) == 1) {
+        if (kv_self.head + u_batch.n_tokens < kv_self.size && (kv_swa.size == 0 || kv_swa.head + u_batch.n_tokens < kv_swa.size)) {
+            probe_delta = 1;
+        } else if (kv_self.head > 0 && (kv_swa.size == 0 || kv_swa.head > 0)) {
+            probe_delta = -1;
+        }
+    }
+    lctx.graph_last_key = key;
+
+    struct node_info {
+        enum ggml_op op;
+        int64_t ne[GGML_MAX_DIMS];
+        size_t  nb[GGML_MAX_DIMS];
+        struct ggml_tensor * src[GGML_MAX_SRC];
+        struct ggml_tensor * view_src;
+        size_t  view_offs;
+        int32_t op_params[GGML_MAX_OP_PARAMS / sizeof(int32_t)];
+    };
+    std::vector<node_info> probe;
+    int probe_n_leafs = 0;
+
+    if (probe_delta != 0) {
+        ggml_backend_sched_reset(lctx.sched);
+
+        kv_self.head += probe_delta;
+        kv_swa.head  += kv_swa.size > 0 ? probe_delta : 0;
+        struct ggml_cgraph * gp = llama_build_graph(lctx, u_batch, false);
+        kv_self.head -= probe_delta;
+        kv_swa.head  -= kv_swa.size > 0 ? probe_delta : 0;
+
+        probe.resize(gp->n_nodes);
+        for (int i = 0; i < gp->n_nodes; ++i) {
+            const struct ggml_tensor * t = gp->nodes[i];
+            node_info & info = probe[i];
+            info.op = t->op;
+            memcpy(info.ne, t->ne, sizeof(info.ne));
+            memcpy(info.nb, t->nb, sizeof(info.nb));
+            memcpy(info.src, t->src, sizeof(info.src));
+            info.view_src  = t->view_src;
+            info.view_offs = t->view_offs;
+            memcpy(info.op_params, t->op_params, sizeof(info.op_params));
+        }
+        probe_n_leafs = gp->n_leafs;
+    }
+
+    ggml_backend_sched_reset(lctx.sched);
+    ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+
+    struct ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+
+    if (probe_delta == 0 || (int) probe.size() != gf->n_nodes || probe_n_leafs != gf->n_leafs) {
+        return gf;
+    }
+
+    lctx.graph_kv_views.clear();
+
+    for (int i = 0; i < gf->n_nodes; ++i) {
+        struct ggml_tensor * t = gf->nodes[i];
+        const node_info & info = probe[i];
+
+        if (info.op != t->op || info.view_src != t->view_src ||
+            memcmp(info.ne,  t->ne,  sizeof(info.ne))  != 0 ||
+            memcmp(info.nb,  t->nb,  sizeof(info.nb))  != 0 ||
+            memcmp(info.src, t->src, sizeof(info.src)) != 0) {
+            return gf;
+        }
+
+        if (info.view_offs != t->view_offs) {
+            const int64_t diff = (int64_t) info.view_offs - (int64_t) t->view_offs;
+            if (t->view_src == nullptr || diff % probe_delta != 0) {
+                return gf;
+            }
+            lctx.graph_kv_views.push_back({ t, (int64_t) t->view_offs, diff / probe_delta });
+        }
+
+        // the offset of a view is also stored in its op params
+        if (t->op != GGML_OP_VIEW && memcmp(info.op_params, t->op_params, sizeof(info.op_params)) != 0) {
+            return gf;
+        }
+    }
+
+    lctx.graph_cached      = gf;
+    lctx.graph_kv_head     = kv_self.head;
+    lctx.graph_kv_head_swa = kv_swa.head;
+
+    return gf;
+}
+
+// decode a batch of tokens by evaluating the transformer
+//
+//   - lctx:      llama context
+//   - batch:     batch to evaluate
+//
+// return 0 on success
+// return positive int on warning
+// return negative int on error
+//
+static int llama_decode_internal(
+         llama_context & lctx,
+           llama_batch   batch_all) { // TODO: rename back to batch
+
+    lctx.is_encoding = false;
+    const uint32_t n_tokens_all = batch_all.n_tokens;
+
+    if (n_tokens_all == 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens == 0", __func__);
+        return -1;
+    }
+
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+
+    GGML_ASSERT((!batch_all.token && batch_all.embd) || (batch_all.token && !batch_all.embd)); // NOLINT
+
+    GGML_ASSERT(n_tokens_all <= cparams.n_batch);
+
+    GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
+
+    if (lctx.t_compute_start_us == 0) {
+        lctx.t_compute_start_us = ggml_time_us();
+    }
+    lctx.n_queued_tokens += n_tokens_all;
+
+    auto & kv_self = lctx.kv_self;
+
+    const int64_t n_embd  = hparams.n_embd;
+    const int64_t n_vocab = hparams.n_vocab;
+
+    uint32_t n_outputs = 0;
+    uint32_t n_outputs_prev = 0;
+    bool top_logits_ok = true; // every ubatch with outputs computed the top logits
+
+    const auto n_ubatch = cparams.n_ubatch;
+
+    // TODO: simplify or deprecate
+    std::vector<llama_pos> pos;
+    std::vector<int32_t>                   n_seq_id;
+    std::vector<llama_seq_id *>            seq_id_arr;
+    std::vector<std::vector<llama_seq_id>> seq_id;
+
+    // this indicates we are doing pooled embedding, so we ignore batch.logits and output all tokens
+    const bool embd_pooled = cparams.embeddings && cparams.pooling_type != LLAMA_POOLING_TYPE_NONE;
+
+    // count outputs
+    if (batch_all.logits && !embd_pooled) {
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            n_outputs += batch_all.logits[i] != 0;
+        }
+    } else if (lctx.logits_all || embd_pooled) {
+        n_outputs = n_tokens_all;
+    } else {
+        // keep last output only
+        n_outputs = 1;
+    }
+
+    // reserve output buffer
+    if (llama_output_reserve(lctx, n_outputs) < n_outputs) {
+        LLAMA_LOG_ERROR("%s: could not reserve space for batch with %u outputs\n", __func__, n_outputs);
+        return -2;
+    };
+
+    // set output mappings
+    if (batch_all.logits) {
+        int32_t i_logits = 0;
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            if (batch_all.logits[i]) {
+                lctx.output_ids[i] = i_logits++;
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < n_outputs; ++i) {
+            lctx.output_ids[i] = i;
+        }
+    }
+
+    // the sequences of the batch are swapped in if they were swapped out, and they are not swapped out while the batch is processed
+    auto & swap_store = lctx.kv_swap_store;
+    std::set<llama_seq_id> batch_seqs;
+    if (hparams.causal_attn && (cparams.kv_swap || !swap_store.seqs.empty())) {
+        batch_seqs = llama_kv_swap_batch_seqs(batch_all);
+        swap_store.n_decode++;
+        for (llama_seq_id s : batch_seqs) {
+            swap_store.last_use[s] = swap_store.n_decode;
+        }
+    }
+
+    for (uint32_t cur_token = 0; cur_token < n_tokens_all; cur_token += n_ubatch) {
+        const uint32_t n_tokens = std::min(n_ubatch, n_tokens_all - cur_token);
+        llama_batch u_batch = {
+            /* .n_tokens   = */ (int32_t) n_tokens,
+            /* .token      = */ batch_all.token     ? batch_all.token    + cur_token        : nullptr,
+            /* .embd       = */ batch_all.embd      ? batch_all.embd     + cur_token*n_embd : nullptr,
+            /* .pos        = */ batch_all.pos       ? batch_all.pos      + cur_token        : nullptr,
+            /* .n_seq_id   = */ batch_all.n_seq_id  ? batch_all.n_seq_id + cur_token        : nullptr,
+            /* .seq_id     = */ batch_all.seq_id    ? batch_all.seq_id   + cur_token        : nullptr,
+            /* .logits     = */ batch_all.logits    ? batch_all.logits   + cur_token        : nullptr,
+            /* .all_pos_0  = */ batch_all.all_pos_0 + (llama_pos) cur_token*batch_all.all_pos_1,
+            /* .all_pos_1  = */ batch_all.all_pos_1,
+            /* .all_seq_id = */ batch_all.all_seq_id,
+        };
+
+        // count the outputs in this u_batch
+        {
+            int32_t n_outputs_new = 0;
 
             if (u_batch.logits && !embd_pooled) {
                 for (uint32_t i = 0; i < n_tokens; i++) {
@@ -18397,7 +20030,11 @@ static int llama_decode_internal(
 
         // non-causal masks do not use the KV cache
         if (hparams.causal_attn) {
-            llama_kv_cache_update(&lctx);
+            if (!swap_store.seqs.empty() && !llama_kv_swap_in_batch(lctx, u_batch, batch_seqs)) {
+                return 1;
+            }
+
+            llama_kv_cache_update_internal(lctx);
 
             // if we have enough unused cells before the current head ->
             //   better to start searching from the beginning of the cache, hoping to fill it
@@ -18405,7 +20042,7 @@ static int llama_decode_internal(
                 kv_self.head = 0;
             }
 
-            if (!llama_kv_cache_find_slot(kv_self, u_batch)) {
+            if (!llama_kv_swap_find_slot(lctx, kv_self, n_tokens, batch_seqs, [&]() { return llama_kv_cache_find_slot(kv_self, u_batch); })) {
                 return 1;
             }
 
@@ -18417,26 +20054,47 @@ static int llama_decode_internal(
                 kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_self), pad)));
                 //kv_self.n = llama_kv_cache_cell_max(kv_self);
             }
+
+            auto & kv_swa = lctx.kv_swa;
+
+            if (kv_swa.size > 0) {
+                // the SWA cache is used as a ring buffer: the cells that fell out of the window are freed before searching
+                llama_kv_cache_swa_prune(kv_swa, hparams, u_batch);
+
+                if (!llama_kv_swap_find_slot(lctx, kv_swa, n_tokens, batch_seqs, [&]() { return llama_kv_cache_swa_find_slot(lctx, u_batch); })) {
+                    return 1;
+                }
+
+                const uint32_t pad = llama_kv_cache_get_padding(cparams);
+                kv_swa.n = std::min(kv_swa.size, std::max(pad, GGML_PAD(llama_kv_cache_cell_max(kv_swa), pad)));
+            }
         }
 
         //printf("kv_self.n = %5d, kv_self.used = %5d, kv_self.head = %5d\n", kv_self.n, kv_self.used, kv_self.head);
 
-        ggml_backend_sched_reset(lctx.sched);
-        ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
+        llama_lora_seq_prepare(lctx, u_batch);
 
-        ggml_cgraph * gf = llama_build_graph(lctx, u_batch, false);
+        bool graph_reused = false;
+        ggml_cgraph * gf = llama_decode_graph(lctx, u_batch, graph_reused);
 
-        // the output is always the last tensor in the graph
-        struct ggml_tensor * res  = gf->nodes[gf->n_nodes - 1];
-        struct ggml_tensor * embd = gf->nodes[gf->n_nodes - 2];
+        // the output is always the last tensor in the graph (followed by the top logits, if requested)
+        int i_res = gf->n_nodes - 1;
+        struct ggml_tensor * top = nullptr;
+        if (strcmp(gf->nodes[i_res]->name, "result_top_logits") == 0) {
+            top = gf->nodes[i_res--];
+        }
+        struct ggml_tensor * res  = gf->nodes[i_res];
+        struct ggml_tensor * embd = gf->nodes[i_res - 1];
 
         if (lctx.n_outputs == 0) {
             // no output
             res  = nullptr;
             embd = nullptr;
+            top  = nullptr;
         } else if (cparams.embeddings) {
             res  = nullptr; // do not extract logits for embedding case
             embd = nullptr;
+            top  = nullptr;
             for (int i = gf->n_nodes - 1; i >= 0; --i) {
                 if (strcmp(gf->nodes[i]->name, "result_embd_pooled") == 0) {
                     embd = gf->nodes[i];
@@ -18450,19 +20108,27 @@ static int llama_decode_internal(
         }
         // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
-        ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        if (!graph_reused) {
+            ggml_backend_sched_alloc_graph(lctx.sched, gf);
+        } else {
+            lctx.n_graph_reuse++;
+        }
 
         llama_set_inputs(lctx, u_batch);
 
         llama_graph_compute(lctx, gf, n_threads);
 
         // update the kv ring buffer
-        {
-            kv_self.head += n_tokens;
+        for (auto * kv : { &kv_self, &lctx.kv_swa }) {
+            if (kv->size == 0) {
+                continue;
+            }
+
+            kv->head += n_tokens;
 
             // Ensure kv cache head points to a valid index.
-            if (kv_self.head >= kv_self.size) {
-                kv_self.head = 0;
+            if (kv->head >= kv->size) {
+                kv->head = 0;
             }
         }
 
@@ -18487,6 +20153,22 @@ static int llama_decode_internal(
             }
         }
 
+        // extract top logits
+        if (top) {
+            ggml_backend_t backend_top = ggml_backend_sched_get_tensor_backend(lctx.sched, top);
+            GGML_ASSERT(backend_top != nullptr);
+            GGML_ASSERT(lctx.top_logits != nullptr);
+
+            const int64_t n_top_row = top->ne[0];
+            float * top_out = lctx.top_logits + n_outputs_prev*n_top_row;
+            const int32_t n_outputs_new = lctx.n_outputs;
+
+            GGML_ASSERT((n_outputs_prev + n_outputs_new)*n_top_row <= (int64_t) lctx.top_logits_size);
+            ggml_backend_tensor_get_async(backend_top, top, top_out, 0, n_outputs_new*n_top_row*sizeof(float));
+        } else if (lctx.n_outputs > 0) {
+            top_logits_ok = false;
+        }
+
         // extract embeddings
         if (embd) {
             ggml_backend_t backend_embd = ggml_backend_sched_get_tensor_backend(lctx.sched, embd);
@@ -18523,6 +20205,23 @@ static int llama_decode_internal(
                             ggml_backend_tensor_get_async(backend_embd, embd, embd_seq_out[seq_id].data(), (n_embd*seq_id)*sizeof(float), n_embd*sizeof(float));
                         }
                     } break;
+                case LLAMA_POOLING_TYPE_RANK:
+                    {
+                        // extract the classifier outputs (the rerank score) of each sequence
+                        auto & embd_seq_out = lctx.embd_seq;
+                        embd_seq_out.clear();
+
+                        const int64_t n_cls_out = embd->ne[0];
+
+                        for (uint32_t i = 0; i < n_tokens; i++) {
+                            const llama_seq_id seq_id = u_batch.seq_id[i][0];
+                            if (embd_seq_out.find(seq_id) != embd_seq_out.end()) {
+                                continue;
+                            }
+                            embd_seq_out[seq_id].resize(n_cls_out);
+                            ggml_backend_tensor_get_async(backend_embd, embd, embd_seq_out[seq_id].data(), (n_cls_out*seq_id)*sizeof(float), n_cls_out*sizeof(float));
+                        }
+                    } break;
                 case LLAMA_POOLING_TYPE_UNSPECIFIED:
                     {
                         GGML_ABORT("unknown pooling type");
@@ -18535,6 +20234,8 @@ static int llama_decode_internal(
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     lctx.n_outputs = n_outputs;
 
+    lctx.top_logits_valid = top_logits_ok && lctx.top_logits != nullptr;
+
     // wait for the computation to finish (automatically done when obtaining the model output)
     //llama_synchronize(&lctx);
 
@@ -18552,7 +20253,123 @@ static int llama_decode_internal(
 
     // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
     // overlap with device computation.
-    ggml_backend_sched_reset(lctx.sched);
+    // The cached graph keeps its allocation, the scheduler is reset when another graph is built.
+    if (!lctx.graph_cached) {
+        ggml_backend_sched_reset(lctx.sched);
+    }
+
+    return 0;
+}
+
+//
+// asynchronous decode
+//
+
+static void llama_output_swap(llama_context & lctx) {
+    auto & spare = lctx.output_spare;
+
+    std::swap(lctx.buf_output,       spare.buf_output);
+    std::swap(lctx.logits_size,      spare.logits_size);
+    std::swap(lctx.logits,           spare.logits);
+    std::swap(lctx.top_logits_size,  spare.top_logits_size);
+    std::swap(lctx.top_logits,       spare.top_logits);
+    std::swap(lctx.top_logits_valid, spare.top_logits_valid);
+    std::swap(lctx.embd_size,        spare.embd_size);
+    std::swap(lctx.embd,             spare.embd);
+    std::swap(lctx.output_ids,       spare.output_ids);
+    std::swap(lctx.output_size,      spare.output_size);
+    std::swap(lctx.n_outputs,        spare.n_outputs);
+    std::swap(lctx.embd_seq,         spare.embd_seq);
+}
+
+static void llama_decode_async_worker(llama_context * lctx) {
+    std::unique_lock<std::mutex> lock(lctx->async_mutex);
+    while (true) {
+        lctx->async_cv.wait(lock, [lctx] { return lctx->async_queued || lctx->async_stop; });
+        if (lctx->async_stop) {
+            break;
+        }
+        lctx->async_queued = false;
+        lock.unlock();
+
+        const int32_t ret = llama_decode_internal(*lctx, lctx->async_batch);
+
+        lock.lock();
+        lctx->async_result = ret;
+        lctx->async_busy   = false;
+        lctx->async_cv.notify_all();
+    }
+}
+
+// wait for the batch submitted with llama_decode_async, if any, and return its result
+static int32_t llama_decode_async_wait(llama_context & lctx) {
+    if (!lctx.async_worker.joinable()) {
+        return 0;
+    }
+    std::unique_lock<std::mutex> lock(lctx.async_mutex);
+    lctx.async_cv.wait(lock, [&lctx] { return !lctx.async_busy; });
+    return lctx.async_result;
+}
+
+static int32_t llama_decode_async_submit(llama_context & lctx, const llama_batch & batch) {
+    if (batch.n_tokens <= 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens == 0", __func__);
+        return -1;
+    }
+
+    // the previous batch must be complete before its outputs become the spare buffers
+    llama_synchronize(&lctx);
+
+    const int32_t n_tokens = batch.n_tokens;
+    const int64_t n_embd   = lctx.model.hparams.n_embd;
+
+    llama_batch & dst = lctx.async_batch;
+    dst = batch;
+
+    if (batch.token) {
+        lctx.async_token.assign(batch.token, batch.token + n_tokens);
+        dst.token = lctx.async_token.data();
+    }
+    if (batch.embd) {
+        lctx.async_embd.assign(batch.embd, batch.embd + n_tokens*n_embd);
+        dst.embd = lctx.async_embd.data();
+    }
+    if (batch.pos) {
+        lctx.async_pos.assign(batch.pos, batch.pos + n_tokens);
+        dst.pos = lctx.async_pos.data();
+    }
+    if (batch.n_seq_id && batch.seq_id) {
+        lctx.async_n_seq_id.assign(batch.n_seq_id, batch.n_seq_id + n_tokens);
+        lctx.async_seq_id_data.clear();
+        for (int32_t i = 0; i < n_tokens; ++i) {
+            lctx.async_seq_id_data.insert(lctx.async_seq_id_data.end(), batch.seq_id[i], batch.seq_id[i] + batch.n_seq_id[i]);
+        }
+        lctx.async_seq_id.resize(n_tokens);
+        for (int32_t i = 0, k = 0; i < n_tokens; k += batch.n_seq_id[i++]) {
+            lctx.async_seq_id[i] = lctx.async_seq_id_data.data() + k;
+        }
+        dst.n_seq_id = lctx.async_n_seq_id.data();
+        dst.seq_id   = lctx.async_seq_id.data();
+    }
+    if (batch.logits) {
+        lctx.async_logits.assign(batch.logits, batch.logits + n_tokens);
+        dst.logits = lctx.async_logits.data();
+    }
+
+    // keep the outputs of the previous batch while this one is evaluated
+    llama_output_swap(lctx);
+
+    if (!lctx.async_worker.joinable()) {
+        lctx.async_worker = std::thread(llama_decode_async_worker, &lctx);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(lctx.async_mutex);
+        lctx.async_queued = true;
+        lctx.async_busy   = true;
+        lctx.async_result = 0;
+    }
+    lctx.async_cv.notify_all();
 
     return 0;
 }
@@ -18644,6 +20461,8 @@ static int llama_encode_internal(
         batch.seq_id = seq_id_arr.data();
     }
 
+    llama_lora_seq_prepare(lctx, batch);
+
     ggml_backend_sched_reset(lctx.sched);
     ggml_backend_sched_set_eval_callback(lctx.sched, lctx.cparams.cb_eval, lctx.cparams.cb_eval_user_data);
 
@@ -18724,9 +20543,11 @@ static int llama_encode_internal(
                             ggml_backend_tensor_get_async(backend_embd, embd, embd_seq_out[seq_id].data(), (n_embd*seq_id)*sizeof(float), n_embd*sizeof(float));
                         }
                     } break;
+                case LLAMA_POOLING_TYPE_RANK:
                 case LLAMA_POOLING_TYPE_UNSPECIFIED:
                     {
-                        GGML_ABORT("unknown pooling type");
+                        // rank pooling is rejected for models with an encoder when the context is created
+                        GGML_ABORT("unsupported pooling type");
                     }
             }
         }
@@ -18740,15 +20561,14 @@ static int llama_encode_internal(
 }
 
 // find holes from the beginning of the KV cache and fill them by moving data from the end of the cache
-static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
-    auto & kv_self = lctx.kv_self;
+static void llama_kv_cache_defrag_internal(struct llama_context & lctx, struct llama_kv_cache & kv) {
 
     const auto & hparams = lctx.model.hparams;
 
     const uint32_t n_layer = hparams.n_layer;
 
-    const uint32_t n_kv   = llama_kv_cache_cell_max(kv_self);
-    const uint32_t n_used = kv_self.used;
+    const uint32_t n_kv   = llama_kv_cache_cell_max(kv);
+    const uint32_t n_used = kv.used;
 
     assert(n_used <= n_kv);
 
@@ -18773,7 +20593,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     std::vector<uint32_t> ids(n_kv, n_kv);
 
     for (uint32_t i0 = 0; i0 < n_used; ++i0) {
-        const auto & cell0 = kv_self.cells[i0];
+        const auto & cell0 = kv.cells[i0];
 
         if (!cell0.is_empty()) {
             ids[i0] = i0;
@@ -18786,7 +20606,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
         uint32_t nh = 1;
 
         // determine the size of the hole
-        while (i0 + nh < n_used && kv_self.cells[i0 + nh].is_empty()) {
+        while (i0 + nh < n_used && kv.cells[i0 + nh].is_empty()) {
             nh++;
         }
 
@@ -18795,7 +20615,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // starting from the end, find nh non-empty cells
         for (; is > i0; --is) {
-            const auto & cell1 = kv_self.cells[is];
+            const auto & cell1 = kv.cells[is];
 
             if (cell1.is_empty() || ids[is] != n_kv) {
                 continue;
@@ -18824,7 +20644,7 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
 
         // go back and move the nf cells to the hole
         for (; i1 < n_kv; ++i1) {
-            auto & cell1 = kv_self.cells[i1];
+            auto & cell1 = kv.cells[i1];
 
             if (cell1.is_empty() || ids[i1] != n_kv) {
                 if (n_moves == max_moves) {
@@ -18840,11 +20660,11 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             ids[i1] = i0 + nf;
 
             // move the cell meta data
-            kv_self.cells[i0 + nf] = cell1;
+            kv.cells[i0 + nf] = cell1;
 
             // clear the old cell and move the head there
             cell1 = llama_kv_cell();
-            kv_self.head = n_used;
+            kv.head = n_used;
 
             if (!cont) {
                 n_moves++;
@@ -18888,23 +20708,23 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa();
     const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa();
 
-    const uint32_t kv_size = kv_self.size;
+    const uint32_t kv_size = kv.size;
 
     std::vector<uint8_t> buf_k;
     std::vector<uint8_t> buf_v;
 
     for (uint32_t il = 0; il < n_layer; ++il) {
-        const size_t k_size_row = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa);
-        const size_t k_size     = ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa*kv_size);
+        const size_t k_size_row = ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa);
+        const size_t k_size     = ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa*kv_size);
 
-        const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
-        const size_t v_size    = ggml_row_size (kv_self.v_l[il]->type, n_embd_v_gqa*kv_size);
+        const size_t v_size_el = ggml_type_size(kv.v_l[il]->type);
+        const size_t v_size    = ggml_row_size (kv.v_l[il]->type, n_embd_v_gqa*kv_size);
 
         buf_k.resize(k_size);
         buf_v.resize(v_size);
 
-        ggml_backend_tensor_get(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_get(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
+        ggml_backend_tensor_get(kv.k_l[il], buf_k.data(), 0, buf_k.size());
+        ggml_backend_tensor_get(kv.v_l[il], buf_v.data(), 0, buf_v.size());
 
         // batch move [i, i+nm) to [id, id+nm)
         // note: cells can move only to a lower index
@@ -18942,15 +20762,15 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
             i += nm - 1;
         }
 
-        ggml_backend_tensor_set(kv_self.k_l[il], buf_k.data(), 0, buf_k.size());
-        ggml_backend_tensor_set(kv_self.v_l[il], buf_v.data(), 0, buf_v.size());
+        ggml_backend_tensor_set(kv.k_l[il], buf_k.data(), 0, buf_k.size());
+        ggml_backend_tensor_set(kv.v_l[il], buf_v.data(), 0, buf_v.size());
     }
 #else
     // ggml_graph defrag
 
     ggml_backend_sched_reset(lctx.sched);
 
-    ggml_cgraph * gf = llama_build_graph_defrag(lctx, ids);
+    ggml_cgraph * gf = llama_build_graph_defrag(lctx, kv, ids);
 
     llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
 #endif
@@ -18964,7 +20784,7 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
     bool need_reserve = false;
 
     // apply K-shift if needed
-    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
+    if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && (lctx.kv_self.has_shift || lctx.kv_swa.has_shift)) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             GGML_ABORT("Deepseek2 does not support K-shift");
         }
@@ -18983,13 +20803,11 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
             need_reserve = true;
         }
 
-        {
-            auto & kv_self = lctx.kv_self;
+        for (auto * kv : { &lctx.kv_self, &lctx.kv_swa }) {
+            kv->has_shift = false;
 
-            kv_self.has_shift = false;
-
-            for (uint32_t i = 0; i < kv_self.size; ++i) {
-                kv_self.cells[i].delta = 0;
+            for (uint32_t i = 0; i < kv->size; ++i) {
+                kv->cells[i].delta = 0;
             }
         }
     }
@@ -19022,7 +20840,7 @@ static void llama_kv_cache_update_internal(struct llama_context & lctx) {
 
     // defragment the KV cache if needed
     if (lctx.kv_self.do_defrag) {
-        llama_kv_cache_defrag_internal(lctx);
+        llama_kv_cache_defrag_internal(lctx, lctx.kv_self);
 
         need_reserve = true;
 
@@ -19073,88 +20891,9 @@ struct quantize_state_internal {
 
     quantize_state_internal(const llama_model & model, const llama_model_quantize_params * params)
         : model(model)
-        , params(params)
-        {}
-};
-
-static void llama_tensor_dequantize_internal(
-    struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
-    const size_t nelements, const int nthread
-) {
-    if (output.size() < nelements) {
-        output.resize(nelements);
-    }
-    float * f32_output = (float *) output.data();
-
-    ggml_type_traits_t qtype;
-    if (ggml_is_quantized(tensor->type)) {
-        qtype = ggml_internal_get_type_traits(tensor->type);
-        if (qtype.to_float == NULL) {
-            throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
-        }
-    } else if (tensor->type != GGML_TYPE_F16 &&
-               tensor->type != GGML_TYPE_BF16) {
-        throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
-    }
-
-    if (tensor->type == GGML_TYPE_I2_S) {
-        // we need to dequantize the entire tensor for I2_S
-        qtype.to_float(tensor->data, f32_output, nelements);
-        return;
-    }
-
-    if (nthread < 2) {
-        if (tensor->type == GGML_TYPE_F16) {
-            ggml_fp16_to_fp32_row((ggml_fp16_t *)tensor->data, f32_output, nelements);
-        } else if (tensor->type == GGML_TYPE_BF16) {
-            ggml_bf16_to_fp32_row((ggml_bf16_t *)tensor->data, f32_output, nelements);
-        } else if (ggml_is_quantized(tensor->type)) {
-            qtype.to_float(tensor->data, f32_output, nelements);
-        } else {
-            GGML_ABORT("fatal error"); // unreachable
-        }
-        return;
-    }
-
-    size_t block_size;
-    if (tensor->type == GGML_TYPE_F16 ||
-        tensor->type == GGML_TYPE_BF16) {
-        block_size = 1;
-    } else {
-        block_size = (size_t)ggml_blck_size(tensor->type);
-    }
-
-    size_t block_size_bytes = ggml_type_size(tensor->type);
-
-    GGML_ASSERT(nelements % block_size == 0);
-    size_t nblocks = nelements / block_size;
-    size_t blocks_per_thread = nblocks / nthread;
-    size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
-
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
-
-    for (int tnum = 0; tnum < nthread; tnum++) {
-        size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
-        size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
-
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else if (typ == GGML_TYPE_BF16) {
-                ggml_bf16_to_fp32_row((ggml_bf16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype.to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-}
+        , params(params)
+        {}
+};
 
 static ggml_type change_type_if_necessary(ggml_type new_type, int nx, int ny) {
     bool convert_incompatible_tensor = false;
@@ -19807,59 +21546,261 @@ static ggml_type llama_tensor_get_type(quantize_state_internal & qs, ggml_type n
     return new_type;
 }
 
-static size_t llama_tensor_quantize_internal(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
-    if (nthread < 2) {
-        // single-thread
-        size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
-        if (!ggml_validate_row_data(new_type, new_data, new_size)) {
-            throw std::runtime_error("quantized data validation failed");
+//
+// quantization pipeline
+//
+// The tensors of the model go through three stages that run at the same time:
+//  - the calling thread reads (and validates) the next tensors and admits them as long as the memory held by the
+//    tensors in flight stays below a bound
+//  - nthread workers convert the admitted tensors to f32 and quantize them in chunks. Chunks of several tensors are
+//    processed concurrently, so that small tensors do not leave most of the threads idle
+//  - a writer thread stores the finished tensors in the output file(s)
+// The types, and hence the sizes, of all tensors are decided before any data is processed. The meta data is therefore
+// written first and each tensor has a fixed offset in the output, so tensors can be written in any order. Written
+// tensors are recorded in a progress file next to the output, which allows an interrupted run to be resumed.
+//
+
+struct llama_quantize_job {
+    enum kind_t {
+        COPY,     // written as is
+        REPACK,   // repacked (or modified) in a single task
+        QUANTIZE, // converted to f32 in n_convert tasks, then quantized in n_quantize tasks
+    };
+
+    int           idx;
+    ggml_tensor * tensor;
+    kind_t        kind     = COPY;
+    ggml_type     new_type = GGML_TYPE_COUNT;
+    size_t        new_size = 0;
+    int           i_split  = 0;
+    size_t        offs     = 0; // offset of the data in the data section of the output file
+    size_t        pad      = 0; // alignment padding written after the data
+
+    const float * imatrix          = nullptr;
+    int64_t       chunk_size       = 0; // elements per quantization task
+    int64_t       rows_per_convert = 0; // rows per f32 conversion task
+
+    int    n_convert  = 0;
+    int    n_quantize = 0;
+    int    n_started  = 0;
+    int    n_finished = 0;
+    size_t footprint  = 0; // bytes held by the job while in flight
+
+    std::vector<no_init<uint8_t>> read_data;
+    std::vector<no_init<float>>   f32_buf;
+    std::vector<no_init<uint8_t>> new_buf;
+
+    const float * f32_data = nullptr;
+    const void  * new_data = nullptr;
+
+    int n_tasks() const { return n_convert + n_quantize; }
+};
+
+// convert rows [first_row, first_row + nrows) of the (contiguous) tensor to f32
+static void llama_tensor_dequantize_rows(const ggml_tensor * tensor, float * output, int64_t first_row, int64_t nrows) {
+    const char  * src = (const char *) tensor->data + first_row*tensor->nb[1];
+    float       * dst = output + first_row*tensor->ne[0];
+    const int64_t n   = nrows*tensor->ne[0];
+    if (tensor->type == GGML_TYPE_F16) {
+        ggml_fp16_to_fp32_row((const ggml_fp16_t *) src, dst, n);
+    } else if (tensor->type == GGML_TYPE_BF16) {
+        ggml_bf16_to_fp32_row((const ggml_bf16_t *) src, dst, n);
+    } else {
+        auto qtype = ggml_internal_get_type_traits(tensor->type);
+        if (qtype.row_meta_size > 0) {
+            // types with per-row meta data (e.g., the row scale of IQ*_KT) convert one row (group) per call
+            const int64_t group = interleaved_properties(tensor->type).second;
+            for (int64_t ir = 0; ir < nrows; ir += group) {
+                qtype.to_float(src + ir*tensor->nb[1], dst + ir*tensor->ne[0], group*tensor->ne[0]);
+            }
+        } else {
+            qtype.to_float(src, dst, n);
+        }
+    }
+}
+
+static void llama_quantize_run_task(llama_quantize_job & job, int task) {
+    const ggml_tensor * tensor = job.tensor;
+
+    if (job.kind == llama_quantize_job::REPACK) {
+        auto aux_tensor = *tensor;
+        aux_tensor.data = job.new_buf.data();
+        std::memcpy(aux_tensor.data, tensor->data, job.new_size);
+        if (job.new_type != tensor->type) {
+            iqk_repack_tensor(&aux_tensor);
+            GGML_ASSERT(aux_tensor.type == job.new_type);
+        } else {
+            bool did_modify = iqk_modify_tensor(&aux_tensor);
+            GGML_ASSERT(did_modify);
+        }
+        return;
+    }
+
+    if (task < job.n_convert) {
+        const int64_t nrows     = ggml_nrows(tensor);
+        const int64_t first_row = task*job.rows_per_convert;
+        llama_tensor_dequantize_rows(tensor, (float *) job.f32_buf.data(), first_row, std::min(job.rows_per_convert, nrows - first_row));
+        return;
+    }
+
+    // quantize each expert separately since they have different importance matrices
+    const int64_t n_per_row        = tensor->ne[0];
+    const int64_t nrows            = tensor->ne[1];
+    const int64_t nrows_per_chunk  = job.chunk_size / n_per_row;
+    const int64_t chunks_per_mat   = (nrows + nrows_per_chunk - 1)/nrows_per_chunk;
+    const int64_t chunk            = task - job.n_convert;
+    const int64_t i03              = chunk / chunks_per_mat;
+    const int64_t first_row        = (chunk % chunks_per_mat) * nrows_per_chunk;
+    const int64_t this_nrow        = std::min(nrows - first_row, nrows_per_chunk);
+    const size_t  row_size         = ggml_row_size(job.new_type, n_per_row);
+
+    const float * f32_data_03 = job.f32_data + i03 * n_per_row * nrows;
+    char        * new_data_03 = (char *) job.new_buf.data() + row_size * i03 * nrows;
+    const float * imatrix_03  = job.imatrix ? job.imatrix + i03 * n_per_row : nullptr;
+
+    size_t this_size = ggml_quantize_chunk(job.new_type, f32_data_03, new_data_03, first_row * n_per_row, this_nrow, n_per_row, imatrix_03);
+    if (!ggml_validate_row_data(job.new_type, new_data_03 + first_row * row_size, this_size)) {
+        throw std::runtime_error(format("quantized data validation failed for %s", tensor->name));
+    }
+}
+
+struct llama_quantize_pipeline {
+    llama_quantize_pipeline(size_t max_pending, std::function<void(llama_quantize_job &)> write)
+        : max_pending(max_pending), write(std::move(write)) {}
+
+    const size_t max_pending;
+    const std::function<void(llama_quantize_job &)> write;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;  // tasks became available, or the pipeline is done
+    std::condition_variable cv_write; // jobs are ready to be written
+    std::condition_variable cv_admit; // memory was released
+
+    std::vector<llama_quantize_job *> active;   // admitted jobs with tasks that have not been started yet
+    std::deque<llama_quantize_job *>  finished; // jobs waiting to be written
+
+    size_t pending    = 0;     // footprint of the jobs in flight
+    int    n_inflight = 0;     // admitted jobs that have not been written yet
+    bool   eof        = false; // all jobs have been admitted
+    bool   failed     = false;
+    std::exception_ptr error;
+
+    void fail(std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!failed) {
+            failed = true;
+            error  = e;
+        }
+        cv_work.notify_all();
+        cv_write.notify_all();
+        cv_admit.notify_all();
+    }
+
+    // wait until a job with the given footprint fits, returns false if the pipeline failed
+    bool admit(size_t footprint) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_admit.wait(lock, [&] { return failed || n_inflight == 0 || pending + footprint <= max_pending; });
+        if (failed) {
+            return false;
         }
-        return new_size;
+        pending += footprint;
+        ++n_inflight;
+        return true;
     }
 
-    std::mutex mutex;
-    int64_t counter = 0;
-    size_t new_size = 0;
-    bool valid = true;
-    auto compute = [&mutex, &counter, &new_size, &valid, new_type, f32_data, new_data, chunk_size,
-            nrows, n_per_row, imatrix]() {
-        const int64_t nrows_per_chunk = chunk_size / n_per_row;
-        size_t local_size = 0;
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex);
-            int64_t first_row = counter; counter += nrows_per_chunk;
-            if (first_row >= nrows) {
-                if (local_size > 0) {
-                    new_size += local_size;
+    void submit(llama_quantize_job & job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job.n_tasks() == 0) {
+            finished.push_back(&job);
+            cv_write.notify_one();
+        } else {
+            active.push_back(&job);
+            cv_work.notify_all();
+        }
+    }
+
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        eof = true;
+        cv_work.notify_all();
+        cv_write.notify_all();
+    }
+
+    void worker() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed) {
+            // take the next task of the oldest job that has one ready. The quantization tasks of a job can only start
+            // once its conversion to f32 is complete.
+            llama_quantize_job * job = nullptr;
+            int task = -1;
+            for (size_t i = 0; i < active.size(); ++i) {
+                auto * j = active[i];
+                if (j->n_started < j->n_convert || j->n_finished >= j->n_convert) {
+                    job  = j;
+                    task = j->n_started++;
+                    if (j->n_started == j->n_tasks()) {
+                        active.erase(active.begin() + i);
+                    }
+                    break;
                 }
-                break;
+            }
+            if (!job) {
+                if (eof && active.empty()) {
+                    break;
+                }
+                cv_work.wait(lock);
+                continue;
             }
             lock.unlock();
-            const int64_t this_nrow = std::min(nrows - first_row, nrows_per_chunk);
-            size_t this_size = ggml_quantize_chunk(new_type, f32_data, new_data, first_row * n_per_row, this_nrow, n_per_row, imatrix);
-            local_size += this_size;
-
-            // validate the quantized data
-            const size_t row_size  = ggml_row_size(new_type, n_per_row);
-            void * this_data = (char *) new_data + first_row * row_size;
-            if (!ggml_validate_row_data(new_type, this_data, this_size)) {
-                std::unique_lock<std::mutex> lock(mutex);
-                valid = false;
-                break;
+            try {
+                llama_quantize_run_task(*job, task);
+            } catch (...) {
+                fail(std::current_exception());
+                return;
+            }
+            lock.lock();
+            ++job->n_finished;
+            if (job->n_finished == job->n_tasks()) {
+                finished.push_back(job);
+                cv_write.notify_one();
+            } else if (job->n_finished == job->n_convert) {
+                cv_work.notify_all();
             }
         }
-    };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
     }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
-    if (!valid) {
-        throw std::runtime_error("quantized data validation failed");
+
+    void writer() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed) {
+            if (finished.empty()) {
+                if (eof && n_inflight == 0) {
+                    break;
+                }
+                cv_write.wait(lock);
+                continue;
+            }
+            auto * job = finished.front();
+            finished.pop_front();
+            lock.unlock();
+            try {
+                write(*job);
+            } catch (...) {
+                fail(std::current_exception());
+                return;
+            }
+            std::vector<no_init<uint8_t>>().swap(job->read_data);
+            std::vector<no_init<float>>().swap(job->f32_buf);
+            std::vector<no_init<uint8_t>>().swap(job->new_buf);
+            lock.lock();
+            pending -= job->footprint;
+            --n_inflight;
+            cv_admit.notify_one();
+            if (eof && n_inflight == 0) {
+                cv_work.notify_all();
+            }
+        }
     }
-    return new_size;
-}
+};
 
 static llama_ftype repacked_ftype(llama_ftype ftype) {
     static std::unordered_map<llama_ftype, llama_ftype> k_map = {
@@ -20139,15 +22080,6 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
-
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
     uint16_t n_split = 1;
     // Assume split index is continuous
     if (params->keep_split) {
@@ -20158,80 +22090,19 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     std::vector<gguf_context*> ctx_outs(n_split, NULL);
     ctx_outs[0] = ctx_out;
 
-    // populate the original tensors so we get an initial meta data
-    for (int i = 0; i < ml.n_tensors; ++i) {
-        auto weight = ml.get_weight(i);
-        uint16_t i_split = params->keep_split ? weight->idx : 0;
-        struct ggml_tensor * tensor = weight->tensor;
-        if (ctx_outs[i_split] == NULL) {
-            ctx_outs[i_split] = gguf_init_empty();
-        }
-        gguf_add_tensor(ctx_outs[i_split], tensor);
-    }
-
-    // Set split info if needed
-    if (n_split > 1) {
-        for (size_t i = 0; i < ctx_outs.size(); ++i) {
-            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
-            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
-            gguf_set_val_i32(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), ml.n_tensors);
-        }
-    }
-
-    int cur_split = -1;
-    std::ofstream fout;
-    auto close_ofstream = [&]() {
-        // Write metadata and close file handler
-        if (fout.is_open()) {
-            fout.seekp(0);
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split]));
-            gguf_get_meta_data(ctx_outs[cur_split], data.data());
-            fout.write((const char *) data.data(), data.size());
-            fout.close();
-        }
-    };
-    auto new_ofstream = [&](int index) {
-        cur_split = index;
-        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
-        std::string fname = fname_out;
-        if (params->keep_split) {
-            char split_path[PATH_MAX] = {0};
-            llama_split_path(split_path, sizeof(split_path), fname_out.c_str(), cur_split, n_split);
-            fname = std::string(split_path);
-        }
-
-        fout = std::ofstream(fname, std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split]);
-        // placeholder for the meta data
-        ::zeros(fout, meta_size);
-    };
-
+    // decide the type of every tensor up front, so that the complete meta data is known before any data is processed
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
+    std::vector<llama_quantize_job> jobs(ml.n_tensors);
     for (int i = 0; i < ml.n_tensors; ++i) {
         auto weight = ml.get_weight(i);
         struct ggml_tensor * tensor = weight->tensor;
-        if (weight->idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight->idx);
-        }
-
-        const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
+        auto & job = jobs[i];
+        job.idx     = i;
+        job.tensor  = tensor;
+        job.i_split = params->keep_split ? weight->idx : 0;
 
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
+        const std::string name = ggml_get_name(tensor);
 
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
@@ -20262,9 +22133,7 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         // do not quantize relative position bias (T5)
         quantize &= name.find("attn_rel_b.weight") == std::string::npos;
 
-        enum ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        enum ggml_type new_type = tensor->type;
 
         if (params->only_repack) {
             ggml_type repacked_type = (ggml_type)iqk_repacked_type(tensor);
@@ -20283,30 +22152,11 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                 }
             }
             if (modify || repacked_type != tensor->type) {
-                new_type = repacked_type;
-                new_size = ggml_nbytes(tensor);
-                if ((int)work.size() < new_size) work.resize(new_size);
-                new_data = work.data();
-
-                auto aux_tensor = *tensor;
-                aux_tensor.data = work.data();
-                std::memcpy(aux_tensor.data, tensor->data, new_size);
-
-                if (repacked_type != tensor->type) {
-                    iqk_repack_tensor(&aux_tensor);
-                    GGML_ASSERT(aux_tensor.type == repacked_type);
-                } else {
-                    bool did_modify = iqk_modify_tensor(&aux_tensor);
-                    GGML_ASSERT(did_modify);
-                }
-            }
-            else {
-                new_type = tensor->type;
-                new_size = ggml_nbytes(tensor);
-                new_data = tensor->data;
+                job.kind  = llama_quantize_job::REPACK;
+                new_type  = repacked_type;
+                job.n_quantize = 1;
             }
-            LLAMA_LOG_INFO("size = %8.3f MB, type = %s\n", new_size/1024.0/1024.0, ggml_type_name(new_type));
-            goto QuantizationDone;
+            quantize = false;
         }
 
         if (quantize) {
@@ -20368,16 +22218,12 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
             // If we've decided to quantize to the same type the tensor is already
             // in then there's nothing to do.
             quantize = tensor->type != new_type;
+            if (!quantize) {
+                new_type = tensor->type;
+            }
         }
 
-        if (!quantize) {
-            new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
-        } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
+        if (quantize) {
             const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(tensor->name);
@@ -20437,15 +22283,17 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
 
-            float * f32_data;
-
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
-                throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_internal(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
+            if (tensor->type != GGML_TYPE_F32) {
+                if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+                    throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
+                }
+                if (ggml_is_quantized(tensor->type)) {
+                    if (ggml_internal_get_type_traits(tensor->type).to_float == NULL) {
+                        throw std::runtime_error(format("type %s unsupported for integer quantization: no dequantization available", ggml_type_name(tensor->type)));
+                    }
+                } else if (tensor->type != GGML_TYPE_F16 && tensor->type != GGML_TYPE_BF16) {
+                    throw std::runtime_error(format("cannot dequantize/convert tensor type %s", ggml_type_name(tensor->type)));
+                }
             }
 
             int chunk_size_multiplier = 1;
@@ -20456,50 +22304,294 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
                 chunk_size_multiplier = num_rows;
             }
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
-
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
-            }
-            new_data = work.data();
-
             const int64_t n_per_row = tensor->ne[0];
             const int64_t nrows = tensor->ne[1];
 
             static const int64_t min_chunk_size = 32 * 512;
             const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row)) *
                                        chunk_size_multiplier;
+            const int64_t nrows_per_chunk = chunk_size / n_per_row;
+
+            job.kind       = llama_quantize_job::QUANTIZE;
+            job.imatrix    = imatrix;
+            job.chunk_size = chunk_size;
+            job.n_quantize = tensor->ne[2] * ((nrows + nrows_per_chunk - 1)/nrows_per_chunk);
+
+            if (tensor->type != GGML_TYPE_F32) {
+                // the rows of row-interleaved types are converted in groups, I2_S can only be converted as a whole
+                const int64_t nrows_total = ggml_nrows(tensor);
+                const int64_t group = interleaved_properties(tensor->type).second;
+                int64_t rows_per_convert = (min_chunk_size + n_per_row - 1)/n_per_row;
+                rows_per_convert = group * ((rows_per_convert + group - 1)/group);
+                if (tensor->type == GGML_TYPE_I2_S) {
+                    rows_per_convert = nrows_total;
+                }
+                job.rows_per_convert = rows_per_convert;
+                job.n_convert        = (nrows_total + rows_per_convert - 1)/rows_per_convert;
+            }
+        }
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+        job.new_type = new_type;
+        job.new_size = quantize ? ggml_row_size(new_type, tensor->ne[0]) * (ggml_nelements(tensor) / tensor->ne[0]) : ggml_nbytes(tensor);
+        job.footprint = (ml.use_mmap ? 0 : ggml_nbytes(tensor)) +
+                        (job.n_convert > 0 ? ggml_nelements(tensor) * sizeof(float) : 0) +
+                        (job.kind != llama_quantize_job::COPY ? job.new_size : 0);
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+        total_size_org += ggml_nbytes(tensor);
+        total_size_new += job.new_size;
+    }
 
-                new_size += llama_tensor_quantize_internal(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+    // Q/K/V and ffn_gate/ffn_up that end up with the same type are stored as one tensor (see create_fused in llm_load_tensors),
+    // the parts are processed as usual and written one after the other into the data of the fused tensor
+    std::vector<std::pair<std::string, std::vector<int>>> fused_groups; // name of the fused tensor, jobs of the parts
+    std::vector<int> fused_group_of(ml.n_tensors, -1);
+    if (params->fuse_weights && llm_arch_supports_fused_weights(model.arch)) {
+        std::unordered_map<std::string, int> job_idx;
+        for (const auto & job : jobs) {
+            job_idx[job.tensor->name] = job.idx;
+        }
+        const std::vector<std::pair<llm_tensor, std::vector<llm_tensor>>> groups = {
+            {LLM_TENSOR_ATTN_QKV,     {LLM_TENSOR_ATTN_Q, LLM_TENSOR_ATTN_K, LLM_TENSOR_ATTN_V}},
+            {LLM_TENSOR_FFN_GATE_UP,  {LLM_TENSOR_FFN_GATE, LLM_TENSOR_FFN_UP}},
+        };
+        for (int il = 0; il < (int) model.hparams.n_layer; ++il) {
+            for (const auto & group : groups) {
+                std::vector<int> parts;
+                for (auto part : group.second) {
+                    auto it = job_idx.find(tn(part, "weight", il));
+                    if (it == job_idx.end()) {
+                        break;
+                    }
+                    const auto & job = jobs[it->second];
+                    const auto & first = parts.empty() ? job : jobs[parts.front()];
+                    if (ggml_n_dims(job.tensor) != 2 || job.tensor->ne[0] != first.tensor->ne[0] ||
+                        job.new_type != first.new_type || job.i_split != first.i_split) {
+                        break;
+                    }
+                    parts.push_back(it->second);
+                }
+                if (parts.size() != group.second.size()) {
+                    continue;
+                }
+                for (int i : parts) {
+                    fused_group_of[i] = fused_groups.size();
+                }
+                fused_groups.emplace_back(tn(group.first, "weight", il), std::move(parts));
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
         }
+        LLAMA_LOG_INFO("%s: storing %d groups of tensors as fused tensors\n", __func__, (int) fused_groups.size());
+    }
 
-QuantizationDone:;
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+    // the meta data of the fused tensors
+    ggml_context * ctx_fused = nullptr;
+    if (!fused_groups.empty()) {
+        ggml_init_params fused_params = {
+            /*.mem_size   =*/ fused_groups.size()*ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ctx_fused = ggml_init(fused_params);
+    }
+
+    // populate the output tensors in the order of the input, a fused tensor takes the place of its first part
+    int n_tensors_out = 0;
+    for (auto & job : jobs) {
+        if (ctx_outs[job.i_split] == NULL) {
+            ctx_outs[job.i_split] = gguf_init_empty();
+        }
+        auto * ctx = ctx_outs[job.i_split];
+
+        const int ig = fused_group_of[job.idx];
+        if (ig < 0) {
+            gguf_add_tensor(ctx, job.tensor);
+            gguf_set_tensor_type(ctx, job.tensor->name, job.new_type);
+            gguf_set_tensor_data(ctx, job.tensor->name, nullptr, job.new_size);
+            job.offs = gguf_get_tensor_offset(ctx, gguf_find_tensor(ctx, job.tensor->name));
+            job.pad  = GGML_PAD(job.new_size, align) - job.new_size;
+            ++n_tensors_out;
+            continue;
+        }
+
+        const auto & name  = fused_groups[ig].first;
+        const auto & parts = fused_groups[ig].second;
+        if (parts.front() != job.idx) {
+            continue;
+        }
+        int64_t n_rows = 0;
+        size_t fused_size = 0;
+        for (int i : parts) {
+            n_rows     += jobs[i].tensor->ne[1];
+            fused_size += jobs[i].new_size;
+        }
+        ggml_tensor * fused = ggml_new_tensor_2d(ctx_fused, job.new_type, job.tensor->ne[0], n_rows);
+        ggml_set_name(fused, name.c_str());
+        gguf_add_tensor(ctx, fused);
+        gguf_set_tensor_data(ctx, name.c_str(), nullptr, fused_size);
+
+        size_t offs = gguf_get_tensor_offset(ctx, gguf_find_tensor(ctx, name.c_str()));
+        for (int i : parts) {
+            jobs[i].offs = offs;
+            offs += jobs[i].new_size;
+        }
+        jobs[parts.back()].pad = GGML_PAD(fused_size, align) - fused_size;
+        ++n_tensors_out;
+    }
+    if (ctx_fused) {
+        ggml_free(ctx_fused);
+    }
+
+    // Set split info if needed
+    if (n_split > 1) {
+        for (size_t i = 0; i < ctx_outs.size(); ++i) {
+            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
+            gguf_set_val_u16(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
+            gguf_set_val_i32(ctx_outs[i], ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), n_tensors_out);
+        }
+    }
+
+    std::vector<std::string> fnames(n_split, fname_out);
+    std::vector<std::vector<uint8_t>> metas(n_split);
+    for (int i_split = 0; i_split < n_split; ++i_split) {
+        if (params->keep_split) {
+            char split_path[PATH_MAX] = {0};
+            llama_split_path(split_path, sizeof(split_path), fname_out.c_str(), i_split, n_split);
+            fnames[i_split] = std::string(split_path);
+        }
+        GGML_ASSERT(ctx_outs[i_split] && "Find uninitialized gguf_context");
+        metas[i_split].resize(gguf_get_meta_size(ctx_outs[i_split]));
+        gguf_get_meta_data(ctx_outs[i_split], metas[i_split].data());
+    }
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split], name.c_str(), new_type);
-        gguf_set_tensor_data(ctx_outs[cur_split], name.c_str(), new_data, new_size);
+    // a progress file is only used if the output files were started with exactly the same meta data
+    const std::string fname_progress = fname_out + ".progress";
+    std::vector<bool> done(ml.n_tensors, false);
+    int n_done = 0;
+    bool resume = false;
+    {
+        std::ifstream fprogress(fname_progress);
+        if (fprogress) {
+            resume = true;
+            for (int i_split = 0; i_split < n_split && resume; ++i_split) {
+                std::ifstream fin(fnames[i_split], std::ios::binary);
+                std::vector<uint8_t> meta(metas[i_split].size());
+                resume = fin && fin.read((char *) meta.data(), meta.size()) && meta == metas[i_split];
+            }
+            std::string line;
+            while (resume && std::getline(fprogress, line) && !fprogress.eof()) {
+                const int i = std::atoi(line.c_str());
+                if (i >= 0 && i < ml.n_tensors && !done[i]) {
+                    done[i] = true;
+                    ++n_done;
+                }
+            }
+            if (resume) {
+                LLAMA_LOG_INFO("%s: resuming from %s, %d of %d tensors are already done\n", __func__, fname_progress.c_str(), n_done, ml.n_tensors);
+            } else {
+                LLAMA_LOG_WARN("%s: ignoring %s, it does not match the output\n", __func__, fname_progress.c_str());
+            }
+        }
+    }
+
+    std::vector<std::ofstream> fouts(n_split);
+    for (int i_split = 0; i_split < n_split; ++i_split) {
+        auto & fout = fouts[i_split];
+        fout.open(fnames[i_split], resume ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary);
+        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+        fout.write((const char *) metas[i_split].data(), metas[i_split].size());
+    }
+    std::ofstream fprogress(fname_progress, resume ? std::ios::app : std::ios::trunc);
+    fprogress.exceptions(std::ofstream::failbit);
+
+    // the tensors in flight may hold at most as much memory as the largest one needs, but at least 1 GiB
+    size_t max_pending = size_t(1) << 30;
+    for (const auto & job : jobs) {
+        max_pending = std::max(max_pending, job.footprint);
+    }
+
+    int n_written = n_done;
+    llama_quantize_pipeline pipeline(max_pending, [&](llama_quantize_job & job) {
+        const ggml_tensor * tensor = job.tensor;
 
         // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+        auto & fout = fouts[job.i_split];
+        fout.seekp(metas[job.i_split].size() + job.offs);
+        fout.write((const char *) job.new_data, job.new_size);
+        zeros(fout, job.pad);
+        fout.flush();
+
+        fprogress << job.idx << '\n';
+        fprogress.flush();
+
+        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
+               ++n_written, ml.n_tensors,
+               ggml_get_name(tensor),
+               llama_format_tensor_shape(tensor).c_str(),
+               ggml_type_name(tensor->type));
+        if (job.kind == llama_quantize_job::QUANTIZE) {
+            LLAMA_LOG_INFO("converting to %s .. size = %8.2f MiB -> %8.2f MiB\n", ggml_type_name(job.new_type),
+                    ggml_nbytes(tensor)/1024.0/1024.0, job.new_size/1024.0/1024.0);
+        } else if (job.kind == llama_quantize_job::REPACK) {
+            LLAMA_LOG_INFO("size = %8.3f MB, type = %s\n", job.new_size/1024.0/1024.0, ggml_type_name(job.new_type));
+        } else {
+            LLAMA_LOG_INFO("size = %8.3f MB\n", job.new_size/1024.0/1024.0);
+        }
+    });
+
+    std::vector<std::thread> workers;
+    workers.reserve(nthread + 1);
+    for (int i = 0; i < nthread; ++i) {
+        workers.emplace_back([&pipeline] { pipeline.worker(); });
+    }
+    workers.emplace_back([&pipeline] { pipeline.writer(); });
+
+    // read the tensors and feed them to the workers. With mmap the data is read (and validated) before the
+    // tensor is admitted, so that reading overlaps with the processing of the tensors in flight.
+    try {
+        for (auto & job : jobs) {
+            if (done[job.idx]) {
+                continue;
+            }
+            ggml_tensor * tensor = job.tensor;
+            if (ml.use_mmap) {
+                ml.load_data_for(tensor);
+            }
+            if (!pipeline.admit(job.footprint)) {
+                break;
+            }
+            if (!ml.use_mmap) {
+                job.read_data.resize(ggml_nbytes(tensor));
+                tensor->data = job.read_data.data();
+                ml.load_data_for(tensor);
+            }
+            if (job.n_convert > 0) {
+                job.f32_buf.resize(ggml_nelements(tensor));
+            }
+            job.f32_data = job.n_convert > 0 ? (const float *) job.f32_buf.data() : (const float *) tensor->data;
+            if (job.kind != llama_quantize_job::COPY) {
+                job.new_buf.resize(job.new_size);
+            }
+            job.new_data = job.kind == llama_quantize_job::COPY ? tensor->data : job.new_buf.data();
+            pipeline.submit(job);
+        }
+    } catch (...) {
+        pipeline.fail(std::current_exception());
+    }
+    pipeline.finish();
+    for (auto & w : workers) { w.join(); }
+
+    if (pipeline.error) {
+        for (auto & c:ctx_outs) {
+            gguf_free(c);
+        }
+        std::rethrow_exception(pipeline.error);
+    }
+
+    for (auto & fout : fouts) {
+        fout.close();
     }
-    close_ofstream();
+    fprogress.close();
+    std::remove(fname_progress.c_str());
+
     for (auto & c:ctx_outs) {
         gguf_free(c);
     }
@@ -20696,6 +22788,8 @@ int32_t llama_lora_adapter_set(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter,
             float scale) {
+    llama_decode_async_wait(*ctx);
+    ctx->graph_cached = nullptr;
     if (ctx->cparams.flash_attn) {
         LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
         return -1;
@@ -20707,6 +22801,8 @@ int32_t llama_lora_adapter_set(
 int32_t llama_lora_adapter_remove(
             struct llama_context * ctx,
             struct llama_lora_adapter * adapter) {
+    llama_decode_async_wait(*ctx);
+    ctx->graph_cached = nullptr;
     auto pos = ctx->lora_adapters.find(adapter);
     if (pos != ctx->lora_adapters.end()) {
         ctx->lora_adapters.erase(pos);
@@ -20716,9 +22812,34 @@ int32_t llama_lora_adapter_remove(
 }
 
 void llama_lora_adapter_clear(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
+    ctx->graph_cached = nullptr;
     ctx->lora_adapters.clear();
 }
 
+int32_t llama_lora_adapter_seq_set(
+            struct llama_context * ctx,
+            struct llama_lora_adapter * adapter,
+            llama_seq_id seq_id,
+            float scale) {
+    llama_decode_async_wait(*ctx);
+    if (adapter == nullptr) {
+        ctx->lora_seq.erase(seq_id);
+        return 0;
+    }
+    if (ctx->cparams.flash_attn) {
+        LLAMA_LOG_ERROR("%s: flash_attn is not compatible with LoRA\n", __func__);
+        return -1;
+    }
+    ctx->lora_seq[seq_id] = { adapter, scale };
+    return 0;
+}
+
+void llama_lora_adapter_seq_clear(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
+    ctx->lora_seq.clear();
+}
+
 void llama_lora_adapter_free(struct llama_lora_adapter * adapter) {
     delete adapter;
 }
@@ -20744,6 +22865,8 @@ struct llama_model_params llama_model_default_params() {
         /*.check_tensors               =*/ false,
         /*.repack_tensors              =*/ false,
         /*.use_thp                     =*/ false,
+        /*.numa_shard                  =*/ false,
+        /*.fuse_weights                =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -20778,6 +22901,12 @@ struct llama_context_params llama_context_default_params() {
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.kv_type_overrides           =*/ nullptr,
+        /*.kv_swap_type                =*/ GGML_TYPE_COUNT,
+        /*.kv_swap_path                =*/ nullptr,
+        /*.huge_page_size              =*/ 0,
+        /*.numa_mem                    =*/ LLAMA_NUMA_MEM_POLICY_NONE,
+        /*.n_top_logits                =*/ 0,
         /*.logits_all                  =*/ false,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
@@ -20785,6 +22914,9 @@ struct llama_context_params llama_context_default_params() {
         /*.mla_attn                    =*/ 0,
         /*.attn_max_batch              =*/ 0,
         /*.fused_moe_up_gate           =*/ false,
+        /*.graph_reuse                 =*/ true,
+        /*.swa_full                    =*/ false,
+        /*.kv_swap                     =*/ false,
         /*.min_experts                 =*/ -1,
         /*.thtesh_experts              =*/ 0.0f,
         /*.abort_callback              =*/ nullptr,
@@ -20816,6 +22948,7 @@ struct llama_model_quantize_params llama_model_quantize_default_params() {
         /*.keep_split                  =*/ false,
         /*.ignore_imatrix_rules        =*/ false,
         /*.only_repack                 =*/ false,
+        /*.fuse_weights                =*/ false,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.custom_quants               =*/ nullptr,
@@ -20973,6 +23106,13 @@ struct llama_context * llama_new_context_with_model(
         return nullptr;
     }
 
+    for (auto * o = params.kv_type_overrides; o && o->pattern; ++o) {
+        if (o->type_v != GGML_TYPE_COUNT && o->type_v != GGML_TYPE_F16 && o->type_v != GGML_TYPE_BF16 && !params.flash_attn) {
+            LLAMA_LOG_ERROR("%s: V cache quantization requires flash_attn (layers %s)\n", __func__, o->pattern);
+            return nullptr;
+        }
+    }
+
     llama_context * ctx = new llama_context(*model);
 
     const auto & hparams = model->hparams;
@@ -20992,8 +23132,14 @@ struct llama_context * llama_new_context_with_model(
     cparams.mla_attn         = params.mla_attn;
     cparams.attn_max_batch   = params.attn_max_batch;
     cparams.fused_moe_up_gate= params.fused_moe_up_gate;
+    cparams.graph_reuse      = params.graph_reuse;
+    cparams.swa_full         = params.swa_full;
+    cparams.kv_swap          = params.kv_swap;
     cparams.min_experts      = params.min_experts;
     cparams.thresh_experts   = params.thresh_experts;
+    cparams.huge_page_size   = params.huge_page_size;
+    cparams.numa_mem         = params.numa_mem;
+    cparams.n_top_logits     = std::min(std::max(params.n_top_logits, 0), (int32_t) hparams.n_vocab);
 
     cparams.pooling_type     = params.pooling_type;
 
@@ -21047,6 +23193,18 @@ struct llama_context * llama_new_context_with_model(
         }
     }
 
+    if (cparams.pooling_type == LLAMA_POOLING_TYPE_RANK && model->cls_out == nullptr) {
+        LLAMA_LOG_ERROR("%s: pooling type 'rank' requires a model with a classification head\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
+    if (cparams.pooling_type == LLAMA_POOLING_TYPE_RANK && llama_model_has_encoder(model)) {
+        LLAMA_LOG_ERROR("%s: pooling type 'rank' is not supported for models with an encoder\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+
     if (params.attention_type == LLAMA_ATTENTION_TYPE_UNSPECIFIED) {
         cparams.causal_attn = hparams.causal_attn;
     } else {
@@ -21096,8 +23254,45 @@ struct llama_context * llama_new_context_with_model(
         type_v = GGML_TYPE_F32; // required by ggml_ssm_scan for Mamba's ssm_states
     }
 
-    GGML_ASSERT(hparams.n_embd_head_k % ggml_blck_size(type_k) == 0);
-    GGML_ASSERT(hparams.n_embd_head_v % ggml_blck_size(type_v) == 0);
+    // per-layer cache types, the first matching override wins
+    std::vector<ggml_type> type_k_l(hparams.n_layer, type_k);
+    std::vector<ggml_type> type_v_l(hparams.n_layer, type_v);
+    if (params.kv_type_overrides && model->arch != LLM_ARCH_MAMBA) {
+        std::vector<bool> done(hparams.n_layer, false);
+        for (auto * o = params.kv_type_overrides; o->pattern; ++o) {
+            std::regex pattern;
+            try {
+                pattern = std::regex(o->pattern);
+            } catch (const std::regex_error & e) {
+                LLAMA_LOG_ERROR("%s: invalid KV cache type override pattern '%s': %s\n", __func__, o->pattern, e.what());
+                llama_free(ctx);
+                return nullptr;
+            }
+            for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+                if (done[il] || !std::regex_match(std::to_string(il), pattern)) {
+                    continue;
+                }
+                if (o->type_k != GGML_TYPE_COUNT) type_k_l[il] = o->type_k;
+                if (o->type_v != GGML_TYPE_COUNT) type_v_l[il] = o->type_v;
+                done[il] = true;
+            }
+        }
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            if (type_k_l[il] != type_k || type_v_l[il] != type_v) {
+                LLAMA_LOG_INFO("%s: layer %3u: K cache type %s, V cache type %s\n", __func__, il,
+                        ggml_type_name(type_k_l[il]), ggml_type_name(type_v_l[il]));
+            }
+        }
+    }
+
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        if (hparams.n_embd_head_k % ggml_blck_size(type_k_l[il]) != 0 || hparams.n_embd_head_v % ggml_blck_size(type_v_l[il]) != 0) {
+            LLAMA_LOG_ERROR("%s: layer %u: the head size is not a multiple of the block size of cache type %s/%s\n", __func__, il,
+                    ggml_type_name(type_k_l[il]), ggml_type_name(type_v_l[il]));
+            llama_free(ctx);
+            return nullptr;
+        }
+    }
 
     if (!hparams.vocab_only) {
         // initialize backends
@@ -21246,39 +23441,113 @@ struct llama_context * llama_new_context_with_model(
         }
         ctx->backends.push_back(ctx->backend_cpu);
 
-        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k, type_v, kv_size, cparams.offload_kqv)) {
+        // the sliding window attention layers only need the cells of the last n_swa positions of each sequence
+        // (plus the cells of the ubatch), they are kept in a separate, smaller cache
+        uint32_t kv_size_swa = 0;
+        if (!cparams.swa_full && hparams.causal_attn && model->arch != LLM_ARCH_MAMBA) {
+            uint32_t n_layer_swa = 0;
+            for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+                n_layer_swa += hparams.is_swa(il);
+            }
+            if (n_layer_swa > 0) {
+                kv_size_swa = GGML_PAD(cparams.n_seq_max*hparams.n_swa_window() + cparams.n_ubatch, llama_kv_cache_get_padding(cparams));
+                if (kv_size_swa >= kv_size) {
+                    kv_size_swa = 0;
+                }
+            }
+        }
+
+        if (!llama_kv_cache_init(ctx->kv_self, ctx, type_k_l, type_v_l, kv_size, cparams.offload_kqv,
+                    [&](int il) { return kv_size_swa == 0 || !hparams.is_swa(il); })) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        if (kv_size_swa > 0) {
+            if (!llama_kv_cache_init(ctx->kv_swa, ctx, type_k_l, type_v_l, kv_size_swa, cparams.offload_kqv,
+                        [&](int il) { return hparams.is_swa(il); })) {
+                LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for sliding window attention cache\n", __func__);
+                llama_free(ctx);
+                return nullptr;
+            }
+
+            LLAMA_LOG_INFO("%s: KV SWA cells  = %u (n_ctx = %u) for the sliding window attention layers\n", __func__, kv_size_swa, kv_size);
+        }
+
+        // store for the sequences swapped out of the KV cache
+        {
+            auto & store = ctx->kv_swap_store;
+
+            switch (params.kv_swap_type) {
+                case GGML_TYPE_COUNT:
+                case GGML_TYPE_F16:
+                case GGML_TYPE_BF16:
+                case GGML_TYPE_Q8_0:
+                case GGML_TYPE_Q6_0:
+                case GGML_TYPE_Q5_0:
+                case GGML_TYPE_Q5_1:
+                case GGML_TYPE_Q4_0:
+                case GGML_TYPE_Q4_1:
+                case GGML_TYPE_IQ4_NL:
+                    store.type = params.kv_swap_type;
+                    break;
+                default:
+                    LLAMA_LOG_ERROR("%s: unsupported type %s for swapped out sequences\n", __func__, ggml_type_name(params.kv_swap_type));
+                    llama_free(ctx);
+                    return nullptr;
+            }
+
+            if (params.kv_swap_path && params.kv_swap_path[0]) {
+                try {
+                    store.file.reset(new llama_file(params.kv_swap_path, "w+b"));
+                } catch (const std::exception & e) {
+                    LLAMA_LOG_ERROR("%s: failed to create the file for swapped out sequences: %s\n", __func__, e.what());
+                    llama_free(ctx);
+                    return nullptr;
+                }
+            }
+
+            if (cparams.kv_swap) {
+                LLAMA_LOG_INFO("%s: KV swap      = %s%s, type = %s\n", __func__,
+                        store.file ? "file " : "host memory", store.file ? params.kv_swap_path : "",
+                        store.type == GGML_TYPE_COUNT ? "unchanged" : ggml_type_name(store.type));
+            }
+        }
+
         {
             size_t memory_size_k = 0;
             size_t memory_size_v = 0;
 
-            for (auto & k : ctx->kv_self.k_l) {
-                memory_size_k += ggml_nbytes(k);
-            }
+            for (const auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+                for (auto & k : kv->k_l) {
+                    memory_size_k += k ? ggml_nbytes(k) : 0;
+                }
 
-            for (auto & v : ctx->kv_self.v_l) {
-                memory_size_v += ggml_nbytes(v);
+                for (auto & v : kv->v_l) {
+                    memory_size_v += v ? ggml_nbytes(v) : 0;
+                }
             }
 
+            // with per-layer overrides there is no single cache type to report
+            const char * type_k_name = std::all_of(type_k_l.begin(), type_k_l.end(), [&](ggml_type t) { return t == type_k; }) ? ggml_type_name(type_k) : "mixed";
+            const char * type_v_name = std::all_of(type_v_l.begin(), type_v_l.end(), [&](ggml_type t) { return t == type_v; }) ? ggml_type_name(type_v) : "mixed";
+
             if (memory_size_k + memory_size_v > 0) {
 	        if (cparams.mla_attn != 0 && !cparams.flash_attn) {
                     LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, c^KV (%s): %7.2f MiB, kv^T (%s): %7.2f MiB\n", __func__,
                             (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                            ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                            ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                            type_k_name, (float)memory_size_k / (1024.0f * 1024.0f),
+                            type_v_name, (float)memory_size_v / (1024.0f * 1024.0f));
                 } else if (cparams.mla_attn != 0 && cparams.flash_attn) {
                     LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, c^KV (%s): %7.2f MiB, kv^T: not used\n", __func__,
                             (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                            ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f));
+                            type_k_name, (float)memory_size_k / (1024.0f * 1024.0f));
                 } else {
                     LLAMA_LOG_INFO("%s: KV self size  = %7.2f MiB, K (%s): %7.2f MiB, V (%s): %7.2f MiB\n", __func__,
                             (float)(memory_size_k + memory_size_v) / (1024.0f * 1024.0f),
-                            ggml_type_name(type_k), (float)memory_size_k / (1024.0f * 1024.0f),
-                            ggml_type_name(type_v), (float)memory_size_v / (1024.0f * 1024.0f));
+                            type_k_name, (float)memory_size_k / (1024.0f * 1024.0f),
+                            type_v_name, (float)memory_size_v / (1024.0f * 1024.0f));
 		}
             }
         }
@@ -21304,7 +23573,7 @@ struct llama_context * llama_new_context_with_model(
             for (auto * backend : ctx->backends) {
                 if (ggml_backend_is_cpu(backend)) {
                     // use host buffers for the CPU backend compute buffer
-                    backend_buft.push_back(llama_default_buffer_type_cpu(true));
+                    backend_buft.push_back(llama_cpu_buffer_type_for(cparams, llama_default_buffer_type_cpu(true), -1, hparams.n_layer));
                 } else {
                     backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
                 }
@@ -21415,6 +23684,10 @@ const struct llama_vocab* llama_get_model_vocab(const struct llama_model* model)
     return &model->vocab;
 }
 
+int32_t llama_vocab_n_tokens(const struct llama_vocab * vocab) {
+    return vocab->n_tokens();
+}
+
 enum llama_rope_type llama_rope_type(const struct llama_model * model) {
     switch (model->arch) {
         // these models do not use RoPE
@@ -21508,6 +23781,16 @@ int32_t llama_n_layer(const struct llama_model * model) {
     return model->hparams.n_layer;
 }
 
+int32_t llama_n_swa(const struct llama_model * model) {
+    const auto & hparams = model->hparams;
+    for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+        if (hparams.is_swa(il)) {
+            return hparams.n_swa_window();
+        }
+    }
+    return 0;
+}
+
 int32_t llama_n_head(const struct llama_model * model) {
     return model->hparams.n_head();
 }
@@ -21689,6 +23972,9 @@ static bool llama_control_vector_init(struct llama_control_vector & cvec, const
 }
 
 int32_t llama_control_vector_apply(struct llama_context * lctx, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+    llama_decode_async_wait(*lctx);
+    lctx->graph_cached = nullptr;
+
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
@@ -21751,6 +24037,7 @@ void llama_kv_cache_view_free(struct llama_kv_cache_view * view) {
 }
 
 void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_kv_cache_view * view) {
+    llama_decode_async_wait(*const_cast<llama_context *>(ctx));
     if (uint32_t(view->n_cells) < ctx->kv_self.size || view->cells == nullptr) {
         view->n_cells = int32_t(ctx->kv_self.size);
         void * p = realloc(view->cells, sizeof(struct llama_kv_cache_view_cell) * view->n_cells);
@@ -21815,6 +24102,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
 }
 
 int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
+    llama_decode_async_wait(*const_cast<llama_context *>(ctx));
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
@@ -21825,53 +24113,135 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
 }
 
 int32_t llama_get_kv_cache_used_cells(const struct llama_context * ctx) {
+    llama_decode_async_wait(*const_cast<llama_context *>(ctx));
     return ctx->kv_self.used;
 }
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
     llama_kv_cache_clear(ctx->kv_self);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_clear(ctx->kv_swa);
+    }
+    ctx->kv_swap_store.clear();
 }
 
 bool llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
-    return llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
+    llama_decode_async_wait(*ctx);
+    if (!llama_kv_swap_seq_rm(*ctx, seq_id, p0, p1)) {
+        return false;
+    }
+    if (!llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1)) {
+        return false;
+    }
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_rm(ctx->kv_swa, seq_id, p0, p1);
+    }
+    return true;
 }
 
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    llama_decode_async_wait(*ctx);
     if (seq_id_src == seq_id_dst) {
         return;
     }
+    for (llama_seq_id s : { seq_id_src, seq_id_dst }) {
+        if (ctx->kv_swap_store.seqs.count(s) && !llama_kv_swap_in(*ctx, s, { seq_id_src, seq_id_dst })) {
+            LLAMA_LOG_ERROR("%s: failed to swap in sequence %d, the sequence is not copied\n", __func__, s);
+            return;
+        }
+    }
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_cp(ctx->kv_swa, seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_wait(*ctx);
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_keep(ctx->kv_swa, seq_id);
+    }
+    std::vector<llama_seq_id> swapped;
+    for (const auto & it : ctx->kv_swap_store.seqs) {
+        if (it.first != seq_id) {
+            swapped.push_back(it.first);
+        }
+    }
+    for (llama_seq_id s : swapped) {
+        ctx->kv_swap_store.erase(s);
+    }
 }
 
 void llama_kv_cache_seq_add(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    llama_decode_async_wait(*ctx);
     if (delta == 0) {
         return;
     }
 
     llama_kv_cache_seq_add(ctx->kv_self, seq_id, p0, p1, delta);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_add(ctx->kv_swa, seq_id, p0, p1, delta);
+    }
+    llama_kv_swap_seq_add(*ctx, seq_id, p0, p1, delta);
 }
 
 void llama_kv_cache_seq_div(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    llama_decode_async_wait(*ctx);
     if (d == 1) {
         return;
     }
 
     llama_kv_cache_seq_div(ctx->kv_self, seq_id, p0, p1, d);
+    if (ctx->kv_swa.size > 0) {
+        llama_kv_cache_seq_div(ctx->kv_swa, seq_id, p0, p1, d);
+    }
+    llama_kv_swap_seq_div(*ctx, seq_id, p0, p1, d);
 }
 
 llama_pos llama_kv_cache_seq_pos_max(struct llama_context * ctx, llama_seq_id seq_id) {
-    return llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id);
+    llama_decode_async_wait(*ctx);
+    return std::max(llama_kv_cache_seq_pos_max(ctx->kv_self, seq_id), llama_kv_swap_seq_pos(*ctx, seq_id, 0, true));
+}
+
+llama_pos llama_kv_cache_seq_pos_min(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_wait(*ctx);
+    llama_pos result = llama_kv_cache_seq_pos_min(ctx->kv_self, seq_id);
+    if (ctx->kv_swap_store.seqs.count(seq_id)) {
+        result = llama_kv_swap_seq_pos(*ctx, seq_id, 0, false);
+    }
+    if (ctx->kv_swa.size > 0 && result >= 0) {
+        // the SWA cache only keeps the last positions of the sequence
+        const llama_pos swa_min = ctx->kv_swap_store.seqs.count(seq_id) ? llama_kv_swap_seq_pos(*ctx, seq_id, 1, false)
+                                                                        : llama_kv_cache_seq_pos_min(ctx->kv_swa, seq_id);
+        result = std::max(result, swa_min);
+    }
+    return result;
+}
+
+bool llama_kv_cache_seq_swap_out(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_wait(*ctx);
+    return llama_kv_swap_out(*ctx, seq_id);
+}
+
+bool llama_kv_cache_seq_swap_in(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_wait(*ctx);
+    return llama_kv_swap_in(*ctx, seq_id, {});
+}
+
+bool llama_kv_cache_seq_swapped(const struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_decode_async_wait(*const_cast<llama_context *>(ctx));
+    return ctx->kv_swap_store.seqs.count(seq_id) > 0;
 }
 
 void llama_kv_cache_defrag(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
     llama_kv_cache_defrag(ctx->kv_self);
 }
 
 void llama_kv_cache_update(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
     llama_kv_cache_update_internal(*ctx);
 }
 
@@ -21998,76 +24368,93 @@ struct llama_data_write {
         }
     }
 
-    void write_kv_cache_data(const struct llama_context * ctx, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache_data(const struct llama_context * ctx, const struct llama_kv_cache & kv, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) {
         const struct llama_hparams & hparams = ctx->model.hparams;
 
         // v_state: 0 -> not transposed V cache
         //          1 -> transposed V cache
         //          2 -> no V cache (as it may be the case with MLA)
-        const uint32_t v_state = kv_self.v_l.empty() ? 2 : kv_self.v_trans ? 1 : 0;
+        const uint32_t v_state = kv.v_l.empty() ? 2 : kv.v_trans ? 1 : 0;
         const uint32_t n_layer = hparams.n_layer;
 
-        write(&v_state, sizeof(v_state));
-        write(&n_layer, sizeof(n_layer));
+        // number of layers stored in the cache (the sliding window attention layers may be in a separate cache)
+        uint32_t n_layer_kv = 0;
+        for (uint32_t il = 0; il < n_layer; ++il) {
+            n_layer_kv += kv.k_l[il] != nullptr;
+        }
+
+        write(&v_state,    sizeof(v_state));
+        write(&n_layer_kv, sizeof(n_layer_kv));
 
         std::vector<uint8_t> tmp_buf;
 
         // Iterate and write all the keys first, each row is a cell
         // Get whole range at a time
         for (uint32_t il = 0; il < n_layer; ++il) {
+            if (!kv.k_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
 
             // Write key type
-            const int32_t k_type_i = (int32_t)kv_self.k_l[il]->type;
+            const int32_t k_type_i = (int32_t)kv.k_l[il]->type;
             write(&k_type_i, sizeof(k_type_i));
 
             // Write row size of key
-            const uint64_t k_size_row = (ctx->cparams.mla_attn == 0) ? ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa) : ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
+            const uint64_t k_size_row = (ctx->cparams.mla_attn == 0) ? ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa) : ggml_row_size(kv.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
             write(&k_size_row, sizeof(k_size_row));
 
             // Read each range of cells of k_size length each into tmp_buf and write out
             for (const auto & range : cell_ranges) {
                 const size_t range_size = range.second - range.first;
                 const size_t buf_size = range_size * k_size_row;
-                write_tensor_data(kv_self.k_l[il], range.first * k_size_row, buf_size);
+                write_tensor_data(kv.k_l[il], range.first * k_size_row, buf_size);
             }
         }
 
         if (v_state == 0) {
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
-                const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+                const int32_t v_type_i = (int32_t)kv.v_l[il]->type;
                 write(&v_type_i, sizeof(v_type_i));
 
                 // Write row size of value
-                const uint64_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+                const uint64_t v_size_row = ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa);
                 write(&v_size_row, sizeof(v_size_row));
 
                 // Read each range of cells of v_size length each into tmp_buf and write out
                 for (const auto & range : cell_ranges) {
                     const size_t range_size = range.second - range.first;
                     const size_t buf_size = range_size * v_size_row;
-                    write_tensor_data(kv_self.v_l[il], range.first * v_size_row, buf_size);
+                    write_tensor_data(kv.v_l[il], range.first * v_size_row, buf_size);
                 }
             }
         }
         else if (v_state == 1) {
             // When v is transposed, we also need the element size and get the element ranges from each row
-            const uint32_t kv_size = kv_self.size;
+            const uint32_t kv_size = kv.size;
             for (uint32_t il = 0; il < n_layer; ++il) {
+                if (!kv.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Write value type
-                const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+                const int32_t v_type_i = (int32_t)kv.v_l[il]->type;
                 write(&v_type_i, sizeof(v_type_i));
 
                 // Write element size
-                const uint32_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
+                const uint32_t v_size_el = ggml_type_size(kv.v_l[il]->type);
                 write(&v_size_el, sizeof(v_size_el));
 
                 // Write GQA embedding size
@@ -22080,37 +24467,36 @@ struct llama_data_write {
                         const size_t range_size = range.second - range.first;
                         const size_t src_offset = (range.first + j * kv_size) * v_size_el;
                         const size_t buf_size = range_size * v_size_el;
-                        write_tensor_data(kv_self.v_l[il], src_offset, buf_size);
+                        write_tensor_data(kv.v_l[il], src_offset, buf_size);
                     }
                 }
             }
         }
     }
 
-    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        const struct llama_kv_cache & kv_self = ctx->kv_self;
+    void write_kv_cache(const struct llama_context * ctx, const struct llama_kv_cache & kv, llama_seq_id seq_id) {
         std::vector<std::pair<uint32_t, uint32_t>> cell_ranges; // ranges, from inclusive, to exclusive
         uint32_t cell_count = 0;
 
         // Count the number of cells with the specified seq_id
         // Find all the ranges of cells with this seq id (or all, when -1)
-        uint32_t cell_range_begin = kv_self.size;
-        for (uint32_t i = 0; i < kv_self.size; ++i) {
-            const auto & cell = kv_self.cells[i];
+        uint32_t cell_range_begin = kv.size;
+        for (uint32_t i = 0; i < kv.size; ++i) {
+            const auto & cell = kv.cells[i];
             if ((seq_id == -1 && !cell.is_empty()) || cell.has_seq_id(seq_id)) {
                 ++cell_count;
-                if (cell_range_begin == kv_self.size) {
+                if (cell_range_begin == kv.size) {
                     cell_range_begin = i;
                 }
             } else {
-                if (cell_range_begin != kv_self.size) {
+                if (cell_range_begin != kv.size) {
                     cell_ranges.emplace_back(cell_range_begin, i);
-                    cell_range_begin = kv_self.size;
+                    cell_range_begin = kv.size;
                 }
             }
         }
-        if (cell_range_begin != kv_self.size) {
-            cell_ranges.emplace_back(cell_range_begin, kv_self.size);
+        if (cell_range_begin != kv.size) {
+            cell_ranges.emplace_back(cell_range_begin, kv.size);
         }
 
         // DEBUG CHECK: Sum of cell counts in ranges should equal the total cell count
@@ -22122,8 +24508,17 @@ struct llama_data_write {
 
         write(&cell_count, sizeof(cell_count));
 
-        write_kv_cache_meta(kv_self, cell_ranges, seq_id);
-        write_kv_cache_data(ctx, cell_ranges);
+        write_kv_cache_meta(kv, cell_ranges, seq_id);
+        write_kv_cache_data(ctx, kv, cell_ranges);
+    }
+
+    void write_kv_cache(const struct llama_context * ctx, llama_seq_id seq_id = -1) {
+        write_kv_cache(ctx, ctx->kv_self, seq_id);
+
+        // the cells of the sliding window attention layers follow the ones of the other layers
+        if (ctx->kv_swa.size > 0) {
+            write_kv_cache(ctx, ctx->kv_swa, seq_id);
+        }
     }
 };
 
@@ -22133,6 +24528,15 @@ struct llama_data_read {
     virtual size_t get_size_read() = 0;
     virtual ~llama_data_read() = default;
 
+    // tensors in host memory are read into directly
+    void read_tensor_data(struct ggml_tensor * tensor, size_t offset, size_t size) {
+        if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            read_to((uint8_t *) tensor->data + offset, size);
+        } else {
+            ggml_backend_tensor_set(tensor, read(size), offset, size);
+        }
+    }
+
     void read_string(std::string & str) {
         uint32_t str_size;
         read_to(&str_size, sizeof(str_size));
@@ -22215,13 +24619,12 @@ struct llama_data_read {
         }
     }
 
-    bool read_kv_cache_meta(struct llama_context * ctx, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
-        struct llama_kv_cache & kv_self = ctx->kv_self;
+    bool read_kv_cache_meta(struct llama_context * ctx, struct llama_kv_cache & kv, uint32_t cell_count, llama_seq_id dest_seq_id = -1) {
 
         if (dest_seq_id != -1) {
             // single sequence
 
-            llama_kv_cache_seq_rm(kv_self, dest_seq_id, -1, -1);
+            llama_kv_cache_seq_rm(kv, dest_seq_id, -1, -1);
 
             llama_batch batch = llama_batch_init(cell_count, 0, 1);
             batch.n_tokens = cell_count;
@@ -22242,34 +24645,35 @@ struct llama_data_read {
                 batch.n_seq_id[i] = 1;
                 batch.seq_id[i][0] = dest_seq_id;
             }
-            if (!llama_kv_cache_find_slot(kv_self, batch)) {
+            const bool found = &kv == &ctx->kv_swa ? llama_kv_cache_swa_find_slot(*ctx, batch) : llama_kv_cache_find_slot(kv, batch);
+            if (!found) {
                 llama_batch_free(batch);
                 LLAMA_LOG_ERROR("%s: failed to find available cells in kv cache\n", __func__);
                 return false;
             }
 
-            // DEBUG CHECK: kv_self.head should be our first cell, kv_self.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
+            // DEBUG CHECK: kv.head should be our first cell, kv.head + cell_count - 1 should be our last cell (verify seq_id and pos values)
             // Assume that this is one contiguous block of cells
-            GGML_ASSERT(kv_self.head + cell_count <= kv_self.size);
-            GGML_ASSERT(kv_self.cells[kv_self.head].pos == batch.pos[0]);
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
-            GGML_ASSERT(kv_self.cells[kv_self.head].has_seq_id(dest_seq_id));
-            GGML_ASSERT(kv_self.cells[kv_self.head + cell_count - 1].has_seq_id(dest_seq_id));
+            GGML_ASSERT(kv.head + cell_count <= kv.size);
+            GGML_ASSERT(kv.cells[kv.head].pos == batch.pos[0]);
+            GGML_ASSERT(kv.cells[kv.head + cell_count - 1].pos == batch.pos[cell_count - 1]);
+            GGML_ASSERT(kv.cells[kv.head].has_seq_id(dest_seq_id));
+            GGML_ASSERT(kv.cells[kv.head + cell_count - 1].has_seq_id(dest_seq_id));
 
             // Cleanup
             llama_batch_free(batch);
         } else {
             // whole KV cache restore
 
-            if (cell_count > kv_self.size) {
+            if (cell_count > kv.size) {
                 LLAMA_LOG_ERROR("%s: not enough cells in kv cache\n", __func__);
                 return false;
             }
 
-            llama_kv_cache_clear(kv_self);
+            llama_kv_cache_clear(kv);
 
             for (uint32_t i = 0; i < cell_count; ++i) {
-                llama_kv_cell & cell = kv_self.cells[i];
+                llama_kv_cell & cell = kv.cells[i];
 
                 llama_pos pos;
                 uint32_t  n_seq_id;
@@ -22292,16 +24696,15 @@ struct llama_data_read {
                 }
             }
 
-            kv_self.head = 0;
-            kv_self.used = cell_count;
+            kv.head = 0;
+            kv.used = cell_count;
         }
 
         return true;
     }
 
-    bool read_kv_cache_data(struct llama_context * ctx, uint32_t cell_count) {
+    bool read_kv_cache_data(struct llama_context * ctx, struct llama_kv_cache & kv, uint32_t cell_count) {
         const struct llama_hparams & hparams = ctx->model.hparams;
-        struct llama_kv_cache & kv_self = ctx->kv_self;
 
         // v_state: 0 -> not transposed V cache
         //          1 -> transposed V cache
@@ -22311,23 +24714,33 @@ struct llama_data_read {
         read_to(&v_state, sizeof(v_state));
         read_to(&n_layer, sizeof(n_layer));
 
-        if (n_layer != hparams.n_layer) {
-            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, hparams.n_layer);
+        // number of layers stored in the cache (the sliding window attention layers may be in a separate cache)
+        uint32_t n_layer_kv = 0;
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            n_layer_kv += kv.k_l[il] != nullptr;
+        }
+
+        if (n_layer != n_layer_kv) {
+            LLAMA_LOG_ERROR("%s: mismatched layer count (%u instead of %u)\n", __func__, n_layer, n_layer_kv);
             return false;
         }
-        if (cell_count > kv_self.size) {
-            LLAMA_LOG_ERROR("%s: not enough cells in kv cache to restore state (%u > %u)\n", __func__, cell_count, kv_self.size);
+        if (cell_count > kv.size) {
+            LLAMA_LOG_ERROR("%s: not enough cells in kv cache to restore state (%u > %u)\n", __func__, cell_count, kv.size);
             return false;
         }
 
-	// Currently the only way there is no V cache (and thus v_state is 2) requires flash_attn, and flash_attn sets kv_self.v_trans to false
-        if (kv_self.v_trans != (v_state == 1)) {
+	// Currently the only way there is no V cache (and thus v_state is 2) requires flash_attn, and flash_attn sets kv.v_trans to false
+        if (kv.v_trans != (v_state == 1)) {
             LLAMA_LOG_ERROR("%s: incompatible V transposition\n", __func__);
             return false;
         }
 
         // For each layer, read the keys for each cell, one row is one cell, read as one contiguous block
-        for (uint32_t il = 0; il < n_layer; ++il) {
+        for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+            if (!kv.k_l[il]) {
+                continue;
+            }
+
             const uint32_t n_embd_k_gqa = hparams.n_embd_k_gqa(il) + hparams.n_embd_k_s();
             const uint32_t n_embd_head_qk_rope = hparams.n_rot;
             const uint32_t kv_lora_rank = hparams.n_lora_kv;
@@ -22336,7 +24749,7 @@ struct llama_data_read {
             // Read type of key
             int32_t k_type_i_ref;
             read_to(&k_type_i_ref, sizeof(k_type_i_ref));
-            const int32_t k_type_i = (int32_t)kv_self.k_l[il]->type;
+            const int32_t k_type_i = (int32_t)kv.k_l[il]->type;
             if (k_type_i != k_type_i_ref) {
                 LLAMA_LOG_ERROR("%s: mismatched key type (%d != %d, layer %d)\n", __func__, k_type_i, k_type_i_ref, il);
                 return false;
@@ -22345,7 +24758,7 @@ struct llama_data_read {
             // Read row size of key
             uint64_t k_size_row_ref;
             read_to(&k_size_row_ref, sizeof(k_size_row_ref));
-            const uint64_t k_size_row = (ctx->cparams.mla_attn == 0) ? ggml_row_size(kv_self.k_l[il]->type, n_embd_k_gqa) : ggml_row_size(kv_self.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
+            const uint64_t k_size_row = (ctx->cparams.mla_attn == 0) ? ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa) : ggml_row_size(kv.k_l[il]->type, kv_lora_rank + n_embd_head_qk_rope);
             if (k_size_row != k_size_row_ref) {
                 LLAMA_LOG_ERROR("%s: mismatched key row size (%zu != %zu, layer %d)\n", __func__, k_size_row, (size_t) k_size_row_ref, il);
                 return false;
@@ -22353,18 +24766,22 @@ struct llama_data_read {
 
             if (cell_count) {
                 // Read and set the keys for the whole cell range
-                ggml_backend_tensor_set(kv_self.k_l[il], read(cell_count * k_size_row), kv_self.head * k_size_row, cell_count * k_size_row);
+                read_tensor_data(kv.k_l[il], kv.head * k_size_row, cell_count * k_size_row);
             }
         }
 
         if (v_state == 0) {
-            for (uint32_t il = 0; il < n_layer; ++il) {
+            for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+                if (!kv.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
                 int32_t v_type_i_ref;
                 read_to(&v_type_i_ref, sizeof(v_type_i_ref));
-                const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+                const int32_t v_type_i = (int32_t)kv.v_l[il]->type;
                 if (v_type_i != v_type_i_ref) {
                     LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
                     return false;
@@ -22373,7 +24790,7 @@ struct llama_data_read {
                 // Read row size of value
                 uint64_t v_size_row_ref;
                 read_to(&v_size_row_ref, sizeof(v_size_row_ref));
-                const size_t v_size_row = ggml_row_size(kv_self.v_l[il]->type, n_embd_v_gqa);
+                const size_t v_size_row = ggml_row_size(kv.v_l[il]->type, n_embd_v_gqa);
                 if (v_size_row != v_size_row_ref) {
                     LLAMA_LOG_ERROR("%s: mismatched value row size (%zu != %zu, layer %d)\n", __func__, v_size_row, (size_t) v_size_row_ref, il);
                     return false;
@@ -22381,19 +24798,23 @@ struct llama_data_read {
 
                 if (cell_count) {
                     // Read and set the values for the whole cell range
-                    ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_row), kv_self.head * v_size_row, cell_count * v_size_row);
+                    read_tensor_data(kv.v_l[il], kv.head * v_size_row, cell_count * v_size_row);
                 }
             }
         }
         else if (v_state == 1) {
             // For each layer, read the values for each cell (transposed)
-            for (uint32_t il = 0; il < n_layer; ++il) {
+            for (uint32_t il = 0; il < hparams.n_layer; ++il) {
+                if (!kv.v_l[il]) {
+                    continue;
+                }
+
                 const uint32_t n_embd_v_gqa = hparams.n_embd_v_gqa(il) + hparams.n_embd_v_s();
 
                 // Read type of value
                 int32_t v_type_i_ref;
                 read_to(&v_type_i_ref, sizeof(v_type_i_ref));
-                const int32_t v_type_i = (int32_t)kv_self.v_l[il]->type;
+                const int32_t v_type_i = (int32_t)kv.v_l[il]->type;
                 if (v_type_i != v_type_i_ref) {
                     LLAMA_LOG_ERROR("%s: mismatched value type (%d != %d, layer %d)\n", __func__, v_type_i, v_type_i_ref, il);
                     return false;
@@ -22402,7 +24823,7 @@ struct llama_data_read {
                 // Read element size of value
                 uint32_t v_size_el_ref;
                 read_to(&v_size_el_ref, sizeof(v_size_el_ref));
-                const size_t v_size_el = ggml_type_size(kv_self.v_l[il]->type);
+                const size_t v_size_el = ggml_type_size(kv.v_l[il]->type);
                 if (v_size_el != v_size_el_ref) {
                     LLAMA_LOG_ERROR("%s: mismatched value element size (%zu != %zu, layer %d)\n", __func__, v_size_el, (size_t) v_size_el_ref, il);
                     return false;
@@ -22419,8 +24840,8 @@ struct llama_data_read {
                 if (cell_count) {
                     // For each row in the transposed matrix, read the values for the whole cell range
                     for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
-                        const size_t dst_offset = (kv_self.head + j * kv_self.size) * v_size_el;
-                        ggml_backend_tensor_set(kv_self.v_l[il], read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                        const size_t dst_offset = (kv.head + j * kv.size) * v_size_el;
+                        read_tensor_data(kv.v_l[il], dst_offset, cell_count * v_size_el);
                     }
                 }
             }
@@ -22429,10 +24850,22 @@ struct llama_data_read {
     }
 
     void read_kv_cache(struct llama_context * ctx, llama_seq_id seq_id = -1) {
-        uint32_t cell_count;
-        read_to(&cell_count, sizeof(cell_count));
+        bool res = true;
+
+        // the cells of the sliding window attention layers follow the ones of the other layers
+        for (auto * kv : { &ctx->kv_self, &ctx->kv_swa }) {
+            if (kv->size == 0) {
+                continue;
+            }
+
+            uint32_t cell_count;
+            read_to(&cell_count, sizeof(cell_count));
 
-        bool res = read_kv_cache_meta(ctx, cell_count, seq_id) && read_kv_cache_data(ctx, cell_count);
+            res = read_kv_cache_meta(ctx, *kv, cell_count, seq_id) && read_kv_cache_data(ctx, *kv, cell_count);
+            if (!res) {
+                break;
+            }
+        }
 
         if (!res) {
             if (seq_id == -1) {
@@ -22535,6 +24968,11 @@ struct llama_data_write_file : llama_data_write {
     }
 
     void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        // tensors in host memory are written without an intermediate copy
+        if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
         temp_buffer.resize(size);
         ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
         write(temp_buffer.data(), temp_buffer.size());
@@ -22568,6 +25006,133 @@ struct llama_data_read_file : llama_data_read {
     }
 };
 
+// the compressed state data is split into blocks of at most LLAMA_STATE_LZ_BLOCK_SIZE bytes
+// each block is stored as its size, the size of the stored data and the LZ compressed data
+// (or the data as it is, if it does not compress)
+static constexpr size_t LLAMA_STATE_LZ_BLOCK_SIZE = 1024*1024;
+
+struct llama_data_write_lz : llama_data_write {
+    llama_file * file;
+    size_t size_written = 0;
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> comp;
+    size_t n_block = 0;
+
+    llama_data_write_lz(llama_file * f) : file(f), block(LLAMA_STATE_LZ_BLOCK_SIZE), comp(llama_lz_compress_bound(LLAMA_STATE_LZ_BLOCK_SIZE)) {}
+
+    void write(const void * src, size_t size) override {
+        const uint8_t * p = (const uint8_t *) src;
+        size_written += size;
+        while (size > 0) {
+            const size_t n = std::min(size, block.size() - n_block);
+            memcpy(block.data() + n_block, p, n);
+            n_block += n;
+            p       += n;
+            size    -= n;
+            if (n_block == block.size()) {
+                flush();
+            }
+        }
+    }
+
+    void write_tensor_data(const struct ggml_tensor * tensor, size_t offset, size_t size) override {
+        if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
+        size_written += size;
+        while (size > 0) {
+            const size_t n = std::min(size, block.size() - n_block);
+            ggml_backend_tensor_get(tensor, block.data() + n_block, offset, n);
+            n_block += n;
+            offset  += n;
+            size    -= n;
+            if (n_block == block.size()) {
+                flush();
+            }
+        }
+    }
+
+    // must be called after the last write
+    void flush() {
+        if (n_block == 0) {
+            return;
+        }
+        const size_t n_comp = llama_lz_compress(block.data(), n_block, comp.data());
+        const bool   stored = n_comp >= n_block;
+        file->write_u32((uint32_t) n_block);
+        file->write_u32((uint32_t) (stored ? n_block : n_comp));
+        file->write_raw(stored ? block.data() : comp.data(), stored ? n_block : n_comp);
+        n_block = 0;
+    }
+
+    size_t get_size_written() override {
+        return size_written;
+    }
+};
+
+struct llama_data_read_lz : llama_data_read {
+    llama_file * file;
+    size_t size_read = 0;
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> comp;
+    std::vector<uint8_t> temp_buffer;
+    size_t n_block = 0;
+    size_t i_block = 0;
+
+    llama_data_read_lz(llama_file * f) : file(f) {}
+
+    void next_block() {
+        const uint32_t n_raw    = file->read_u32();
+        const uint32_t n_stored = file->read_u32();
+        if (n_raw == 0 || n_raw > LLAMA_STATE_LZ_BLOCK_SIZE || n_stored > n_raw) {
+            throw std::runtime_error("invalid compressed state block");
+        }
+        block.resize(n_raw);
+        if (n_stored == n_raw) {
+            file->read_raw(block.data(), n_raw);
+        } else {
+            comp.resize(n_stored);
+            file->read_raw(comp.data(), n_stored);
+            if (llama_lz_decompress(comp.data(), n_stored, block.data(), n_raw) != n_raw) {
+                throw std::runtime_error("corrupted compressed state block");
+            }
+        }
+        n_block = n_raw;
+        i_block = 0;
+    }
+
+    void read_to(void * dst, size_t size) override {
+        uint8_t * p = (uint8_t *) dst;
+        size_read += size;
+        while (size > 0) {
+            if (i_block == n_block) {
+                next_block();
+            }
+            const size_t n = std::min(size, n_block - i_block);
+            memcpy(p, block.data() + i_block, n);
+            i_block += n;
+            p       += n;
+            size    -= n;
+        }
+    }
+
+    const uint8_t * read(size_t size) override {
+        temp_buffer.resize(size);
+        read_to(temp_buffer.data(), size);
+        return temp_buffer.data();
+    }
+
+    // whether all of the decompressed data has been read
+    bool at_end() const {
+        return i_block == n_block && file->tell() == file->size;
+    }
+
+    size_t get_size_read() override {
+        return size_read;
+    }
+};
+
 /** copy state data into either a buffer or file depending on the passed in context
  *
  * file context:
@@ -22581,7 +25146,7 @@ struct llama_data_read_file : llama_data_read {
  * llama_state_get_data_internal(ctx, data_ctx);
  *
 */
-static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
+static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, bool swap_in = true) {
     llama_synchronize(ctx);
 
     data_ctx.write_model_info(ctx);
@@ -22593,6 +25158,9 @@ static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_da
     data_ctx.write_logits(ctx);
     data_ctx.write_embeddings(ctx);
 
+    if (swap_in) {
+        llama_kv_swap_in_all(*ctx, -1);
+    }
     data_ctx.write_kv_cache(ctx);
 
     return data_ctx.get_size_written();
@@ -22613,7 +25181,9 @@ size_t llama_state_get_data(struct llama_context * ctx, uint8_t * dst, size_t si
 size_t llama_state_get_size(struct llama_context * ctx) {
     llama_data_write_dummy data_ctx;
     try {
-        return llama_state_get_data_internal(ctx, data_ctx);
+        // the swapped out sequences are swapped in only when the state is saved, their size comes from the swap store
+        const size_t size = llama_state_get_data_internal(ctx, data_ctx, false);
+        return size + llama_kv_swap_state_size(*ctx, -1);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error getting state size: %s\n", __func__, err.what());
         return 0;
@@ -22633,6 +25203,7 @@ static size_t llama_state_set_data_internal(struct llama_context * ctx, llama_da
     data_ctx.read_logits(ctx);
     data_ctx.read_embeddings(ctx);
 
+    ctx->kv_swap_store.clear();
     data_ctx.read_kv_cache(ctx);
 
     return data_ctx.get_size_read();
@@ -22726,9 +25297,12 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
     }
 }
 
-static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
+static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id, bool swap_in = true) {
     llama_synchronize(ctx);
 
+    if (swap_in) {
+        llama_kv_swap_in_all(*ctx, seq_id);
+    }
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -22736,7 +25310,8 @@ static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llam
 
 size_t llama_state_seq_get_size(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_data_write_dummy data_ctx;
-    return llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+    const size_t size = llama_state_seq_get_data_internal(ctx, data_ctx, seq_id, false);
+    return size + llama_kv_swap_state_size(*ctx, seq_id);
 }
 
 size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_t size, llama_seq_id seq_id) {
@@ -22752,6 +25327,7 @@ size_t llama_state_seq_get_data(struct llama_context * ctx, uint8_t * dst, size_
 static size_t llama_state_seq_set_data_internal(struct llama_context * ctx, llama_data_read & data_ctx, llama_seq_id dest_seq_id) {
     llama_synchronize(ctx);
 
+    ctx->kv_swap_store.erase(dest_seq_id);
     data_ctx.read_kv_cache(ctx, dest_seq_id);
 
     return data_ctx.get_size_read();
@@ -22767,16 +25343,25 @@ size_t llama_state_seq_set_data(struct llama_context * ctx, const uint8_t * src,
     }
 }
 
-static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, llama_state_seq_flags flags) {
     llama_file file(filepath, "wb");
 
-    file.write_u32(LLAMA_STATE_SEQ_MAGIC);
+    const bool compress = flags & LLAMA_STATE_SEQ_FLAGS_COMPRESS;
+
+    file.write_u32(compress ? LLAMA_STATE_SEQ_MAGIC_LZ : LLAMA_STATE_SEQ_MAGIC);
     file.write_u32(LLAMA_STATE_SEQ_VERSION);
 
     // save the prompt
     file.write_u32((uint32_t) n_token_count);
     file.write_raw(tokens, sizeof(llama_token) * n_token_count);
 
+    if (compress) {
+        llama_data_write_lz data_ctx(&file);
+        llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
+        data_ctx.flush();
+        return file.tell();
+    }
+
     // save the context state using stream saving
     llama_data_write_file data_ctx(&file);
     llama_state_seq_get_data_internal(ctx, data_ctx, seq_id);
@@ -22789,15 +25374,19 @@ static size_t llama_state_seq_save_file_internal(struct llama_context * ctx, con
 static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, const char * filepath, llama_seq_id dest_seq_id, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
     llama_file file(filepath, "rb");
 
+    bool compressed = false;
+
     // version checks
     {
         const uint32_t magic   = file.read_u32();
         const uint32_t version = file.read_u32();
 
-        if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION) {
+        if ((magic != LLAMA_STATE_SEQ_MAGIC && magic != LLAMA_STATE_SEQ_MAGIC_LZ) || version != LLAMA_STATE_SEQ_VERSION) {
             LLAMA_LOG_ERROR("%s: unknown (magic, version) for sequence state file: %08x, %08x\n", __func__, magic, version);
             return 0;
         }
+
+        compressed = magic == LLAMA_STATE_SEQ_MAGIC_LZ;
     }
 
     // load the prompt
@@ -22813,6 +25402,16 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
         *n_token_count_out = n_token_count;
     }
 
+    if (compressed) {
+        llama_data_read_lz data_ctx(&file);
+        const size_t nread = llama_state_seq_set_data_internal(ctx, data_ctx, dest_seq_id);
+        if (!nread || !data_ctx.at_end()) {
+            LLAMA_LOG_ERROR("%s: failed to restore sequence state\n", __func__);
+            return 0;
+        }
+        return file.tell();
+    }
+
     // restore the context state
     {
         const size_t state_size = file.size - file.tell();
@@ -22830,8 +25429,12 @@ static size_t llama_state_seq_load_file_internal(struct llama_context * ctx, con
 }
 
 size_t llama_state_seq_save_file(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count) {
+    return llama_state_seq_save_file_ext(ctx, filepath, seq_id, tokens, n_token_count, 0);
+}
+
+size_t llama_state_seq_save_file_ext(struct llama_context * ctx, const char * filepath, llama_seq_id seq_id, const llama_token * tokens, size_t n_token_count, llama_state_seq_flags flags) {
     try {
-        return llama_state_seq_save_file_internal(ctx, filepath, seq_id, tokens, n_token_count);
+        return llama_state_seq_save_file_internal(ctx, filepath, seq_id, tokens, n_token_count, flags);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: error saving sequence state file: %s\n", __func__, err.what());
         return 0;
@@ -22848,6 +25451,7 @@ size_t llama_state_seq_load_file(struct llama_context * ctx, const char * filepa
 }
 
 void llama_set_n_threads(struct llama_context * ctx, uint32_t n_threads, uint32_t n_threads_batch) {
+    llama_decode_async_wait(*ctx);
     ctx->cparams.n_threads       = n_threads;
     ctx->cparams.n_threads_batch = n_threads_batch;
 }
@@ -22866,10 +25470,12 @@ void llama_set_abort_callback(struct llama_context * ctx, bool (*abort_callback)
 }
 
 void llama_set_embeddings(struct llama_context * ctx, bool embeddings) {
+    llama_decode_async_wait(*ctx);
     ctx->cparams.embeddings = embeddings;
 }
 
 void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
+    llama_decode_async_wait(*ctx);
     ctx->cparams.causal_attn = causal_attn;
 }
 
@@ -22931,6 +25537,8 @@ void llama_batch_free(struct llama_batch batch) {
 int32_t llama_encode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_async_wait(*ctx);
+
     const int ret = llama_encode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to encode, ret = %d\n", __func__, ret);
@@ -22942,6 +25550,8 @@ int32_t llama_encode(
 int32_t llama_decode(
         struct llama_context * ctx,
           struct llama_batch   batch) {
+    llama_decode_async_wait(*ctx);
+
     const int ret = llama_decode_internal(*ctx, batch);
     if (ret < 0) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -22950,7 +25560,29 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        struct llama_context * ctx,
+          struct llama_batch   batch) {
+    const int ret = llama_decode_async_submit(*ctx, batch);
+    if (ret < 0) {
+        LLAMA_LOG_ERROR("%s: failed to submit batch, ret = %d\n", __func__, ret);
+    }
+
+    return ret;
+}
+
+int32_t llama_decode_wait(struct llama_context * ctx) {
+    const int ret = llama_decode_async_wait(*ctx);
+    if (ret < 0) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+    }
+
+    return ret;
+}
+
 void llama_synchronize(struct llama_context * ctx) {
+    llama_decode_async_wait(*ctx);
+
     ggml_backend_sched_synchronize(ctx->sched);
 
     // FIXME: if multiple single tokens are evaluated without a synchronization,
@@ -23020,6 +25652,36 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+int32_t llama_get_top_logits_ith(struct llama_context * ctx, int32_t i, llama_token_data * data, float * lse) {
+    llama_synchronize(ctx);
+
+    if (!ctx->top_logits_valid) {
+        return 0;
+    }
+
+    int32_t j = -1;
+    if (i < 0) {
+        j = ctx->n_outputs + i;
+    } else if ((size_t) i < ctx->output_ids.size()) {
+        j = ctx->output_ids[i];
+    }
+    if (j < 0 || j >= ctx->n_outputs) {
+        return 0;
+    }
+
+    const int32_t k = ctx->cparams.n_top_logits;
+    const float * row = ctx->top_logits + j*(2*k + 1);
+
+    for (int32_t l = 0; l < k; ++l) {
+        data[l] = llama_token_data{ (llama_token) row[l], row[k + l], 0.0f };
+    }
+    if (lse) {
+        *lse = row[2*k];
+    }
+
+    return k;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -23963,13 +26625,20 @@ struct llama_sampler_dry * llama_sampler_init_dry(const struct llama_vocab* voca
     return llama_sampler_init_dry_impl(*vocab, vocab->n_tokens(), dry_multiplier, dry_base, dry_allowed_length, dry_penalty_last_n, seq_breakers, num_breakers);
 }
 
+struct llama_sampler_dry * llama_sampler_init_dry_testing(int32_t context_size, float dry_multiplier, float dry_base, int32_t dry_allowed_length, int32_t dry_penalty_last_n, const std::vector<std::vector<llama_token>> & seq_breakers) {
+    std::unordered_multimap<llama_token, std::vector<llama_token>> processed_breakers;
+    for (const auto & seq : seq_breakers) {
+        GGML_ASSERT(!seq.empty());
+        processed_breakers.emplace(seq.front(), std::vector<llama_token>(seq.begin() + 1, seq.end()));
+    }
+    return llama_sampler_init_dry_breakers_impl(context_size, dry_multiplier, dry_base, dry_allowed_length, dry_penalty_last_n, std::move(processed_breakers));
+}
+
 void llama_sampler_dry_reset(struct llama_sampler_dry* smpl) {
     if (!smpl) {
         return;
     }
-    smpl->last_tokens.clear();
-    smpl->dry_repeat_count.clear();
-    smpl->dry_max_token_repeat.clear();
+    llama_sampler_dry_reset_impl(smpl);
 }
 
 void llama_sampler_dry_free(struct llama_sampler_dry* smpl) {
@@ -23977,28 +26646,54 @@ void llama_sampler_dry_free(struct llama_sampler_dry* smpl) {
 }
 
 struct llama_sampler_dry* llama_sampler_dry_clone(struct llama_sampler_dry* smpl) {
-    // nullptr is passed as vocab because it is only needed for raw sequence breaker processing, which we have already done and will be copying
-    auto* result = llama_sampler_init_dry(nullptr, smpl->dry_multiplier, smpl->dry_base, smpl->dry_allowed_length, smpl->dry_penalty_last_n, NULL, 0);
-    // Copy the state, including the processed breakers
-    {
-        auto* result_ctx = smpl;
-        result_ctx->dry_processed_breakers = smpl->dry_processed_breakers;
-        result_ctx->dry_repeat_count = smpl->dry_repeat_count;
-        result_ctx->dry_max_token_repeat = smpl->dry_max_token_repeat;
-        result_ctx->last_tokens = smpl->last_tokens;
+    if (!smpl) {
+        return nullptr;
     }
-
-    return result;
+    // the processed breakers and the incremental state are copied as they are
+    return new llama_sampler_dry(*smpl);
 }
 
 void llama_sampler_dry_accept(struct llama_sampler_dry* smpl, llama_token token) {
     if (!smpl) {
         return;
     }
-    if (smpl->dry_multiplier == 0.0f || smpl->dry_base < 1.0f || smpl->dry_penalty_last_n == 0) {
+    llama_sampler_dry_accept_impl(smpl, token);
+}
+
+struct llama_sampler_penalties * llama_sampler_init_penalties(int32_t n_vocab, int32_t penalty_last_n, float penalty_repeat, float penalty_freq, float penalty_present) {
+    return llama_sampler_init_penalties_impl(n_vocab, penalty_last_n, penalty_repeat, penalty_freq, penalty_present);
+}
+
+void llama_sample_penalties(struct llama_context * ctx, struct llama_sampler_penalties * smpl, llama_token_data_array * candidates) {
+    if (!smpl) {
+        return;
+    }
+    llama_sampler_penalties_apply_impl(ctx ? &ctx->sampling : nullptr, smpl, candidates);
+}
+
+void llama_sampler_penalties_accept(struct llama_sampler_penalties * smpl, llama_token token) {
+    if (!smpl) {
+        return;
+    }
+    llama_sampler_penalties_accept_impl(smpl, token);
+}
+
+void llama_sampler_penalties_reset(struct llama_sampler_penalties * smpl) {
+    if (!smpl) {
         return;
     }
-    smpl->last_tokens.push_back(token);
+    llama_sampler_penalties_reset_impl(smpl);
+}
+
+struct llama_sampler_penalties * llama_sampler_penalties_clone(struct llama_sampler_penalties * smpl) {
+    if (!smpl) {
+        return nullptr;
+    }
+    return new llama_sampler_penalties(*smpl);
+}
+
+void llama_sampler_penalties_free(struct llama_sampler_penalties * smpl) {
+    delete smpl;
 }
 
 int llama_split_prefix(char * dest, size_t maxlen, const char * split_path, int split_no, int split_count) {
@@ -24029,6 +26724,8 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.n_sample =*/ std::max(1, ctx->sampling.n_sample),
         /*.n_p_eval =*/ std::max(0, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
+
+        /*.n_graph_reuse =*/ ctx->n_graph_reuse,
     };
 
     return result;
@@ -24053,6 +26750,8 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
 
+    ctx->n_graph_reuse = 0;
+
     ctx->sampling.reset_timings();
 }
 
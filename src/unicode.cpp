@@ -547,7 +547,10 @@ static std::vector<size_t> unicode_regex_split_custom_kimi_k2(const std::string
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string& text, const std::vector<size_t>& offsets) {
+// max_digits:     the N in \p{N}{1,N} (QWEN2 and friends use \p{N})
+// punct_newlines: whether [\r\n]* follows the punctuation run (not the case for SEED_CODER)
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string& text, const std::vector<size_t>& offsets,
+        size_t max_digits = 3, bool punct_newlines = true) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
@@ -624,7 +627,7 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string&
             if (flags.is_number) {
                 size_t ini = pos;
                 while (_get_flags(pos).is_number) {
-                    if (++pos - ini >= 3) {
+                    if (++pos - ini >= max_digits) {
                         _add_token(pos);
                         ini = pos;
                     }
@@ -641,7 +644,174 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string&
                     flags2 = _get_flags(++pos);
                 }
                 uint32_t cpt2 = _get_cpt(pos);
-                while (cpt2 == '\r' || cpt2 == '\n') {
+                while (punct_newlines && (cpt2 == '\r' || cpt2 == '\n')) {
+                    cpt2 = _get_cpt(++pos);
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            size_t num_whitespaces = 0;
+            size_t last_end_r_or_n = 0;
+            while (_get_flags(pos + num_whitespaces).is_whitespace) {
+                uint32_t cpt2 = _get_cpt(pos + num_whitespaces);
+                if (cpt2 == '\r' || cpt2 == '\n') {
+                    last_end_r_or_n = pos + num_whitespaces + 1;
+                }
+                num_whitespaces++;
+            }
+
+            // regex: \s*[\r\n]+
+            if (last_end_r_or_n > 0) {
+                pos = last_end_r_or_n;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+(?!\S)
+            if (num_whitespaces > 1 && _get_cpt(pos + num_whitespaces) != OUT_OF_RANGE) {
+                pos += num_whitespaces - 1;
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: \s+
+            if (num_whitespaces > 0) {
+                pos += num_whitespaces;
+                _add_token(pos);
+                continue;
+            }
+
+            // no matches
+            _add_token(++pos);
+        }
+    }
+
+    return bpe_offsets;
+}
+
+// GPT4O regex as adapted in llama-vocab.cpp (upper = letter but not a-z, lower = letter but not A-Z):
+// "[^\r\n\p{L}\p{N}]?U*L+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\r\n\p{L}\p{N}]?U+L*(?:...)?|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n/]*|\s*[\r\n]+|\s+(?!\S)|\s+"
+// TEKKEN is the same with \p{N} and without the contractions
+static std::vector<size_t> unicode_regex_split_custom_gpt4o(const std::string& text, const std::vector<size_t>& offsets,
+        size_t max_digits, bool contractions) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        static const uint32_t OUT_OF_RANGE = 0xFFFFFFFF;
+        auto _get_cpt = [&](const size_t pos) -> uint32_t {
+            return (offset_ini <= pos && pos < offset_end) ? cpts[pos] : OUT_OF_RANGE;
+        };
+
+        auto _get_flags = [&](const size_t pos) -> codepoint_flags {
+            return (offset_ini <= pos && pos < offset_end) ? unicode_cpt_flags(cpts[pos]) : codepoint_flags{};
+        };
+
+        auto _is_upper = [&](const size_t pos) -> bool {
+            const uint32_t cpt = _get_cpt(pos);
+            return _get_flags(pos).is_letter && !(cpt >= 'a' && cpt <= 'z');
+        };
+
+        auto _is_lower = [&](const size_t pos) -> bool {
+            const uint32_t cpt = _get_cpt(pos);
+            return _get_flags(pos).is_letter && !(cpt >= 'A' && cpt <= 'Z');
+        };
+
+        // length of the contraction at pos, 0 if none
+        auto _contraction = [&](const size_t pos) -> size_t {
+            if (!contractions || _get_cpt(pos) != '\'' || pos + 1 >= offset_end) {
+                return 0;
+            }
+            uint32_t cpt_next = unicode_tolower(_get_cpt(pos + 1));
+            if (cpt_next == 's' || cpt_next == 't' || cpt_next == 'm' || cpt_next == 'd') {
+                return 2;
+            }
+            if (pos + 2 < offset_end) {
+                uint32_t cpt_next_next = unicode_tolower(_get_cpt(pos + 2));
+                if ((cpt_next == 'r' && cpt_next_next == 'e') ||
+                    (cpt_next == 'v' && cpt_next_next == 'e') ||
+                    (cpt_next == 'l' && cpt_next_next == 'l')) {
+                    return 3;
+                }
+            }
+            return 0;
+        };
+
+        size_t _prev_end = offset_ini;
+        auto _add_token = [&](const size_t end) -> size_t {
+            assert(_prev_end <= end && end <= offset_end);
+            size_t len = end - _prev_end;
+            if (len > 0) {
+                bpe_offsets.push_back(len);
+            }
+            _prev_end = end;
+            return len;
+        };
+
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/) {
+            const uint32_t cpt = _get_cpt(pos);
+            const auto flags = _get_flags(pos);
+
+            // regex: [^\r\n\p{L}\p{N}]?U*L+(...)?|[^\r\n\p{L}\p{N}]?U+L*(...)?
+            if (!(cpt == '\r' || cpt == '\n' || flags.is_number)) {
+                const size_t ini = pos + (flags.is_letter ? 0 : 1);
+                if (_get_flags(ini).is_letter) {
+                    size_t end_upper = ini;
+                    while (_is_upper(end_upper)) {
+                        end_upper++;
+                    }
+                    size_t end = end_upper;
+                    while (_is_lower(end)) {
+                        end++;
+                    }
+                    if (end == end_upper) {
+                        // U* backtracks until L+ matches - only possible where the letter is both
+                        for (size_t i = end_upper; i > ini; --i) {
+                            if (_is_lower(i - 1)) {
+                                end = i;
+                                break;
+                            }
+                        }
+                        // otherwise: second alternative, U+ with empty L*
+                    }
+                    pos = end;
+                    pos += _contraction(pos);
+                    _add_token(pos);
+                    continue;
+                }
+            }
+
+            // regex: \p{N}{1,3}
+            if (flags.is_number) {
+                size_t ini = pos;
+                while (_get_flags(pos).is_number) {
+                    if (++pos - ini >= max_digits) {
+                        _add_token(pos);
+                        ini = pos;
+                    }
+                }
+                _add_token(pos);
+                continue;
+            }
+
+            // regex: <space>?[^\s\p{L}\p{N}]+[\r\n/]*
+            auto flags2 = (cpt == ' ' ? _get_flags(pos + 1) : flags);
+            if (!(flags2.is_whitespace | flags2.is_letter | flags2.is_number) && flags.as_uint()) {
+                pos += (cpt == ' ');
+                while (!(flags2.is_whitespace | flags2.is_letter | flags2.is_number) && flags2.as_uint()) {
+                    flags2 = _get_flags(++pos);
+                }
+                uint32_t cpt2 = _get_cpt(pos);
+                while (cpt2 == '\r' || cpt2 == '\n' || cpt2 == '/') {
                     cpt2 = _get_cpt(++pos);
                 }
                 _add_token(pos);
@@ -687,6 +857,137 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string&
     return bpe_offsets;
 }
 
+// single-class patterns like "\p{N}+", "[0-9][0-9][0-9]" or "\s?\p{L}+": runs of codepoints of one class,
+// optionally preceded by a whitespace. As with std::regex, the text between two matches becomes one word.
+struct unicode_run_pattern {
+    enum prefix_type {
+        PREFIX_NONE,
+        PREFIX_WHITESPACE, // \s?
+        PREFIX_SPACE,      // ' '?
+    };
+
+    bool (*match)(uint32_t cpt, const codepoint_flags & flags);
+    prefix_type prefix;
+    size_t min_len; // codepoints per match, not counting the prefix
+    size_t max_len; // 0 - unlimited
+};
+
+static std::vector<size_t> unicode_regex_split_custom_run(const std::string& text, const std::vector<size_t>& offsets, const unicode_run_pattern & pattern) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    const auto cpts = unicode_cpts_from_utf8(text);
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        auto _match = [&](const size_t pos) -> bool {
+            return pos < offset_end && pattern.match(cpts[pos], unicode_cpt_flags(cpts[pos]));
+        };
+
+        auto _is_prefix = [&](const size_t pos) -> bool {
+            switch (pattern.prefix) {
+                case unicode_run_pattern::PREFIX_WHITESPACE: return unicode_cpt_flags(cpts[pos]).is_whitespace;
+                case unicode_run_pattern::PREFIX_SPACE:      return cpts[pos] == ' ';
+                default:                                     return false;
+            }
+        };
+
+        size_t gap_start = offset_ini;
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/) {
+            size_t ini = pos;
+            if (!_match(pos)) {
+                if (!_is_prefix(pos) || !_match(pos + 1)) {
+                    pos++;
+                    continue;
+                }
+                ini = pos + 1;
+            }
+
+            size_t end = ini;
+            while (_match(end) && (pattern.max_len == 0 || end - ini < pattern.max_len)) {
+                end++;
+            }
+
+            if (end - ini < pattern.min_len) {
+                // too short - part of the gap
+                pos = end;
+                continue;
+            }
+
+            if (pos > gap_start) {
+                bpe_offsets.push_back(pos - gap_start);
+            }
+            bpe_offsets.push_back(end - pos);
+            pos       = end;
+            gap_start = end;
+        }
+
+        if (offset_end > gap_start) {
+            bpe_offsets.push_back(offset_end - gap_start);
+        }
+    }
+
+    return bpe_offsets;
+}
+
+static const std::unordered_map<std::string, unicode_run_pattern> & unicode_run_patterns() {
+    using run = unicode_run_pattern;
+
+    static auto is_number  = [](uint32_t,     const codepoint_flags & flags) { return (bool) flags.is_number; };
+    static auto is_digit   = [](uint32_t cpt, const codepoint_flags &)       { return cpt >= '0' && cpt <= '9'; };
+    static auto is_newline = [](uint32_t cpt, const codepoint_flags &)       { return cpt == '\r' || cpt == '\n'; };
+    static auto is_letter  = [](uint32_t,     const codepoint_flags & flags) { return (bool) flags.is_letter; };
+    static auto is_punct   = [](uint32_t,     const codepoint_flags & flags) { return (bool) flags.is_punctuation; };
+    static auto is_punct_sym = [](uint32_t cpt, const codepoint_flags & flags) {
+        return flags.is_punctuation || cpt == '$' || cpt == '+' || cpt == '<' || cpt == '=' || cpt == '>' || cpt == '^' || cpt == '~' || cpt == '|';
+    };
+    static auto is_punct_sym_bt = [](uint32_t cpt, const codepoint_flags & flags) {
+        return is_punct_sym(cpt, flags) || cpt == '`';
+    };
+    // note: std::wregex sees non-ASCII whitespace as 0x0B, so it never matches a literal range
+    static auto is_cjk_hangul = [](uint32_t cpt, const codepoint_flags & flags) {
+        return !flags.is_whitespace && ((cpt >= 0x4E00 && cpt <= 0x9FA5) || (cpt >= 0x0800 && cpt <= 0x4E00) || (cpt >= 0xAC00 && cpt <= 0xD7FF));
+    };
+    static auto is_cjk_kana = [](uint32_t cpt, const codepoint_flags & flags) {
+        return !flags.is_whitespace && ((cpt >= 0x4E00 && cpt <= 0x9FA5) || (cpt >= 0x3040 && cpt <= 0x309F) || (cpt >= 0x30A0 && cpt <= 0x30FF));
+    };
+    static auto is_poro_word = [](uint32_t cpt, const codepoint_flags & flags) {
+        if (flags.is_whitespace) {
+            return false;
+        }
+        switch (cpt) {
+            case '(': case '|': case '.': case ',': case '!': case '?': case ')':
+            case 0x2026: case 0x3002: case 0xFF0C: case 0x3001: case 0x0964: case 0x06D4: case 0x060C:
+                return false;
+            default:
+                return true;
+        }
+    };
+
+    static const std::unordered_map<std::string, run> patterns = {
+        { "\\p{N}",                        { is_number,       run::PREFIX_NONE,       1, 1 } },
+        { "\\p{N}+",                       { is_number,       run::PREFIX_NONE,       1, 0 } },
+        { "\\p{N}{1,3}",                   { is_number,       run::PREFIX_NONE,       1, 3 } },
+        { "[0-9]",                         { is_digit,        run::PREFIX_NONE,       1, 1 } },
+        { "[0-9][0-9][0-9]",               { is_digit,        run::PREFIX_NONE,       3, 3 } },
+        { "[\r\n]",                        { is_newline,      run::PREFIX_NONE,       1, 1 } },
+        { "\\s?\\p{L}+",                   { is_letter,       run::PREFIX_WHITESPACE, 1, 0 } },
+        { "\\s?\\p{P}+",                   { is_punct,        run::PREFIX_WHITESPACE, 1, 0 } },
+        { "[\\p{P}\\$\\+<=>\\^~\\|]+",     { is_punct_sym,    run::PREFIX_NONE,       1, 0 } },
+        { "[\\p{P}\\$\\+<=>\\^~\\|`]+",    { is_punct_sym_bt, run::PREFIX_NONE,       1, 0 } },
+        { "[一-龥ࠀ-一가-퟿]+",               { is_cjk_hangul,   run::PREFIX_NONE,       1, 0 } },
+        { "[一-龥぀-ゟ゠-ヿ]+",               { is_cjk_kana,     run::PREFIX_NONE,       1, 0 } },
+        { " ?[^(\\s|.,!?…。，、।۔،)]+",     { is_poro_word,    run::PREFIX_SPACE,      1, 0 } },
+    };
+
+    return patterns;
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring& wtext, const std::wstring& regex_expr, const std::vector<size_t>& offsets) {
     std::wregex expr(regex_expr);
@@ -759,10 +1060,34 @@ static std::vector<size_t> unicode_regex_split_custom(const std::string& text, c
 
         bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
     }
+    else if (
+        regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+        regex_expr == "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+") {
+        // QWEN2 and BAILINGMOE: single digits, \s*[\r\n] ends at the same place as \s*[\r\n]+
+        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets, 1);
+    }
+    else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // SEED_CODER
+        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets, 1, false);
+    }
+    else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text, offsets, 3, true);
+    }
+    else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        // TEKKEN
+        bpe_offsets = unicode_regex_split_custom_gpt4o(text, offsets, 1, false);
+    }
     else if (regex_expr == "\\p{Han}+") {
         // K2's first pattern - handle all K2 patterns together
         bpe_offsets = unicode_regex_split_custom_kimi_k2(text, offsets);
     }
+    else {
+        const auto & patterns = unicode_run_patterns();
+        const auto it = patterns.find(regex_expr);
+        if (it != patterns.end()) {
+            bpe_offsets = unicode_regex_split_custom_run(text, offsets, it->second);
+        }
+    }
 
     return bpe_offsets;
 }
@@ -885,7 +1210,7 @@ uint32_t unicode_tolower(uint32_t cp) {
     return it == unicode_map_lowercase.end() ? cp : it->second;
 }
 
-std::vector<std::string> unicode_regex_split(const std::string& text, const std::vector<std::string>& regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string& text, const std::vector<std::string>& regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", codepoint_flags::NUMBER },
@@ -960,11 +1285,13 @@ std::vector<std::string> unicode_regex_split(const std::string& text, const std:
 
     for (auto& regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        if (use_custom) {
+            auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
 
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
-            continue;
+            if (!tmp.empty()) {
+                bpe_offsets = std::move(tmp);
+                continue;
+            }
         }
 
         // fallback to general-purpose std::regex / std::wregex
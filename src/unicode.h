@@ -66,4 +66,5 @@ uint32_t unicode_tolower(uint32_t cp);
 
 bool unicode_cpt_is_han(uint32_t cpt);
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs);
+// use_custom = false splits with std::regex only, without the hand-written splitters of known patterns (for testing)
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom = true);
@@ -1,8 +1,11 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
+#include <string>
 
 #include "get-model.h"
+#include "ggml.h"
 
 char * get_model_or_exit(int argc, char *argv[]) {
     char * model_path;
@@ -19,3 +22,79 @@ char * get_model_or_exit(int argc, char *argv[]) {
 
     return model_path;
 }
+
+void write_random_model(const char * fname, int n_vocab, int n_embd, int n_layer, int n_ff, unsigned seed, int n_swa) {
+    const int n_head    = 4;
+    const int n_head_kv = 2;
+    const int n_embd_kv = n_embd/n_head*n_head_kv;
+
+    // gemma2 has post-attention and post-FFN norms and shares the output weight with the token embeddings
+    const bool gemma2 = n_swa > 0;
+    const std::string arch = gemma2 ? "gemma2" : "llama";
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.architecture", arch.c_str());
+    gguf_set_val_u32(gguf, "general.file_type", 0);
+    gguf_set_val_u32(gguf, (arch + ".vocab_size").c_str(), n_vocab);
+    gguf_set_val_u32(gguf, (arch + ".context_length").c_str(), 4096);
+    gguf_set_val_u32(gguf, (arch + ".embedding_length").c_str(), n_embd);
+    gguf_set_val_u32(gguf, (arch + ".block_count").c_str(), n_layer);
+    gguf_set_val_u32(gguf, (arch + ".feed_forward_length").c_str(), n_ff);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count").c_str(), n_head);
+    gguf_set_val_u32(gguf, (arch + ".attention.head_count_kv").c_str(), n_head_kv);
+    gguf_set_val_u32(gguf, (arch + ".rope.dimension_count").c_str(), n_embd/n_head);
+    gguf_set_val_f32(gguf, (arch + ".attention.layer_norm_rms_epsilon").c_str(), 1e-5f);
+    if (gemma2) {
+        gguf_set_val_u32(gguf, (arch + ".attention.sliding_window").c_str(), n_swa);
+    }
+    gguf_set_val_str(gguf, "tokenizer.ggml.model", "no_vocab");
+
+    const size_t n_weights = (size_t) 2*n_vocab*n_embd + 2*n_embd +
+        (size_t) n_layer*(4*n_embd + 2*n_embd*n_embd + 2*n_embd*n_embd_kv + 3*n_embd*n_ff);
+    const size_t n_tensors = 3 + 11*n_layer;
+    ggml_init_params params = { n_weights*sizeof(float) + n_tensors*(ggml_tensor_overhead() + GGML_MEM_ALIGN), nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, float scale) {
+        ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            // norm weights are 1
+            data[i] = ne1 > 0 ? scale*dist(rng) : 1.0f;
+        }
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab, 1.0f);
+    add("output_norm.weight", n_embd, 0, 0.0f);
+    if (!gemma2) {
+        add("output.weight",  n_embd, n_vocab, 0.1f);
+    }
+    for (int il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+        add(blk + "attn_norm.weight",   n_embd, 0, 0.0f);
+        add(blk + "attn_q.weight",      n_embd, n_embd,    0.06f);
+        add(blk + "attn_k.weight",      n_embd, n_embd_kv, 0.06f);
+        add(blk + "attn_v.weight",      n_embd, n_embd_kv, 0.06f);
+        add(blk + "attn_output.weight", n_embd, n_embd,    0.06f);
+        if (gemma2) {
+            add(blk + "post_attention_norm.weight", n_embd, 0, 0.0f);
+        }
+        add(blk + "ffn_norm.weight",    n_embd, 0, 0.0f);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff,   0.06f);
+        add(blk + "ffn_up.weight",      n_embd, n_ff,   0.06f);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd, 0.06f);
+        if (gemma2) {
+            add(blk + "post_ffw_norm.weight", n_embd, 0, 0.0f);
+        }
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
@@ -1,2 +1,8 @@
 #pragma once
 char * get_model_or_exit(int, char*[]);
+
+// writes a small llama model with random f32 weights and no vocabulary to fname,
+// for the tests that need to evaluate a model but not a particular one
+// with n_swa > 0 the model is a gemma2 model whose even layers use sliding window attention over n_swa positions
+// (the gemma2 graph needs the n_layer of a known model size: 26, 42 or 46)
+void write_random_model(const char * fname, int n_vocab, int n_embd, int n_layer, int n_ff, unsigned seed, int n_swa = 0);
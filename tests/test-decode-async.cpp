@@ -0,0 +1,249 @@
+// checks that the outputs of llama_decode_async give the same results as llama_decode, whether they are read
+// after llama_decode_wait or with getters called while the batch is still being evaluated
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// how the outputs of an asynchronous decode are read
+enum read_mode {
+    READ_AFTER_WAIT,     // llama_decode_wait, then the getters
+    READ_WHILE_PENDING,  // the getters right after llama_decode_async, they wait for the batch
+    READ_AFTER_DECODE,   // every other batch is left pending for the synchronous llama_decode of the next one
+};
+
+struct step {
+    std::vector<llama_token>  tokens;
+    std::vector<llama_pos>    pos;
+    std::vector<llama_seq_id> seq_id;
+    llama_pos                 rm_from; // llama_kv_cache_seq_rm(seq 0, rm_from, -1) before the batch, if >= 0
+};
+
+// a prompt on two sequences, single tokens on both, a removal of the end of sequence 0, then more single tokens
+static std::vector<step> make_steps(int n_vocab) {
+    std::vector<step> steps;
+
+    step prompt = { {}, {}, {}, -1 };
+    for (int i = 0; i < 12; ++i) {
+        prompt.tokens.push_back((i*37 + 1) % n_vocab);
+        prompt.pos.push_back(i % 6);
+        prompt.seq_id.push_back(i / 6);
+    }
+    steps.push_back(prompt);
+
+    llama_pos pos = 6;
+    for (int i = 0; i < 16; ++i) {
+        step s = { {}, {}, {}, -1 };
+        if (i == 8) {
+            pos -= 3;
+            s.rm_from = pos;
+        }
+        s.tokens = { llama_token((pos*11) % n_vocab), llama_token((pos*13 + 5) % n_vocab) };
+        s.pos    = { pos, i < 8 ? pos : pos + 3 };
+        s.seq_id = { 0, 1 };
+        steps.push_back(s);
+        pos += 1;
+    }
+
+    return steps;
+}
+
+static llama_context * new_context(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 128;
+    cparams.n_batch   = 32;
+    cparams.n_ubatch  = 32;
+    cparams.n_seq_max = 2;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+    return ctx;
+}
+
+static void fill_batch(llama_batch & batch, const step & s) {
+    llama_batch_clear(batch);
+    for (size_t i = 0; i < s.tokens.size(); ++i) {
+        llama_batch_add(batch, s.tokens[i], s.pos[i], { s.seq_id[i] }, true);
+    }
+}
+
+// the logits of all outputs of each step, the number of used KV cells and the last position of sequence 0 after it
+// the logits of a step whose outputs were not read are empty
+struct result {
+    std::vector<std::vector<float>> logits;
+    std::vector<int32_t>            n_used;
+    std::vector<llama_pos>          pos_max;
+};
+
+static void read_outputs(llama_context * ctx, int n_vocab, int n_outputs, result & res) {
+    std::vector<float> logits;
+    for (int i = 0; i < n_outputs; ++i) {
+        const float * l = llama_get_logits_ith(ctx, i);
+        assert(l);
+        logits.insert(logits.end(), l, l + n_vocab);
+    }
+    res.logits.push_back(logits);
+    res.n_used.push_back(llama_get_kv_cache_used_cells(ctx));
+    res.pos_max.push_back(llama_kv_cache_seq_pos_max(ctx, 0));
+}
+
+static void skip_outputs(result & res) {
+    res.logits.emplace_back();
+    res.n_used.push_back(-1);
+    res.pos_max.push_back(-1);
+}
+
+static result run_sync(llama_model * model, const std::vector<step> & steps) {
+    llama_context * ctx = new_context(model);
+    const int n_vocab = llama_n_vocab(model);
+
+    result res;
+    llama_batch batch = llama_batch_init(32, 0, 1);
+    for (const auto & s : steps) {
+        if (s.rm_from >= 0) {
+            llama_kv_cache_seq_rm(ctx, 0, s.rm_from, -1);
+        }
+        fill_batch(batch, s);
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        read_outputs(ctx, n_vocab, batch.n_tokens, res);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+static result run_async(llama_model * model, const std::vector<step> & steps, read_mode mode) {
+    llama_context * ctx = new_context(model);
+    const int n_vocab = llama_n_vocab(model);
+
+    result res;
+    llama_batch batch = llama_batch_init(32, 0, 1);
+
+    // the outputs of the last step that was read
+    const float * logits_prev = nullptr;
+    std::vector<float> logits_prev_copy;
+
+    for (size_t k = 0; k < steps.size(); ++k) {
+        const step & s = steps[k];
+        const bool sync = mode == READ_AFTER_DECODE && k % 2 == 1;
+
+        // with READ_AFTER_DECODE the previous batch is still pending here, the removal waits for it
+        if (s.rm_from >= 0) {
+            llama_kv_cache_seq_rm(ctx, 0, s.rm_from, -1);
+        }
+
+        fill_batch(batch, s);
+        const int n_outputs = batch.n_tokens;
+
+        if (sync) {
+            const int ret = llama_decode(ctx, batch);
+            assert(ret == 0);
+        } else {
+            const int ret = llama_decode_async(ctx, batch);
+            assert(ret == 0);
+
+            // the batch was copied, so it can be overwritten right away
+            llama_batch_clear(batch);
+            for (int i = 0; i < n_outputs; ++i) {
+                llama_batch_add(batch, n_vocab - 1, 1000, { 1 }, false);
+            }
+
+            // the outputs of the previous batch are left untouched while this one is evaluated
+            if (logits_prev) {
+                assert(memcmp(logits_prev, logits_prev_copy.data(), logits_prev_copy.size()*sizeof(float)) == 0);
+            }
+        }
+
+        switch (mode) {
+            case READ_AFTER_WAIT:
+                {
+                    const int ret = llama_decode_wait(ctx);
+                    assert(ret == 0);
+                    read_outputs(ctx, n_vocab, n_outputs, res);
+                } break;
+            case READ_WHILE_PENDING:
+                {
+                    read_outputs(ctx, n_vocab, n_outputs, res);
+                    // the getters waited, nothing is pending any more
+                    const int ret = llama_decode_wait(ctx);
+                    assert(ret == 0);
+                } break;
+            case READ_AFTER_DECODE:
+                {
+                    // the outputs of the asynchronous batches are replaced by the next llama_decode before they are read
+                    if (!sync) {
+                        skip_outputs(res);
+                        continue;
+                    }
+                    read_outputs(ctx, n_vocab, n_outputs, res);
+                } break;
+        }
+
+        logits_prev = llama_get_logits(ctx);
+        logits_prev_copy.assign(logits_prev, logits_prev + (size_t) n_outputs*n_vocab);
+    }
+
+    // the last batch may still be pending
+    const int ret = llama_decode_wait(ctx);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+static void check(const char * name, const result & ref, const result & out) {
+    fprintf(stderr, "%s: %s\n", __func__, name);
+    assert(ref.logits.size() == out.logits.size());
+    for (size_t k = 0; k < ref.logits.size(); ++k) {
+        if (out.logits[k].empty()) {
+            continue;
+        }
+        if (ref.logits[k] != out.logits[k]) {
+            fprintf(stderr, "%s: %s: step %zu: logits differ\n", __func__, name, k);
+            assert(false);
+        }
+        assert(ref.n_used[k]  == out.n_used[k]);
+        assert(ref.pos_max[k] == out.pos_max[k]);
+    }
+}
+
+int main(void) {
+    const char * fname = "test-decode-async.gguf";
+    write_random_model(fname, 256, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    const std::vector<step> steps = make_steps(llama_n_vocab(model));
+    const result ref = run_sync(model, steps);
+
+    check("after llama_decode_wait", ref, run_async(model, steps, READ_AFTER_WAIT));
+    check("while pending",           ref, run_async(model, steps, READ_WHILE_PENDING));
+    check("after llama_decode",      ref, run_async(model, steps, READ_AFTER_DECODE));
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
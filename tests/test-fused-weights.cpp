@@ -0,0 +1,259 @@
+// checks that Q/K/V and ffn_gate/ffn_up fused into one tensor give the same results as the separate weights
+
+#include "llama.h"
+#include "common.h"
+#include "ggml.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static float max_diff(const float * ref, const float * out, size_t n) {
+    float diff = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        diff = std::max(diff, std::fabs(ref[i] - out[i]));
+    }
+    return diff;
+}
+
+// the value of element (i0, i1) of a 2D tensor that may be a strided view
+static float get_f32(const ggml_tensor * t, int64_t i0, int64_t i1) {
+    return *(const float *) ((const char *) t->data + i0*t->nb[0] + i1*t->nb[1]);
+}
+
+// one matrix multiplication with a fused tensor, with its results used as views, against one per part
+static void test_mul_mat(ggml_type type, int n_threads) {
+    const int64_t n_embd  = 64;
+    const int64_t n_parts = 3;
+    const int64_t n_rows[n_parts] = { 64, 32, 32 };
+    const int64_t n_rows_fused    = 128;
+    const int64_t n_tokens        = 7;
+
+    ggml_init_params params = { 16*1024*1024, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+
+    std::vector<float> data(n_embd*n_rows_fused);
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+    ggml_tensor * base = ggml_new_tensor_2d(ctx, type, n_embd, n_rows_fused);
+    ggml_quantize_chunk(type, data.data(), base->data, 0, n_rows_fused, n_embd, nullptr);
+
+    ggml_tensor * cur = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    for (int64_t i = 0; i < ggml_nelements(cur); ++i) {
+        ((float *) cur->data)[i] = dist(rng);
+    }
+
+    // the parts as the model loader creates them, and the results as llm_build_lora_mm_fused creates them
+    ggml_tensor * mm = ggml_mul_mat(ctx, base, cur);
+    ggml_tensor * ref[n_parts];
+    ggml_tensor * out[n_parts];
+    int64_t offset = 0;
+    for (int k = 0; k < n_parts; ++k) {
+        ggml_tensor * part = ggml_view_2d(ctx, base, n_embd, n_rows[k], base->nb[1], offset*base->nb[1]);
+        ref[k] = ggml_mul_mat(ctx, part, cur);
+        out[k] = ggml_view_2d(ctx, mm, n_rows[k], n_tokens, mm->nb[1], offset*ggml_element_size(mm));
+        offset += n_rows[k];
+    }
+    // gate and up as used by the FFN
+    ggml_tensor * ref_ffn = ggml_fused_mul_unary(ctx, ref[1], ref[2], GGML_UNARY_OP_SILU);
+    ggml_tensor * out_ffn = ggml_fused_mul_unary(ctx, out[1], out[2], GGML_UNARY_OP_SILU);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    for (int k = 0; k < n_parts; ++k) {
+        ggml_build_forward_expand(gf, ref[k]);
+        ggml_build_forward_expand(gf, out[k]);
+    }
+    ggml_build_forward_expand(gf, ref_ffn);
+    ggml_build_forward_expand(gf, out_ffn);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    for (int k = 0; k < n_parts; ++k) {
+        for (int64_t i1 = 0; i1 < n_tokens; ++i1) {
+            for (int64_t i0 = 0; i0 < n_rows[k]; ++i0) {
+                const float r = get_f32(ref[k], i0, i1);
+                const float o = get_f32(out[k], i0, i1);
+                if (std::fabs(r - o) > 1e-4f*std::max(1.0f, std::fabs(r))) {
+                    fprintf(stderr, "%s(%s, %d): part %d, (%d, %d): %g, expected %g\n", __func__, ggml_type_name(type), n_threads,
+                            k, (int) i0, (int) i1, o, r);
+                    assert(false);
+                }
+            }
+        }
+    }
+    assert(ggml_is_contiguous(ref_ffn) && ggml_is_contiguous(out_ffn));
+    assert(max_diff((const float *) ref_ffn->data, (const float *) out_ffn->data, ggml_nelements(ref_ffn)) < 1e-4f);
+
+    ggml_free(ctx);
+}
+
+static void quantize(const char * fname_inp, const char * fname_out, bool fuse_weights) {
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    params.nthread      = 2;
+    params.ftype        = LLAMA_FTYPE_MOSTLY_Q8_0;
+    params.fuse_weights = fuse_weights;
+    const uint32_t ret = llama_model_quantize(fname_inp, fname_out, &params);
+    assert(ret == 0);
+}
+
+static bool has_tensor(const char * fname, const char * name) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * gguf = gguf_init_from_file(fname, params);
+    assert(gguf);
+    const bool res = gguf_find_tensor(gguf, name) >= 0;
+    gguf_free(gguf);
+    return res;
+}
+
+// a LoRA adapter for attn_q of the first layer, to which the fused matrix multiplication does not apply
+static void write_lora(const char * fname, int n_embd) {
+    const int rank = 16;
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.type", "adapter");
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "adapter.type", "lora");
+    gguf_set_val_f32(gguf, "adapter.lora.alpha", (float) rank);
+
+    ggml_init_params params = { 2*rank*n_embd*sizeof(float) + 2*(ggml_tensor_overhead() + GGML_MEM_ALIGN), nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(7);
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+
+    ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, rank);
+    ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, n_embd);
+    ggml_set_name(a, "blk.0.attn_q.weight.lora_a");
+    ggml_set_name(b, "blk.0.attn_q.weight.lora_b");
+    for (auto * t : { a, b }) {
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            ((float *) t->data)[i] = dist(rng);
+        }
+        gguf_add_tensor(gguf, t);
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
+
+// the logits of all tokens of a prompt
+static std::vector<float> eval(const char * fname, bool use_mmap, bool fuse_weights, const char * fname_lora) {
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap     = use_mmap;
+    mparams.fuse_weights = fuse_weights;
+    llama_model * model = llama_load_model_from_file(fname, mparams);
+    assert(model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 64;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 64;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+
+    llama_lora_adapter * adapter = nullptr;
+    if (fname_lora) {
+        adapter = llama_lora_adapter_init(model, fname_lora);
+        assert(adapter);
+        const int32_t ret = llama_lora_adapter_set(ctx, adapter, 1.0f);
+        assert(ret == 0);
+    }
+
+    const int n_vocab  = llama_n_vocab(model);
+    const int n_tokens = 24;
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (int i = 0; i < n_tokens; ++i) {
+        llama_batch_add(batch, (i*37 + 1) % n_vocab, i, { 0 }, true);
+    }
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    const float * logits = llama_get_logits(ctx);
+    std::vector<float> res(logits, logits + (size_t) n_tokens*n_vocab);
+
+    llama_batch_free(batch);
+    if (adapter) {
+        llama_lora_adapter_free(adapter);
+    }
+    llama_free(ctx);
+    llama_free_model(model);
+
+    return res;
+}
+
+static void check_logits(const char * name, const std::vector<float> & ref, const std::vector<float> & out) {
+    fprintf(stderr, "%s: %s\n", __func__, name);
+    assert(ref.size() == out.size());
+    const float diff = max_diff(ref.data(), out.data(), ref.size());
+    if (diff > 1e-3f) {
+        fprintf(stderr, "%s: %s: logits differ by %g\n", __func__, name, diff);
+        assert(false);
+    }
+}
+
+int main(void) {
+    const char * fname       = "test-fused-weights.gguf";
+    const char * fname_q     = "test-fused-weights-q.gguf";
+    const char * fname_fused = "test-fused-weights-fused.gguf";
+    const char * fname_lora  = "test-fused-weights-lora.gguf";
+
+    const int n_embd = 64;
+    write_random_model(fname, 256, n_embd, 2, 128, 42);
+
+    llama_backend_init();
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        for (int n_threads : { 1, 4 }) {
+            test_mul_mat(type, n_threads);
+        }
+    }
+
+    quantize(fname, fname_q, false);
+    quantize(fname, fname_fused, true);
+    assert(!has_tensor(fname_q, "blk.0.attn_qkv.weight"));
+    assert( has_tensor(fname_fused, "blk.0.attn_qkv.weight"));
+    assert( has_tensor(fname_fused, "blk.1.ffn_gate_up.weight"));
+    assert(!has_tensor(fname_fused, "blk.1.ffn_up.weight"));
+
+    const std::vector<float> ref = eval(fname_q, true, false, nullptr);
+
+    // fused by llama-quantize
+    check_logits("stored, mmap",    ref, eval(fname_fused, true,  false, nullptr));
+    check_logits("stored, no mmap", ref, eval(fname_fused, false, false, nullptr));
+    // fused at load time
+    check_logits("runtime, mmap",    ref, eval(fname_q, true,  true, nullptr));
+    check_logits("runtime, no mmap", ref, eval(fname_q, false, true, nullptr));
+
+    // with a LoRA adapter on one of the parts, the parts are multiplied separately
+    write_lora(fname_lora, n_embd);
+    const std::vector<float> ref_lora = eval(fname_q, true, false, fname_lora);
+    assert(max_diff(ref.data(), ref_lora.data(), ref.size()) > 1e-3f);
+    check_logits("stored, LoRA",  ref_lora, eval(fname_fused, true, false, fname_lora));
+    check_logits("runtime, LoRA", ref_lora, eval(fname_q, false, true, fname_lora));
+
+    llama_backend_free();
+
+    for (const char * f : { fname, fname_q, fname_fused, fname_lora }) {
+        std::remove(f);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
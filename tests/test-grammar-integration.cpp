@@ -44,6 +44,59 @@ static bool test_build_grammar_fails(const std::string & grammar_str) {
     return grammar_fails;
 }
 
+// small vocabulary with multi-character, multi-byte, partial and invalid UTF-8 pieces
+static const std::vector<std::string> & test_pieces() {
+    static std::vector<std::string> pieces;
+    if (pieces.empty()) {
+        for (int c = 32; c < 127; ++c) {
+            pieces.push_back(std::string(1, (char) c));
+        }
+        for (const char * piece : {
+                "\n", "\t", "  ", "\"\n", "{\"", "\":", "\": \"", "\",", "\", \"", "\"}", "}}", "[{", "]}", ", ", ": ",
+                "true", "false", "null", "12", "123", "-1", "0.5", "1e", "ab", "abc", "hello", " world", "foo", "bar",
+                "\u00e9", "\u65e5\u672c", "a\u00e9", "\xc3", "\xe6\x97", "\xa9", "\xff", "\U0001f600", "\xf0\x9f", "" }) {
+            pieces.push_back(piece);
+        }
+    }
+    return pieces;
+}
+
+// checks that the token masks computed with the trie (directly and through the cached states of the
+// compiled grammar) agree with matching every piece against each stack
+static void check_token_mask(const llama_grammar * grammar) {
+    static const auto trie = llama_grammar_token_trie_init(test_pieces());
+
+    const llama_grammar_rules  & rules  = llama_grammar_get_rules(grammar);
+    const llama_grammar_stacks & stacks = llama_grammar_get_stacks(const_cast<llama_grammar *>(grammar));
+
+    std::vector<uint64_t> allowed;
+    llama_grammar_token_mask(rules, stacks, *trie, allowed);
+
+    std::vector<uint64_t> allowed_cached;
+    llama_grammar_get_token_mask(grammar, *trie, allowed_cached);
+    assert(allowed_cached == allowed);
+
+    const auto & pieces = test_pieces();
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        bool expected = false;
+        if (!pieces[id].empty()) {
+            const auto decoded = decode_utf8(pieces[id], {});
+            const llama_grammar_candidates candidates = { { 0, decoded.first.data(), decoded.second } };
+            for (const auto & stack : stacks) {
+                if (llama_grammar_reject_candidates_for_stack(rules, stack, candidates).empty()) {
+                    expected = true;
+                    break;
+                }
+            }
+        }
+        const bool actual = (allowed[id >> 6] >> (id & 63)) & 1;
+        if (actual != expected) {
+            fprintf(stderr, "token mask mismatch for piece \"%s\": expected %d, got %d\n", pieces[id].c_str(), expected, actual);
+        }
+        assert(actual == expected);
+    }
+}
+
 static bool match_string(const std::string & input, llama_grammar * grammar) {
     auto decoded = decode_utf8(input, {});
 
@@ -55,6 +108,8 @@ static bool match_string(const std::string & input, llama_grammar * grammar) {
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
         const llama_grammar_stacks prev_stacks = llama_grammar_get_stacks(grammar); // copy
 
+        check_token_mask(grammar);
+
         llama_grammar_accept(rules, prev_stacks, *it, cur_stacks);
 
         if (cur_stacks.empty()) {
@@ -0,0 +1,172 @@
+// checks that the CPU backend gives the same results when it computes a node together with the one before it
+// (element-wise ops after a matrix multiplication, the K cache copy after a rope) as when it computes them apart
+
+#include "ggml.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <vector>
+
+enum epilogue_op {
+    EPILOGUE_BIAS,
+    EPILOGUE_RESIDUAL,
+    EPILOGUE_ADD_INPLACE,
+    EPILOGUE_SCALE,
+    EPILOGUE_SCALE_INPLACE,
+    EPILOGUE_SOFTCAP,
+};
+
+static const char * epilogue_op_name(epilogue_op op) {
+    switch (op) {
+        case EPILOGUE_BIAS:          return "bias";
+        case EPILOGUE_RESIDUAL:      return "residual";
+        case EPILOGUE_ADD_INPLACE:   return "add_inplace";
+        case EPILOGUE_SCALE:         return "scale";
+        case EPILOGUE_SCALE_INPLACE: return "scale_inplace";
+        case EPILOGUE_SOFTCAP:       return "softcap";
+    }
+    return "";
+}
+
+static void fill_random(ggml_tensor * t, std::mt19937 & rng) {
+    std::normal_distribution<float> dist(0.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(t));
+    for (auto & x : data) {
+        x = dist(rng);
+    }
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), ggml_nbytes(t));
+    } else {
+        ggml_quantize_chunk(t->type, data.data(), t->data, 0, ggml_nrows(t), t->ne[0], nullptr);
+    }
+}
+
+// builds the graph of build(ctx) and computes it, with another node in between the last node and its producer
+// if apart, so that the two are not computed together; returns the data of the last node
+static std::vector<uint8_t> compute(const std::function<ggml_tensor * (ggml_context *, ggml_tensor **)> & build, bool apart, int n_threads) {
+    ggml_init_params params = { 64*1024*1024, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * producer = nullptr;
+    ggml_tensor * out = build(ctx, &producer);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    if (apart) {
+        ggml_tensor * other = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 64);
+        memset(other->data, 0, ggml_nbytes(other));
+        ggml_build_forward_expand(gf, producer);
+        ggml_build_forward_expand(gf, ggml_scale(ctx, other, 2.0f));
+    }
+    ggml_build_forward_expand(gf, out);
+    assert(gf->nodes[gf->n_nodes - 1] == out);
+
+    const enum ggml_status status = ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+    assert(status == GGML_STATUS_SUCCESS);
+
+    std::vector<uint8_t> res(ggml_nbytes(out));
+    memcpy(res.data(), out->data, res.size());
+
+    ggml_free(ctx);
+
+    return res;
+}
+
+static void test_mul_mat(ggml_type type, int64_t nx, int64_t ny, epilogue_op op, int n_threads) {
+    const int64_t ne00 = 128;
+
+    auto build = [&](ggml_context * ctx, ggml_tensor ** producer) {
+        std::mt19937 rng(42);
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, type, ne00, nx);
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne00, ny);
+        ggml_tensor * c = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, nx, op == EPILOGUE_BIAS ? 1 : ny);
+        fill_random(a, rng);
+        fill_random(b, rng);
+        fill_random(c, rng);
+
+        ggml_tensor * mm = ggml_mul_mat(ctx, a, b);
+        *producer = mm;
+        switch (op) {
+            case EPILOGUE_BIAS:
+            case EPILOGUE_RESIDUAL:      return ggml_add(ctx, mm, c);
+            case EPILOGUE_ADD_INPLACE:   return ggml_add_inplace(ctx, mm, c);
+            case EPILOGUE_SCALE:         return ggml_scale(ctx, mm, 0.125f);
+            case EPILOGUE_SCALE_INPLACE: return ggml_scale_inplace(ctx, mm, 0.125f);
+            case EPILOGUE_SOFTCAP:       return ggml_softcap(ctx, mm, 0.1f, 30.0f);
+        }
+        return (ggml_tensor *) nullptr;
+    };
+
+    if (compute(build, true, n_threads) != compute(build, false, n_threads)) {
+        fprintf(stderr, "%s: %s, nx = %d, ny = %d, %s, %d threads: results differ\n", __func__,
+                ggml_type_name(type), (int) nx, (int) ny, epilogue_op_name(op), n_threads);
+        assert(false);
+    }
+}
+
+// the rotated K of a batch copied into a view of the K cache, as llm_build_kv_store does
+static void test_rope_cpy(ggml_type type_k, int64_t n_tokens, int n_threads) {
+    const int64_t n_embd_head = 64;
+    const int64_t n_head_kv   = 4;
+    const int64_t n_ctx       = 64;
+    const int64_t kv_head     = 5;
+
+    auto build = [&](ggml_context * ctx, ggml_tensor ** producer) {
+        std::mt19937 rng(42);
+        ggml_tensor * k   = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, n_embd_head, n_head_kv, n_tokens);
+        ggml_tensor * pos = ggml_new_tensor_1d(ctx, GGML_TYPE_I32, n_tokens);
+        fill_random(k, rng);
+        for (int64_t i = 0; i < n_tokens; ++i) {
+            ((int32_t *) pos->data)[i] = kv_head + i;
+        }
+        ggml_tensor * k_cache = ggml_new_tensor_2d(ctx, type_k, n_embd_head*n_head_kv, n_ctx);
+        memset(k_cache->data, 0, ggml_nbytes(k_cache));
+
+        ggml_tensor * k_rot = ggml_rope_ext(ctx, k, pos, nullptr, n_embd_head, 0, 4096, 10000.0f, 1.0f, 0.0f, 1.0f, 32.0f, 1.0f);
+        *producer = k_rot;
+
+        const size_t k_row_size = ggml_row_size(type_k, n_embd_head);
+        ggml_tensor * k_cache_view = ggml_view_2d(ctx, k_cache, n_embd_head, n_tokens*n_head_kv,
+                k_row_size, k_row_size*n_head_kv*kv_head);
+        return ggml_cpy(ctx, k_rot, k_cache_view);
+    };
+
+    if (compute(build, true, n_threads) != compute(build, false, n_threads)) {
+        fprintf(stderr, "%s: %s, n_tokens = %d, %d threads: results differ\n", __func__,
+                ggml_type_name(type_k), (int) n_tokens, n_threads);
+        assert(false);
+    }
+}
+
+int main(void) {
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        // few rows and many columns: the threads also split the columns
+        for (int64_t nx : { 16, 64, 256 }) {
+            for (int64_t ny : { 1, 5, 40 }) {
+                for (epilogue_op op : { EPILOGUE_BIAS, EPILOGUE_RESIDUAL, EPILOGUE_ADD_INPLACE, EPILOGUE_SCALE, EPILOGUE_SCALE_INPLACE, EPILOGUE_SOFTCAP }) {
+                    for (int n_threads : { 1, 3, 8 }) {
+                        test_mul_mat(type, nx, ny, op, n_threads);
+                    }
+                }
+            }
+        }
+    }
+
+    for (ggml_type type_k : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q8_0 }) {
+        for (int64_t n_tokens : { 1, 7, 32 }) {
+            for (int n_threads : { 1, 3, 8 }) {
+                test_rope_cpy(type_k, n_tokens, n_threads);
+            }
+        }
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,109 @@
+// checks that evaluating the cached graph of the previous ubatch gives the same logits as building the graph every time
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// the logits of all tokens of a decode sequence, and the number of ubatches that evaluated the cached graph
+static std::vector<float> run(llama_model * model, bool reuse, int32_t & n_graph_reuse) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx       = 256;
+    cparams.n_batch     = 64;
+    cparams.n_ubatch    = 64;
+    cparams.n_threads   = cparams.n_threads_batch = 4;
+    cparams.seed        = 1234;
+    cparams.graph_reuse = reuse;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+
+    const int n_vocab = llama_n_vocab(model);
+
+    std::vector<float> logits;
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    auto decode = [&](int pos, const std::vector<llama_token> & tokens) {
+        llama_batch_clear(batch);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            llama_batch_add(batch, tokens[i], pos + i, { 0 }, true);
+        }
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            const float * l = llama_get_logits_ith(ctx, i);
+            logits.insert(logits.end(), l, l + n_vocab);
+        }
+    };
+
+    int pos = 0;
+    decode(pos, { 1, 17, 33, 250, 4, 9, 100, 7 });
+    pos += 8;
+
+    // single token ubatches, the views of the KV cells written move forward
+    for (int i = 0; i < 16; ++i) {
+        decode(pos, { llama_token((pos*37) % n_vocab) });
+        pos += 1;
+    }
+
+    // the head moves back to the removed cells
+    llama_kv_cache_seq_rm(ctx, 0, pos - 6, -1);
+    pos -= 6;
+    for (int i = 0; i < 8; ++i) {
+        decode(pos, { llama_token((pos*11) % n_vocab) });
+        pos += 1;
+    }
+
+    // ubatches of two tokens
+    for (int i = 0; i < 6; ++i) {
+        decode(pos, { llama_token((pos*5) % n_vocab), llama_token((pos*3) % n_vocab) });
+        pos += 2;
+    }
+
+    n_graph_reuse = llama_get_timings(ctx).n_graph_reuse;
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return logits;
+}
+
+int main(void) {
+    const char * fname = "test-graph-reuse.gguf";
+    write_random_model(fname, 256, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    int32_t n_reuse_ref = 0;
+    int32_t n_reuse_out = 0;
+    const std::vector<float> ref = run(model, false, n_reuse_ref);
+    const std::vector<float> out = run(model, true,  n_reuse_out);
+
+    // a key is cached when it repeats, so all but the first two ubatches of each run of equal shapes reuse the graph
+    fprintf(stderr, "%s: %d ubatches reused the graph\n", __func__, n_reuse_out);
+    assert(n_reuse_ref == 0);
+    assert(n_reuse_out >= 14 + 6 + 4);
+
+    assert(ref.size() == out.size());
+    assert(memcmp(ref.data(), out.data(), ref.size()*sizeof(float)) == 0);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
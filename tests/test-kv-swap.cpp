@@ -0,0 +1,186 @@
+// checks that sequences swapped out of the KV cache and back in give the same logits as sequences that stayed in the cache
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+static const int n_prompt = 40;
+
+struct test_context {
+    llama_context * ctx;
+    llama_batch     batch;
+    int             n_vocab;
+
+    test_context(llama_model * model, uint32_t n_ctx, bool kv_swap, const char * kv_swap_path) {
+        llama_context_params cparams = llama_context_default_params();
+        cparams.n_ctx        = n_ctx;
+        cparams.n_batch      = 64;
+        cparams.n_ubatch     = 64;
+        cparams.n_seq_max    = 2;
+        cparams.n_threads    = cparams.n_threads_batch = 4;
+        cparams.seed         = 1234;
+        cparams.kv_swap      = kv_swap;
+        cparams.kv_swap_path = kv_swap_path;
+
+        ctx = llama_new_context_with_model(model, cparams);
+        assert(ctx);
+
+        batch   = llama_batch_init(64, 0, 1);
+        n_vocab = llama_n_vocab(model);
+    }
+
+    ~test_context() {
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+
+    // decodes the tokens of a sequence and returns the logits of the last one
+    std::vector<float> decode(llama_seq_id seq_id, llama_pos pos, const std::vector<llama_token> & tokens) {
+        llama_batch_clear(batch);
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            llama_batch_add(batch, tokens[i], pos + i, { seq_id }, i == tokens.size() - 1);
+        }
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        const float * logits = llama_get_logits_ith(ctx, tokens.size() - 1);
+        return std::vector<float>(logits, logits + n_vocab);
+    }
+
+    void prompt(llama_seq_id seq_id) {
+        std::vector<llama_token> tokens;
+        for (int i = 0; i < n_prompt; ++i) {
+            tokens.push_back((i*37 + seq_id*101 + 1) % n_vocab);
+        }
+        decode(seq_id, 0, tokens);
+    }
+};
+
+static void check_logits(const std::vector<float> & ref, const std::vector<float> & out) {
+    assert(ref.size() == out.size());
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        max_diff = std::max(max_diff, std::fabs(ref[i] - out[i]));
+    }
+    if (max_diff > 1e-3f) {
+        fprintf(stderr, "%s: logits differ by %g\n", __func__, max_diff);
+        assert(false);
+    }
+}
+
+// the logits of the next token of sequence 0 after edit, with and without swapping the sequence out before (or after) the edit
+static void test_edit(llama_model * model, const char * kv_swap_path, const char * name,
+        const std::function<void(llama_context *)> & edit, llama_pos pos_min, llama_pos pos_max, bool swapped = true, bool edit_first = false) {
+    fprintf(stderr, "%s: %s\n", __func__, name);
+
+    test_context ref(model, 256, false, nullptr);
+    ref.prompt(0);
+    ref.prompt(1);
+    edit(ref.ctx);
+    assert(llama_kv_cache_seq_pos_min(ref.ctx, 0) == pos_min);
+    assert(llama_kv_cache_seq_pos_max(ref.ctx, 0) == pos_max);
+    const size_t seq_size   = llama_state_seq_get_size(ref.ctx, 0);
+    const size_t state_size = llama_state_get_size(ref.ctx);
+
+    test_context out(model, 256, false, kv_swap_path);
+    out.prompt(0);
+    out.prompt(1);
+    if (edit_first) {
+        edit(out.ctx);
+    }
+    assert(llama_kv_cache_seq_swap_out(out.ctx, 0));
+    assert(llama_kv_cache_seq_swapped(out.ctx, 0));
+    assert(!llama_kv_cache_seq_swapped(out.ctx, 1));
+    assert(llama_get_kv_cache_used_cells(out.ctx) == n_prompt);
+    if (!edit_first) {
+        edit(out.ctx);
+    }
+    assert(llama_kv_cache_seq_swapped(out.ctx, 0) == swapped);
+    assert(llama_kv_cache_seq_pos_min(out.ctx, 0) == pos_min);
+    assert(llama_kv_cache_seq_pos_max(out.ctx, 0) == pos_max);
+
+    // the size of the state is computed without swapping the sequence in
+    assert(llama_state_seq_get_size(out.ctx, 0) == seq_size);
+    assert(llama_state_get_size(out.ctx) == state_size);
+    assert(llama_kv_cache_seq_swapped(out.ctx, 0) == swapped);
+
+    // the next decode of the sequence swaps it back in, the pending K shift is applied then
+    check_logits(ref.decode(0, pos_max + 1, { 7 }), out.decode(0, pos_max + 1, { 7 }));
+    assert(!llama_kv_cache_seq_swapped(out.ctx, 0));
+    check_logits(ref.decode(1, n_prompt, { 9 }), out.decode(1, n_prompt, { 9 }));
+}
+
+// a cache that holds only one prompt at a time: the least recently used sequence is swapped out automatically
+static void test_auto(llama_model * model, const char * kv_swap_path) {
+    fprintf(stderr, "%s\n", __func__);
+
+    test_context ref(model, 256, false, nullptr);
+    test_context out(model, 64, true, kv_swap_path);
+
+    for (auto * tc : { &ref, &out }) {
+        tc->prompt(0);
+        tc->prompt(1);
+    }
+    assert(llama_kv_cache_seq_swapped(out.ctx, 0));
+
+    for (int i = 0; i < 4; ++i) {
+        const llama_seq_id s = i % 2;
+        check_logits(ref.decode(s, n_prompt + i/2, { 3 + i }), out.decode(s, n_prompt + i/2, { 3 + i }));
+        assert(!llama_kv_cache_seq_swapped(out.ctx, s));
+        assert(llama_kv_cache_seq_swapped(out.ctx, 1 - s));
+    }
+}
+
+int main(void) {
+    const char * fname      = "test-kv-swap.gguf";
+    const char * fname_swap = "test-kv-swap.bin";
+    write_random_model(fname, 256, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    for (const char * kv_swap_path : { (const char *) nullptr, fname_swap }) {
+        test_edit(model, kv_swap_path, "none", [](llama_context *) {}, 0, n_prompt - 1);
+        test_edit(model, kv_swap_path, "seq_add", [](llama_context * ctx) {
+            llama_kv_cache_seq_add(ctx, 0, 10, -1, 5);
+        }, 0, n_prompt + 4);
+        // the K shift is still pending when the sequence is swapped out
+        test_edit(model, kv_swap_path, "seq_add before swap out", [](llama_context * ctx) {
+            llama_kv_cache_seq_add(ctx, 0, 10, -1, 5);
+        }, 0, n_prompt + 4, true, true);
+        test_edit(model, kv_swap_path, "seq_add shifting out", [](llama_context * ctx) {
+            llama_kv_cache_seq_add(ctx, 0, 0, -1, -8);
+        }, 0, n_prompt - 9);
+        test_edit(model, kv_swap_path, "seq_div", [](llama_context * ctx) {
+            llama_kv_cache_seq_div(ctx, 0, 20, -1, 2);
+        }, 0, (n_prompt - 1)/2);
+        // removing a part of a sequence swaps it in
+        test_edit(model, kv_swap_path, "seq_rm", [](llama_context * ctx) {
+            assert(llama_kv_cache_seq_rm(ctx, 0, 30, -1));
+        }, 0, 29, false);
+        test_auto(model, kv_swap_path);
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+    std::remove(fname_swap);
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
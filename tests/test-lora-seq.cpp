@@ -0,0 +1,244 @@
+// checks that a batch mixing sequences with different per-sequence LoRA adapters and with none gives each sequence
+// the logits of a separate decode with its adapter set for the whole context
+
+#include "llama.h"
+#include "common.h"
+#include "ggml.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const int n_embd    = 64;
+static const int n_embd_kv = 32;
+static const int n_ff      = 128;
+static const int n_vocab   = 256;
+
+// a LoRA adapter for the given weights, each with its number of inputs and outputs
+static void write_lora(const char * fname, const std::vector<std::pair<std::string, std::pair<int, int>>> & weights, unsigned seed) {
+    // the rank is at least 16, the f32 matrix multiplications of smaller ones take another path
+    const int rank = 16;
+
+    gguf_context * gguf = gguf_init_empty();
+    gguf_set_val_str(gguf, "general.type", "adapter");
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "adapter.type", "lora");
+    gguf_set_val_f32(gguf, "adapter.lora.alpha", (float) rank);
+
+    size_t n_weights = 0;
+    for (const auto & w : weights) {
+        n_weights += (size_t) rank*(w.second.first + w.second.second);
+    }
+    ggml_init_params params = { n_weights*sizeof(float) + 2*weights.size()*(ggml_tensor_overhead() + GGML_MEM_ALIGN), nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 0.1f);
+
+    for (const auto & w : weights) {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, w.second.first, rank);
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, rank, w.second.second);
+        ggml_set_name(a, (w.first + ".weight.lora_a").c_str());
+        ggml_set_name(b, (w.first + ".weight.lora_b").c_str());
+        for (auto * t : { a, b }) {
+            for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+                ((float *) t->data)[i] = dist(rng);
+            }
+            gguf_add_tensor(gguf, t);
+        }
+    }
+
+    gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
+
+static llama_context * new_context(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 64;
+    cparams.n_seq_max = 4;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+    return ctx;
+}
+
+// the adapter of a sequence, if any, with its scale
+struct seq_adapter {
+    llama_lora_adapter * adapter;
+    float                scale;
+};
+
+static const int n_prompt = 6;
+static const int n_gen    = 3;
+
+static llama_token get_token(int seq, int pos) {
+    return (seq*71 + pos*37 + 1) % n_vocab;
+}
+
+// only the last two tokens of the prompt are outputs, so the output weight sees fewer rows than the layers
+static bool is_output(int pos) {
+    return pos >= n_prompt - 2;
+}
+
+// the logits of the outputs of one sequence decoded alone, with its adapter set for the context
+static std::vector<float> eval_alone(llama_model * model, int seq, const seq_adapter & sa) {
+    llama_context * ctx = new_context(model);
+    if (sa.adapter) {
+        const int32_t ret = llama_lora_adapter_set(ctx, sa.adapter, sa.scale);
+        assert(ret == 0);
+    }
+
+    std::vector<float> res;
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    llama_batch_clear(batch);
+    for (int pos = 0; pos < n_prompt; ++pos) {
+        llama_batch_add(batch, get_token(seq, pos), pos, { 0 }, is_output(pos));
+    }
+    for (int k = 0; k <= n_gen; ++k) {
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                const float * l = llama_get_logits_ith(ctx, i);
+                res.insert(res.end(), l, l + n_vocab);
+            }
+        }
+        llama_batch_clear(batch);
+        llama_batch_add(batch, get_token(seq, n_prompt + k), n_prompt + k, { 0 }, true);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+// the logits of the outputs of each sequence, all sequences decoded in the same batches with per-sequence adapters
+static std::vector<std::vector<float>> eval_mixed(llama_model * model, const std::vector<seq_adapter> & adapters) {
+    const int n_seq = adapters.size();
+
+    llama_context * ctx = new_context(model);
+    for (int s = 0; s < n_seq; ++s) {
+        const int32_t ret = llama_lora_adapter_seq_set(ctx, adapters[s].adapter, s, adapters[s].scale);
+        assert(ret == 0);
+    }
+
+    std::vector<std::vector<float>> res(n_seq);
+    llama_batch batch = llama_batch_init(64, 0, 1);
+
+    // the tokens of the sequences are interleaved
+    llama_batch_clear(batch);
+    for (int pos = 0; pos < n_prompt; ++pos) {
+        for (int s = 0; s < n_seq; ++s) {
+            llama_batch_add(batch, get_token(s, pos), pos, { s }, is_output(pos));
+        }
+    }
+    for (int k = 0; k <= n_gen; ++k) {
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            if (batch.logits[i]) {
+                const float * l = llama_get_logits_ith(ctx, i);
+                res[batch.seq_id[i][0]].insert(res[batch.seq_id[i][0]].end(), l, l + n_vocab);
+            }
+        }
+        llama_batch_clear(batch);
+        for (int s = n_seq - 1; s >= 0; --s) {
+            llama_batch_add(batch, get_token(s, n_prompt + k), n_prompt + k, { s }, true);
+        }
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+
+    return res;
+}
+
+static float max_diff(const std::vector<float> & ref, const std::vector<float> & out) {
+    assert(ref.size() == out.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        diff = std::max(diff, std::fabs(ref[i] - out[i]));
+    }
+    return diff;
+}
+
+int main(void) {
+    const char * fname        = "test-lora-seq.gguf";
+    const char * fname_lora_a = "test-lora-seq-a.gguf";
+    const char * fname_lora_b = "test-lora-seq-b.gguf";
+
+    write_random_model(fname, n_vocab, n_embd, 2, n_ff, 42);
+
+    // the adapters modify different weights, both modify the output weight
+    write_lora(fname_lora_a, {
+        { "blk.0.attn_q",   { n_embd, n_embd    } },
+        { "blk.0.attn_v",   { n_embd, n_embd_kv } },
+        { "blk.1.ffn_up",   { n_embd, n_ff      } },
+        { "output",         { n_embd, n_vocab   } },
+    }, 1);
+    write_lora(fname_lora_b, {
+        { "blk.0.attn_k",   { n_embd, n_embd_kv } },
+        { "blk.1.ffn_down", { n_ff,   n_embd    } },
+        { "output",         { n_embd, n_vocab   } },
+    }, 2);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    llama_lora_adapter * lora_a = llama_lora_adapter_init(model, fname_lora_a);
+    llama_lora_adapter * lora_b = llama_lora_adapter_init(model, fname_lora_b);
+    assert(lora_a && lora_b);
+
+    // the same adapter with two scales, another adapter and no adapter
+    const std::vector<seq_adapter> adapters = {
+        { lora_a,  1.0f },
+        { nullptr, 0.0f },
+        { lora_b,  0.5f },
+        { lora_a,  2.0f },
+    };
+
+    const std::vector<std::vector<float>> out = eval_mixed(model, adapters);
+
+    for (size_t s = 0; s < adapters.size(); ++s) {
+        const std::vector<float> ref = eval_alone(model, s, adapters[s]);
+        const float diff = max_diff(ref, out[s]);
+        fprintf(stderr, "%s: sequence %zu: max diff %g\n", __func__, s, diff);
+        assert(diff < 1e-3f);
+        // the adapters change the logits
+        if (adapters[s].adapter) {
+            assert(max_diff(eval_alone(model, s, { nullptr, 0.0f }), ref) > 1e-2f);
+        }
+    }
+
+    llama_lora_adapter_free(lora_a);
+    llama_lora_adapter_free(lora_b);
+    llama_free_model(model);
+    llama_backend_free();
+
+    for (const char * f : { fname, fname_lora_a, fname_lora_b }) {
+        std::remove(f);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama-lz.h"
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static size_t round_trip(const std::vector<uint8_t> & data) {
+    std::vector<uint8_t> comp(llama_lz_compress_bound(data.size()));
+    const size_t n_comp = llama_lz_compress(data.data(), data.size(), comp.data());
+    assert(n_comp <= comp.size());
+
+    std::vector<uint8_t> out(data.size());
+    const size_t n_out = llama_lz_decompress(comp.data(), n_comp, out.data(), out.size());
+    assert(n_out == data.size());
+    assert(data.empty() || memcmp(out.data(), data.data(), data.size()) == 0);
+
+    if (!data.empty()) {
+        // the output buffer must be large enough
+        std::vector<uint8_t> small(data.size() - 1);
+        assert(llama_lz_decompress(comp.data(), n_comp, small.data(), small.size()) == 0);
+    }
+
+    return n_comp;
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    for (size_t n : { 0, 1, 3, 4, 5, 15, 16, 17, 270, 4096, 100000 }) {
+        std::vector<uint8_t> data(n);
+
+        // incompressible
+        for (auto & x : data) {
+            x = rng() & 0xff;
+        }
+        round_trip(data);
+
+        // runs and repeats of varying length, with matches that overlap the output
+        for (size_t i = 0; i < n; ++i) {
+            data[i] = (i / (1 + rng() % 300)) % 7;
+        }
+        round_trip(data);
+
+        // constant
+        std::fill(data.begin(), data.end(), 0);
+        const size_t n_comp = round_trip(data);
+        assert(n < 4096 || n_comp < n/128);
+    }
+
+    // repeats at the largest distance and beyond it
+    {
+        std::vector<uint8_t> data(3*65536);
+        for (auto & x : data) {
+            x = rng() & 0xff;
+        }
+        memcpy(data.data() + 65535, data.data(), 1000);
+        memcpy(data.data() + 2*65536 + 10, data.data() + 100, 1000);
+        round_trip(data);
+    }
+
+    // truncated or corrupted data must not be accepted
+    {
+        std::vector<uint8_t> data(10000);
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = (i % 97) ^ (i / 1000);
+        }
+        std::vector<uint8_t> comp(llama_lz_compress_bound(data.size()));
+        const size_t n_comp = llama_lz_compress(data.data(), data.size(), comp.data());
+        std::vector<uint8_t> out(data.size());
+        for (size_t n = 0; n < n_comp; ++n) {
+            assert(llama_lz_decompress(comp.data(), n, out.data(), out.size()) != data.size());
+        }
+        for (int k = 0; k < 1000; ++k) {
+            auto bad = comp;
+            bad[rng() % n_comp] ^= 1 + rng() % 255;
+            // anything is fine as long as it stays within the output buffer
+            llama_lz_decompress(bad.data(), n_comp, out.data(), out.size());
+        }
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -37,6 +37,7 @@ struct quantize_perf_params {
     bool op_dequantize_row_q = false;
     bool op_quantize_row_q_dot = false;
     bool op_vec_dot_q = false;
+    bool op_quantize_chunk = false;
     int64_t iterations = ITERATIONS;
 };
 
@@ -119,6 +120,7 @@ static void usage(char * argv[]) {
     printf("  -4                    use size as L1, L2, L3, MEM sizes (L1:%d L2:%d L3:%d MEM:%d)\n", L1_SIZE, L2_SIZE, L3_SIZE, MEM_SIZE);
     printf("  --op OP               set test operation as quantize_row_q_reference, quantize_row_q, dequantize_row_q,\n");
     printf("                        quantize_row_q_dot, vec_dot_q (all)\n");
+    printf("                        or quantize_chunk (16 rows with an importance matrix, as used by llama-quantize)\n");
     printf("  --type TYPE           set test type as");
     for (int i = 0; i < GGML_TYPE_COUNT; i++) {
         ggml_type type = (ggml_type) i;
@@ -185,6 +187,8 @@ int main(int argc, char * argv[]) {
                 params.op_quantize_row_q_dot = true;
             } else if (op == "vec_dot_q") {
                 params.op_vec_dot_q = true;
+            } else if (op == "quantize_chunk") {
+                params.op_quantize_chunk = true;
             } else {
                 invalid_param = true;
                 break;
@@ -235,7 +239,8 @@ int main(int argc, char * argv[]) {
     if (params.test_sizes.empty()) {
         params.test_sizes.push_back(L1_SIZE);
     }
-    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q)) {
+    if (!(params.op_quantize_row_q_reference || params.op_quantize_row_q || params.op_dequantize_row_q || params.op_quantize_row_q_dot || params.op_vec_dot_q ||
+          params.op_quantize_chunk)) {
         params.op_quantize_row_q_reference = params.op_quantize_row_q = params.op_dequantize_row_q = params.op_quantize_row_q_dot = params.op_vec_dot_q = true;
     }
 
@@ -257,6 +262,12 @@ int main(int argc, char * argv[]) {
     generate_data(0, largest, test_data1);
     generate_data(1, largest, test_data2);
 
+    // synthetic importance matrix for quantize_chunk
+    std::vector<float> imatrix(largest/16);
+    for (size_t i = 0; i < imatrix.size(); i++) {
+        imatrix[i] = 1.0f + cosf(0.1f*i)*cosf(0.1f*i);
+    }
+
     int64_t iterations = params.iterations;
 
 
@@ -354,6 +365,26 @@ int main(int argc, char * argv[]) {
                 }
                 printf("\n");
             }
+
+            if (params.op_quantize_chunk) {
+                printf("  quantize_chunk\n");
+                for (size_t size : params.test_sizes) {
+                    printf("    %zu values (%.2f MB)\n", size, 4*size/(float)(1024*1024));
+                    const int64_t nrows = 16;
+                    const int64_t n_per_row = size/nrows;
+                    if (size % nrows != 0 || n_per_row % ggml_blck_size(type) != 0) {
+                        printf("      skipped: %zu values are not 16 rows of whole blocks\n", size);
+                        continue;
+                    }
+                    auto quantize_fn = [&](void) -> float {
+                        ggml_quantize_chunk(type, test_data1, test_q1, 0, nrows, n_per_row, imatrix.data());
+                        return test_q1[0];
+                    };
+                    size_t quantized_size = nrows*ggml_row_size(type, n_per_row);
+                    benchmark_function(size, quantized_size, iterations, quantize_fn);
+                }
+                printf("\n");
+            }
         }
     }
 
@@ -0,0 +1,146 @@
+// checks that a quantization resumed from its progress file gives the same output as an uninterrupted one
+
+#include "llama.h"
+#include "ggml.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+static std::vector<uint8_t> read_file(const std::string & fname) {
+    std::ifstream fin(fname, std::ios::binary);
+    assert(fin);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string & fname, const std::vector<uint8_t> & data) {
+    std::ofstream fout(fname, std::ios::binary);
+    fout.write((const char *) data.data(), data.size());
+}
+
+static bool file_exists(const std::string & fname) {
+    return (bool) std::ifstream(fname);
+}
+
+static void quantize(const std::string & fname_inp, const std::string & fname_out, llama_ftype ftype) {
+    llama_model_quantize_params params = llama_model_quantize_default_params();
+    params.nthread = 2;
+    params.ftype   = ftype;
+    const uint32_t ret = llama_model_quantize(fname_inp.c_str(), fname_out.c_str(), &params);
+    assert(ret == 0);
+}
+
+// the names of the tensors in the order of the model file, which is the order used in the progress file
+static std::vector<std::string> tensor_names(const std::string & fname) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * gguf = gguf_init_from_file(fname.c_str(), params);
+    assert(gguf);
+    std::vector<std::string> names;
+    for (int i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+        names.push_back(gguf_get_tensor_name(gguf, i));
+    }
+    gguf_free(gguf);
+    return names;
+}
+
+// simulates an interrupted run: the tensors that are not recorded as done are overwritten with garbage
+static void interrupt(const std::string & fname_out, const std::vector<std::string> & names, const std::vector<bool> & done) {
+    ggml_context * ctx = nullptr;
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ &ctx };
+    gguf_context * gguf = gguf_init_from_file(fname_out.c_str(), params);
+    assert(gguf);
+
+    std::vector<uint8_t> data = read_file(fname_out);
+    std::ofstream fprogress(fname_out + ".progress");
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (done[i]) {
+            fprogress << i << '\n';
+            continue;
+        }
+        const int idx = gguf_find_tensor(gguf, names[i].c_str());
+        assert(idx >= 0);
+        const size_t offs   = gguf_get_data_offset(gguf) + gguf_get_tensor_offset(gguf, idx);
+        const size_t nbytes = ggml_nbytes(ggml_get_tensor(ctx, names[i].c_str()));
+        assert(offs + nbytes <= data.size());
+        for (size_t j = 0; j < nbytes; ++j) {
+            data[offs + j] = uint8_t(0xa5 ^ j);
+        }
+    }
+    // the record of a tensor that was being written when the run stopped
+    fprogress << 1;
+
+    write_file(fname_out, data);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+}
+
+int main(void) {
+    const std::string fname_inp = "test-quantize-resume.gguf";
+    const std::string fname_out = "test-quantize-resume-q.gguf";
+    const std::string fname_ref = "test-quantize-resume-ref.gguf";
+
+    write_random_model(fname_inp.c_str(), 256, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    const std::vector<std::string> names = tensor_names(fname_inp);
+    std::vector<bool> done(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        done[i] = i % 2 == 0;
+    }
+    assert(!done[1]);
+
+    for (llama_ftype ftype : { LLAMA_FTYPE_MOSTLY_Q4_0, LLAMA_FTYPE_MOSTLY_Q8_0 }) {
+        quantize(fname_inp, fname_ref, ftype);
+        assert(!file_exists(fname_ref + ".progress"));
+        const std::vector<uint8_t> ref = read_file(fname_ref);
+
+        // resume the interrupted run: only the missing tensors are written again
+        write_file(fname_out, ref);
+        interrupt(fname_out, names, done);
+        quantize(fname_inp, fname_out, ftype);
+        assert(!file_exists(fname_out + ".progress"));
+        assert(read_file(fname_out) == ref);
+
+        // the tensors recorded as done are not written again
+        write_file(fname_out, ref);
+        interrupt(fname_out, names, std::vector<bool>(names.size(), false));
+        const std::vector<uint8_t> garbled = read_file(fname_out);
+        {
+            std::ofstream fprogress(fname_out + ".progress");
+            for (size_t i = 0; i < names.size(); ++i) {
+                fprogress << i << '\n';
+            }
+        }
+        quantize(fname_inp, fname_out, ftype);
+        assert(read_file(fname_out) == garbled);
+
+        // the progress file of a run with another type does not match the output and is ignored
+        write_file(fname_out, ref);
+        interrupt(fname_out, names, done);
+        quantize(fname_inp, fname_out, ftype == LLAMA_FTYPE_MOSTLY_Q4_0 ? LLAMA_FTYPE_MOSTLY_Q8_0 : LLAMA_FTYPE_MOSTLY_Q4_0);
+        assert(!file_exists(fname_out + ".progress"));
+        assert(read_file(fname_out) != ref);
+        quantize(fname_inp, fname_out, ftype);
+        assert(read_file(fname_out) == ref);
+    }
+
+    llama_backend_free();
+
+    std::remove(fname_inp.c_str());
+    std::remove(fname_out.c_str());
+    std::remove(fname_ref.c_str());
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+// checks that the hand-written pre-tokenizer splitters give the same words as the std::regex path,
+// and that merging the words of a long text in parallel gives the same tokens as merging them on one thread
+
+#include "llama.h"
+#include "common.h"
+#include "unicode.h"
+#include "llama-vocab.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// the patterns that unicode_regex_split_custom() handles and that std::regex supports
+// the llama3 pattern with (?i:...) and the kimi-k2 patterns have no std::regex equivalent
+static const std::vector<std::string> k_patterns = {
+    // LLAMA3
+    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    // QWEN2
+    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    // BAILINGMOE
+    "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+    // SEED_CODER
+    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    // GPT4O
+    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    // TEKKEN
+    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+    // single-class patterns
+    "\\p{N}",
+    "\\p{N}+",
+    "\\p{N}{1,3}",
+    "[0-9]",
+    "[0-9][0-9][0-9]",
+    "[\r\n]",
+    "\\s?\\p{L}+",
+    "\\s?\\p{P}+",
+    "[\\p{P}\\$\\+<=>\\^~\\|]+",
+    "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+    "[一-龥ࠀ-一가-퟿]+",
+    "[一-龥぀-ゟ゠-ヿ]+",
+    " ?[^(\\s|.,!?…。，、।۔،)]+",
+};
+
+// letters of both cases, digits, white space, punctuation, contractions and non-ASCII letters, numbers, marks and spaces
+static const std::vector<std::string> k_chars = {
+    "a", "b", "s", "t", "x", "A", "B", "S", "T", "X", "0", "1", "7", "9",
+    " ", " ", " ", "\n", "\r", "\t", "'", "'", ".", ",", "!", "?", "/", "-", "(", ")", "$", "+", "<", "=", "|", "`", "_",
+    "é", "É", "ß", "Ω", "ω", "中", "文", "ー", "あ", "ア", "한", "²", "١", "…", "。", "，", "、", "—", "।",
+    "\xcc\x81", "😀", "\xc2\xa0", "\xe3\x80\x80",
+};
+
+static std::string escape(const std::string & s) {
+    std::string res;
+    for (char c : s) {
+        switch (c) {
+            case '\n': res += "\\n"; break;
+            case '\r': res += "\\r"; break;
+            case '\t': res += "\\t"; break;
+            default:   res += c;
+        }
+    }
+    return res;
+}
+
+static void test_split(const std::string & pattern, const std::string & text) {
+    const std::vector<std::string> ref = unicode_regex_split(text, { pattern }, false);
+    const std::vector<std::string> out = unicode_regex_split(text, { pattern }, true);
+    if (ref != out) {
+        fprintf(stderr, "%s: pattern '%s', text '%s'\n", __func__, escape(pattern).c_str(), escape(text).c_str());
+        fprintf(stderr, "  std::regex:");
+        for (const auto & w : ref) {
+            fprintf(stderr, " '%s'", escape(w).c_str());
+        }
+        fprintf(stderr, "\n  custom:    ");
+        for (const auto & w : out) {
+            fprintf(stderr, " '%s'", escape(w).c_str());
+        }
+        fprintf(stderr, "\n");
+        assert(false);
+    }
+}
+
+static void test_splitters() {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> dist_char(0, k_chars.size() - 1);
+    std::uniform_int_distribution<int>    dist_len(0, 48);
+
+    for (const auto & pattern : k_patterns) {
+        // runs of the same character class
+        for (const auto & c : k_chars) {
+            test_split(pattern, c);
+            test_split(pattern, c + c + c + c);
+            test_split(pattern, " " + c + c + " " + c);
+        }
+        for (int i = 0; i < 2000; ++i) {
+            std::string text;
+            const int n = dist_len(rng);
+            for (int j = 0; j < n; ++j) {
+                text += k_chars[dist_char(rng)];
+            }
+            test_split(pattern, text);
+        }
+    }
+}
+
+// a text of many sentences, tokenized at once with n_threads_bpe threads and sentence by sentence
+static void test_parallel_merge(const llama_vocab & vocab_ref) {
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<int> dist_words(3, 12);
+    std::uniform_int_distribution<int> dist_len(1, 10);
+    std::uniform_int_distribution<int> dist_char(0, 61);
+
+    const std::string alphabet = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+    std::string text;
+    std::vector<llama_token> ref;
+    for (int i = 0; i < 12000; ++i) {
+        // sentences end with a period and the next one starts with a space, so no word crosses two sentences
+        std::string sentence = i == 0 ? "" : " ";
+        const int n_words = dist_words(rng);
+        for (int j = 0; j < n_words; ++j) {
+            if (j > 0) {
+                sentence += ' ';
+            }
+            const int len = dist_len(rng);
+            for (int k = 0; k < len; ++k) {
+                sentence += alphabet[dist_char(rng)];
+            }
+        }
+        sentence += '.';
+        const std::vector<llama_token> tokens = llama_tokenize_internal(vocab_ref, sentence, false);
+        ref.insert(ref.end(), tokens.begin(), tokens.end());
+        text += sentence;
+    }
+
+    for (uint32_t n_threads : { 1, 2, 3, 8 }) {
+        llama_vocab vocab = vocab_ref;
+        vocab.n_threads_bpe = n_threads;
+        const std::vector<llama_token> out = llama_tokenize_internal(vocab, text, false);
+        if (out != ref) {
+            fprintf(stderr, "%s: %u threads: %zu tokens, expected %zu\n", __func__, n_threads, out.size(), ref.size());
+            assert(false);
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <BPE vocab file>\n", argv[0]);
+        return 1;
+    }
+
+    test_splitters();
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+    llama_model * model = llama_load_model_from_file(argv[1], mparams);
+    assert(model);
+    assert(llama_vocab_type(model) == LLAMA_VOCAB_TYPE_BPE);
+
+    llama_context * ctx = llama_new_context_with_model(model, llama_context_default_params());
+    assert(ctx);
+
+    test_parallel_merge(*llama_get_vocab(ctx));
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -1,12 +1,18 @@
+#define LLAMA_API_INTERNAL
 #include "ggml.h"
 #include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "get-model.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
 #endif
 
 #include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -148,6 +154,195 @@ static void test_repetition_penalties(
     }
 }
 
+// the incrementally maintained penalties must match the penalties recomputed from the window
+static void test_penalties_incremental(
+    const int n_vocab, const int penalty_last_n, const int n_tokens, float repeat_penalty, float alpha_frequency, float alpha_presence
+) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> dist_small(0, 15);
+    std::uniform_int_distribution<int> dist_vocab(0, n_vocab - 1);
+    std::uniform_real_distribution<float> dist_logit(-5.0f, 5.0f);
+
+    llama_sampler_penalties * smpl = llama_sampler_init_penalties(n_vocab, penalty_last_n, repeat_penalty, alpha_frequency, alpha_presence);
+
+    std::vector<llama_token> history;
+    for (int it = 0; it < n_tokens; ++it) {
+        std::vector<llama_token_data> cur_a;
+        for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+            cur_a.emplace_back(llama_token_data{token_id, dist_logit(rng), 0.0f});
+        }
+        std::vector<llama_token_data> cur_b = cur_a;
+        if (it % 3 == 2) {
+            // candidates that are not in token order
+            std::reverse(cur_a.begin(), cur_a.end());
+            std::reverse(cur_b.begin(), cur_b.end());
+        }
+
+        llama_token_data_array cur_a_p = { cur_a.data(), cur_a.size(), false };
+        llama_token_data_array cur_b_p = { cur_b.data(), cur_b.size(), false };
+
+        const size_t n_last = std::min(history.size(), (size_t) penalty_last_n);
+        llama_sample_repetition_penalties(nullptr, &cur_a_p, history.data() + history.size() - n_last, n_last, repeat_penalty, alpha_frequency, alpha_presence);
+        llama_sample_penalties(nullptr, smpl, &cur_b_p);
+
+        for (size_t i = 0; i < cur_a.size(); ++i) {
+            GGML_ASSERT(cur_a[i].id == cur_b[i].id);
+            GGML_ASSERT(cur_a[i].logit == cur_b[i].logit);
+        }
+
+        const llama_token token = it % 2 ? dist_small(rng) : dist_vocab(rng);
+        history.push_back(token);
+        llama_sampler_penalties_accept(smpl, token);
+
+        if (it == n_tokens / 2) {
+            llama_sampler_penalties_reset(smpl);
+            history.clear();
+        }
+    }
+
+    llama_sampler_penalties_free(smpl);
+
+    printf("%s: n_vocab = %d, penalty_last_n = %d, n_tokens = %d OK\n", __func__, n_vocab, penalty_last_n, n_tokens);
+}
+
+// straightforward O(n^2) DRY penalty over the last tokens of the history, as described by the original implementation
+static void dry_reference(
+        const std::vector<llama_token> & history, int context_size, float dry_multiplier, float dry_base, int allowed_length,
+        int penalty_last_n, const std::vector<std::vector<llama_token>> & seq_breakers, std::vector<llama_token_data> & cur) {
+    if (dry_multiplier == 0.0f || dry_base < 1.0f || penalty_last_n == 0) {
+        return;
+    }
+    const int last_n = penalty_last_n == -1 ? context_size : std::max(penalty_last_n, 0);
+    const int n = std::min(std::min((int) history.size(), last_n), context_size);
+    if (n <= allowed_length) {
+        return;
+    }
+    // rat(i) is the i-th token from the end
+    auto rat = [&](int i) { return history[history.size() - 1 - i]; };
+
+    // the most recent complete sequence breaker limits the length of the repeats
+    int rep_limit = n;
+    for (int i = 0; i < n && rep_limit == n; ++i) {
+        int longest = -1;
+        for (const auto & seq : seq_breakers) {
+            const int tail = (int) seq.size() - 1;
+            if (seq[0] != rat(i) || tail > i) {
+                continue;
+            }
+            bool match = true;
+            for (int j = 0; j < tail; ++j) {
+                match = match && seq[j + 1] == rat(i - j - 1);
+            }
+            if (match) {
+                longest = std::max(longest, tail);
+            }
+        }
+        if (longest >= 0) {
+            rep_limit = i - longest;
+        }
+    }
+
+    // for the token that follows each earlier occurrence of a suffix of the window, the longest such suffix
+    std::vector<int> max_repeat(cur.size(), -1);
+    for (int k = 1; k < n; ++k) {
+        int len = 0;
+        while (len + k < n && rat(len) == rat(len + k)) {
+            ++len;
+        }
+        len = std::min(len, rep_limit);
+        if (len >= allowed_length) {
+            const llama_token next = rat(k - 1);
+            max_repeat[next] = std::max(max_repeat[next], len);
+        }
+    }
+
+    const int max_exponent = dry_base > 1.000001f ? int(88.7228391f / std::log(dry_base)) : 0;
+    for (auto & td : cur) {
+        if (max_repeat[td.id] < 0) {
+            continue;
+        }
+        bool single_token_breaker = false;
+        for (const auto & seq : seq_breakers) {
+            single_token_breaker = single_token_breaker || (seq.size() == 1 && seq[0] == td.id);
+        }
+        if (single_token_breaker) {
+            continue;
+        }
+        int repeat_exp = max_repeat[td.id] - allowed_length;
+        if (max_exponent > 0 && repeat_exp > max_exponent) {
+            repeat_exp = max_exponent;
+        }
+        const float penalty = dry_multiplier * std::pow(dry_base, repeat_exp);
+        td.logit -= penalty;
+    }
+}
+
+static void test_dry_incremental(
+    const int n_vocab, const int context_size, const int allowed_length, const int penalty_last_n, const int n_tokens,
+    const std::vector<std::vector<llama_token>> & seq_breakers
+) {
+    const float dry_multiplier = 0.8f;
+    const float dry_base       = 1.75f;
+
+    std::mt19937 rng(4321);
+    std::uniform_int_distribution<int> dist_vocab(0, n_vocab - 1);
+    std::uniform_int_distribution<int> dist_pick(0, 9);
+    std::uniform_real_distribution<float> dist_logit(-5.0f, 5.0f);
+
+    llama_sampler_dry * smpl = llama_sampler_init_dry_testing(context_size, dry_multiplier, dry_base, allowed_length, penalty_last_n, seq_breakers);
+
+    std::vector<llama_token> history;
+    for (int it = 0; it < n_tokens; ++it) {
+        std::vector<llama_token_data> cur_a;
+        for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+            cur_a.emplace_back(llama_token_data{token_id, dist_logit(rng), 0.0f});
+        }
+        std::vector<llama_token_data> cur_b = cur_a;
+        if (it % 3 == 2) {
+            // candidates that are not in token order
+            std::reverse(cur_a.begin(), cur_a.end());
+            std::reverse(cur_b.begin(), cur_b.end());
+        }
+
+        dry_reference(history, context_size, dry_multiplier, dry_base, allowed_length, penalty_last_n, seq_breakers, cur_a);
+        llama_token_data_array cur_b_p = { cur_b.data(), cur_b.size(), false };
+        llama_sample_dry(nullptr, smpl, &cur_b_p);
+
+        for (size_t i = 0; i < cur_a.size(); ++i) {
+            GGML_ASSERT(cur_a[i].id == cur_b[i].id);
+            GGML_ASSERT(cur_a[i].logit == cur_b[i].logit);
+        }
+
+        // mostly repeat an earlier stretch of the history to get long matches, sometimes emit a breaker
+        llama_token token;
+        const int pick = dist_pick(rng);
+        if (pick < 6 && history.size() > 8) {
+            token = history[history.size() - 8];
+        } else if (pick == 6 && !seq_breakers.empty()) {
+            const auto & seq = seq_breakers[it % seq_breakers.size()];
+            for (size_t j = 0; j + 1 < seq.size(); ++j) {
+                history.push_back(seq[j]);
+                llama_sampler_dry_accept(smpl, seq[j]);
+            }
+            token = seq.back();
+        } else {
+            token = dist_vocab(rng);
+        }
+        history.push_back(token);
+        llama_sampler_dry_accept(smpl, token);
+
+        if (it == n_tokens / 2) {
+            llama_sampler_dry_reset(smpl);
+            history.clear();
+        }
+    }
+
+    llama_sampler_dry_free(smpl);
+
+    printf("%s: n_vocab = %d, context_size = %d, allowed_length = %d, penalty_last_n = %d, n_breakers = %d OK\n",
+            __func__, n_vocab, context_size, allowed_length, penalty_last_n, (int) seq_breakers.size());
+}
+
 static void test_sampler_queue(
     const size_t n_vocab, const std::string samplers_sequence, const int top_k, const float top_p, const float min_p
 ) {
@@ -230,6 +425,105 @@ static void test_sampler_queue(
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static llama_context * new_context(llama_model * model, int32_t n_top_logits) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx        = 128;
+    cparams.n_threads    = cparams.n_threads_batch = 2;
+    cparams.seed         = 1234;
+    cparams.n_top_logits = n_top_logits;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    GGML_ASSERT(ctx);
+    return ctx;
+}
+
+// the top logits computed in the graph (ggml_top_k_lse), and sampling from them (common sampling with
+// --top-logits) against sampling from the full vocabulary
+static void test_top_logits(const llama_sampling_params & sparams, const std::vector<std::pair<llama_token, float>> & logit_bias) {
+    const char * fname = "test-sampling.gguf";
+    write_random_model(fname, 512, 64, 1, 128, 42);
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    GGML_ASSERT(model);
+
+    const int n_vocab = llama_n_vocab(model);
+    const int n_top   = 32;
+
+    llama_context * ctx_full = new_context(model, 0);
+    llama_context * ctx_top  = new_context(model, n_top);
+
+    llama_sampling_params params = sparams;
+    params.seed = 42;
+    for (const auto & b : logit_bias) {
+        params.logit_bias[b.first] = b.second;
+    }
+    llama_sampling_context * smpl_full = llama_sampling_init(llama_get_model_vocab(model), params);
+    llama_sampling_context * smpl_top  = llama_sampling_init(llama_get_model_vocab(model), params);
+
+    llama_batch batch = llama_batch_init(16, 0, 1);
+    for (int i = 0; i < 8; ++i) {
+        llama_batch_add(batch, (i*97 + 5) % n_vocab, i, { 0 }, true);
+    }
+
+    std::vector<llama_token_data> top(n_top);
+    for (int n_past = batch.n_tokens; n_past < 40; ++n_past) {
+        GGML_ASSERT(llama_decode(ctx_full, batch) == 0);
+        GGML_ASSERT(llama_decode(ctx_top,  batch) == 0);
+
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            // the k largest logits in descending order, and the log-sum-exp of all of them
+            const float * logits = llama_get_logits_ith(ctx_top, i);
+            std::vector<llama_token_data> ref;
+            for (llama_token id = 0; id < n_vocab; ++id) {
+                ref.push_back({ id, logits[id], 0.0f });
+            }
+            std::sort(ref.begin(), ref.end(), [](const llama_token_data & a, const llama_token_data & b) {
+                return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+            });
+            const float max = ref[0].logit;
+            double sum = 0.0;
+            for (const auto & c : ref) {
+                sum += exp(c.logit - max);
+            }
+
+            float lse = 0.0f;
+            GGML_ASSERT(llama_get_top_logits_ith(ctx_top, i, top.data(), &lse) == n_top);
+            for (int j = 0; j < n_top; ++j) {
+                GGML_ASSERT(top[j].id == ref[j].id && top[j].logit == ref[j].logit && top[j].p == 0.0f);
+            }
+            GGML_ASSERT(fabsf(lse - (max + (float) log(sum))) < 1e-4f*std::max(1.0f, fabsf(lse)));
+            GGML_ASSERT(llama_get_top_logits_ith(ctx_full, i, top.data(), nullptr) == 0);
+        }
+
+        const llama_token id_full = llama_sampling_sample(smpl_full, ctx_full, nullptr, batch.n_tokens - 1);
+        const llama_token id_top  = llama_sampling_sample(smpl_top,  ctx_top,  nullptr, batch.n_tokens - 1);
+        if (id_full != id_top) {
+            fprintf(stderr, "%s: n_past = %d: sampled %d from the top logits, %d from all logits\n", __func__, n_past, id_top, id_full);
+            GGML_ASSERT(false);
+        }
+        for (const auto & b : logit_bias) {
+            GGML_ASSERT(b.second < 0.0f || id_top == b.first);
+            GGML_ASSERT(b.second > 0.0f || id_top != b.first);
+        }
+        llama_sampling_accept(smpl_full, ctx_full, id_full, false);
+        llama_sampling_accept(smpl_top,  ctx_top,  id_top,  false);
+
+        llama_batch_clear(batch);
+        llama_batch_add(batch, id_top, n_past, { 0 }, true);
+    }
+
+    llama_batch_free(batch);
+    llama_sampling_free(smpl_full);
+    llama_sampling_free(smpl_top);
+    llama_free(ctx_full);
+    llama_free(ctx_top);
+    llama_free_model(model);
+
+    std::remove(fname);
+
+    printf("%s: top_k = %d, temp = %.1f, penalty_repeat = %.1f, penalty_freq = %.1f, %d logit biases OK\n", __func__,
+            sparams.top_k, sparams.temp, sparams.penalty_repeat, sparams.penalty_freq, (int) logit_bias.size());
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -267,6 +561,21 @@ int main(void) {
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 1.0f, 5.0f, 5.0f);
     test_repetition_penalties({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 1.0f, 5.0f, 5.0f);
 
+    test_penalties_incremental(64,   1, 100, 1.3f, 0.0f, 0.0f);
+    test_penalties_incremental(64,  16, 300, 1.3f, 0.5f, 0.4f);
+    test_penalties_incremental(1000, 256, 600, 0.9f, 0.1f, 1.0f);
+
+    const std::vector<std::vector<llama_token>> breakers = { {3}, {5, 6}, {5, 7, 1}, {2, 4} };
+    test_dry_incremental(16,  64, 2,  -1, 400, {});
+    test_dry_incremental(16,  64, 2,  -1, 400, breakers);
+    test_dry_incremental(16,  64, 0,  16, 400, breakers);
+    test_dry_incremental(16,  64, 1,   1, 200, breakers);
+    test_dry_incremental(16,  64, 3,   3, 200, breakers);
+    test_dry_incremental(16,  64, 4,   4, 200, breakers);
+    test_dry_incremental(16,  32, 2, 100, 400, breakers);
+    test_dry_incremental(8,  256, 2, 256, 600, breakers);
+    test_dry_incremental(8,  256, 2,   0, 100, breakers);
+
     test_sampler_queue(10000, "k", 10000, 1.0f, 1.0f);
     test_sampler_queue(10000, "k",     1, 1.0f, 1.0f);
     test_sampler_queue(10000, "p", 10000, 1.0f, 1.0f);
@@ -295,6 +604,24 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    llama_backend_init();
+
+    llama_sampling_params sparams;
+    sparams.top_k = 16;
+    sparams.temp  = -1.0f;
+    test_top_logits(sparams, {});
+    sparams.temp  = 1.0f;
+    test_top_logits(sparams, {});
+    sparams.penalty_repeat = 1.5f;
+    sparams.penalty_freq   = 0.5f;
+    test_top_logits(sparams, {});
+    // a boosted token outside of the top logits, and a suppressed one
+    test_top_logits(sparams, { { 3, 100.0f } });
+    sparams.temp = -1.0f;
+    test_top_logits(sparams, { { 3, -INFINITY } });
+
+    llama_backend_free();
+
     printf("OK\n");
 
     return 0;
@@ -0,0 +1,206 @@
+// checks the batched scoring of llama_score against evaluating every continuation on its own
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// log-probabilities of the tokens of a continuation, decoded together with the prefix in sequence seq_id
+static llama_score_continuation score_single(llama_context * ctx, llama_seq_id seq_id, const std::vector<llama_token> & prefix, const std::vector<llama_token> & cont) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    std::vector<llama_token> tokens = prefix;
+    tokens.insert(tokens.end(), cont.begin(), cont.end() - 1);
+
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        llama_batch_add(batch, tokens[i], i, { seq_id }, i + 1 >= prefix.size());
+    }
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_score_continuation res;
+    for (size_t i = 0; i < cont.size(); ++i) {
+        const float * logits = llama_get_logits_ith(ctx, prefix.size() - 1 + i);
+        double sum = 0;
+        int i_max = 0;
+        for (int j = 0; j < n_vocab; ++j) {
+            sum += std::exp((double) logits[j]);
+            i_max = logits[j] > logits[i_max] ? j : i_max;
+        }
+        res.logprobs.push_back(logits[cont[i]] - (float) std::log(sum));
+        res.logprob += res.logprobs.back();
+        res.greedy = res.greedy && i_max == cont[i];
+    }
+
+    llama_batch_free(batch);
+    llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+
+    return res;
+}
+
+static void check_results(const std::vector<llama_score_result> & ref, const std::vector<llama_score_result> & out) {
+    assert(ref.size() == out.size());
+    for (size_t it = 0; it < ref.size(); ++it) {
+        assert(ref[it].continuations.size() == out[it].continuations.size());
+        for (size_t ic = 0; ic < ref[it].continuations.size(); ++ic) {
+            const auto & r = ref[it].continuations[ic];
+            const auto & o = out[it].continuations[ic];
+            assert(r.logprobs.size() == o.logprobs.size());
+            for (size_t i = 0; i < r.logprobs.size(); ++i) {
+                if (std::fabs(r.logprobs[i] - o.logprobs[i]) > 1e-3f) {
+                    fprintf(stderr, "%s: task %zu, continuation %zu, token %zu: logprob %g, expected %g\n", __func__, it, ic, i, o.logprobs[i], r.logprobs[i]);
+                    assert(false);
+                }
+            }
+            assert(std::fabs(r.logprob - o.logprob) < 1e-2f);
+            assert(r.greedy == o.greedy);
+        }
+    }
+}
+
+int main(void) {
+    const char * fname = "test-score.gguf";
+    const int n_vocab = 256;
+    write_random_model(fname, n_vocab, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 64;
+    cparams.n_seq_max = 4;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+
+    std::mt19937 rng(1);
+    auto random_tokens = [&](int n) {
+        std::vector<llama_token> tokens(n);
+        for (auto & t : tokens) {
+            t = rng() % n_vocab;
+        }
+        return tokens;
+    };
+
+    std::vector<llama_score_task> tasks;
+    for (int it = 0; it < 6; ++it) {
+        llama_score_task task;
+        task.prefix = random_tokens(1 + rng() % 20);
+        const int n_cont = 1 + it % 3;
+        for (int ic = 0; ic < n_cont; ++ic) {
+            task.continuations.push_back(random_tokens(1 + rng() % 6));
+        }
+        tasks.push_back(std::move(task));
+    }
+    // a continuation that is the most likely one
+    {
+        llama_score_task task;
+        task.prefix = random_tokens(5);
+        llama_batch batch = llama_batch_init(task.prefix.size(), 0, 1);
+        for (size_t i = 0; i < task.prefix.size(); ++i) {
+            llama_batch_add(batch, task.prefix[i], i, { 1 }, i + 1 == task.prefix.size());
+        }
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        const float * logits = llama_get_logits_ith(ctx, task.prefix.size() - 1);
+        llama_token greedy = 0;
+        for (llama_token j = 1; j < n_vocab; ++j) {
+            greedy = logits[j] > logits[greedy] ? j : greedy;
+        }
+        llama_batch_free(batch);
+        llama_kv_cache_seq_rm(ctx, 1, -1, -1);
+        task.continuations.push_back({ greedy });
+        task.continuations.push_back({ (greedy + 1) % n_vocab });
+        tasks.push_back(std::move(task));
+    }
+
+    std::vector<llama_score_result> ref(tasks.size());
+    for (size_t it = 0; it < tasks.size(); ++it) {
+        for (const auto & cont : tasks[it].continuations) {
+            ref[it].continuations.push_back(score_single(ctx, 1, tasks[it].prefix, cont));
+        }
+    }
+    assert(ref.back().continuations[0].greedy && !ref.back().continuations[1].greedy);
+
+    // the KV cells used by the task that needs the most
+    int32_t n_cells_max = 0;
+    for (const auto & task : tasks) {
+        int32_t n_cells = task.prefix.size();
+        for (const auto & cont : task.continuations) {
+            n_cells += cont.size() - 1;
+        }
+        n_cells_max = std::max(n_cells_max, n_cells);
+    }
+
+    // sequence 0 holds a prompt that scoring must not touch
+    {
+        llama_batch batch = llama_batch_init(16, 0, 1);
+        for (int i = 0; i < 16; ++i) {
+            llama_batch_add(batch, i, i, { 0 }, false);
+        }
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        llama_batch_free(batch);
+    }
+    const int32_t n_used = llama_get_kv_cache_used_cells(ctx);
+
+    std::vector<llama_score_result> out;
+
+    // all tasks in as few groups as the sequences allow, decoded in pieces of 16 tokens
+    assert(llama_score(ctx, tasks, out, 1, 3, 16));
+    check_results(ref, out);
+    assert(llama_get_kv_cache_used_cells(ctx) == n_used);
+    assert(llama_kv_cache_seq_pos_max(ctx, 0) == 15);
+
+    // one task at a time
+    assert(llama_score(ctx, tasks, out, 1, 3, 64, n_cells_max));
+    check_results(ref, out);
+    assert(llama_get_kv_cache_used_cells(ctx) == n_used);
+
+    // invalid tasks
+    {
+        auto bad = tasks;
+        bad[2].prefix.clear();
+        assert(!llama_score(ctx, bad, out, 1, 3, 64));
+    }
+    {
+        auto bad = tasks;
+        bad[1].continuations[0].clear();
+        assert(!llama_score(ctx, bad, out, 1, 3, 64));
+    }
+    {
+        auto bad = tasks;
+        bad[0].continuations.resize(4, { 1 });
+        assert(!llama_score(ctx, bad, out, 1, 3, 64));
+    }
+    // a task that needs more cells than given
+    assert(!llama_score(ctx, tasks, out, 1, 3, 64, n_cells_max - 1));
+    assert(llama_get_kv_cache_used_cells(ctx) == n_used);
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
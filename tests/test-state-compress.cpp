@@ -0,0 +1,164 @@
+// checks that a sequence state saved with LLAMA_STATE_SEQ_FLAGS_COMPRESS is loaded by llama_state_seq_load_file
+// and continues with the same logits as the original sequence, and that truncated files are rejected
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+static const int n_vocab  = 256;
+static const int n_prompt = 40;
+static const int n_gen    = 8;
+
+static llama_context * new_context(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 128;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 64;
+    cparams.n_seq_max = 2;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+    return ctx;
+}
+
+static llama_token get_token(llama_pos pos) {
+    return (pos*37 + 1) % n_vocab;
+}
+
+// the logits of the tokens at positions [p0, p1) of a sequence, decoded one at a time
+static std::vector<float> generate(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    std::vector<float> res;
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    for (llama_pos p = p0; p < p1; ++p) {
+        llama_batch_clear(batch);
+        llama_batch_add(batch, get_token(p), p, { seq_id }, true);
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        const float * l = llama_get_logits_ith(ctx, 0);
+        res.insert(res.end(), l, l + n_vocab);
+    }
+    llama_batch_free(batch);
+    return res;
+}
+
+static std::vector<uint8_t> read_file(const char * fname) {
+    std::ifstream f(fname, std::ios::binary);
+    return std::vector<uint8_t>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const char * fname, const uint8_t * data, size_t size) {
+    std::ofstream f(fname, std::ios::binary);
+    f.write((const char *) data, size);
+}
+
+// loads the state file into sequence 1 of a new context and continues the sequence
+static std::vector<float> load_and_generate(llama_model * model, const char * fname, const std::vector<llama_token> & tokens) {
+    llama_context * ctx = new_context(model);
+
+    std::vector<llama_token> tokens_out(n_prompt);
+    size_t n_token_count = 0;
+    const size_t n_read = llama_state_seq_load_file(ctx, fname, 1, tokens_out.data(), tokens_out.size(), &n_token_count);
+    assert(n_read > 0);
+    assert(n_token_count == tokens.size());
+    assert(std::equal(tokens.begin(), tokens.end(), tokens_out.begin()));
+    assert(llama_kv_cache_seq_pos_max(ctx, 1) == n_prompt - 1);
+
+    std::vector<float> res = generate(ctx, 1, n_prompt, n_prompt + n_gen);
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static void check(const char * name, const std::vector<float> & ref, const std::vector<float> & out) {
+    assert(ref.size() == out.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        diff = std::max(diff, std::fabs(ref[i] - out[i]));
+    }
+    fprintf(stderr, "%s: %s: max diff %g\n", __func__, name, diff);
+    assert(diff < 1e-4f);
+}
+
+int main(void) {
+    const char * fname       = "test-state-compress.gguf";
+    const char * fname_plain = "test-state-compress-plain.bin";
+    const char * fname_lz    = "test-state-compress-lz.bin";
+    const char * fname_trunc = "test-state-compress-trunc.bin";
+
+    write_random_model(fname, n_vocab, 64, 2, 128, 42);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+
+    llama_context * ctx = new_context(model);
+
+    // a prompt on sequence 0, saved with and without compression
+    std::vector<llama_token> tokens;
+    llama_batch batch = llama_batch_init(n_prompt, 0, 1);
+    for (llama_pos p = 0; p < n_prompt; ++p) {
+        tokens.push_back(get_token(p));
+        llama_batch_add(batch, tokens.back(), p, { 0 }, false);
+    }
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+    llama_batch_free(batch);
+
+    const size_t n_plain = llama_state_seq_save_file(ctx, fname_plain, 0, tokens.data(), tokens.size());
+    const size_t n_lz    = llama_state_seq_save_file_ext(ctx, fname_lz, 0, tokens.data(), tokens.size(), LLAMA_STATE_SEQ_FLAGS_COMPRESS);
+    assert(n_plain > 0 && n_lz > 0);
+
+    const std::vector<uint8_t> data_plain = read_file(fname_plain);
+    const std::vector<uint8_t> data_lz    = read_file(fname_lz);
+    assert(data_plain.size() == n_plain && data_lz.size() == n_lz);
+    // a different magic, the same version and prompt
+    assert(memcmp(data_plain.data(), data_lz.data(), 4) != 0);
+    assert(memcmp(data_plain.data() + 4, data_lz.data() + 4, 8 + tokens.size()*sizeof(llama_token)) == 0);
+
+    const std::vector<float> ref = generate(ctx, 0, n_prompt, n_prompt + n_gen);
+    llama_free(ctx);
+
+    check("plain",      ref, load_and_generate(model, fname_plain, tokens));
+    check("compressed", ref, load_and_generate(model, fname_lz,    tokens));
+
+    // truncated in the header, in the prompt, in the first block header and in the block data, and by one byte
+    const size_t n_header = 12 + tokens.size()*sizeof(llama_token);
+    for (size_t n : { (size_t) 6, n_header - 2, n_header + 3, (n_header + n_lz)/2, n_lz - 1 }) {
+        write_file(fname_trunc, data_lz.data(), n);
+
+        llama_context * ctx_trunc = new_context(model);
+        std::vector<llama_token> tokens_out(n_prompt);
+        size_t n_token_count = 0;
+        const size_t n_read = llama_state_seq_load_file(ctx_trunc, fname_trunc, 1, tokens_out.data(), tokens_out.size(), &n_token_count);
+        fprintf(stderr, "%s: truncated to %zu of %zu bytes: %zu\n", __func__, n, n_lz, n_read);
+        assert(n_read == 0);
+        llama_free(ctx_trunc);
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    for (const char * f : { fname, fname_plain, fname_lz, fname_trunc }) {
+        std::remove(f);
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
@@ -0,0 +1,180 @@
+// checks that the ring-sized cache of the sliding window attention layers gives the same logits as keeping all
+// positions (swa_full), across the llama_kv_cache_seq_* operations and a state save/load, and that
+// llama_kv_cache_seq_pos_min tells when a sequence can no longer be continued from an earlier position
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const int n_vocab = 256;
+static const int n_swa   = 8;
+
+static llama_context * new_context(llama_model * model, bool swa_full) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_ubatch  = 16;
+    cparams.n_seq_max = 3;
+    cparams.n_threads = cparams.n_threads_batch = 4;
+    cparams.seed      = 1234;
+    cparams.swa_full  = swa_full;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    assert(ctx);
+    return ctx;
+}
+
+static llama_token get_token(llama_seq_id seq_id, llama_pos pos) {
+    return (seq_id*71 + pos*37 + 1) % n_vocab;
+}
+
+// the logits of the tokens at positions [p0, p1) of a sequence, the tokens of seq_tok if it is not the same sequence
+static std::vector<float> decode(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_seq_id seq_tok = -1) {
+    if (seq_tok < 0) {
+        seq_tok = seq_id;
+    }
+    std::vector<float> res;
+    llama_batch batch = llama_batch_init(64, 0, 1);
+    for (llama_pos p = p0; p < p1; p += 64) {
+        llama_batch_clear(batch);
+        for (llama_pos i = p; i < std::min(p + 64, p1); ++i) {
+            llama_batch_add(batch, get_token(seq_tok, i), i, { seq_id }, true);
+        }
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+        for (int i = 0; i < batch.n_tokens; ++i) {
+            const float * l = llama_get_logits_ith(ctx, i);
+            res.insert(res.end(), l, l + n_vocab);
+        }
+    }
+    llama_batch_free(batch);
+    return res;
+}
+
+static void check(const char * name, const std::vector<float> & ref, const std::vector<float> & out) {
+    assert(ref.size() == out.size());
+    float diff = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        diff = std::max(diff, std::fabs(ref[i] - out[i]));
+    }
+    fprintf(stderr, "%s: %s: max diff %g\n", __func__, name, diff);
+    assert(diff < 1e-3f);
+}
+
+// the same tokens decoded in both contexts
+static void decode_both(const char * name, llama_context * ctx_full, llama_context * ctx_ring, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    check(name, decode(ctx_full, seq_id, p0, p1), decode(ctx_ring, seq_id, p0, p1));
+}
+
+// a sequence can be continued from position p if the sliding window of p is still in the cache
+static bool can_continue(llama_context * ctx, llama_seq_id seq_id, llama_pos p) {
+    return llama_kv_cache_seq_pos_min(ctx, seq_id) <= std::max(0, p - n_swa + 1);
+}
+
+int main(void) {
+    const char * fname = "test-swa-cache.gguf";
+    write_random_model(fname, n_vocab, 64, 26, 128, 42, n_swa);
+
+    llama_backend_init();
+
+    llama_model * model = llama_load_model_from_file(fname, llama_model_default_params());
+    assert(model);
+    assert(llama_n_swa(model) == n_swa);
+
+    llama_context * ctx_full = new_context(model, true);
+    llama_context * ctx_ring = new_context(model, false);
+
+    // prompts of two sequences, longer than the ring, then single tokens on both
+    decode_both("prompt 0", ctx_full, ctx_ring, 0, 0, 80);
+    decode_both("prompt 1", ctx_full, ctx_ring, 1, 0, 40);
+    for (llama_pos p = 0; p < 12; ++p) {
+        decode_both("gen 0", ctx_full, ctx_ring, 0, 80 + p, 81 + p);
+        decode_both("gen 1", ctx_full, ctx_ring, 1, 40 + p, 41 + p);
+    }
+    assert(llama_kv_cache_seq_pos_min(ctx_full, 0) == 0);
+    assert(llama_kv_cache_seq_pos_min(ctx_ring, 0) > 0);
+
+    // seq_rm: the last token of a sequence, the ring only keeps the window of the last position
+    assert(llama_kv_cache_seq_pos_min(ctx_ring, 1) == 51 - n_swa + 1);
+    assert( can_continue(ctx_ring, 1, 51));
+    assert(!can_continue(ctx_ring, 1, 50));
+    llama_kv_cache_seq_rm(ctx_full, 1, 51, -1);
+    llama_kv_cache_seq_rm(ctx_ring, 1, 51, -1);
+    decode_both("seq_rm", ctx_full, ctx_ring, 1, 51, 60);
+
+    // seq_cp: a copy of sequence 0 continued on its own
+    llama_kv_cache_seq_cp(ctx_full, 0, 2, -1, -1);
+    llama_kv_cache_seq_cp(ctx_ring, 0, 2, -1, -1);
+    decode_both("seq_cp", ctx_full, ctx_ring, 2, 92, 100);
+    decode_both("seq_cp 0", ctx_full, ctx_ring, 0, 92, 96);
+
+    // seq_add: a context shift of sequence 0, positions far enough apart that the windows do not see the gap
+    llama_kv_cache_seq_rm (ctx_full, 0, 10, 30);
+    llama_kv_cache_seq_rm (ctx_ring, 0, 10, 30);
+    llama_kv_cache_seq_add(ctx_full, 0, 30, -1, -20);
+    llama_kv_cache_seq_add(ctx_ring, 0, 30, -1, -20);
+    assert(llama_kv_cache_seq_pos_max(ctx_full, 0) == 75);
+    assert(llama_kv_cache_seq_pos_max(ctx_ring, 0) == 75);
+    decode_both("seq_add", ctx_full, ctx_ring, 0, 76, 90);
+
+    // state save/load: the whole context, and one sequence into another one
+    {
+        std::vector<uint8_t> state(llama_state_get_size(ctx_ring));
+        const size_t n_written = llama_state_get_data(ctx_ring, state.data(), state.size());
+        assert(n_written > 0 && n_written <= state.size());
+
+        std::vector<uint8_t> state_seq(llama_state_seq_get_size(ctx_ring, 1));
+        const size_t n_written_seq = llama_state_seq_get_data(ctx_ring, state_seq.data(), state_seq.size(), 1);
+        assert(n_written_seq == state_seq.size());
+
+        llama_context * ctx_load = new_context(model, false);
+        const size_t n_read = llama_state_set_data(ctx_load, state.data(), n_written);
+        assert(n_read == n_written);
+        check("state", decode(ctx_full, 0, 90, 100), decode(ctx_load, 0, 90, 100));
+        llama_free(ctx_load);
+
+        ctx_load = new_context(model, false);
+        const size_t n_read_seq = llama_state_seq_set_data(ctx_load, state_seq.data(), state_seq.size(), 2);
+        assert(n_read_seq == n_written_seq);
+        assert(llama_kv_cache_seq_pos_min(ctx_load, 2) == llama_kv_cache_seq_pos_min(ctx_ring, 1));
+        check("state seq", decode(ctx_full, 1, 60, 70), decode(ctx_load, 2, 60, 70, 1));
+        llama_free(ctx_load);
+
+        decode(ctx_ring, 1, 60, 70);
+    }
+
+    // the window of an early position of sequence 1 was evicted: it is evaluated again from the start,
+    // as the server does when the common part of a prompt cannot be reused
+    {
+        const llama_pos p = 20;
+        assert( can_continue(ctx_full, 1, p));
+        assert(!can_continue(ctx_ring, 1, p));
+
+        llama_kv_cache_seq_rm(ctx_full, 1, p, -1);
+        llama_kv_cache_seq_rm(ctx_ring, 1, -1, -1);
+        assert(llama_kv_cache_seq_pos_min(ctx_ring, 1) == -1);
+        decode(ctx_ring, 1, 0, p);
+        assert(can_continue(ctx_ring, 1, p));
+        decode_both("fallback", ctx_full, ctx_ring, 1, p, p + 12);
+    }
+
+    llama_free(ctx_ring);
+    llama_free(ctx_full);
+    llama_free_model(model);
+    llama_backend_free();
+
+    std::remove(fname);
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}